@@ -26,16 +26,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "jitter_buffer.h"
+#include "ring_buffer.h"
 #include "rtp.h"
 
 #include "../toxcore/logger.h"
 #include "../toxcore/mono_time.h"
 
-static struct JitterBuffer *jbuf_new(uint32_t capacity);
-static void jbuf_clear(struct JitterBuffer *q);
-static void jbuf_free(struct JitterBuffer *q);
-static int jbuf_write(const Logger *log, struct JitterBuffer *q, struct RTPMessage *m);
-static struct RTPMessage *jbuf_read(struct JitterBuffer *q, int32_t *success);
 static OpusEncoder *create_audio_encoder(const Logger *log, int32_t bit_rate, int32_t sampling_rate,
         int32_t channel_count);
 static bool reconfigure_audio_encoder(const Logger *log, OpusEncoder **e, int32_t new_br, int32_t new_sr,
@@ -45,7 +42,8 @@ static bool reconfigure_audio_decoder(ACSession *ac, int32_t sampling_rate, int8
 
 
 ACSession *ac_new(Mono_Time *mono_time, const Logger *log, ToxAV *av, uint32_t friend_number,
-                  toxav_audio_receive_frame_cb *cb, void *cb_data)
+                  toxav_audio_receive_frame_cb *cb, void *cb_data,
+                  toxav_audio_receive_stats_cb *stats_cb, void *stats_cb_data)
 {
     ACSession *ac = (ACSession *)calloc(sizeof(ACSession), 1);
 
@@ -54,10 +52,12 @@ ACSession *ac_new(Mono_Time *mono_time, const Logger *log, ToxAV *av, uint32_t f
         return nullptr;
     }
 
-    if (create_recursive_mutex(ac->queue_mutex) != 0) {
-        LOGGER_WARNING(log, "Failed to create recursive mutex!");
-        free(ac);
-        return nullptr;
+    ac->j_queue = spsc_rb_new(AUDIO_QUEUE_SIZE);
+    ac->msg_pool = rtp_message_pool_new(AUDIO_MESSAGE_POOL_SIZE);
+
+    if (ac->j_queue == nullptr || ac->msg_pool == nullptr) {
+        LOGGER_WARNING(log, "Allocation failed! Application might misbehave!");
+        goto BASE_CLEANUP;
     }
 
     int status;
@@ -104,14 +104,18 @@ ACSession *ac_new(Mono_Time *mono_time, const Logger *log, ToxAV *av, uint32_t f
     ac->friend_number = friend_number;
     ac->acb = cb;
     ac->acb_user_data = cb_data;
+    ac->ascb = stats_cb;
+    ac->ascb_user_data = stats_cb_data;
+    ac->last_stats = current_time_monotonic(mono_time);
 
     return ac;
 
 DECODER_CLEANUP:
     opus_decoder_destroy(ac->decoder);
-    jbuf_free((struct JitterBuffer *)ac->j_buf);
+    jbuf_free(ac->j_buf);
 BASE_CLEANUP:
-    pthread_mutex_destroy(ac->queue_mutex);
+    rtp_message_pool_kill(ac->msg_pool);
+    spsc_rb_kill(ac->j_queue);
     free(ac);
     return nullptr;
 }
@@ -124,9 +128,16 @@ void ac_kill(ACSession *ac)
 
     opus_encoder_destroy(ac->encoder);
     opus_decoder_destroy(ac->decoder);
-    jbuf_free((struct JitterBuffer *)ac->j_buf);
+    jbuf_free(ac->j_buf);
 
-    pthread_mutex_destroy(ac->queue_mutex);
+    void *msg;
+
+    while (spsc_rb_read(ac->j_queue, &msg)) {
+        free(msg);
+    }
+
+    spsc_rb_kill(ac->j_queue);
+    rtp_message_pool_kill(ac->msg_pool);
 
     LOGGER_DEBUG(ac->log, "Terminated audio handler: %p", (void *)ac);
     free(ac);
@@ -138,21 +149,24 @@ void ac_iterate(ACSession *ac)
         return;
     }
 
-    /* TODO(mannol): fix this and jitter buffering */
-
     /* Enough space for the maximum frame size (120 ms 48 KHz stereo audio) */
     int16_t temp_audio_buffer[AUDIO_MAX_BUFFER_SIZE_PCM16 * AUDIO_MAX_CHANNEL_COUNT];
 
-    pthread_mutex_lock(ac->queue_mutex);
-    struct JitterBuffer *const j_buf = (struct JitterBuffer *)ac->j_buf;
+    const uint64_t now = current_time_monotonic(ac->mono_time);
+    void *received;
 
-    int rc = 0;
-    struct RTPMessage *msg = jbuf_read(j_buf, &rc);
+    while (spsc_rb_read(ac->j_queue, &received)) {
+        jbuf_write(ac->log, ac->j_buf, (struct RTPMessage *)received);
+    }
+
+    JitterBufferAction action;
+    struct RTPMessage *msg;
 
-    for (; msg != nullptr || rc == 2; msg = jbuf_read(j_buf, &rc)) {
-        pthread_mutex_unlock(ac->queue_mutex);
+    while ((msg = jbuf_read(ac->j_buf, now, &action)) != nullptr || action != JBUF_WAIT) {
+        int rc;
 
-        if (rc == 2) {
+        if (msg == nullptr) {
+            /* Lost, or growing the delay. */
             LOGGER_DEBUG(ac->log, "OPUS correction");
             int fs = (ac->lp_sampling_rate * ac->lp_frame_duration) / 1000;
             rc = opus_decode(ac->decoder, nullptr, 0, temp_audio_buffer, fs, 1);
@@ -184,7 +198,7 @@ void ac_iterate(ACSession *ac)
               */
             if (!reconfigure_audio_decoder(ac, ac->lp_sampling_rate, ac->lp_channel_count)) {
                 LOGGER_WARNING(ac->log, "Failed to reconfigure decoder!");
-                free(msg);
+                rtp_message_free(msg);
                 continue;
             }
 
@@ -197,23 +211,40 @@ void ac_iterate(ACSession *ac)
              * max_size is the max duration of the frame in samples (per channel) that can fit
              * into the decoded_frame array
              */
+            const uint64_t start = current_time_monotonic_us();
             rc = opus_decode(ac->decoder, msg->data + 4, msg->len - 4, temp_audio_buffer, 5760, 0);
-            free(msg);
+            const uint32_t decode_time = current_time_monotonic_us() - start;
+            ac->decode_time = ac->decode_time ? (ac->decode_time * 7 + decode_time) / 8 : decode_time;
+            rtp_message_free(msg);
+
+            if (rc > 0) {
+                ac->lp_frame_duration = (rc * 1000) / ac->lp_sampling_rate;
+                jbuf_set_frame_duration(ac->j_buf, ac->lp_frame_duration);
+            }
+
+            if (rc > 0 && action == JBUF_ACCELERATE) {
+                /* Shrink the delay by playing this frame shorter. */
+                const size_t sample_count = jbuf_accelerate_pcm(temp_audio_buffer, rc, ac->lp_channel_count);
+                jbuf_shorten(ac->j_buf, (uint64_t)(rc - sample_count) * 1000000 / ac->lp_sampling_rate);
+                rc = sample_count;
+            }
         }
 
         if (rc < 0) {
             LOGGER_WARNING(ac->log, "Decoding error: %s", opus_strerror(rc));
         } else if (ac->acb) {
-            ac->lp_frame_duration = (rc * 1000) / ac->lp_sampling_rate;
-
             ac->acb(ac->av, ac->friend_number, temp_audio_buffer, rc, ac->lp_channel_count,
                     ac->lp_sampling_rate, ac->acb_user_data);
         }
-
-        return;
     }
 
-    pthread_mutex_unlock(ac->queue_mutex);
+    if (ac->ascb && ac->last_stats + AUDIO_STATS_INTERVAL <= now) {
+        JitterBufferStats stats;
+        jbuf_get_stats(ac->j_buf, &stats);
+        ac->ascb(ac->av, ac->friend_number, stats.delay, stats.target_delay, stats.jitter,
+                 stats.late, stats.lost, ac->ascb_user_data);
+        ac->last_stats = now;
+    }
 }
 
 int ac_queue_message(Mono_Time *mono_time, void *acp, struct RTPMessage *msg)
@@ -236,11 +267,10 @@ int ac_queue_message(Mono_Time *mono_time, void *acp, struct RTPMessage *msg)
         return -1;
     }
 
-    pthread_mutex_lock(ac->queue_mutex);
-    int rc = jbuf_write(ac->log, (struct JitterBuffer *)ac->j_buf, msg);
-    pthread_mutex_unlock(ac->queue_mutex);
+    /* ac_iterate moves it into the jitter buffer. */
+    msg->received = current_time_monotonic(mono_time);
 
-    if (rc == -1) {
+    if (!spsc_rb_write(ac->j_queue, msg)) {
         LOGGER_WARNING(ac->log, "Could not queue the message!");
         free(msg);
         return -1;
@@ -264,112 +294,6 @@ int ac_reconfigure_encoder(ACSession *ac, int32_t bit_rate, int32_t sampling_rat
 
 
 
-struct JitterBuffer {
-    struct RTPMessage **queue;
-    uint32_t size;
-    uint32_t capacity;
-    uint16_t bottom;
-    uint16_t top;
-};
-
-static struct JitterBuffer *jbuf_new(uint32_t capacity)
-{
-    unsigned int size = 1;
-
-    while (size <= (capacity * 4)) {
-        size *= 2;
-    }
-
-    struct JitterBuffer *q = (struct JitterBuffer *)calloc(sizeof(struct JitterBuffer), 1);
-
-    if (!q) {
-        return nullptr;
-    }
-
-    q->queue = (struct RTPMessage **)calloc(sizeof(struct RTPMessage *), size);
-
-    if (!q->queue) {
-        free(q);
-        return nullptr;
-    }
-
-    q->size = size;
-    q->capacity = capacity;
-    return q;
-}
-static void jbuf_clear(struct JitterBuffer *q)
-{
-    for (; q->bottom != q->top; ++q->bottom) {
-        if (q->queue[q->bottom % q->size]) {
-            free(q->queue[q->bottom % q->size]);
-            q->queue[q->bottom % q->size] = nullptr;
-        }
-    }
-}
-static void jbuf_free(struct JitterBuffer *q)
-{
-    if (!q) {
-        return;
-    }
-
-    jbuf_clear(q);
-    free(q->queue);
-    free(q);
-}
-static int jbuf_write(const Logger *log, struct JitterBuffer *q, struct RTPMessage *m)
-{
-    uint16_t sequnum = m->header.sequnum;
-
-    unsigned int num = sequnum % q->size;
-
-    if ((uint32_t)(sequnum - q->bottom) > q->size) {
-        LOGGER_DEBUG(log, "Clearing filled jitter buffer: %p", (void *)q);
-
-        jbuf_clear(q);
-        q->bottom = sequnum - q->capacity;
-        q->queue[num] = m;
-        q->top = sequnum + 1;
-        return 0;
-    }
-
-    if (q->queue[num]) {
-        return -1;
-    }
-
-    q->queue[num] = m;
-
-    if ((sequnum - q->bottom) >= (q->top - q->bottom)) {
-        q->top = sequnum + 1;
-    }
-
-    return 0;
-}
-static struct RTPMessage *jbuf_read(struct JitterBuffer *q, int32_t *success)
-{
-    if (q->top == q->bottom) {
-        *success = 0;
-        return nullptr;
-    }
-
-    unsigned int num = q->bottom % q->size;
-
-    if (q->queue[num]) {
-        struct RTPMessage *ret = q->queue[num];
-        q->queue[num] = nullptr;
-        ++q->bottom;
-        *success = 1;
-        return ret;
-    }
-
-    if ((uint32_t)(q->top - q->bottom) > q->capacity) {
-        ++q->bottom;
-        *success = 2;
-        return nullptr;
-    }
-
-    *success = 0;
-    return nullptr;
-}
 OpusEncoder *create_audio_encoder(const Logger *log, int32_t bit_rate, int32_t sampling_rate, int32_t channel_count)
 {
     int status = OPUS_OK;
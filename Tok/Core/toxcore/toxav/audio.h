@@ -24,12 +24,16 @@
 
 #include "../toxcore/logger.h"
 #include "../toxcore/util.h"
+#include "jitter_buffer.h"
 #include "rtp.h"
 
 #include "opus.h"
 #include <pthread.h>
 
-#define AUDIO_JITTERBUFFER_COUNT 3
+#define AUDIO_JITTERBUFFER_COUNT 256 /* Frames; 5 seconds of 20 ms frames */
+#define AUDIO_QUEUE_SIZE 16
+#define AUDIO_MESSAGE_POOL_SIZE 16
+#define AUDIO_STATS_INTERVAL 1000
 #define AUDIO_MAX_SAMPLE_RATE 48000
 #define AUDIO_MAX_CHANNEL_COUNT 2
 
@@ -58,6 +62,7 @@ typedef struct ACSession_s {
     int32_t le_sample_rate; /* Last encoder sample rate */
     int32_t le_channel_count; /* Last encoder channel count */
     int32_t le_bit_rate; /* Last encoder bit rate */
+    uint32_t encode_time; /* Moving average of the time in us it took to encode a frame */
 
     /* decoding */
     OpusDecoder *decoder;
@@ -67,19 +72,25 @@ typedef struct ACSession_s {
     int32_t ld_sample_rate; /* Last decoder sample rate */
     int32_t ld_channel_count; /* Last decoder channel count */
     uint64_t ldrts; /* Last decoder reconfiguration time stamp */
-    void *j_buf;
-
-    pthread_mutex_t queue_mutex[1];
+    uint32_t decode_time; /* Moving average of the time in us it took to decode a frame */
+    JitterBuffer *j_buf; /* Only used by the thread decoding */
+    struct SPSCRingBuffer *j_queue; /* Received messages on their way to j_buf */
+    RTPMessagePool *msg_pool;
 
     ToxAV *av;
     uint32_t friend_number;
     /* Audio frame receive callback */
     toxav_audio_receive_frame_cb *acb;
     void *acb_user_data;
+    /* Jitter buffer stats callback */
+    toxav_audio_receive_stats_cb *ascb;
+    void *ascb_user_data;
+    uint64_t last_stats;
 } ACSession;
 
 ACSession *ac_new(Mono_Time *mono_time, const Logger *log, ToxAV *av, uint32_t friend_number,
-                  toxav_audio_receive_frame_cb *cb, void *cb_data);
+                  toxav_audio_receive_frame_cb *cb, void *cb_data,
+                  toxav_audio_receive_stats_cb *stats_cb, void *stats_cb_data);
 void ac_kill(ACSession *ac);
 void ac_iterate(ACSession *ac);
 int ac_queue_message(Mono_Time *mono_time, void *acp, struct RTPMessage *msg);
@@ -65,6 +65,11 @@ struct BWController_s {
     BWCRcvPkt rcvpkt; /* To calculate average received packet (this means split parts, not the full message!) */
 
     uint32_t packet_loss_counted_cycles;
+
+    /* Fraction of the data lost in the last cycle, as measured by us and as
+     * reported by the peer. */
+    float recv_loss;
+    float sent_loss;
 };
 
 struct BWCMessage {
@@ -72,6 +77,21 @@ struct BWCMessage {
     uint32_t recv;
 };
 
+float bwc_get_recv_loss(const BWController *bwc)
+{
+    return bwc ? bwc->recv_loss : 0.0f;
+}
+
+float bwc_get_sent_loss(const BWController *bwc)
+{
+    /* The peer only sends an update for a cycle with loss. */
+    if (!bwc || bwc->cycle.last_recv_timestamp + 2 * BWC_SEND_INTERVAL_MS < current_time_monotonic(bwc->m->mono_time)) {
+        return 0.0f;
+    }
+
+    return bwc->sent_loss;
+}
+
 int bwc_handle_data(Messenger *m, uint32_t friendnumber, const uint8_t *data, uint16_t length, void *object);
 void send_update(BWController *bwc);
 
@@ -140,6 +160,7 @@ void send_update(BWController *bwc)
     if (bwc->packet_loss_counted_cycles > BWC_AVG_LOSS_OVER_CYCLES_COUNT &&
             current_time_monotonic(bwc->m->mono_time) - bwc->cycle.last_sent_timestamp > BWC_SEND_INTERVAL_MS) {
         bwc->packet_loss_counted_cycles = 0;
+        bwc->recv_loss = (float)bwc->cycle.lost / (bwc->cycle.recv + bwc->cycle.lost);
 
         if (bwc->cycle.lost) {
             LOGGER_DEBUG(bwc->m->log, "%p Sent update rcv: %u lost: %u percent: %f %%",
@@ -180,6 +201,8 @@ static int on_update(BWController *bwc, const struct BWCMessage *msg)
     uint32_t recv = net_ntohl(msg->recv);
     uint32_t lost = net_ntohl(msg->lost);
 
+    bwc->sent_loss = recv + lost ? (float)lost / (recv + lost) : 0.0f;
+
     if (lost && bwc->mcb) {
         LOGGER_DEBUG(bwc->m->log, "recved: %u lost: %u percentage: %f %%", recv, lost,
                      (((double) lost / (recv + lost)) * 100.0));
@@ -33,4 +33,9 @@ void bwc_kill(BWController *bwc);
 void bwc_add_lost(BWController *bwc, uint32_t bytes_lost);
 void bwc_add_recv(BWController *bwc, uint32_t recv_bytes);
 
+/* Fraction of the received data that was lost in the last measured cycle. */
+float bwc_get_recv_loss(const BWController *bwc);
+/* Fraction of the sent data that the peer last reported lost. */
+float bwc_get_sent_loss(const BWController *bwc);
+
 #endif // C_TOXCORE_TOXAV_BWCONTROLLER_H
@@ -0,0 +1,369 @@
+/*
+ * Adaptive jitter buffer for received audio frames.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ * Copyright © 2013-2015 Tox project.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif /* HAVE_CONFIG_H */
+
+#include "jitter_buffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../toxcore/ccompat.h"
+
+/* The target delay covers JBUF_DELAY_PERCENTILE percent of the last
+ * JBUF_DELAY_HISTORY frames, once there are JBUF_MIN_SAMPLES of them.
+ */
+#define JBUF_DELAY_HISTORY 256
+#define JBUF_DELAY_PERCENTILE 99
+#define JBUF_MIN_SAMPLES 32
+
+/* After this many frames concealed with nothing buffered, the peer is taken
+ * to have stopped sending (e.g. muted), and the next frame starts over. */
+#define JBUF_MAX_CONCEAL 10
+
+struct JitterBuffer {
+    struct RTPMessage **queue;
+    uint32_t size;
+    /* Sequence number of the next frame to play. */
+    uint16_t bottom;
+    /* One past the highest sequence number received. */
+    uint16_t top;
+
+    bool playing;
+    uint32_t frame_duration;
+    /* Sender timestamp the next frame is expected to have. */
+    uint32_t next_timestamp;
+
+    /* Transit times (local arrival time minus sender timestamp) are relative
+     * to that of the first frame, as the clocks are unrelated. A frame is
+     * played when its transit time reaches playout. */
+    uint32_t base_transit;
+    int32_t playout;
+    uint32_t shortened_us;
+
+    int32_t transit[JBUF_DELAY_HISTORY];
+    uint32_t transit_count;
+    uint32_t transit_index;
+    int32_t last_transit;
+    int32_t min_transit;
+    uint32_t target;
+    /* RFC 3550 jitter, times 16. */
+    uint32_t jitter;
+
+    uint32_t concealed_in_row;
+    /* Concealed while nothing was buffered: lost, unless the peer stopped sending. */
+    uint32_t unconfirmed_lost;
+
+    uint32_t late;
+    uint32_t lost;
+    uint32_t expanded;
+    uint32_t accelerated;
+};
+
+JitterBuffer *jbuf_new(uint32_t size)
+{
+    uint32_t pow2 = 1;
+
+    while (pow2 < size) {
+        pow2 *= 2;
+    }
+
+    JitterBuffer *q = (JitterBuffer *)calloc(sizeof(JitterBuffer), 1);
+
+    if (!q) {
+        return nullptr;
+    }
+
+    q->queue = (struct RTPMessage **)calloc(sizeof(struct RTPMessage *), pow2);
+
+    if (!q->queue) {
+        free(q);
+        return nullptr;
+    }
+
+    q->size = pow2;
+    q->frame_duration = JBUF_DEFAULT_FRAME_DURATION;
+    q->target = JBUF_START_DELAY;
+    return q;
+}
+
+static void jbuf_clear(JitterBuffer *q)
+{
+    for (uint32_t i = 0; i < q->size; ++i) {
+        if (q->queue[i]) {
+            rtp_message_free(q->queue[i]);
+            q->queue[i] = nullptr;
+        }
+    }
+}
+
+void jbuf_free(JitterBuffer *q)
+{
+    if (!q) {
+        return;
+    }
+
+    jbuf_clear(q);
+    free(q->queue);
+    free(q);
+}
+
+static int cmp_transit(const void *a, const void *b)
+{
+    const int32_t x = *(const int32_t *)a;
+    const int32_t y = *(const int32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void jbuf_add_transit(JitterBuffer *q, int32_t transit)
+{
+    if (q->transit_count != 0) {
+        const int32_t d = transit - q->last_transit;
+        q->jitter += (uint32_t)(d < 0 ? -d : d) - ((q->jitter + 8) >> 4);
+    }
+
+    q->last_transit = transit;
+    q->transit[q->transit_index] = transit;
+    q->transit_index = (q->transit_index + 1) % JBUF_DELAY_HISTORY;
+
+    if (q->transit_count < JBUF_DELAY_HISTORY) {
+        ++q->transit_count;
+    }
+
+    int32_t sorted[JBUF_DELAY_HISTORY];
+    memcpy(sorted, q->transit, q->transit_count * sizeof(int32_t));
+    qsort(sorted, q->transit_count, sizeof(int32_t), cmp_transit);
+
+    q->min_transit = sorted[0];
+    uint32_t target = sorted[(q->transit_count - 1) * JBUF_DELAY_PERCENTILE / 100] - sorted[0];
+
+    if (q->transit_count < JBUF_MIN_SAMPLES && target < JBUF_START_DELAY) {
+        target = JBUF_START_DELAY;
+    }
+
+    if (target < q->frame_duration) {
+        target = q->frame_duration;
+    }
+
+    if (target > JBUF_MAX_DELAY) {
+        target = JBUF_MAX_DELAY;
+    }
+
+    q->target = target;
+}
+
+/* Play from m on, with the target delay for the earliest frames. */
+static void jbuf_restart(JitterBuffer *q, struct RTPMessage *m)
+{
+    jbuf_clear(q);
+    q->bottom = m->header.sequnum;
+    q->top = m->header.sequnum;
+    q->next_timestamp = m->header.timestamp;
+    q->playout = q->min_transit + (int32_t)q->target;
+    q->playing = true;
+    q->concealed_in_row = 0;
+    q->unconfirmed_lost = 0;
+}
+
+int jbuf_write(const Logger *log, JitterBuffer *q, struct RTPMessage *m)
+{
+    const uint32_t transit = (uint32_t)m->received - m->header.timestamp;
+
+    if (q->transit_count == 0) {
+        q->base_transit = transit;
+    }
+
+    jbuf_add_transit(q, (int32_t)(transit - q->base_transit));
+
+    const uint16_t sequnum = m->header.sequnum;
+
+    if (!q->playing) {
+        jbuf_restart(q, m);
+    } else if ((int16_t)(sequnum - q->bottom) < 0) {
+        /* Already played or concealed. */
+        ++q->late;
+        rtp_message_free(m);
+        return -1;
+    } else if ((uint16_t)(sequnum - q->bottom) >= q->size) {
+        LOGGER_DEBUG(log, "Clearing filled jitter buffer: %p", (void *)q);
+        jbuf_restart(q, m);
+    }
+
+    q->lost += q->unconfirmed_lost;
+    q->unconfirmed_lost = 0;
+
+    const uint32_t num = sequnum % q->size;
+
+    if (q->queue[num]) {
+        rtp_message_free(m);
+        return -1;
+    }
+
+    q->queue[num] = m;
+
+    if ((uint16_t)(sequnum - q->bottom) >= (uint16_t)(q->top - q->bottom)) {
+        q->top = sequnum + 1;
+    }
+
+    return 0;
+}
+
+struct RTPMessage *jbuf_read(JitterBuffer *q, uint64_t now, JitterBufferAction *action)
+{
+    *action = JBUF_WAIT;
+
+    if (!q->playing) {
+        return nullptr;
+    }
+
+    const uint32_t num = q->bottom % q->size;
+    struct RTPMessage *const m = q->queue[num];
+    const uint32_t timestamp = m ? m->header.timestamp : q->next_timestamp;
+    const uint32_t due = timestamp + q->base_transit + (uint32_t)q->playout;
+
+    if ((int32_t)((uint32_t)now - due) < 0) {
+        return nullptr;
+    }
+
+    if (m == nullptr) {
+        if (q->top == q->bottom) {
+            if (q->concealed_in_row >= JBUF_MAX_CONCEAL) {
+                q->playing = false;
+                q->unconfirmed_lost = 0;
+                return nullptr;
+            }
+
+            ++q->top;
+            ++q->unconfirmed_lost;
+        } else {
+            ++q->lost;
+        }
+
+        ++q->bottom;
+        ++q->concealed_in_row;
+        q->next_timestamp += q->frame_duration;
+        *action = JBUF_CONCEAL;
+        return nullptr;
+    }
+
+    q->concealed_in_row = 0;
+    const int32_t delay = q->playout - q->min_transit;
+
+    if ((int32_t)q->target - delay >= (int32_t)q->frame_duration / 2) {
+        q->playout += q->frame_duration;
+        ++q->expanded;
+        *action = JBUF_EXPAND;
+        return nullptr;
+    }
+
+    q->queue[num] = nullptr;
+    ++q->bottom;
+    q->next_timestamp = m->header.timestamp + q->frame_duration;
+
+    if (delay > (int32_t)(q->target + q->frame_duration / 2)) {
+        ++q->accelerated;
+        *action = JBUF_ACCELERATE;
+    } else {
+        *action = JBUF_PLAY;
+    }
+
+    return m;
+}
+
+void jbuf_set_frame_duration(JitterBuffer *q, uint32_t frame_duration)
+{
+    if (frame_duration != 0) {
+        q->frame_duration = frame_duration;
+    }
+}
+
+void jbuf_shorten(JitterBuffer *q, uint32_t us)
+{
+    q->shortened_us += us;
+    q->playout -= q->shortened_us / 1000;
+    q->shortened_us %= 1000;
+}
+
+void jbuf_get_stats(const JitterBuffer *q, JitterBufferStats *stats)
+{
+    const int32_t delay = q->playout - q->min_transit;
+
+    stats->delay = q->playing && delay > 0 ? delay : 0;
+    stats->target_delay = q->target;
+    stats->jitter = q->jitter >> 4;
+    stats->late = q->late;
+    stats->lost = q->lost;
+    stats->expanded = q->expanded;
+    stats->accelerated = q->accelerated;
+}
+
+size_t jbuf_accelerate_pcm(int16_t *pcm, size_t sample_count, uint8_t channels)
+{
+    const size_t max_cut = sample_count / 4;
+    const size_t min_cut = max_cut / 2;
+
+    if (min_cut == 0 || channels == 0) {
+        return sample_count;
+    }
+
+    /* Cut where the first channel repeats best, i.e. a whole number of pitch
+     * periods. Compares the squared normalised correlation, keeping its sign. */
+    size_t cut = max_cut;
+    double best = -2.0;
+
+    for (size_t len = min_cut; len <= max_cut; ++len) {
+        int64_t xy = 0;
+        int64_t xx = 0;
+        int64_t yy = 0;
+
+        for (size_t i = 0; i < len; ++i) {
+            const int32_t x = pcm[i * channels];
+            const int32_t y = pcm[(i + len) * channels];
+            xy += x * y;
+            xx += x * x;
+            yy += y * y;
+        }
+
+        const double score = xx == 0 || yy == 0 ? 0.0 :
+                             (double)xy * (double)(xy < 0 ? -xy : xy) / ((double)xx * (double)yy);
+
+        if (score > best) {
+            best = score;
+            cut = len;
+        }
+    }
+
+    /* Fade from the first period into the second, then skip the second. */
+    for (size_t i = 0; i < cut; ++i) {
+        for (size_t c = 0; c < channels; ++c) {
+            const int32_t a = pcm[i * channels + c];
+            const int32_t b = pcm[(i + cut) * channels + c];
+            pcm[i * channels + c] = (int16_t)((a * (int32_t)(cut - i) + b * (int32_t)i) / (int32_t)cut);
+        }
+    }
+
+    memmove(pcm + cut * channels, pcm + 2 * cut * channels, (sample_count - 2 * cut) * channels * sizeof(int16_t));
+    return sample_count - cut;
+}
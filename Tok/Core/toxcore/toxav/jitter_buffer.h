@@ -0,0 +1,125 @@
+/*
+ * Adaptive jitter buffer for received audio frames.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ * Copyright © 2013-2015 Tox project.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef C_TOXCORE_TOXAV_JITTER_BUFFER_H
+#define C_TOXCORE_TOXAV_JITTER_BUFFER_H
+
+#include "rtp.h"
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Playout delay in ms before enough frames arrived to measure the jitter. */
+#define JBUF_START_DELAY 60
+/* Upper bound of the target playout delay in ms. */
+#define JBUF_MAX_DELAY 1000
+/* Frame duration in ms assumed until jbuf_set_frame_duration is called. */
+#define JBUF_DEFAULT_FRAME_DURATION 20
+
+/**
+ * What to play next, as returned by jbuf_read.
+ */
+typedef enum JitterBufferAction {
+    /* Nothing is due yet. */
+    JBUF_WAIT,
+    /* Decode and play the returned frame. */
+    JBUF_PLAY,
+    /* Decode the returned frame and play it shortened with jbuf_accelerate_pcm,
+     * then report the time removed with jbuf_shorten. */
+    JBUF_ACCELERATE,
+    /* The next frame was lost: play one frame of packet loss concealment. */
+    JBUF_CONCEAL,
+    /* Play one frame of packet loss concealment to grow the playout delay. */
+    JBUF_EXPAND,
+} JitterBufferAction;
+
+typedef struct JitterBufferStats {
+    /* Time in ms the earliest arriving frames wait before they are played. */
+    uint32_t delay;
+    /* Playout delay in ms the buffer is adapting to. */
+    uint32_t target_delay;
+    /* Interarrival jitter in ms as defined in RFC 3550. */
+    uint32_t jitter;
+    /* Frames that arrived after they were concealed. */
+    uint32_t late;
+    /* Frames that were concealed. */
+    uint32_t lost;
+    /* Concealment frames played to grow the delay. */
+    uint32_t expanded;
+    /* Frames played shortened to shrink the delay. */
+    uint32_t accelerated;
+} JitterBufferStats;
+
+/**
+ * Orders received frames by sequence number and decides when each one is
+ * played.
+ *
+ * The target delay is how much later than the earliest frames most of the
+ * recent frames arrived. When the playout delay is below it, concealment frames
+ * are inserted; when it is above, frames are played shortened.
+ */
+typedef struct JitterBuffer JitterBuffer;
+
+/* size is the number of frames the buffer can hold, rounded up to a power of 2. */
+JitterBuffer *jbuf_new(uint32_t size);
+void jbuf_free(JitterBuffer *q);
+
+/**
+ * Add a frame whose `received` time is set. The buffer owns the frame
+ * afterwards.
+ *
+ * @return 0 on success, -1 if the frame was late or a duplicate and got freed.
+ */
+int jbuf_write(const Logger *log, JitterBuffer *q, struct RTPMessage *m);
+
+/**
+ * Take the next frame to play at time `now` (in ms). Call it until it returns
+ * JBUF_WAIT. Frames are returned for JBUF_PLAY and JBUF_ACCELERATE, and need
+ * to be released with rtp_message_free.
+ */
+struct RTPMessage *jbuf_read(JitterBuffer *q, uint64_t now, JitterBufferAction *action);
+
+/* Set the duration in ms of the frames being received. */
+void jbuf_set_frame_duration(JitterBuffer *q, uint32_t frame_duration);
+
+/* Report that an accelerated frame was played `us` microseconds shorter. */
+void jbuf_shorten(JitterBuffer *q, uint32_t us);
+
+void jbuf_get_stats(const JitterBuffer *q, JitterBufferStats *stats);
+
+/**
+ * Shorten a frame of interleaved PCM audio by up to a quarter of its length.
+ * Two pitch periods are cross-faded into one so that the cut is hard to hear.
+ *
+ * @return the new number of samples per channel.
+ */
+size_t jbuf_accelerate_pcm(int16_t *pcm, size_t sample_count, uint8_t channels);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif // C_TOXCORE_TOXAV_JITTER_BUFFER_H
@@ -0,0 +1,408 @@
+#include "jitter_buffer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+constexpr uint32_t kFrame = 20;
+// The sender's and receiver's clocks are unrelated.
+constexpr uint32_t kSenderClock = 4000000000u;
+constexpr uint64_t kReceiverClock = 1000000;
+
+RTPMessage *new_frame(uint16_t sequnum, uint64_t sent, uint64_t received) {
+  RTPMessage *m = static_cast<RTPMessage *>(calloc(1, sizeof(RTPMessage)));
+  m->header.sequnum = sequnum;
+  m->header.timestamp = static_cast<uint32_t>(kSenderClock + sent);
+  m->received = kReceiverClock + received;
+  return m;
+}
+
+class JitterBufferTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    log_ = logger_new();
+    q_ = jbuf_new(64);
+    ASSERT_NE(q_, nullptr);
+  }
+
+  void TearDown() override {
+    jbuf_free(q_);
+    logger_kill(log_);
+  }
+
+  // Frame i, sent at i * kFrame ms and received `delay` ms later.
+  int write(uint16_t i, uint64_t delay) { return jbuf_write(log_, q_, new_frame(i, i * kFrame, i * kFrame + delay)); }
+
+  // The next action at time t, and the sequence number of the frame played.
+  JitterBufferAction read(uint64_t t, int *sequnum = nullptr) {
+    JitterBufferAction action;
+    RTPMessage *m = jbuf_read(q_, kReceiverClock + t, &action);
+
+    if (sequnum != nullptr) {
+      *sequnum = m ? m->header.sequnum : -1;
+    }
+
+    rtp_message_free(m);
+    return action;
+  }
+
+  JitterBufferStats stats() const {
+    JitterBufferStats stats;
+    jbuf_get_stats(q_, &stats);
+    return stats;
+  }
+
+  Logger *log_;
+  JitterBuffer *q_;
+};
+
+TEST_F(JitterBufferTest, WaitsTheStartDelayBeforePlaying) {
+  write(0, 10);
+  EXPECT_EQ(read(10 + JBUF_START_DELAY - 1), JBUF_WAIT);
+
+  int sequnum;
+  EXPECT_EQ(read(10 + JBUF_START_DELAY, &sequnum), JBUF_PLAY);
+  EXPECT_EQ(sequnum, 0);
+  EXPECT_EQ(stats().delay, JBUF_START_DELAY);
+}
+
+TEST_F(JitterBufferTest, PlaysFramesInSequenceOrder) {
+  write(0, 10);
+  write(2, 10);
+  write(1, 40);
+  uint64_t const start = 10 + JBUF_START_DELAY;
+
+  for (int i = 0; i < 3; ++i) {
+    int sequnum;
+    EXPECT_EQ(read(start + i * kFrame, &sequnum), JBUF_PLAY);
+    EXPECT_EQ(sequnum, i);
+  }
+
+  EXPECT_EQ(stats().lost, 0);
+}
+
+TEST_F(JitterBufferTest, ConcealsAFrameThatIsNotThereInTime) {
+  write(0, 10);
+  write(2, 10);
+  uint64_t const start = 10 + JBUF_START_DELAY;
+
+  EXPECT_EQ(read(start), JBUF_PLAY);
+  EXPECT_EQ(read(start + kFrame), JBUF_CONCEAL);
+  EXPECT_EQ(stats().lost, 1);
+
+  // Too late now.
+  EXPECT_EQ(write(1, start + kFrame), -1);
+  EXPECT_EQ(stats().late, 1);
+
+  int sequnum;
+  EXPECT_EQ(read(start + 2 * kFrame, &sequnum), JBUF_PLAY);
+  EXPECT_EQ(sequnum, 2);
+}
+
+TEST_F(JitterBufferTest, RefusesDuplicates) {
+  EXPECT_EQ(write(0, 10), 0);
+  EXPECT_EQ(write(0, 10), -1);
+}
+
+TEST_F(JitterBufferTest, StopsConcealingWhenThePeerStopsSending) {
+  write(0, 10);
+  uint64_t t = 10 + JBUF_START_DELAY;
+  EXPECT_EQ(read(t), JBUF_PLAY);
+
+  int concealed = 0;
+
+  for (int i = 0; i < 100; ++i) {
+    t += kFrame;
+
+    if (read(t) == JBUF_CONCEAL) {
+      ++concealed;
+    }
+  }
+
+  EXPECT_LT(concealed, 100);
+  EXPECT_EQ(read(t), JBUF_WAIT);
+
+  // Nothing was lost: the peer stopped sending.
+  write(200, 10);
+  EXPECT_EQ(stats().lost, 0);
+}
+
+TEST(JitterBufferPcm, AccelerateCutsWholePitchPeriods) {
+  // 200 Hz at 48 kHz: a pitch period of 240 samples.
+  size_t const count = 960;
+  std::vector<int16_t> pcm(count);
+
+  for (size_t i = 0; i < count; ++i) {
+    pcm[i] = static_cast<int16_t>(10000 * std::sin(2 * M_PI * i / 240.0));
+  }
+
+  std::vector<int16_t> const original = pcm;
+  size_t const shortened = jbuf_accelerate_pcm(pcm.data(), count, 1);
+
+  EXPECT_EQ(shortened, count - 240);
+
+  // The result is the same sine wave, one period shorter.
+  for (size_t i = 0; i < shortened; ++i) {
+    ASSERT_NEAR(pcm[i], original[i], 2) << i;
+  }
+}
+
+TEST(JitterBufferPcm, AccelerateKeepsTheEndsOfEachChannel) {
+  size_t const count = 480;
+  std::vector<int16_t> pcm(count * 2);
+
+  for (size_t i = 0; i < count; ++i) {
+    pcm[i * 2] = static_cast<int16_t>(i);
+    pcm[i * 2 + 1] = static_cast<int16_t>(-static_cast<int>(i));
+  }
+
+  size_t const shortened = jbuf_accelerate_pcm(pcm.data(), count, 2);
+
+  EXPECT_LT(shortened, count);
+  EXPECT_GE(shortened, count - count / 4);
+  EXPECT_EQ(pcm[0], 0);
+  EXPECT_EQ(pcm[1], 0);
+  EXPECT_EQ(pcm[(shortened - 1) * 2], static_cast<int16_t>(count - 1));
+  EXPECT_EQ(pcm[(shortened - 1) * 2 + 1], -static_cast<int16_t>(count - 1));
+}
+
+/* Simulation: a sender sends a frame every kFrame ms, frame i arrives
+ * trace[i] ms later than the fastest frames (or never if it is negative), and
+ * the decoding thread runs every kTick ms. */
+
+constexpr uint32_t kTick = 10;
+constexpr uint32_t kTransit = 40;
+
+struct Simulation {
+  uint32_t played = 0;
+  uint32_t late = 0;
+  uint32_t lost = 0;
+  uint32_t expanded = 0;
+  uint32_t accelerated = 0;
+  // Mean time in ms frames waited in the buffer.
+  double mean_wait = 0;
+  uint32_t final_target = 0;
+};
+
+Simulation simulate(const std::vector<int> &trace) {
+  Logger *log = logger_new();
+  JitterBuffer *q = jbuf_new(256);
+
+  struct Arrival {
+    uint64_t time;
+    uint16_t sequnum;
+  };
+  std::vector<Arrival> arrivals;
+
+  for (size_t i = 0; i < trace.size(); ++i) {
+    if (trace[i] >= 0) {
+      arrivals.push_back({i * kFrame + kTransit + trace[i], static_cast<uint16_t>(i)});
+    }
+  }
+
+  std::stable_sort(arrivals.begin(), arrivals.end(),
+                   [](const Arrival &a, const Arrival &b) { return a.time < b.time; });
+
+  Simulation result;
+  double total_wait = 0;
+  size_t next = 0;
+  uint64_t const end = trace.size() * kFrame + kTransit + JBUF_MAX_DELAY;
+
+  for (uint64_t t = 0; t < end; t += kTick) {
+    for (; next < arrivals.size() && arrivals[next].time <= t; ++next) {
+      uint16_t const i = arrivals[next].sequnum;
+      jbuf_write(log, q, new_frame(i, i * kFrame, arrivals[next].time));
+    }
+
+    JitterBufferAction action;
+    RTPMessage *m;
+
+    while ((m = jbuf_read(q, kReceiverClock + t, &action)) != nullptr || action != JBUF_WAIT) {
+      if (m == nullptr) {
+        continue;
+      }
+
+      ++result.played;
+      total_wait += kReceiverClock + t - m->received;
+
+      if (action == JBUF_ACCELERATE) {
+        // What jbuf_accelerate_pcm cuts at most.
+        jbuf_shorten(q, kFrame * 1000 / 4);
+      }
+
+      rtp_message_free(m);
+    }
+  }
+
+  JitterBufferStats stats;
+  jbuf_get_stats(q, &stats);
+  result.late = stats.late;
+  result.lost = stats.lost;
+  result.expanded = stats.expanded;
+  result.accelerated = stats.accelerated;
+  result.final_target = stats.target_delay;
+  result.mean_wait = result.played != 0 ? total_wait / result.played : 0;
+
+  jbuf_free(q);
+  logger_kill(log);
+  return result;
+}
+
+// One minute of frames on a wired link: a few ms of jitter.
+std::vector<int> wired_trace(std::mt19937 &rng) {
+  std::uniform_int_distribution<int> jitter(0, 4);
+  std::vector<int> trace(3000);
+
+  for (int &delay : trace) {
+    delay = jitter(rng);
+  }
+
+  return trace;
+}
+
+// Wi-Fi: up to 10 ms of jitter, and 3% of frames held up by retransmissions.
+std::vector<int> wifi_trace(std::mt19937 &rng) {
+  std::uniform_int_distribution<int> jitter(0, 10);
+  std::uniform_int_distribution<int> spike(40, 120);
+  std::bernoulli_distribution spiked(0.03);
+  std::vector<int> trace(3000);
+
+  for (int &delay : trace) {
+    delay = spiked(rng) ? spike(rng) : jitter(rng);
+  }
+
+  return trace;
+}
+
+// Mobile: queueing delay that wanders between 0 and 80 ms, a 300 ms stall
+// every few seconds after which the held frames arrive at once, and 1% loss.
+std::vector<int> mobile_trace(std::mt19937 &rng) {
+  std::uniform_int_distribution<int> step(-3, 3);
+  std::uniform_int_distribution<int> stall_gap(100, 250);
+  std::bernoulli_distribution dropped(0.01);
+  std::vector<int> trace(3000);
+  int queueing = 20;
+  int next_stall = stall_gap(rng);
+
+  for (int i = 0; i < static_cast<int>(trace.size()); ++i) {
+    queueing = std::min(80, std::max(0, queueing + step(rng)));
+    trace[i] = queueing;
+
+    if (i == next_stall) {
+      // Frames sent during the stall arrive when it ends.
+      for (int j = 0; j < 300 / static_cast<int>(kFrame) && i + j < static_cast<int>(trace.size()); ++j) {
+        trace[i + j] = queueing + 300 - j * kFrame;
+      }
+
+      i += 300 / kFrame - 1;
+      next_stall = i + stall_gap(rng);
+    }
+  }
+
+  for (int &delay : trace) {
+    if (dropped(rng)) {
+      delay = -1;
+    }
+  }
+
+  return trace;
+}
+
+// A recorded trace: the delay of each frame in ms on its own line, or "-"
+// for a frame that never arrived.
+std::vector<int> load_trace(const char *path) {
+  std::ifstream in(path);
+  std::vector<int> trace;
+  std::string line;
+
+  while (std::getline(in, line)) {
+    if (!line.empty()) {
+      trace.push_back(line[0] == '-' ? -1 : std::atoi(line.c_str()));
+    }
+  }
+
+  int const fastest = *std::min_element(trace.begin(), trace.end(), [](int a, int b) {
+    return a >= 0 && (b < 0 || a < b);
+  });
+
+  for (int &delay : trace) {
+    if (delay >= 0) {
+      delay -= fastest;
+    }
+  }
+
+  return trace;
+}
+
+void print(const char *name, const Simulation &s) {
+  std::printf("%-8s played %4u, lost %3u (late %3u), expanded %3u, accelerated %4u, "
+              "mean wait %5.1f ms, final target %3u ms\n",
+              name, s.played, s.lost, s.late, s.expanded, s.accelerated, s.mean_wait, s.final_target);
+}
+
+TEST(JitterBufferSimulation, WiredLinkKeepsTheDelayLow) {
+  std::mt19937 rng(1);
+  Simulation const s = simulate(wired_trace(rng));
+  print("wired", s);
+
+  EXPECT_EQ(s.lost, 0);
+  EXPECT_EQ(s.played, 3000);
+  EXPECT_LT(s.mean_wait, 2.0 * kFrame);
+}
+
+TEST(JitterBufferSimulation, WifiSpikesAreMostlyAbsorbed) {
+  std::mt19937 rng(2);
+  Simulation const s = simulate(wifi_trace(rng));
+  print("wifi", s);
+
+  EXPECT_LT(s.lost, 3000 / 50);
+  // Late frames were concealed too.
+  EXPECT_EQ(s.played + s.lost, 3000);
+}
+
+TEST(JitterBufferSimulation, MobileStallsGrowAndShrinkTheDelay) {
+  std::mt19937 rng(3);
+  std::vector<int> trace = mobile_trace(rng);
+  size_t const dropped = std::count(trace.begin(), trace.end(), -1);
+  Simulation const s = simulate(trace);
+  print("mobile", s);
+
+  EXPECT_GT(s.expanded, 0);
+  EXPECT_GT(s.accelerated, 0);
+  // Lost beyond what the network dropped.
+  EXPECT_LT(s.lost - dropped, 3000 / 50);
+}
+
+TEST(JitterBufferSimulation, ShrinksTheDelayOnceTheJitterIsGone) {
+  std::mt19937 rng(4);
+  std::vector<int> trace = wifi_trace(rng);
+  std::vector<int> const calm = wired_trace(rng);
+  trace.insert(trace.end(), calm.begin(), calm.end());
+  Simulation const s = simulate(trace);
+  print("settling", s);
+
+  EXPECT_LE(s.final_target, 2 * kFrame);
+}
+
+TEST(JitterBufferSimulation, RecordedTrace) {
+  char const *path = std::getenv("JITTER_BUFFER_TRACE");
+
+  if (path == nullptr) {
+    return;
+  }
+
+  std::vector<int> const trace = load_trace(path);
+  ASSERT_FALSE(trace.empty());
+  print("recorded", simulate(trace));
+}
+
+}  // namespace
@@ -124,3 +124,95 @@ uint16_t rb_data(const RingBuffer *b, void **dest)
 
     return i;
 }
+
+/* Keeps the reader's and the writer's indices on separate cache lines. */
+#define SPSC_RB_CACHE_LINE 64
+
+struct SPSCRingBuffer {
+    void   **data;
+    uint32_t mask; /* Size - 1 */
+    uint8_t  data_padding[SPSC_RB_CACHE_LINE];
+
+    /* Written by the reader. */
+    uint32_t head;
+    uint32_t cached_tail; /* The reader's last look at tail */
+    uint8_t  head_padding[SPSC_RB_CACHE_LINE - 2 * sizeof(uint32_t)];
+
+    /* Written by the writer. */
+    uint32_t tail;
+    uint32_t cached_head; /* The writer's last look at head */
+    uint8_t  tail_padding[SPSC_RB_CACHE_LINE - 2 * sizeof(uint32_t)];
+};
+
+SPSCRingBuffer *spsc_rb_new(uint32_t size)
+{
+    SPSCRingBuffer *buf = (SPSCRingBuffer *)calloc(sizeof(SPSCRingBuffer), 1);
+
+    if (!buf) {
+        return nullptr;
+    }
+
+    uint32_t capacity = 1;
+
+    while (capacity < size) {
+        capacity *= 2;
+    }
+
+    buf->mask = capacity - 1;
+
+    if (!(buf->data = (void **)calloc(capacity, sizeof(void *)))) {
+        free(buf);
+        return nullptr;
+    }
+
+    return buf;
+}
+
+void spsc_rb_kill(SPSCRingBuffer *b)
+{
+    if (b) {
+        free(b->data);
+        free(b);
+    }
+}
+
+bool spsc_rb_write(SPSCRingBuffer *b, void *p)
+{
+    const uint32_t tail = __atomic_load_n(&b->tail, __ATOMIC_RELAXED);
+
+    /* Only look at the reader's index when the last look says we're full. */
+    if (tail - b->cached_head > b->mask) {
+        b->cached_head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+
+        if (tail - b->cached_head > b->mask) {
+            return false;
+        }
+    }
+
+    b->data[tail & b->mask] = p;
+    __atomic_store_n(&b->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool spsc_rb_read(SPSCRingBuffer *b, void **p)
+{
+    const uint32_t head = __atomic_load_n(&b->head, __ATOMIC_RELAXED);
+
+    if (head == b->cached_tail) {
+        b->cached_tail = __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE);
+
+        if (head == b->cached_tail) {
+            *p = nullptr;
+            return false;
+        }
+    }
+
+    *p = b->data[head & b->mask];
+    __atomic_store_n(&b->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+uint32_t spsc_rb_size(const SPSCRingBuffer *b)
+{
+    return __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+}
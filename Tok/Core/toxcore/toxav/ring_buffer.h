@@ -40,6 +40,22 @@ void rb_kill(RingBuffer *b);
 uint16_t rb_size(const RingBuffer *b);
 uint16_t rb_data(const RingBuffer *b, void **dest);
 
+/* Lock-free ring buffer for one writing and one reading thread, e.g. the
+ * thread receiving media handing it to the thread decoding it. Unlike
+ * RingBuffer, a full buffer refuses new elements, as only the reader may
+ * remove them.
+ */
+typedef struct SPSCRingBuffer SPSCRingBuffer;
+/* size is rounded up to a power of 2. */
+SPSCRingBuffer *spsc_rb_new(uint32_t size);
+void spsc_rb_kill(SPSCRingBuffer *b);
+/* Only called by the writer. Returns false if the buffer is full. */
+bool spsc_rb_write(SPSCRingBuffer *b, void *p);
+/* Only called by the reader. Returns false if the buffer is empty. */
+bool spsc_rb_read(SPSCRingBuffer *b, void **p);
+/* Number of elements in the buffer; only a hint while the other thread runs. */
+uint32_t spsc_rb_size(const SPSCRingBuffer *b);
+
 #ifdef __cplusplus
 }
 #endif
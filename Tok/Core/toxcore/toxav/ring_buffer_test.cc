@@ -2,6 +2,11 @@
 
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -193,4 +198,168 @@ TEST(RingBuffer, SizeIsLimitedByMaxSize) {
   EXPECT_EQ(rb.size(), 4);
 }
 
+TEST(SPSCRingBuffer, SizeIsRoundedUpToAPowerOfTwo) {
+  SPSCRingBuffer *rb = spsc_rb_new(5);
+  ASSERT_NE(rb, nullptr);
+  int value0 = 123;
+
+  for (int i = 0; i < 8; ++i) {
+    EXPECT_TRUE(spsc_rb_write(rb, &value0));
+  }
+
+  EXPECT_FALSE(spsc_rb_write(rb, &value0));
+  EXPECT_EQ(spsc_rb_size(rb), 8);
+  spsc_rb_kill(rb);
+}
+
+TEST(SPSCRingBuffer, ReadsInTheOrderWritten) {
+  SPSCRingBuffer *rb = spsc_rb_new(4);
+  ASSERT_NE(rb, nullptr);
+  int values[10];
+
+  // Wraps around the buffer a few times.
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_TRUE(spsc_rb_write(rb, &values[i]));
+    void *retrieved;
+    EXPECT_TRUE(spsc_rb_read(rb, &retrieved));
+    EXPECT_EQ(retrieved, &values[i]);
+  }
+
+  EXPECT_EQ(spsc_rb_size(rb), 0);
+  spsc_rb_kill(rb);
+}
+
+TEST(SPSCRingBuffer, WritingToAFullBufferFails) {
+  SPSCRingBuffer *rb = spsc_rb_new(2);
+  ASSERT_NE(rb, nullptr);
+  int value0 = 123;
+  int value1 = 231;
+  int value2 = 312;
+  EXPECT_TRUE(spsc_rb_write(rb, &value0));
+  EXPECT_TRUE(spsc_rb_write(rb, &value1));
+
+  // Unlike rb_write, the oldest element is kept.
+  EXPECT_FALSE(spsc_rb_write(rb, &value2));
+
+  void *retrieved;
+  EXPECT_TRUE(spsc_rb_read(rb, &retrieved));
+  EXPECT_EQ(retrieved, &value0);
+  EXPECT_TRUE(spsc_rb_write(rb, &value2));
+  spsc_rb_kill(rb);
+}
+
+TEST(SPSCRingBuffer, ReadingFromEmptyBufferFails) {
+  SPSCRingBuffer *rb = spsc_rb_new(2);
+  ASSERT_NE(rb, nullptr);
+  int value0 = 123;
+  void *retrieved = &value0;
+  EXPECT_FALSE(spsc_rb_read(rb, &retrieved));
+  EXPECT_EQ(retrieved, nullptr);
+  spsc_rb_kill(rb);
+}
+
+using Clock = std::chrono::steady_clock;
+
+// What toxav used before: a RingBuffer behind a mutex. Writes fail when full,
+// as with the lock-free queue, so both move the same items.
+class LockedQueue {
+ public:
+  explicit LockedQueue(uint32_t size) : rb_(rb_new(size)) {}
+  ~LockedQueue() { rb_kill(rb_); }
+
+  bool write(void *p) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (rb_full(rb_)) {
+      return false;
+    }
+
+    rb_write(rb_, p);
+    return true;
+  }
+
+  bool read(void **p) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return rb_read(rb_, p);
+  }
+
+ private:
+  std::mutex mutex_;
+  RingBuffer *rb_;
+};
+
+class LockFreeQueue {
+ public:
+  explicit LockFreeQueue(uint32_t size) : rb_(spsc_rb_new(size)) {}
+  ~LockFreeQueue() { spsc_rb_kill(rb_); }
+
+  bool write(void *p) { return spsc_rb_write(rb_, p); }
+  bool read(void **p) { return spsc_rb_read(rb_, p); }
+
+ private:
+  SPSCRingBuffer *rb_;
+};
+
+struct Stamped {
+  Clock::time_point sent;
+};
+
+// Moves items from one thread to another, as the network thread hands frames
+// to the decoding thread. Both sides yield when they can't make progress, so
+// that this also works on a single core.
+template <typename Queue>
+void run_handoff(const char *name, uint32_t items) {
+  Queue queue(64);
+  std::vector<Stamped> stamps(items);
+  std::vector<double> latency_us;
+  latency_us.reserve(items);
+
+  auto const start = Clock::now();
+
+  std::thread producer([&]() {
+    for (uint32_t i = 0; i < items; ++i) {
+      stamps[i].sent = Clock::now();
+
+      while (!queue.write(&stamps[i])) {
+        std::this_thread::yield();
+      }
+    }
+  });
+
+  Stamped *expected = stamps.data();
+
+  while (latency_us.size() < items) {
+    void *p;
+
+    if (!queue.read(&p)) {
+      std::this_thread::yield();
+      continue;
+    }
+
+    ASSERT_EQ(p, expected);
+    ++expected;
+    latency_us.push_back(
+        std::chrono::duration<double, std::micro>(Clock::now() - static_cast<Stamped *>(p)->sent).count());
+  }
+
+  auto const elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+  producer.join();
+
+  std::sort(latency_us.begin(), latency_us.end());
+  std::printf("%-10s %u items: %.2f Mitems/s, latency p50 %.1f us, p99 %.1f us\n", name, items,
+              items / elapsed / 1e6, latency_us[items / 2], latency_us[items * 99 / 100]);
+}
+
+TEST(SPSCRingBuffer, TwoThreadHandoffBenchmark) {
+  uint32_t items = 200000;
+  char const *env = std::getenv("RING_BUFFER_BENCHMARK_ITEMS");
+
+  if (env != nullptr) {
+    items = std::max(100, std::atoi(env));
+  }
+
+  run_handoff<LockedQueue>("mutex", items);
+  run_handoff<LockFreeQueue>("lock-free", items);
+}
+
 }  // namespace
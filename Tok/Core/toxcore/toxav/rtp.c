@@ -29,6 +29,7 @@
 #include <string.h>
 
 #include "bwcontroller.h"
+#include "ring_buffer.h"
 
 #include "../toxcore/Messenger.h"
 #include "../toxcore/logger.h"
@@ -41,12 +42,103 @@
  */
 #define VIDEO_KEEP_KEYFRAME_IN_BUFFER_FOR_MS 15
 
+struct RTPMessagePool {
+    /* Written by the thread freeing messages, read by the one allocating them. */
+    SPSCRingBuffer *free_msgs;
+};
+
+RTPMessagePool *rtp_message_pool_new(uint32_t size)
+{
+    RTPMessagePool *pool = (RTPMessagePool *)calloc(1, sizeof(RTPMessagePool));
+
+    if (pool == nullptr) {
+        return nullptr;
+    }
+
+    pool->free_msgs = spsc_rb_new(size);
+
+    if (pool->free_msgs == nullptr) {
+        free(pool);
+        return nullptr;
+    }
+
+    return pool;
+}
+
+void rtp_message_pool_kill(RTPMessagePool *pool)
+{
+    if (pool == nullptr) {
+        return;
+    }
+
+    void *msg;
+
+    while (spsc_rb_read(pool->free_msgs, &msg)) {
+        free(msg);
+    }
+
+    spsc_rb_kill(pool->free_msgs);
+    free(pool);
+}
+
+void rtp_message_free(struct RTPMessage *msg)
+{
+    if (msg == nullptr) {
+        return;
+    }
+
+    if (msg->pool == nullptr || !spsc_rb_write(msg->pool->free_msgs, msg)) {
+        free(msg);
+    }
+}
+
+/**
+ * Take a message with room for allocate_len bytes of data from the pool, or
+ * allocate one. The header fields and the allocate_len bytes of data are
+ * zeroed: frames missing some of their fragments still go to the decoder, which
+ * must not see what an earlier frame left in the buffer.
+ */
+static struct RTPMessage *rtp_message_new(RTPMessagePool *pool, uint32_t allocate_len)
+{
+    void *reused = nullptr;
+    struct RTPMessage *msg = nullptr;
+
+    if (pool != nullptr && spsc_rb_read(pool->free_msgs, &reused)) {
+        msg = (struct RTPMessage *)reused;
+
+        if (msg->capacity < allocate_len) {
+            msg = (struct RTPMessage *)realloc(reused, sizeof(struct RTPMessage) + allocate_len);
+
+            if (msg == nullptr) {
+                free(reused);
+                return nullptr;
+            }
+
+            msg->capacity = allocate_len;
+        }
+    } else {
+        msg = (struct RTPMessage *)malloc(sizeof(struct RTPMessage) + allocate_len);
+
+        if (msg == nullptr) {
+            return nullptr;
+        }
+
+        msg->capacity = allocate_len;
+    }
+
+    const uint32_t capacity = msg->capacity;
+    memset(msg, 0, sizeof(struct RTPMessage) + allocate_len);
+    msg->pool = pool;
+    msg->capacity = capacity;
+    return msg;
+}
+
 // allocate_len is NOT including header!
-static struct RTPMessage *new_message(const struct RTPHeader *header, size_t allocate_len, const uint8_t *data,
-                                      uint16_t data_length)
+static struct RTPMessage *new_message(RTPMessagePool *pool, const struct RTPHeader *header, size_t allocate_len,
+                                      const uint8_t *data, uint16_t data_length)
 {
     assert(allocate_len >= data_length);
-    struct RTPMessage *msg = (struct RTPMessage *)calloc(1, sizeof(struct RTPMessage) + allocate_len);
+    struct RTPMessage *msg = rtp_message_new(pool, allocate_len);
 
     if (msg == nullptr) {
         return nullptr;
@@ -251,8 +343,8 @@ static struct RTPMessage *process_frame(const Logger *log, struct RTPWorkBufferL
  * @param incoming_data The pure payload without header.
  * @param incoming_data_length The length in bytes of the incoming data payload.
  */
-static bool fill_data_into_slot(const Logger *log, struct RTPWorkBufferList *wkbl, const uint8_t slot_id,
-                                bool is_keyframe, const struct RTPHeader *header,
+static bool fill_data_into_slot(const Logger *log, RTPMessagePool *pool, struct RTPWorkBufferList *wkbl,
+                                const uint8_t slot_id, bool is_keyframe, const struct RTPHeader *header,
                                 const uint8_t *incoming_data, uint16_t incoming_data_length)
 {
     // We're either filling the data into an existing slot, or in a new one that
@@ -268,7 +360,7 @@ static bool fill_data_into_slot(const Logger *log, struct RTPWorkBufferList *wkb
 
         // No data for this slot has been received, yet, so we create a new
         // message for it with enough memory for the entire frame.
-        struct RTPMessage *msg = (struct RTPMessage *)calloc(1, sizeof(struct RTPMessage) + header->data_length_full);
+        struct RTPMessage *msg = rtp_message_new(pool, header->data_length_full);
 
         if (msg == nullptr) {
             LOGGER_ERROR(log, "Out of memory while trying to allocate for frame of size %u\n",
@@ -311,6 +403,29 @@ static bool fill_data_into_slot(const Logger *log, struct RTPWorkBufferList *wkb
     return slot->received_len == header->data_length_full;
 }
 
+/**
+ * Pass a complete frame, or a video frame that is as complete as it gets, to
+ * the session's decoder, counting it in the session's stats.
+ */
+static int deliver_frame(RTPSession *session, struct RTPMessage *msg)
+{
+    if (msg != nullptr) {
+        const struct RTPHeader *const header = &msg->header;
+        const bool is_large = (header->flags & RTP_LARGE_FRAME) != 0;
+        const uint32_t length = is_large ? header->data_length_full : header->data_length_lower;
+        const uint32_t received = is_large ? header->received_length_full : msg->len;
+
+        rtp_stats_add(&session->received, current_time_monotonic(session->m->mono_time), received,
+                      (header->flags & RTP_KEY_FRAME) != 0);
+
+        if (received < length) {
+            ++session->received.incomplete;
+        }
+    }
+
+    return session->mcb(session->m->mono_time, session->cs, msg);
+}
+
 static void update_bwc_values(const Logger *log, RTPSession *session, const struct RTPMessage *msg)
 {
     if (session->first_packets_counter < DISMISS_FIRST_LOST_VIDEO_PACKET_COUNT) {
@@ -389,7 +504,7 @@ static int handle_video_packet(RTPSession *session, const struct RTPHeader *head
         LOGGER_DEBUG(log, "-- handle_video_packet -- CALLBACK-001a b0=%d b1=%d", (int)m_new->data[0], (int)m_new->data[1]);
         update_bwc_values(log, session, m_new);
         // Pass ownership of m_new to the callback.
-        session->mcb(session->m->mono_time, session->cs, m_new);
+        deliver_frame(session, m_new);
         // Now we no longer own m_new.
         m_new = nullptr;
 
@@ -411,6 +526,7 @@ static int handle_video_packet(RTPSession *session, const struct RTPHeader *head
     // fill in this part into the slot buffer at the correct offset
     if (!fill_data_into_slot(
                 log,
+                session->pool,
                 session->work_buffer_list,
                 slot_id,
                 is_keyframe,
@@ -426,7 +542,7 @@ static int handle_video_packet(RTPSession *session, const struct RTPHeader *head
     if (m_new) {
         LOGGER_DEBUG(log, "-- handle_video_packet -- CALLBACK-003a b0=%d b1=%d", (int)m_new->data[0], (int)m_new->data[1]);
         update_bwc_values(log, session, m_new);
-        session->mcb(session->m->mono_time, session->cs, m_new);
+        deliver_frame(session, m_new);
 
         m_new = nullptr;
     }
@@ -499,15 +615,15 @@ static int handle_rtp_packet(Messenger *m, uint32_t friendnumber, const uint8_t
 
         /* Invoke processing of active multiparted message */
         if (session->mp) {
-            session->mcb(session->m->mono_time, session->cs, session->mp);
+            deliver_frame(session, session->mp);
             session->mp = nullptr;
         }
 
         /* The message came in the allowed time;
          */
 
-        return session->mcb(session->m->mono_time, session->cs, new_message(&header, length - RTP_HEADER_SIZE,
-                            data + RTP_HEADER_SIZE, length - RTP_HEADER_SIZE));
+        return deliver_frame(session, new_message(session->pool, &header, length - RTP_HEADER_SIZE,
+                             data + RTP_HEADER_SIZE, length - RTP_HEADER_SIZE));
     }
 
     /* The message is sent in multiple parts */
@@ -542,7 +658,7 @@ static int handle_rtp_packet(Messenger *m, uint32_t friendnumber, const uint8_t
                 /* Received a full message; now push it for the further
                  * processing.
                  */
-                session->mcb(session->m->mono_time, session->cs, session->mp);
+                deliver_frame(session, session->mp);
                 session->mp = nullptr;
             }
         } else {
@@ -555,7 +671,7 @@ static int handle_rtp_packet(Messenger *m, uint32_t friendnumber, const uint8_t
             }
 
             /* Push the previous message for processing */
-            session->mcb(session->m->mono_time, session->cs, session->mp);
+            deliver_frame(session, session->mp);
 
             session->mp = nullptr;
             goto NEW_MULTIPARTED;
@@ -573,7 +689,8 @@ NEW_MULTIPARTED:
 
         /* Store message.
          */
-        session->mp = new_message(&header, header.data_length_lower, data + RTP_HEADER_SIZE, length - RTP_HEADER_SIZE);
+        session->mp = new_message(session->pool, &header, header.data_length_lower, data + RTP_HEADER_SIZE,
+                                  length - RTP_HEADER_SIZE);
         memmove(session->mp->data + header.offset_lower, session->mp->data, session->mp->len);
     }
 
@@ -640,7 +757,7 @@ size_t rtp_header_unpack(const uint8_t *data, struct RTPHeader *header)
 }
 
 RTPSession *rtp_new(int payload_type, Messenger *m, uint32_t friendnumber,
-                    BWController *bwc, void *cs, rtp_m_cb *mcb)
+                    BWController *bwc, void *cs, rtp_m_cb *mcb, RTPMessagePool *pool)
 {
     assert(mcb != nullptr);
     assert(cs != nullptr);
@@ -677,6 +794,7 @@ RTPSession *rtp_new(int payload_type, Messenger *m, uint32_t friendnumber,
     session->bwc = bwc;
     session->cs = cs;
     session->mcb = mcb;
+    session->pool = pool;
 
     if (-1 == rtp_allow_receiving(session)) {
         LOGGER_WARNING(m->log, "Failed to start rtp receiving mode");
@@ -700,6 +818,12 @@ void rtp_kill(RTPSession *session)
     LOGGER_DEBUG(session->m->log, "Terminated RTP session V3 work_buffer_list->next_free_entry: %d",
                  (int)session->work_buffer_list->next_free_entry);
 
+    /* Not on the decoding thread, so the pool can't take these back. */
+    for (int8_t i = 0; i < session->work_buffer_list->next_free_entry; ++i) {
+        free(session->work_buffer_list->work_buffer[i].buf);
+    }
+
+    free(session->mp);
     free(session->work_buffer_list);
     free(session);
 }
@@ -760,7 +884,8 @@ int rtp_send_data(RTPSession *session, const uint8_t *data, uint32_t length,
 
     header.sequnum = session->sequnum;
 
-    header.timestamp = current_time_monotonic(session->m->mono_time);
+    const uint64_t now = current_time_monotonic(session->m->mono_time);
+    header.timestamp = now;
 
     header.ssrc = session->ssrc;
 
@@ -788,66 +913,71 @@ int rtp_send_data(RTPSession *session, const uint8_t *data, uint32_t length,
         header.flags |= RTP_KEY_FRAME;
     }
 
-    VLA(uint8_t, rdata, length + RTP_HEADER_SIZE + 1);
-    memset(rdata, 0, SIZEOF_VLA(rdata));
+    /* Only the packet id and header are staged. Each piece of the frame is
+     * sent straight from data, the frame is never copied as a whole.
+     */
+    uint8_t rdata[1 + RTP_HEADER_SIZE];
     rdata[0] = session->payload_type;  // packet id == payload_type
 
-    if (MAX_CRYPTO_DATA_SIZE > (length + RTP_HEADER_SIZE + 1)) {
-        /**
-         * The length is lesser than the maximum allowed length (including header)
-         * Send the packet in single piece.
-         */
+    const uint32_t max_piece = MAX_CRYPTO_DATA_SIZE - sizeof(rdata);
+    uint32_t sent = 0;
+
+    do {
+        const uint16_t piece = (uint16_t)min_u32(length - sent, max_piece);
+
+        header.offset_lower = sent;
+        header.offset_full = sent; // raw data offset, without any header
         rtp_header_pack(rdata + 1, &header);
-        memcpy(rdata + 1 + RTP_HEADER_SIZE, data, length);
 
-        if (-1 == m_send_custom_lossy_packet(session->m, session->friend_number, rdata, SIZEOF_VLA(rdata))) {
+        if (-1 == m_send_custom_lossy_packet_split(session->m, session->friend_number, rdata, sizeof(rdata),
+                data + sent, piece)) {
             const char *netstrerror = net_new_strerror(net_error());
             LOGGER_WARNING(session->m->log, "RTP send failed (len: %u)! std error: %s, net error: %s",
-                           (unsigned)SIZEOF_VLA(rdata), strerror(errno), netstrerror);
+                           (unsigned)(sizeof(rdata) + piece), strerror(errno), netstrerror);
             net_kill_strerror(netstrerror);
         }
-    } else {
-        /**
-         * The length is greater than the maximum allowed length (including header)
-         * Send the packet in multiple pieces.
-         */
-        uint32_t sent = 0;
-        uint16_t piece = MAX_CRYPTO_DATA_SIZE - (RTP_HEADER_SIZE + 1);
-
-        while ((length - sent) + RTP_HEADER_SIZE + 1 > MAX_CRYPTO_DATA_SIZE) {
-            rtp_header_pack(rdata + 1, &header);
-            memcpy(rdata + 1 + RTP_HEADER_SIZE, data + sent, piece);
-
-            if (-1 == m_send_custom_lossy_packet(session->m, session->friend_number,
-                                                 rdata, piece + RTP_HEADER_SIZE + 1)) {
-                const char *netstrerror = net_new_strerror(net_error());
-                LOGGER_WARNING(session->m->log, "RTP send failed (len: %d)! std error: %s, net error: %s",
-                               piece + RTP_HEADER_SIZE + 1, strerror(errno), netstrerror);
-                net_kill_strerror(netstrerror);
-            }
 
-            sent += piece;
-            header.offset_lower = sent;
-            header.offset_full = sent; // raw data offset, without any header
-        }
+        sent += piece;
+    } while (sent < length);
 
-        /* Send remaining */
-        piece = length - sent;
+    rtp_stats_add(&session->sent, now, length, is_keyframe);
+    ++session->sequnum;
+    return 0;
+}
 
-        if (piece) {
-            rtp_header_pack(rdata + 1, &header);
-            memcpy(rdata + 1 + RTP_HEADER_SIZE, data + sent, piece);
+void rtp_stats_add(RTPStats *stats, uint64_t now, uint32_t bytes, bool is_keyframe)
+{
+    const uint64_t elapsed = now - stats->interval_start;
 
-            if (-1 == m_send_custom_lossy_packet(session->m, session->friend_number, rdata,
-                                                 piece + RTP_HEADER_SIZE + 1)) {
-                const char *netstrerror = net_new_strerror(net_error());
-                LOGGER_WARNING(session->m->log, "RTP send failed (len: %d)! std error: %s, net error: %s",
-                               piece + RTP_HEADER_SIZE + 1, strerror(errno), netstrerror);
-                net_kill_strerror(netstrerror);
-            }
+    if (elapsed >= RTP_STATS_INTERVAL) {
+        if (elapsed < 2 * RTP_STATS_INTERVAL) {
+            stats->frame_rate = (stats->frames - stats->interval_frames) * 1000 / elapsed;
+            stats->bit_rate = (stats->bytes - stats->interval_bytes) * 8000 / elapsed;
+        } else {
+            stats->frame_rate = 0;
+            stats->bit_rate = 0;
         }
+
+        stats->interval_start = now;
+        stats->interval_frames = stats->frames;
+        stats->interval_bytes = stats->bytes;
     }
 
-    ++session->sequnum;
-    return 0;
+    ++stats->frames;
+    stats->bytes += bytes;
+
+    if (is_keyframe) {
+        ++stats->keyframes;
+    }
+}
+
+void rtp_stats_get_rates(const RTPStats *stats, uint64_t now, uint32_t *frame_rate, uint32_t *bit_rate)
+{
+    if (now - stats->interval_start >= 2 * RTP_STATS_INTERVAL) {
+        *frame_rate = 0;
+        *bit_rate = 0;
+    } else {
+        *frame_rate = stats->frame_rate;
+        *bit_rate = stats->bit_rate;
+    }
 }
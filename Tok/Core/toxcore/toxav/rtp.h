@@ -115,6 +115,8 @@ struct RTPHeader {
 };
 
 
+typedef struct RTPMessagePool RTPMessagePool;
+
 struct RTPMessage {
     /**
      * This is used in the old code that doesn't deal with large frames, i.e.
@@ -125,6 +127,20 @@ struct RTPMessage {
     uint16_t len;
 
     struct RTPHeader header;
+
+    /**
+     * The pool this message goes back to, or NULL if it is simply freed.
+     */
+    RTPMessagePool *pool;
+    /**
+     * Number of bytes allocated for data.
+     */
+    uint32_t capacity;
+    /**
+     * Local time in ms the message was handed to the session decoding it.
+     */
+    uint64_t received;
+
     uint8_t data[];
 };
 
@@ -159,6 +175,29 @@ struct RTPWorkBufferList {
 
 #define DISMISS_FIRST_LOST_VIDEO_PACKET_COUNT 10
 
+/* Length in ms of the interval the frame and bit rates in RTPStats are over. */
+#define RTP_STATS_INTERVAL 1000
+
+/**
+ * Counters for the frames sent or received in an RTP session. Only the thread
+ * sending or receiving writes to them, others may read slightly stale values.
+ */
+typedef struct RTPStats {
+    uint64_t frames;
+    uint64_t keyframes;
+    /* Payload bytes, without the RTP header. */
+    uint64_t bytes;
+    /* Video frames passed on to the decoder with parts missing. */
+    uint64_t incomplete;
+
+    /* Frames and bits per second over the last complete interval. */
+    uint32_t frame_rate;
+    uint32_t bit_rate;
+    uint64_t interval_start;
+    uint64_t interval_frames;
+    uint64_t interval_bytes;
+} RTPStats;
+
 typedef int rtp_m_cb(Mono_Time *mono_time, void *cs, struct RTPMessage *msg);
 
 /**
@@ -178,6 +217,9 @@ typedef struct RTPSession {
     BWController *bwc;
     void *cs;
     rtp_m_cb *mcb;
+    RTPMessagePool *pool;
+    RTPStats sent;
+    RTPStats received;
 } RTPSession;
 
 
@@ -199,8 +241,32 @@ size_t rtp_header_pack(uint8_t *rdata, const struct RTPHeader *header);
  */
 size_t rtp_header_unpack(const uint8_t *data, struct RTPHeader *header);
 
+/**
+ * Create a pool keeping up to size messages for reuse.
+ *
+ * The thread receiving packets takes messages from the pool, and the thread
+ * decoding them gives them back with \ref rtp_message_free, so that a steady
+ * stream of frames doesn't allocate. Messages are as large as the largest
+ * frame they have held.
+ */
+RTPMessagePool *rtp_message_pool_new(uint32_t size);
+/**
+ * Free the pool and the messages in it. Messages taken from it must have been
+ * given back or freed.
+ */
+void rtp_message_pool_kill(RTPMessagePool *pool);
+/**
+ * Give a message back to its pool, or free it if the pool is full. Only the
+ * thread decoding messages may call this; others can free() them.
+ */
+void rtp_message_free(struct RTPMessage *msg);
+
+/**
+ * @param pool Where messages passed to mcb come from. May be NULL to allocate
+ *   each of them.
+ */
 RTPSession *rtp_new(int payload_type, Messenger *m, uint32_t friendnumber,
-                    BWController *bwc, void *cs, rtp_m_cb *mcb);
+                    BWController *bwc, void *cs, rtp_m_cb *mcb, RTPMessagePool *pool);
 void rtp_kill(RTPSession *session);
 int rtp_allow_receiving(RTPSession *session);
 int rtp_stop_receiving(RTPSession *session);
@@ -216,6 +282,17 @@ int rtp_stop_receiving(RTPSession *session);
 int rtp_send_data(RTPSession *session, const uint8_t *data, uint32_t length,
                   bool is_keyframe, const Logger *log);
 
+/**
+ * Count a frame of `bytes` bytes sent or received at time `now` in ms.
+ */
+void rtp_stats_add(RTPStats *stats, uint64_t now, uint32_t bytes, bool is_keyframe);
+
+/**
+ * Get the frame rate in frames per second and the bit rate in bits per second
+ * as of time `now`. They are 0 if nothing was sent or received for a while.
+ */
+void rtp_stats_get_rates(const RTPStats *stats, uint64_t now, uint32_t *frame_rate, uint32_t *bit_rate);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
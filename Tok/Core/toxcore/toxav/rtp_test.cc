@@ -61,4 +61,30 @@ TEST(Rtp, SerialisingAllOnes) {
                         RTP_HEADER_SIZE));
 }
 
+TEST(Rtp, StatsRates) {
+  RTPStats stats = {0};
+  uint64_t now = 100000;
+
+  // 25 frames per second of 1000 bytes, every 10th a key frame.
+  for (int i = 0; i < 100; ++i) {
+    rtp_stats_add(&stats, now, 1000, i % 10 == 0);
+    now += 40;
+  }
+
+  EXPECT_EQ(stats.frames, 100u);
+  EXPECT_EQ(stats.keyframes, 10u);
+  EXPECT_EQ(stats.bytes, 100000u);
+
+  uint32_t frame_rate;
+  uint32_t bit_rate;
+  rtp_stats_get_rates(&stats, now, &frame_rate, &bit_rate);
+  EXPECT_EQ(frame_rate, 25u);
+  EXPECT_EQ(bit_rate, 200000u);
+
+  // Nothing arrives for a while.
+  rtp_stats_get_rates(&stats, now + 2 * RTP_STATS_INTERVAL, &frame_rate, &bit_rate);
+  EXPECT_EQ(frame_rate, 0u);
+  EXPECT_EQ(bit_rate, 0u);
+}
+
 }  // namespace
@@ -76,6 +76,85 @@ class tox {
   struct this;
 }
 
+%{
+/**
+ * Statistics of the audio or video frames sent or received in a call.
+ */
+typedef struct Toxav_Stream_Stats {
+    /**
+     * The number of frames since the call started.
+     */
+    uint64_t frames;
+    /**
+     * The number of key frames among them. Always 0 for audio.
+     */
+    uint64_t keyframes;
+    /**
+     * The number of bytes of encoded frames since the call started.
+     */
+    uint64_t bytes;
+    /**
+     * Frames per second over the last second.
+     */
+    uint32_t frame_rate;
+    /**
+     * Bit rate in kbit/sec over the last second. Unlike the bit rate set for
+     * the encoder, this is what was actually sent or received.
+     */
+    uint32_t bit_rate;
+    /**
+     * Moving average of the time in microseconds it took to encode or decode a
+     * frame.
+     */
+    uint32_t codec_time;
+} Toxav_Stream_Stats;
+
+/**
+ * Statistics of a call, see toxav_call_get_stats.
+ */
+typedef struct Toxav_Call_Stats {
+    /**
+     * Lowest round trip time to the friend in ms. 0 if not measured yet.
+     */
+    uint32_t min_rtt;
+    /**
+     * Moving average of the recent round trip times to the friend in ms. 0 if
+     * not measured yet.
+     */
+    uint32_t rtt;
+    /**
+     * Percentage of the sent data the friend reported lost in the last second.
+     */
+    uint32_t sent_loss;
+    /**
+     * Percentage of the received data that was lost in the last second.
+     */
+    uint32_t received_loss;
+
+    Toxav_Stream_Stats audio_sent;
+    Toxav_Stream_Stats audio_received;
+    Toxav_Stream_Stats video_sent;
+    Toxav_Stream_Stats video_received;
+
+    /**
+     * The number of video frames that were decoded with parts missing.
+     */
+    uint64_t video_incomplete;
+    /**
+     * Interarrival jitter of the received audio in ms as defined in RFC 3550.
+     */
+    uint32_t audio_jitter;
+    /**
+     * The audio jitter buffer state, as passed to the audio receive_stats
+     * event.
+     */
+    uint32_t audio_delay;
+    uint32_t audio_target_delay;
+    uint32_t audio_late;
+    uint32_t audio_lost;
+} Toxav_Call_Stats;
+%}
+
 /**
  * ToxAV.
  */
@@ -541,6 +620,30 @@ namespace video {
      */
     typedef void(uint32_t friend_number, uint32_t video_bit_rate);
   }
+
+  /**
+   * Set how many threads the VP8 encoder and decoder of each call may use.
+   * A value of 0 picks one from the number of cores and the frame size, which
+   * is the default. VP8 splits each frame by macroblock rows, so more threads
+   * than a frame has rows of macroblocks don't help.
+   *
+   * Running calls apply the encoder settings to the next frame they send.
+   * The decoder threads apply to calls started afterwards.
+   *
+   * @param encoder_threads Number of threads encoding a frame, up to 16.
+   * @param decoder_threads Number of threads decoding a frame, up to 16.
+   * @param token_partitions Number of parts each sent frame is split in, so
+   *   that the friend's decoder can decode them in parallel: 1, 2, 4 or 8.
+   *
+   * @return true on success.
+   */
+  bool set_threads(uint32_t encoder_threads, uint32_t decoder_threads, uint32_t token_partitions) {
+    /**
+     * A thread count was larger than 16, or token_partitions was not one of
+     * 0, 1, 2, 4 or 8.
+     */
+    INVALID,
+  }
 }
 
 
@@ -568,6 +671,30 @@ namespace audio {
     typedef void(uint32_t friend_number, const int16_t *pcm, size_t sample_count,
                  uint8_t channels, uint32_t sampling_rate);
   }
+
+  event receive_stats {
+    /**
+     * The function type for the ${event receive_stats} callback. It is called
+     * about once a second during a call in which audio is received, with the
+     * state of the jitter buffer for that call.
+     *
+     * Received frames wait in the jitter buffer until they are played. Its
+     * target delay follows how much later than the earliest frames most
+     * frames arrive, and the buffer grows or shrinks its delay towards it.
+     *
+     * @param friend_number The friend number of the friend who sends the audio.
+     * @param delay Time in ms the earliest arriving frames wait before they are
+     *   played.
+     * @param target_delay Delay in ms the jitter buffer is adapting to.
+     * @param jitter Interarrival jitter in ms as defined in RFC 3550.
+     * @param late Number of frames since the call started that arrived after
+     *   they were needed. These are also counted in lost.
+     * @param lost Number of frames since the call started that had not arrived
+     *   when they were needed, and were concealed.
+     */
+    typedef void(uint32_t friend_number, uint32_t delay, uint32_t target_delay,
+                 uint32_t jitter, uint32_t late, uint32_t lost);
+  }
 }
 
 namespace video {
@@ -600,6 +727,44 @@ namespace video {
   }
 }
 
+
+/*******************************************************************************
+ *
+ * :: Call statistics
+ *
+ ******************************************************************************/
+
+
+/**
+ * Get statistics of the media sent and received in a call. They are counted
+ * all the time, so this is cheap enough to call e.g. once a second for every
+ * call.
+ *
+ * @param friend_number The friend number of the friend this client is in a call
+ * with.
+ * @param stats The statistics are written here.
+ *
+ * @return true on success.
+ */
+bool call_get_stats(uint32_t friend_number, Toxav_Call_Stats *stats) {
+  /**
+   * Synchronization error occurred.
+   */
+  SYNC,
+  /**
+   * The stats pointer was NULL.
+   */
+  NULL,
+  /**
+   * The friend_number passed did not designate a valid friend.
+   */
+  FRIEND_NOT_FOUND,
+  /**
+   * This client is currently not in a call with the friend.
+   */
+  FRIEND_NOT_IN_CALL,
+}
+
 }
 
 %{
@@ -666,6 +831,8 @@ typedef TOXAV_ERR_ANSWER Toxav_Err_Answer;
 typedef TOXAV_ERR_CALL_CONTROL Toxav_Err_Call_Control;
 typedef TOXAV_ERR_BIT_RATE_SET Toxav_Err_Bit_Rate_Set;
 typedef TOXAV_ERR_SEND_FRAME Toxav_Err_Send_Frame;
+typedef TOXAV_ERR_VIDEO_SET_THREADS Toxav_Err_Video_Set_Threads;
+typedef TOXAV_ERR_CALL_GET_STATS Toxav_Err_Call_Get_Stats;
 typedef TOXAV_CALL_CONTROL Toxav_Call_Control;
 
 #endif // C_TOXCORE_TOXAV_TOXAV_H
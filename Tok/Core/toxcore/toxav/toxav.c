@@ -99,6 +99,9 @@ struct ToxAV {
     /* Audio frame receive callback */
     toxav_audio_receive_frame_cb *acb;
     void *acb_user_data;
+    /* Audio jitter buffer stats callback */
+    toxav_audio_receive_stats_cb *ascb;
+    void *ascb_user_data;
     /* Video frame receive callback */
     toxav_video_receive_frame_cb *vcb;
     void *vcb_user_data;
@@ -109,6 +112,8 @@ struct ToxAV {
     toxav_video_bit_rate_cb *vbcb;
     void *vbcb_user_data;
 
+    VCThreading video_threading;
+
     /** Decode time measures */
     int32_t dmssc; /** Measure count */
     int32_t dmsst; /** Last cycle total */
@@ -715,6 +720,47 @@ void toxav_callback_video_bit_rate(ToxAV *av, toxav_video_bit_rate_cb *callback,
     av->vbcb_user_data = user_data;
     pthread_mutex_unlock(av->mutex);
 }
+
+bool toxav_video_set_threads(ToxAV *av, uint32_t encoder_threads, uint32_t decoder_threads, uint32_t token_partitions,
+                             Toxav_Err_Video_Set_Threads *error)
+{
+    Toxav_Err_Video_Set_Threads rc = TOXAV_ERR_VIDEO_SET_THREADS_OK;
+
+    if (encoder_threads > VIDEO_MAX_THREADS || decoder_threads > VIDEO_MAX_THREADS ||
+            (token_partitions != 0 && token_partitions != 1 && token_partitions != 2 && token_partitions != 4
+             && token_partitions != 8)) {
+        rc = TOXAV_ERR_VIDEO_SET_THREADS_INVALID;
+        goto RETURN;
+    }
+
+    pthread_mutex_lock(av->mutex);
+
+    av->video_threading.encoder_threads = encoder_threads;
+    av->video_threading.decoder_threads = decoder_threads;
+    av->video_threading.token_partitions = token_partitions;
+
+    /* Running encoders pick it up with the next frame, decoders keep theirs. */
+    if (av->calls != nullptr) {
+        for (ToxAVCall *i = av->calls[av->calls_head]; i != nullptr; i = i->next) {
+            if (i->active) {
+                pthread_mutex_lock(i->mutex_video);
+                i->video->threading.encoder_threads = encoder_threads;
+                i->video->threading.token_partitions = token_partitions;
+                pthread_mutex_unlock(i->mutex_video);
+            }
+        }
+    }
+
+    pthread_mutex_unlock(av->mutex);
+RETURN:
+
+    if (error) {
+        *error = rc;
+    }
+
+    return rc == TOXAV_ERR_VIDEO_SET_THREADS_OK;
+}
+
 bool toxav_audio_send_frame(ToxAV *av, uint32_t friend_number, const int16_t *pcm, size_t sample_count,
                             uint8_t channels, uint32_t sampling_rate, Toxav_Err_Send_Frame *error)
 {
@@ -773,8 +819,12 @@ bool toxav_audio_send_frame(ToxAV *av, uint32_t friend_number, const int16_t *pc
 
         sampling_rate = net_htonl(sampling_rate);
         memcpy(dest, &sampling_rate, sizeof(sampling_rate));
+        const uint64_t start = current_time_monotonic_us();
         int vrc = opus_encode(call->audio->encoder, pcm, sample_count,
                               dest + sizeof(sampling_rate), SIZEOF_VLA(dest) - sizeof(sampling_rate));
+        const uint32_t encode_time = current_time_monotonic_us() - start;
+        call->audio->encode_time = call->audio->encode_time ? (call->audio->encode_time * 7 + encode_time) / 8 :
+                                   encode_time;
 
         if (vrc < 0) {
             LOGGER_WARNING(av->m->log, "Failed to encode frame %s", opus_strerror(vrc));
@@ -918,8 +968,12 @@ bool toxav_video_send_frame(ToxAV *av, uint32_t friend_number, uint16_t width, u
         memcpy(img.planes[VPX_PLANE_U], u, (width / 2) * (height / 2));
         memcpy(img.planes[VPX_PLANE_V], v, (width / 2) * (height / 2));
 
+        const uint64_t start = current_time_monotonic_us();
         vpx_codec_err_t vrc = vpx_codec_encode(call->video->encoder, &img,
                                                call->video->frame_counter, 1, vpx_encode_flags, MAX_ENCODE_TIME_US);
+        const uint32_t encode_time = current_time_monotonic_us() - start;
+        call->video->encode_time = call->video->encode_time ? (call->video->encode_time * 7 + encode_time) / 8 :
+                                   encode_time;
 
         vpx_img_free(&img);
 
@@ -954,6 +1008,14 @@ void toxav_callback_audio_receive_frame(ToxAV *av, toxav_audio_receive_frame_cb
     pthread_mutex_unlock(av->mutex);
 }
 
+void toxav_callback_audio_receive_stats(ToxAV *av, toxav_audio_receive_stats_cb *callback, void *user_data)
+{
+    pthread_mutex_lock(av->mutex);
+    av->ascb = callback;
+    av->ascb_user_data = user_data;
+    pthread_mutex_unlock(av->mutex);
+}
+
 void toxav_callback_video_receive_frame(ToxAV *av, toxav_video_receive_frame_cb *callback, void *user_data)
 {
     pthread_mutex_lock(av->mutex);
@@ -962,6 +1024,90 @@ void toxav_callback_video_receive_frame(ToxAV *av, toxav_video_receive_frame_cb
     pthread_mutex_unlock(av->mutex);
 }
 
+static void get_stream_stats(const RTPStats *rtp_stats, uint64_t now, uint32_t codec_time, Toxav_Stream_Stats *stats)
+{
+    uint32_t bit_rate;
+    rtp_stats_get_rates(rtp_stats, now, &stats->frame_rate, &bit_rate);
+    stats->bit_rate = bit_rate / 1000;
+    stats->frames = rtp_stats->frames;
+    stats->keyframes = rtp_stats->keyframes;
+    stats->bytes = rtp_stats->bytes;
+    stats->codec_time = codec_time;
+}
+
+bool toxav_call_get_stats(ToxAV *av, uint32_t friend_number, Toxav_Call_Stats *stats, Toxav_Err_Call_Get_Stats *error)
+{
+    Toxav_Err_Call_Get_Stats rc = TOXAV_ERR_CALL_GET_STATS_OK;
+    ToxAVCall *call;
+
+    if (m_friend_exists(av->m, friend_number) == 0) {
+        rc = TOXAV_ERR_CALL_GET_STATS_FRIEND_NOT_FOUND;
+        goto RETURN;
+    }
+
+    if (stats == nullptr) {
+        rc = TOXAV_ERR_CALL_GET_STATS_NULL;
+        goto RETURN;
+    }
+
+    if (pthread_mutex_trylock(av->mutex) != 0) {
+        rc = TOXAV_ERR_CALL_GET_STATS_SYNC;
+        goto RETURN;
+    }
+
+    call = call_get(av, friend_number);
+
+    if (call == nullptr || !call->active) {
+        pthread_mutex_unlock(av->mutex);
+        rc = TOXAV_ERR_CALL_GET_STATS_FRIEND_NOT_IN_CALL;
+        goto RETURN;
+    }
+
+    /* Keeps toxav_iterate off the decoders and the jitter buffer. The sending
+     * and receiving side only update counters, which may be slightly stale. */
+    pthread_mutex_lock(call->mutex);
+    pthread_mutex_unlock(av->mutex);
+
+    memset(stats, 0, sizeof(Toxav_Call_Stats));
+
+    uint64_t min_rtt;
+    uint64_t rtt;
+
+    if (m_get_friend_rtt(av->m, friend_number, &min_rtt, &rtt) == 0) {
+        stats->min_rtt = min_rtt;
+        stats->rtt = rtt;
+    }
+
+    stats->sent_loss = bwc_get_sent_loss(call->bwc) * 100;
+    stats->received_loss = bwc_get_recv_loss(call->bwc) * 100;
+
+    const uint64_t now = current_time_monotonic(av->m->mono_time);
+
+    get_stream_stats(&call->audio_rtp->sent, now, call->audio->encode_time, &stats->audio_sent);
+    get_stream_stats(&call->audio_rtp->received, now, call->audio->decode_time, &stats->audio_received);
+    get_stream_stats(&call->video_rtp->sent, now, call->video->encode_time, &stats->video_sent);
+    get_stream_stats(&call->video_rtp->received, now, call->video->decode_time, &stats->video_received);
+    stats->video_incomplete = call->video_rtp->received.incomplete;
+
+    JitterBufferStats jbuf_stats;
+    jbuf_get_stats(call->audio->j_buf, &jbuf_stats);
+    stats->audio_jitter = jbuf_stats.jitter;
+    stats->audio_delay = jbuf_stats.delay;
+    stats->audio_target_delay = jbuf_stats.target_delay;
+    stats->audio_late = jbuf_stats.late;
+    stats->audio_lost = jbuf_stats.lost;
+
+    pthread_mutex_unlock(call->mutex);
+
+RETURN:
+
+    if (error) {
+        *error = rc;
+    }
+
+    return rc == TOXAV_ERR_CALL_GET_STATS_OK;
+}
+
 /*******************************************************************************
  *
  * :: Internal
@@ -1331,7 +1477,8 @@ bool call_prepare_transmission(ToxAVCall *call)
     call->bwc = bwc_new(av->m, call->friend_number, callback_bwc, call);
 
     { /* Prepare audio */
-        call->audio = ac_new(av->m->mono_time, av->m->log, av, call->friend_number, av->acb, av->acb_user_data);
+        call->audio = ac_new(av->m->mono_time, av->m->log, av, call->friend_number, av->acb, av->acb_user_data,
+                             av->ascb, av->ascb_user_data);
 
         if (!call->audio) {
             LOGGER_ERROR(av->m->log, "Failed to create audio codec session");
@@ -1339,7 +1486,7 @@ bool call_prepare_transmission(ToxAVCall *call)
         }
 
         call->audio_rtp = rtp_new(RTP_TYPE_AUDIO, av->m, call->friend_number, call->bwc,
-                                  call->audio, ac_queue_message);
+                                  call->audio, ac_queue_message, call->audio->msg_pool);
 
         if (!call->audio_rtp) {
             LOGGER_ERROR(av->m->log, "Failed to create audio rtp session");
@@ -1347,7 +1494,8 @@ bool call_prepare_transmission(ToxAVCall *call)
         }
     }
     { /* Prepare video */
-        call->video = vc_new(av->m->mono_time, av->m->log, av, call->friend_number, av->vcb, av->vcb_user_data);
+        call->video = vc_new(av->m->mono_time, av->m->log, av, call->friend_number, av->vcb, av->vcb_user_data,
+                             &av->video_threading);
 
         if (!call->video) {
             LOGGER_ERROR(av->m->log, "Failed to create video codec session");
@@ -1355,7 +1503,7 @@ bool call_prepare_transmission(ToxAVCall *call)
         }
 
         call->video_rtp = rtp_new(RTP_TYPE_VIDEO, av->m, call->friend_number, call->bwc,
-                                  call->video, vc_queue_message);
+                                  call->video, vc_queue_message, call->video->msg_pool);
 
         if (!call->video_rtp) {
             LOGGER_ERROR(av->m->log, "Failed to create video rtp session");
@@ -72,6 +72,83 @@ extern "C" {
 typedef struct Tox Tox;
 #endif /* TOX_DEFINED */
 
+/**
+ * Statistics of the audio or video frames sent or received in a call.
+ */
+typedef struct Toxav_Stream_Stats {
+    /**
+     * The number of frames since the call started.
+     */
+    uint64_t frames;
+    /**
+     * The number of key frames among them. Always 0 for audio.
+     */
+    uint64_t keyframes;
+    /**
+     * The number of bytes of encoded frames since the call started.
+     */
+    uint64_t bytes;
+    /**
+     * Frames per second over the last second.
+     */
+    uint32_t frame_rate;
+    /**
+     * Bit rate in kbit/sec over the last second. Unlike the bit rate set for
+     * the encoder, this is what was actually sent or received.
+     */
+    uint32_t bit_rate;
+    /**
+     * Moving average of the time in microseconds it took to encode or decode a
+     * frame.
+     */
+    uint32_t codec_time;
+} Toxav_Stream_Stats;
+
+/**
+ * Statistics of a call, see toxav_call_get_stats.
+ */
+typedef struct Toxav_Call_Stats {
+    /**
+     * Lowest round trip time to the friend in ms. 0 if not measured yet.
+     */
+    uint32_t min_rtt;
+    /**
+     * Moving average of the recent round trip times to the friend in ms. 0 if
+     * not measured yet.
+     */
+    uint32_t rtt;
+    /**
+     * Percentage of the sent data the friend reported lost in the last second.
+     */
+    uint32_t sent_loss;
+    /**
+     * Percentage of the received data that was lost in the last second.
+     */
+    uint32_t received_loss;
+
+    Toxav_Stream_Stats audio_sent;
+    Toxav_Stream_Stats audio_received;
+    Toxav_Stream_Stats video_sent;
+    Toxav_Stream_Stats video_received;
+
+    /**
+     * The number of video frames that were decoded with parts missing.
+     */
+    uint64_t video_incomplete;
+    /**
+     * Interarrival jitter of the received audio in ms as defined in RFC 3550.
+     */
+    uint32_t audio_jitter;
+    /**
+     * The audio jitter buffer state, as passed to the audio receive_stats
+     * event.
+     */
+    uint32_t audio_delay;
+    uint32_t audio_target_delay;
+    uint32_t audio_late;
+    uint32_t audio_lost;
+} Toxav_Call_Stats;
+
 /**
  * ToxAV.
  */
@@ -668,6 +745,42 @@ typedef void toxav_video_bit_rate_cb(ToxAV *av, uint32_t friend_number, uint32_t
 void toxav_callback_video_bit_rate(ToxAV *av, toxav_video_bit_rate_cb *callback, void *user_data);
 
 
+typedef enum TOXAV_ERR_VIDEO_SET_THREADS {
+
+    /**
+     * The function returned successfully.
+     */
+    TOXAV_ERR_VIDEO_SET_THREADS_OK,
+
+    /**
+     * A thread count was larger than 16, or token_partitions was not one of
+     * 0, 1, 2, 4 or 8.
+     */
+    TOXAV_ERR_VIDEO_SET_THREADS_INVALID,
+
+} TOXAV_ERR_VIDEO_SET_THREADS;
+
+
+/**
+ * Set how many threads the VP8 encoder and decoder of each call may use.
+ * A value of 0 picks one from the number of cores and the frame size, which
+ * is the default. VP8 splits each frame by macroblock rows, so more threads
+ * than a frame has rows of macroblocks don't help.
+ *
+ * Running calls apply the encoder settings to the next frame they send.
+ * The decoder threads apply to calls started afterwards.
+ *
+ * @param encoder_threads Number of threads encoding a frame, up to 16.
+ * @param decoder_threads Number of threads decoding a frame, up to 16.
+ * @param token_partitions Number of parts each sent frame is split in, so
+ *   that the friend's decoder can decode them in parallel: 1, 2, 4 or 8.
+ *
+ * @return true on success.
+ */
+bool toxav_video_set_threads(ToxAV *av, uint32_t encoder_threads, uint32_t decoder_threads, uint32_t token_partitions,
+                             TOXAV_ERR_VIDEO_SET_THREADS *error);
+
+
 /*******************************************************************************
  *
  * :: A/V receiving
@@ -698,6 +811,35 @@ typedef void toxav_audio_receive_frame_cb(ToxAV *av, uint32_t friend_number, con
  */
 void toxav_callback_audio_receive_frame(ToxAV *av, toxav_audio_receive_frame_cb *callback, void *user_data);
 
+/**
+ * The function type for the audio_receive_stats callback. It is called
+ * about once a second during a call in which audio is received, with the
+ * state of the jitter buffer for that call.
+ *
+ * Received frames wait in the jitter buffer until they are played. Its
+ * target delay follows how much later than the earliest frames most
+ * frames arrive, and the buffer grows or shrinks its delay towards it.
+ *
+ * @param friend_number The friend number of the friend who sends the audio.
+ * @param delay Time in ms the earliest arriving frames wait before they are
+ *   played.
+ * @param target_delay Delay in ms the jitter buffer is adapting to.
+ * @param jitter Interarrival jitter in ms as defined in RFC 3550.
+ * @param late Number of frames since the call started that arrived after
+ *   they were needed. These are also counted in lost.
+ * @param lost Number of frames since the call started that had not arrived
+ *   when they were needed, and were concealed.
+ */
+typedef void toxav_audio_receive_stats_cb(ToxAV *av, uint32_t friend_number, uint32_t delay, uint32_t target_delay,
+        uint32_t jitter, uint32_t late, uint32_t lost, void *user_data);
+
+
+/**
+ * Set the callback for the `audio_receive_stats` event. Pass NULL to unset.
+ *
+ */
+void toxav_callback_audio_receive_stats(ToxAV *av, toxav_audio_receive_stats_cb *callback, void *user_data);
+
 /**
  * The function type for the video_receive_frame callback.
  *
@@ -731,6 +873,59 @@ typedef void toxav_video_receive_frame_cb(ToxAV *av, uint32_t friend_number, uin
  */
 void toxav_callback_video_receive_frame(ToxAV *av, toxav_video_receive_frame_cb *callback, void *user_data);
 
+
+/*******************************************************************************
+ *
+ * :: Call statistics
+ *
+ ******************************************************************************/
+
+
+
+typedef enum TOXAV_ERR_CALL_GET_STATS {
+
+    /**
+     * The function returned successfully.
+     */
+    TOXAV_ERR_CALL_GET_STATS_OK,
+
+    /**
+     * Synchronization error occurred.
+     */
+    TOXAV_ERR_CALL_GET_STATS_SYNC,
+
+    /**
+     * The stats pointer was NULL.
+     */
+    TOXAV_ERR_CALL_GET_STATS_NULL,
+
+    /**
+     * The friend_number passed did not designate a valid friend.
+     */
+    TOXAV_ERR_CALL_GET_STATS_FRIEND_NOT_FOUND,
+
+    /**
+     * This client is currently not in a call with the friend.
+     */
+    TOXAV_ERR_CALL_GET_STATS_FRIEND_NOT_IN_CALL,
+
+} TOXAV_ERR_CALL_GET_STATS;
+
+
+/**
+ * Get statistics of the media sent and received in a call. They are counted
+ * all the time, so this is cheap enough to call e.g. once a second for every
+ * call.
+ *
+ * @param friend_number The friend number of the friend this client is in a call
+ * with.
+ * @param stats The statistics are written here.
+ *
+ * @return true on success.
+ */
+bool toxav_call_get_stats(ToxAV *av, uint32_t friend_number, Toxav_Call_Stats *stats, TOXAV_ERR_CALL_GET_STATS *error);
+
+
 /**
  * NOTE Compatibility with old toxav group calls. TODO(iphydf): remove
  *
@@ -795,6 +990,8 @@ typedef TOXAV_ERR_ANSWER Toxav_Err_Answer;
 typedef TOXAV_ERR_CALL_CONTROL Toxav_Err_Call_Control;
 typedef TOXAV_ERR_BIT_RATE_SET Toxav_Err_Bit_Rate_Set;
 typedef TOXAV_ERR_SEND_FRAME Toxav_Err_Send_Frame;
+typedef TOXAV_ERR_VIDEO_SET_THREADS Toxav_Err_Video_Set_Threads;
+typedef TOXAV_ERR_CALL_GET_STATS Toxav_Err_Call_Get_Stats;
 typedef TOXAV_CALL_CONTROL Toxav_Call_Control;
 
 #endif // C_TOXCORE_TOXAV_TOXAV_H
@@ -27,6 +27,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
 #include "msi.h"
 #include "ring_buffer.h"
 #include "rtp.h"
@@ -71,6 +77,7 @@
  */
 #define VIDEO_BITRATE_INITIAL_VALUE 5000
 #define VIDEO_DECODE_BUFFER_SIZE 5 // this buffer has normally max. 1 entry
+#define VIDEO_MESSAGE_POOL_SIZE 4
 
 static vpx_codec_iface_t *video_codec_decoder_interface(void)
 {
@@ -86,11 +93,90 @@ static vpx_codec_iface_t *video_codec_encoder_interface(void)
 
 #define VPX_MAX_DIST_START 40
 
-#define VPX_MAX_ENCODER_THREADS 4
 #define VPX_MAX_DECODER_THREADS 4
 #define VIDEO_VP8_DECODER_POST_PROCESSING_ENABLED 0
 
-static void vc_init_encoder_cfg(const Logger *log, vpx_codec_enc_cfg_t *cfg, int16_t kf_max_dist)
+static uint32_t cpu_count(void)
+{
+#if defined(_WIN32) || defined(__WIN32__) || defined(WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+    const long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+#else
+    return 1;
+#endif
+}
+
+/* Threads that have enough macroblock rows to work on in a frame of this size. */
+static uint32_t threads_for_frame_size(uint16_t width, uint16_t height)
+{
+    const uint32_t pixels = (uint32_t)width * height;
+
+    if (pixels >= 1920 * 1080) {
+        return 8;
+    }
+
+    if (pixels >= 1280 * 720) {
+        return 4;
+    }
+
+    if (pixels >= 640 * 360) {
+        return 2;
+    }
+
+    return 1;
+}
+
+static uint32_t vc_encoder_threads(const VCSession *vc, uint16_t width, uint16_t height)
+{
+    if (vc->threading.encoder_threads != 0) {
+        return vc->threading.encoder_threads;
+    }
+
+    return min_u32(threads_for_frame_size(width, height), vc->cpu_count);
+}
+
+static uint32_t vc_decoder_threads(const VCSession *vc)
+{
+    if (vc->threading.decoder_threads != 0) {
+        return vc->threading.decoder_threads;
+    }
+
+    return min_u32(VPX_MAX_DECODER_THREADS, vc->cpu_count);
+}
+
+/* Set the token partitions for frames of this size, if they changed. */
+static int vc_update_token_partitions(VCSession *vc, uint16_t width, uint16_t height)
+{
+    /* The peer's cores are unknown, so it's only up to the frame size. */
+    const uint32_t partitions = vc->threading.token_partitions != 0 ? vc->threading.token_partitions :
+                                threads_for_frame_size(width, height);
+
+    if (partitions == vc->token_partitions) {
+        return 0;
+    }
+
+    int log2_partitions = 0;
+
+    while ((1u << log2_partitions) < partitions) {
+        ++log2_partitions;
+    }
+
+    const vpx_codec_err_t rc = vpx_codec_control(vc->encoder, VP8E_SET_TOKEN_PARTITIONS, log2_partitions);
+
+    if (rc != VPX_CODEC_OK) {
+        LOGGER_ERROR(vc->log, "Failed to set token partitions: %s", vpx_codec_err_to_string(rc));
+        return -1;
+    }
+
+    vc->token_partitions = partitions;
+    return 0;
+}
+
+static void vc_init_encoder_cfg(const Logger *log, vpx_codec_enc_cfg_t *cfg, int16_t kf_max_dist, uint32_t threads)
 {
     vpx_codec_err_t rc = vpx_codec_enc_config_default(video_codec_encoder_interface(), cfg, 0);
 
@@ -136,7 +222,7 @@ static void vc_init_encoder_cfg(const Logger *log, vpx_codec_enc_cfg_t *cfg, int
         LOGGER_DEBUG(log, "kf_max_dist=%d (2)", cfg->kf_max_dist);
     }
 
-    cfg->g_threads = VPX_MAX_ENCODER_THREADS; // Maximum number of threads to use
+    cfg->g_threads = threads; // Maximum number of threads to use
     /* TODO: set these to something reasonable */
     // cfg->g_timebase.num = 1;
     // cfg->g_timebase.den = 60; // 60 fps
@@ -160,7 +246,7 @@ static void vc_init_encoder_cfg(const Logger *log, vpx_codec_enc_cfg_t *cfg, int
 }
 
 VCSession *vc_new(Mono_Time *mono_time, const Logger *log, ToxAV *av, uint32_t friend_number,
-                  toxav_video_receive_frame_cb *cb, void *cb_data)
+                  toxav_video_receive_frame_cb *cb, void *cb_data, const VCThreading *threading)
 {
     VCSession *vc = (VCSession *)calloc(sizeof(VCSession), 1);
     vpx_codec_err_t rc;
@@ -170,17 +256,15 @@ VCSession *vc_new(Mono_Time *mono_time, const Logger *log, ToxAV *av, uint32_t f
         return nullptr;
     }
 
-    if (create_recursive_mutex(vc->queue_mutex) != 0) {
-        LOGGER_WARNING(log, "Failed to create recursive mutex!");
-        free(vc);
-        return nullptr;
-    }
+    vc->threading = *threading;
+    vc->cpu_count = cpu_count();
 
     int cpu_used_value = VP8E_SET_CPUUSED_VALUE;
 
-    vc->vbuf_raw = rb_new(VIDEO_DECODE_BUFFER_SIZE);
+    vc->vbuf_raw = spsc_rb_new(VIDEO_DECODE_BUFFER_SIZE);
+    vc->msg_pool = rtp_message_pool_new(VIDEO_MESSAGE_POOL_SIZE);
 
-    if (!vc->vbuf_raw) {
+    if (!vc->vbuf_raw || !vc->msg_pool) {
         goto BASE_CLEANUP;
     }
 
@@ -192,7 +276,7 @@ VCSession *vc_new(Mono_Time *mono_time, const Logger *log, ToxAV *av, uint32_t f
      *    Conceal errors in decoded frames
      */
     vpx_codec_dec_cfg_t  dec_cfg;
-    dec_cfg.threads = VPX_MAX_DECODER_THREADS; // Maximum number of threads to use
+    dec_cfg.threads = vc_decoder_threads(vc); // Maximum number of threads to use
     dec_cfg.w = VIDEO_CODEC_DECODER_MAX_WIDTH;
     dec_cfg.h = VIDEO_CODEC_DECODER_MAX_HEIGHT;
 
@@ -230,10 +314,11 @@ VCSession *vc_new(Mono_Time *mono_time, const Logger *log, ToxAV *av, uint32_t f
         }
     }
 
-    /* Set encoder to some initial values
+    /* Set encoder to some initial values. The frame size is a dummy until the
+     * first frame reconfigures the encoder, so it doesn't pick the threads.
      */
     vpx_codec_enc_cfg_t  cfg;
-    vc_init_encoder_cfg(log, &cfg, 1);
+    vc_init_encoder_cfg(log, &cfg, 1, vc_encoder_threads(vc, 0, 0));
 
     LOGGER_DEBUG(log, "Using VP8 codec for encoder (0.1)");
     rc = vpx_codec_enc_init(vc->encoder, video_codec_encoder_interface(), &cfg, VPX_CODEC_USE_FRAME_THREADING);
@@ -251,6 +336,9 @@ VCSession *vc_new(Mono_Time *mono_time, const Logger *log, ToxAV *av, uint32_t f
         goto BASE_CLEANUP_1;
     }
 
+    /* The encoder starts with one; vc_reconfigure_encoder sets the rest. */
+    vc->token_partitions = 1;
+
     /*
     VPX_CTRL_USE_TYPE(VP8E_SET_NOISE_SENSITIVITY,  unsigned int)
     control function to set noise sensitivity
@@ -276,8 +364,8 @@ VCSession *vc_new(Mono_Time *mono_time, const Logger *log, ToxAV *av, uint32_t f
 BASE_CLEANUP_1:
     vpx_codec_destroy(vc->decoder);
 BASE_CLEANUP:
-    pthread_mutex_destroy(vc->queue_mutex);
-    rb_kill(vc->vbuf_raw);
+    rtp_message_pool_kill(vc->msg_pool);
+    spsc_rb_kill(vc->vbuf_raw);
     free(vc);
     return nullptr;
 }
@@ -292,12 +380,12 @@ void vc_kill(VCSession *vc)
     vpx_codec_destroy(vc->decoder);
     void *p;
 
-    while (rb_read(vc->vbuf_raw, &p)) {
+    while (spsc_rb_read(vc->vbuf_raw, &p)) {
         free(p);
     }
 
-    rb_kill(vc->vbuf_raw);
-    pthread_mutex_destroy(vc->queue_mutex);
+    spsc_rb_kill(vc->vbuf_raw);
+    rtp_message_pool_kill(vc->msg_pool);
     LOGGER_DEBUG(vc->log, "Terminated video handler: %p", (void *)vc);
     free(vc);
 }
@@ -308,17 +396,21 @@ void vc_iterate(VCSession *vc)
         return;
     }
 
-    pthread_mutex_lock(vc->queue_mutex);
-
     struct RTPMessage *p;
 
-    if (!rb_read(vc->vbuf_raw, (void **)&p)) {
+    if (!spsc_rb_read(vc->vbuf_raw, (void **)&p)) {
         LOGGER_TRACE(vc->log, "no Video frame data available");
-        pthread_mutex_unlock(vc->queue_mutex);
         return;
     }
 
-    pthread_mutex_unlock(vc->queue_mutex);
+    /* When decoding falls behind, skip to the newest frame rather than show
+     * old ones late. */
+    while (spsc_rb_size(vc->vbuf_raw) > 0) {
+        LOGGER_DEBUG(vc->log, "decoder behind, dropping old frame");
+        rtp_message_free(p);
+        spsc_rb_read(vc->vbuf_raw, (void **)&p);
+    }
+
     const struct RTPHeader *const header = &p->header;
 
     uint32_t full_data_len;
@@ -332,9 +424,12 @@ void vc_iterate(VCSession *vc)
     }
 
     LOGGER_DEBUG(vc->log, "vc_iterate: rb_read p->len=%d p->header.xe=%d", (int)full_data_len, p->header.xe);
-    LOGGER_DEBUG(vc->log, "vc_iterate: rb_read rb size=%d", (int)rb_size(vc->vbuf_raw));
+    LOGGER_DEBUG(vc->log, "vc_iterate: rb_read rb size=%d", (int)spsc_rb_size(vc->vbuf_raw));
+    const uint64_t start = current_time_monotonic_us();
     const vpx_codec_err_t rc = vpx_codec_decode(vc->decoder, p->data, full_data_len, nullptr, MAX_DECODE_TIME_US);
-    free(p);
+    const uint32_t decode_time = current_time_monotonic_us() - start;
+    vc->decode_time = vc->decode_time ? (vc->decode_time * 7 + decode_time) / 8 : decode_time;
+    rtp_message_free(p);
 
     if (rc != VPX_CODEC_OK) {
         LOGGER_ERROR(vc->log, "Error decoding video: %d %s", (int)rc, vpx_codec_err_to_string(rc));
@@ -382,19 +477,21 @@ int vc_queue_message(Mono_Time *mono_time, void *vcp, struct RTPMessage *msg)
         return -1;
     }
 
-    pthread_mutex_lock(vc->queue_mutex);
-
     if ((header->flags & RTP_LARGE_FRAME) && header->pt == RTP_TYPE_VIDEO % 128) {
         LOGGER_DEBUG(vc->log, "rb_write msg->len=%d b0=%d b1=%d", (int)msg->len, (int)msg->data[0], (int)msg->data[1]);
     }
 
-    free(rb_write(vc->vbuf_raw, msg));
+    /* vc_iterate drops the older frames, so this only fills up while the
+     * decoding thread stalls. Only it may remove entries, so drop this one. */
+    if (!spsc_rb_write(vc->vbuf_raw, msg)) {
+        LOGGER_DEBUG(vc->log, "decode buffer full, dropping frame");
+        free(msg);
+    }
 
     /* Calculate time it took for peer to send us this frame */
     uint32_t t_lcfd = current_time_monotonic(mono_time) - vc->linfts;
     vc->lcfd = t_lcfd > 100 ? vc->lcfd : t_lcfd;
     vc->linfts = current_time_monotonic(mono_time);
-    pthread_mutex_unlock(vc->queue_mutex);
     return 0;
 }
 
@@ -406,12 +503,15 @@ int vc_reconfigure_encoder(VCSession *vc, uint32_t bit_rate, uint16_t width, uin
 
     vpx_codec_enc_cfg_t cfg2 = *vc->encoder->config.enc;
     vpx_codec_err_t rc;
+    const uint32_t threads = vc_encoder_threads(vc, width, height);
 
-    if (cfg2.rc_target_bitrate == bit_rate && cfg2.g_w == width && cfg2.g_h == height && kf_max_dist == -1) {
-        return 0; /* Nothing changed */
+    if (cfg2.rc_target_bitrate == bit_rate && cfg2.g_w == width && cfg2.g_h == height && cfg2.g_threads == threads
+            && kf_max_dist == -1) {
+        /* Nothing changed, except maybe the token partitions */
+        return vc_update_token_partitions(vc, width, height);
     }
 
-    if (cfg2.g_w == width && cfg2.g_h == height && kf_max_dist == -1) {
+    if (cfg2.g_w == width && cfg2.g_h == height && cfg2.g_threads == threads && kf_max_dist == -1) {
         /* Only bit rate changed */
         LOGGER_INFO(vc->log, "bitrate change from: %u to: %u", (uint32_t)cfg2.rc_target_bitrate, (uint32_t)bit_rate);
         cfg2.rc_target_bitrate = bit_rate;
@@ -424,11 +524,12 @@ int vc_reconfigure_encoder(VCSession *vc, uint32_t bit_rate, uint16_t width, uin
     } else {
         /* Resolution is changed, must reinitialize encoder since libvpx v1.4 doesn't support
          * reconfiguring encoder to use resolutions greater than initially set.
+         * The encoder threads are started at init too.
          */
         LOGGER_DEBUG(vc->log, "Have to reinitialize vpx encoder on session %p", (void *)vc);
         vpx_codec_ctx_t new_c;
         vpx_codec_enc_cfg_t  cfg;
-        vc_init_encoder_cfg(vc->log, &cfg, kf_max_dist);
+        vc_init_encoder_cfg(vc->log, &cfg, kf_max_dist, threads);
         cfg.rc_target_bitrate = bit_rate;
         cfg.g_w = width;
         cfg.g_h = height;
@@ -453,7 +554,8 @@ int vc_reconfigure_encoder(VCSession *vc, uint32_t bit_rate, uint16_t width, uin
 
         vpx_codec_destroy(vc->encoder);
         memcpy(vc->encoder, &new_c, sizeof(new_c));
+        vc->token_partitions = 1;
     }
 
-    return 0;
+    return vc_update_token_partitions(vc, width, height);
 }
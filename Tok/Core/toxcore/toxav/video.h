@@ -37,14 +37,36 @@
 
 #include <pthread.h>
 
+/* Upper bound of the thread counts that can be set. */
+#define VIDEO_MAX_THREADS 16
+
+/**
+ * How the VP8 encoder and decoder of a call use threads. A field that is 0 is
+ * picked from the number of cores and the frame size.
+ *
+ * VP8 always splits the work of a frame by macroblock rows, so there is no
+ * separate row based mode to turn on.
+ */
+typedef struct VCThreading {
+    uint32_t encoder_threads;
+    uint32_t decoder_threads;
+    /* Number of token partitions of each encoded frame: 1, 2, 4 or 8. The
+     * peer's decoder can work on as many macroblock rows at once. */
+    uint32_t token_partitions;
+} VCThreading;
+
 typedef struct VCSession_s {
     /* encoding */
     vpx_codec_ctx_t encoder[1];
     uint32_t frame_counter;
+    uint32_t encode_time; /* Moving average of the time in us it took to encode a frame */
+    uint32_t token_partitions; /* Currently set on the encoder */
 
     /* decoding */
     vpx_codec_ctx_t decoder[1];
-    struct RingBuffer *vbuf_raw; /* Un-decoded data */
+    struct SPSCRingBuffer *vbuf_raw; /* Un-decoded data */
+    RTPMessagePool *msg_pool;
+    uint32_t decode_time; /* Moving average of the time in us it took to decode a frame */
 
     uint64_t linfts; /* Last received frame time stamp */
     uint32_t lcfd; /* Last calculated frame duration for incoming video payload */
@@ -52,16 +74,16 @@ typedef struct VCSession_s {
     const Logger *log;
     ToxAV *av;
     uint32_t friend_number;
+    VCThreading threading;
+    uint32_t cpu_count;
 
     /* Video frame receive callback */
     toxav_video_receive_frame_cb *vcb;
     void *vcb_user_data;
-
-    pthread_mutex_t queue_mutex[1];
 } VCSession;
 
 VCSession *vc_new(Mono_Time *mono_time, const Logger *log, ToxAV *av, uint32_t friend_number,
-                  toxav_video_receive_frame_cb *cb, void *cb_data);
+                  toxav_video_receive_frame_cb *cb, void *cb_data, const VCThreading *threading);
 void vc_kill(VCSession *vc);
 void vc_iterate(VCSession *vc);
 int vc_queue_message(Mono_Time *mono_time, void *vcp, struct RTPMessage *msg);
@@ -0,0 +1,215 @@
+#include "video.h"
+
+#include "../toxcore/logger.h"
+#include "../toxcore/mono_time.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// The deadline toxav_video_send_frame gives the encoder.
+constexpr unsigned long kEncodeDeadlineUs = 1000000 / 40;
+constexpr uint32_t kBitRate = 2500;
+
+// Moving gradients with some noise on top, so that the encoder has motion to
+// search for and detail to code.
+void fill_frame(std::vector<uint8_t> &frame, uint16_t width, uint16_t height, uint32_t n) {
+  uint8_t *const y = frame.data();
+  uint8_t *const u = y + width * height;
+  uint8_t *const v = u + (width / 2) * (height / 2);
+  uint32_t seed = n + 1;
+
+  for (uint32_t row = 0; row < height; ++row) {
+    for (uint32_t col = 0; col < width; ++col) {
+      seed = seed * 1103515245 + 12345;
+      y[row * width + col] = static_cast<uint8_t>(col + 2 * row + 4 * n + ((seed >> 16) & 15));
+    }
+  }
+
+  for (uint32_t row = 0; row < height / 2u; ++row) {
+    for (uint32_t col = 0; col < width / 2u; ++col) {
+      u[row * (width / 2) + col] = static_cast<uint8_t>(128 + (col + n) / 8);
+      v[row * (width / 2) + col] = static_cast<uint8_t>(row + n);
+    }
+  }
+}
+
+struct Result {
+  uint32_t decoded = 0;
+  size_t bytes = 0;
+  double encode_fps = 0;
+  double decode_fps = 0;
+};
+
+// Encode frames with a session's encoder as toxav_video_send_frame does, then
+// decode them with its decoder as vc_iterate does.
+Result run_session(const VCThreading &threading, uint16_t width, uint16_t height, uint32_t frames) {
+  Result result;
+  Logger *log = logger_new();
+  Mono_Time *mono_time = mono_time_new();
+  VCSession *vc = vc_new(mono_time, log, nullptr, 0, nullptr, nullptr, &threading);
+
+  if (vc == nullptr) {
+    ADD_FAILURE() << "vc_new failed";
+    mono_time_free(mono_time);
+    logger_kill(log);
+    return result;
+  }
+
+  EXPECT_EQ(vc_reconfigure_encoder(vc, kBitRate, width, height, -1), 0);
+
+  std::vector<uint8_t> frame(width * height * 3 / 2);
+  std::vector<std::vector<uint8_t>> encoded;
+  Clock::duration encode_time{};
+
+  for (uint32_t n = 0; n < frames; ++n) {
+    fill_frame(frame, width, height, n);
+
+    vpx_image_t img;
+    vpx_img_wrap(&img, VPX_IMG_FMT_I420, width, height, 1, frame.data());
+
+    auto const start = Clock::now();
+    EXPECT_EQ(vpx_codec_encode(vc->encoder, &img, n, 1, n == 0 ? VPX_EFLAG_FORCE_KF : 0, kEncodeDeadlineUs),
+              VPX_CODEC_OK);
+
+    vpx_codec_iter_t iter = nullptr;
+
+    while (const vpx_codec_cx_pkt_t *pkt = vpx_codec_get_cx_data(vc->encoder, &iter)) {
+      if (pkt->kind == VPX_CODEC_CX_FRAME_PKT) {
+        const uint8_t *const data = static_cast<const uint8_t *>(pkt->data.frame.buf);
+        encoded.emplace_back(data, data + pkt->data.frame.sz);
+      }
+    }
+
+    encode_time += Clock::now() - start;
+  }
+
+  Clock::duration decode_time{};
+
+  for (const std::vector<uint8_t> &data : encoded) {
+    result.bytes += data.size();
+
+    auto const start = Clock::now();
+    EXPECT_EQ(vpx_codec_decode(vc->decoder, data.data(), data.size(), nullptr, 0), VPX_CODEC_OK);
+
+    vpx_codec_iter_t iter = nullptr;
+
+    while (vpx_image_t *img = vpx_codec_get_frame(vc->decoder, &iter)) {
+      EXPECT_LE(img->d_w, width);
+      EXPECT_LE(img->d_h, height);
+      ++result.decoded;
+    }
+
+    decode_time += Clock::now() - start;
+  }
+
+  result.encode_fps = frames / std::chrono::duration<double>(encode_time).count();
+  result.decode_fps = encoded.size() / std::chrono::duration<double>(decode_time).count();
+
+  vc_kill(vc);
+  mono_time_free(mono_time);
+  logger_kill(log);
+  return result;
+}
+
+TEST(Video, EncodesAndDecodesWithThreads) {
+  const VCThreading threading = {4, 4, 4};
+  const Result result = run_session(threading, 640, 360, 10);
+  EXPECT_EQ(result.decoded, 10u);
+  EXPECT_GT(result.bytes, 0u);
+}
+
+void count_frame(ToxAV *av, uint32_t friend_number, uint16_t width, uint16_t height, const uint8_t *y,
+                 const uint8_t *u, const uint8_t *v, int32_t ystride, int32_t ustride, int32_t vstride,
+                 void *user_data) {
+  ++*static_cast<uint32_t *>(user_data);
+}
+
+TEST(Video, IterateSkipsToTheNewestFrame) {
+  constexpr uint16_t kWidth = 160;
+  constexpr uint16_t kHeight = 120;
+  Logger *log = logger_new();
+  Mono_Time *mono_time = mono_time_new();
+  uint32_t shown = 0;
+  const VCThreading threading = {1, 1, 1};
+  VCSession *vc = vc_new(mono_time, log, nullptr, 0, count_frame, &shown, &threading);
+  ASSERT_NE(vc, nullptr);
+  ASSERT_EQ(vc_reconfigure_encoder(vc, kBitRate, kWidth, kHeight, -1), 0);
+
+  std::vector<uint8_t> frame(kWidth * kHeight * 3 / 2);
+
+  // Key frames, so that each of them decodes on its own.
+  for (uint32_t n = 0; n < 3; ++n) {
+    fill_frame(frame, kWidth, kHeight, n);
+
+    vpx_image_t img;
+    vpx_img_wrap(&img, VPX_IMG_FMT_I420, kWidth, kHeight, 1, frame.data());
+    ASSERT_EQ(vpx_codec_encode(vc->encoder, &img, n, 1, VPX_EFLAG_FORCE_KF, kEncodeDeadlineUs), VPX_CODEC_OK);
+
+    vpx_codec_iter_t iter = nullptr;
+
+    while (const vpx_codec_cx_pkt_t *pkt = vpx_codec_get_cx_data(vc->encoder, &iter)) {
+      if (pkt->kind != VPX_CODEC_CX_FRAME_PKT) {
+        continue;
+      }
+
+      const uint32_t len = pkt->data.frame.sz;
+      struct RTPMessage *msg = static_cast<struct RTPMessage *>(calloc(1, sizeof(struct RTPMessage) + len));
+      ASSERT_NE(msg, nullptr);
+      memcpy(msg->data, pkt->data.frame.buf, len);
+      msg->len = len;
+      msg->header.pt = RTP_TYPE_VIDEO % 128;
+      msg->header.flags = RTP_LARGE_FRAME;
+      msg->header.data_length_full = len;
+      ASSERT_EQ(vc_queue_message(mono_time, vc, msg), 0);
+    }
+  }
+
+  vc_iterate(vc);
+  EXPECT_EQ(shown, 1u);
+
+  // The older frames were dropped, not left for later.
+  vc_iterate(vc);
+  EXPECT_EQ(shown, 1u);
+
+  vc_kill(vc);
+  mono_time_free(mono_time);
+  logger_kill(log);
+}
+
+TEST(Video, ThreadingBenchmark) {
+  uint32_t frames = 60;
+  char const *env = std::getenv("VIDEO_BENCHMARK_FRAMES");
+
+  if (env != nullptr) {
+    frames = std::max(10, std::atoi(env));
+  }
+
+  const VCThreading configs[] = {
+      {1, 1, 1},
+      {2, 2, 2},
+      {4, 4, 4},
+      {8, 8, 8},
+      {0, 0, 0},
+  };
+
+  for (const VCThreading &threading : configs) {
+    const Result result = run_session(threading, 1280, 720, frames);
+    EXPECT_EQ(result.decoded, frames);
+    std::printf("720p threads enc %u dec %u partitions %u%s: encode %.1f fps, decode %.1f fps, %.0f kbit/frame\n",
+                threading.encoder_threads, threading.decoder_threads, threading.token_partitions,
+                threading.encoder_threads == 0 ? " (auto)" : "", result.encode_fps, result.decode_fps,
+                result.bytes * 8.0 / 1000 / std::max(result.decoded, 1u));
+  }
+}
+
+}  // namespace
@@ -28,10 +28,12 @@
 #include "DHT.h"
 
 #include "LAN_discovery.h"
+#include "hash_index.h"
 #include "logger.h"
 #include "mono_time.h"
 #include "network.h"
 #include "ping.h"
+#include "precompute.h"
 #include "state.h"
 #include "util.h"
 
@@ -98,7 +100,10 @@ struct DHT {
 
     bool hole_punching_enabled;
 
+    /* LCLIENT_LENGTH buckets of LCLIENT_NODES, see close_bucket_index. */
     Client_data    close_clientlist[LCLIENT_LIST];
+    Hash_Index    *close_ip_port_index; // assoc ip_port -> index in close_clientlist
+    uint32_t       close_buckets_used;  // buckets past this one have never held a node
     uint64_t       close_lastgetnodes;
     uint32_t       close_bootstrap_times;
 
@@ -113,8 +118,8 @@ struct DHT {
     uint32_t       loaded_num_nodes;
     unsigned int   loaded_nodes_index;
 
-    Shared_Keys shared_keys_recv;
-    Shared_Keys shared_keys_sent;
+    Shared_Keys   *shared_keys_recv;
+    Shared_Keys   *shared_keys_sent;
 
     struct Ping   *ping;
     Ping_Array    *dht_ping_array;
@@ -238,6 +243,222 @@ static unsigned int bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
     return i * 8 + j;
 }
 
+/* Return the bucket of the close list that public_key belongs in: the number of
+ * leading bits it shares with our own key, capped at the last bucket.
+ */
+static uint32_t close_bucket_index(const DHT *dht, const uint8_t *public_key)
+{
+    const unsigned int index = bit_by_bit_cmp(public_key, dht->self_public_key);
+    return index < LCLIENT_LENGTH ? index : LCLIENT_LENGTH - 1;
+}
+
+static Client_data *close_bucket(DHT *dht, uint32_t bucket)
+{
+    return &dht->close_clientlist[bucket * LCLIENT_NODES];
+}
+
+/* Return the index in close_clientlist of the entry for public_key, or UINT32_MAX. */
+static uint32_t index_of_close_pk(const DHT *dht, const uint8_t *public_key)
+{
+    const uint32_t start = close_bucket_index(dht, public_key) * LCLIENT_NODES;
+
+    for (uint32_t i = start; i < start + LCLIENT_NODES; ++i) {
+        if (id_equal(dht->close_clientlist[i].public_key, public_key)) {
+            return i;
+        }
+    }
+
+    return UINT32_MAX;
+}
+
+/* Hits a key keeps count of, so that the hand passes it that many times. */
+#define SHARED_KEYS_MAX_USES 3
+
+typedef struct Shared_Key {
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    uint64_t time_last_requested;
+    bool stored;
+    /* Hits not yet aged by the CLOCK hand, up to SHARED_KEYS_MAX_USES. */
+    uint8_t uses;
+} Shared_Key;
+
+struct Shared_Keys {
+    Shared_Key *keys;
+    /* CLOCK hand of each set. */
+    uint8_t *hands;
+    uint32_t set_mask;
+    uint32_t ways;
+    /* Random, so that peers can't choose keys that all land in one set. */
+    uint64_t seed;
+
+    Shared_Keys_Stats stats;
+};
+
+Shared_Keys *shared_keys_new(uint32_t size, uint32_t ways)
+{
+    if (size == 0) {
+        size = SHARED_KEYS_DEFAULT_SIZE;
+    }
+
+    if (ways == 0) {
+        ways = SHARED_KEYS_DEFAULT_WAYS;
+    }
+
+    if (ways > SHARED_KEYS_MAX_WAYS) {
+        return nullptr;
+    }
+
+    uint32_t sets = 1;
+
+    while ((uint64_t)sets * ways < size) {
+        sets *= 2;
+    }
+
+    Shared_Keys *const shared_keys = (Shared_Keys *)calloc(1, sizeof(Shared_Keys));
+
+    if (shared_keys == nullptr) {
+        return nullptr;
+    }
+
+    shared_keys->keys = (Shared_Key *)calloc((size_t)sets * ways, sizeof(Shared_Key));
+    shared_keys->hands = (uint8_t *)calloc(sets, sizeof(uint8_t));
+
+    if (shared_keys->keys == nullptr || shared_keys->hands == nullptr) {
+        shared_keys_kill(shared_keys);
+        return nullptr;
+    }
+
+    shared_keys->set_mask = sets - 1;
+    shared_keys->ways = ways;
+    shared_keys->seed = random_u64();
+    return shared_keys;
+}
+
+void shared_keys_kill(Shared_Keys *shared_keys)
+{
+    if (shared_keys == nullptr) {
+        return;
+    }
+
+    if (shared_keys->keys != nullptr) {
+        crypto_memzero(shared_keys->keys, (size_t)shared_keys_get_size(shared_keys) * sizeof(Shared_Key));
+    }
+
+    free(shared_keys->keys);
+    free(shared_keys->hands);
+    free(shared_keys);
+}
+
+uint32_t shared_keys_get_size(const Shared_Keys *shared_keys)
+{
+    return (shared_keys->set_mask + 1) * shared_keys->ways;
+}
+
+void shared_keys_get_stats(const Shared_Keys *shared_keys, Shared_Keys_Stats *stats)
+{
+    *stats = shared_keys->stats;
+}
+
+static uint32_t shared_keys_set(const Shared_Keys *shared_keys, const uint8_t *public_key)
+{
+    uint64_t h = shared_keys->seed;
+
+    for (uint32_t i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, public_key + i, sizeof(word));
+        h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 32;
+    }
+
+    return (uint32_t)h & shared_keys->set_mask;
+}
+
+/* Advance the hand of the set past entries that have been used, taking one use
+ * off each, to the entry to replace.
+ */
+static Shared_Key *clock_victim(Shared_Keys *shared_keys, uint32_t set)
+{
+    Shared_Key *const keys = &shared_keys->keys[(size_t)set * shared_keys->ways];
+    uint8_t *const hand = &shared_keys->hands[set];
+
+    while (keys[*hand].uses != 0) {
+        --keys[*hand].uses;
+        *hand = (*hand + 1) % shared_keys->ways;
+    }
+
+    Shared_Key *const victim = &keys[*hand];
+    *hand = (*hand + 1) % shared_keys->ways;
+    return victim;
+}
+
+/* Copy the key for public_key to shared_key if it is stored. */
+static bool shared_keys_get(const Mono_Time *mono_time, Shared_Keys *shared_keys, uint8_t *shared_key,
+                            const uint8_t *public_key)
+{
+    Shared_Key *const keys = &shared_keys->keys[(size_t)shared_keys_set(shared_keys, public_key) * shared_keys->ways];
+
+    for (uint32_t i = 0; i < shared_keys->ways; ++i) {
+        Shared_Key *const key = &keys[i];
+
+        if (key->stored && id_equal(public_key, key->public_key)) {
+            memcpy(shared_key, key->shared_key, CRYPTO_SHARED_KEY_SIZE);
+
+            if (key->uses < SHARED_KEYS_MAX_USES) {
+                ++key->uses;
+            }
+
+            key->time_last_requested = mono_time_get(mono_time);
+            ++shared_keys->stats.hits;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Store a key that shared_keys_get didn't find. */
+static void shared_keys_store(const Mono_Time *mono_time, Shared_Keys *shared_keys, const uint8_t *shared_key,
+                              const uint8_t *public_key)
+{
+    const uint32_t set = shared_keys_set(shared_keys, public_key);
+    Shared_Key *const keys = &shared_keys->keys[(size_t)set * shared_keys->ways];
+    /* Empty or not requested for KEYS_TIMEOUT. */
+    Shared_Key *free_key = nullptr;
+    /* Not requested again since it was stored. */
+    Shared_Key *unused_key = nullptr;
+
+    for (uint32_t i = 0; i < shared_keys->ways; ++i) {
+        Shared_Key *const key = &keys[i];
+
+        if (!key->stored || mono_time_is_timeout(mono_time, key->time_last_requested, KEYS_TIMEOUT)) {
+            free_key = key;
+        } else if (key->uses == 0 && unused_key == nullptr) {
+            unused_key = key;
+        }
+    }
+
+    ++shared_keys->stats.misses;
+
+    /* Keys seen once only compete with each other, until the set fills up with
+     * keys that have been requested again and the hand ages them. */
+    Shared_Key *victim = free_key != nullptr ? free_key : unused_key;
+
+    if (victim == nullptr) {
+        victim = clock_victim(shared_keys, set);
+    }
+
+    if (victim->stored) {
+        ++shared_keys->stats.evictions;
+    }
+
+    victim->stored = true;
+    victim->uses = 0;
+    memcpy(victim->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(victim->shared_key, shared_key, CRYPTO_SHARED_KEY_SIZE);
+    victim->time_last_requested = mono_time_get(mono_time);
+}
+
 /* Shared key generations are costly, it is therefore smart to store commonly used
  * ones so that they can re used later without being computed again.
  *
@@ -247,46 +468,28 @@ static unsigned int bit_by_bit_cmp(const uint8_t *pk1, const uint8_t *pk2)
 void get_shared_key(const Mono_Time *mono_time, Shared_Keys *shared_keys, uint8_t *shared_key,
                     const uint8_t *secret_key, const uint8_t *public_key)
 {
-    uint32_t num = ~0;
-    uint32_t curr = 0;
-
-    for (uint32_t i = 0; i < MAX_KEYS_PER_SLOT; ++i) {
-        const int index = public_key[30] * MAX_KEYS_PER_SLOT + i;
-        Shared_Key *const key = &shared_keys->keys[index];
-
-        if (key->stored) {
-            if (id_equal(public_key, key->public_key)) {
-                memcpy(shared_key, key->shared_key, CRYPTO_SHARED_KEY_SIZE);
-                ++key->times_requested;
-                key->time_last_requested = mono_time_get(mono_time);
-                return;
-            }
-
-            if (num != 0) {
-                if (mono_time_is_timeout(mono_time, key->time_last_requested, KEYS_TIMEOUT)) {
-                    num = 0;
-                    curr = index;
-                } else if (num > key->times_requested) {
-                    num = key->times_requested;
-                    curr = index;
-                }
-            }
-        } else if (num != 0) {
-            num = 0;
-            curr = index;
-        }
+    if (shared_keys_get(mono_time, shared_keys, shared_key, public_key)) {
+        return;
     }
 
     encrypt_precompute(public_key, secret_key, shared_key);
+    shared_keys_store(mono_time, shared_keys, shared_key, public_key);
+}
 
-    if (num != UINT32_MAX) {
-        Shared_Key *const key = &shared_keys->keys[curr];
-        key->stored = true;
-        key->times_requested = 1;
-        memcpy(key->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
-        memcpy(key->shared_key, shared_key, CRYPTO_SHARED_KEY_SIZE);
-        key->time_last_requested = mono_time_get(mono_time);
+bool get_shared_key_for_packet(const Mono_Time *mono_time, Shared_Keys *shared_keys, Precompute_Pool *pool,
+                               IP_Port source, const uint8_t *packet, uint16_t length, uint8_t *shared_key,
+                               const uint8_t *secret_key, const uint8_t *public_key)
+{
+    if (shared_keys_get(mono_time, shared_keys, shared_key, public_key)) {
+        return true;
+    }
+
+    if (!precompute_shared_key(pool, source, packet, length, public_key, secret_key, shared_key)) {
+        return false;
     }
+
+    shared_keys_store(mono_time, shared_keys, shared_key, public_key);
+    return true;
 }
 
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
@@ -294,7 +497,7 @@ void get_shared_key(const Mono_Time *mono_time, Shared_Keys *shared_keys, uint8_
  */
 void dht_get_shared_key_recv(DHT *dht, uint8_t *shared_key, const uint8_t *public_key)
 {
-    get_shared_key(dht->mono_time, &dht->shared_keys_recv, shared_key, dht->self_secret_key, public_key);
+    get_shared_key(dht->mono_time, dht->shared_keys_recv, shared_key, dht->self_secret_key, public_key);
 }
 
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
@@ -302,7 +505,36 @@ void dht_get_shared_key_recv(DHT *dht, uint8_t *shared_key, const uint8_t *publi
  */
 void dht_get_shared_key_sent(DHT *dht, uint8_t *shared_key, const uint8_t *public_key)
 {
-    get_shared_key(dht->mono_time, &dht->shared_keys_sent, shared_key, dht->self_secret_key, public_key);
+    get_shared_key(dht->mono_time, dht->shared_keys_sent, shared_key, dht->self_secret_key, public_key);
+}
+
+bool dht_get_shared_key_recv_for_packet(DHT *dht, uint8_t *shared_key, const uint8_t *public_key, IP_Port source,
+                                        const uint8_t *packet, uint16_t length)
+{
+    return get_shared_key_for_packet(dht->mono_time, dht->shared_keys_recv, networking_get_precompute_pool(dht->net),
+                                     source, packet, length, shared_key, dht->self_secret_key, public_key);
+}
+
+bool dht_get_shared_key_sent_for_packet(DHT *dht, uint8_t *shared_key, const uint8_t *public_key, IP_Port source,
+                                        const uint8_t *packet, uint16_t length)
+{
+    return get_shared_key_for_packet(dht->mono_time, dht->shared_keys_sent, networking_get_precompute_pool(dht->net),
+                                     source, packet, length, shared_key, dht->self_secret_key, public_key);
+}
+
+Shared_Keys *dht_shared_keys_new(const DHT *dht)
+{
+    return shared_keys_new(shared_keys_get_size(dht->shared_keys_recv), dht->shared_keys_recv->ways);
+}
+
+void dht_get_shared_keys_stats(const DHT *dht, Shared_Keys_Stats *stats)
+{
+    Shared_Keys_Stats sent;
+    shared_keys_get_stats(dht->shared_keys_recv, stats);
+    shared_keys_get_stats(dht->shared_keys_sent, &sent);
+    stats->hits += sent.hits;
+    stats->misses += sent.misses;
+    stats->evictions += sent.evictions;
 }
 
 #define CRYPTO_SIZE 1 + CRYPTO_PUBLIC_KEY_SIZE * 2 + CRYPTO_NONCE_SIZE
@@ -330,14 +562,19 @@ int create_request(const uint8_t *send_public_key, const uint8_t *send_secret_ke
 
     uint8_t *const nonce = packet + 1 + CRYPTO_PUBLIC_KEY_SIZE * 2;
     random_nonce(nonce);
-    uint8_t temp[MAX_CRYPTO_REQUEST_SIZE];
-    memcpy(temp + 1, data, length);
-    temp[0] = request_id;
-    const int len = encrypt_data(recv_public_key, send_secret_key, nonce, temp, length + 1,
-                                 CRYPTO_SIZE + packet);
+
+    /* The request is written where it goes in the packet and encrypted in place. */
+    uint8_t *const plain = packet + CRYPTO_SIZE + CRYPTO_MAC_SIZE;
+    plain[0] = request_id;
+    memcpy(plain + 1, data, length);
+
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    encrypt_precompute(recv_public_key, send_secret_key, shared_key);
+    const int len = encrypt_data_symmetric_detached(shared_key, nonce, plain, length + 1, plain, packet + CRYPTO_SIZE);
+    crypto_memzero(shared_key, sizeof(shared_key));
 
     if (len == -1) {
-        crypto_memzero(temp, MAX_CRYPTO_REQUEST_SIZE);
+        crypto_memzero(plain, length + 1);
         return -1;
     }
 
@@ -345,8 +582,32 @@ int create_request(const uint8_t *send_public_key, const uint8_t *send_secret_ke
     memcpy(packet + 1, recv_public_key, CRYPTO_PUBLIC_KEY_SIZE);
     memcpy(packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, send_public_key, CRYPTO_PUBLIC_KEY_SIZE);
 
+    return len + CRYPTO_MAC_SIZE + CRYPTO_SIZE;
+}
+
+/* handle_request, given the key shared with the sender. */
+static int open_request(const uint8_t *shared_key, uint8_t *public_key, uint8_t *data, uint8_t *request_id,
+                        const uint8_t *packet, uint16_t length)
+{
+    if (length <= CRYPTO_SIZE + CRYPTO_MAC_SIZE || length > MAX_CRYPTO_REQUEST_SIZE) {
+        return -1;
+    }
+
+    memcpy(public_key, packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, CRYPTO_PUBLIC_KEY_SIZE);
+    const uint8_t *const nonce = packet + 1 + CRYPTO_PUBLIC_KEY_SIZE * 2;
+    uint8_t temp[MAX_CRYPTO_REQUEST_SIZE];
+    int len1 = decrypt_data_symmetric(shared_key, nonce, packet + CRYPTO_SIZE, length - CRYPTO_SIZE, temp);
+
+    if (len1 == -1 || len1 == 0) {
+        crypto_memzero(temp, MAX_CRYPTO_REQUEST_SIZE);
+        return -1;
+    }
+
+    request_id[0] = temp[0];
+    --len1;
+    memcpy(data, temp + 1, len1);
     crypto_memzero(temp, MAX_CRYPTO_REQUEST_SIZE);
-    return len + CRYPTO_SIZE;
+    return len1;
 }
 
 /* Puts the senders public key in the request in public_key, the data from the request
@@ -370,22 +631,11 @@ int handle_request(const uint8_t *self_public_key, const uint8_t *self_secret_ke
         return -1;
     }
 
-    memcpy(public_key, packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, CRYPTO_PUBLIC_KEY_SIZE);
-    const uint8_t *const nonce = packet + 1 + CRYPTO_PUBLIC_KEY_SIZE * 2;
-    uint8_t temp[MAX_CRYPTO_REQUEST_SIZE];
-    int len1 = decrypt_data(public_key, self_secret_key, nonce,
-                            packet + CRYPTO_SIZE, length - CRYPTO_SIZE, temp);
-
-    if (len1 == -1 || len1 == 0) {
-        crypto_memzero(temp, MAX_CRYPTO_REQUEST_SIZE);
-        return -1;
-    }
-
-    request_id[0] = temp[0];
-    --len1;
-    memcpy(data, temp + 1, len1);
-    crypto_memzero(temp, MAX_CRYPTO_REQUEST_SIZE);
-    return len1;
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+    encrypt_precompute(packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, self_secret_key, shared_key);
+    const int len = open_request(shared_key, public_key, data, request_id, packet, length);
+    crypto_memzero(shared_key, sizeof(shared_key));
+    return len;
 }
 
 #define PACKED_NODE_SIZE_IP4 (1 + SIZE_IP4 + sizeof(uint16_t) + CRYPTO_PUBLIC_KEY_SIZE)
@@ -467,12 +717,12 @@ int pack_ip_port(uint8_t *data, uint16_t length, const IP_Port *ip_port)
 static int dht_create_packet(const uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE],
                              const uint8_t *shared_key, const uint8_t type, uint8_t *plain, size_t plain_length, uint8_t *packet)
 {
-    VLA(uint8_t, encrypted, plain_length + CRYPTO_MAC_SIZE);
-    uint8_t nonce[CRYPTO_NONCE_SIZE];
+    uint8_t *const nonce = packet + 1 + CRYPTO_PUBLIC_KEY_SIZE;
 
     random_nonce(nonce);
 
-    const int encrypted_length = encrypt_data_symmetric(shared_key, nonce, plain, plain_length, encrypted);
+    const int encrypted_length = encrypt_data_symmetric(shared_key, nonce, plain, plain_length,
+                                 packet + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE);
 
     if (encrypted_length == -1) {
         return -1;
@@ -480,8 +730,6 @@ static int dht_create_packet(const uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE],
 
     packet[0] = type;
     memcpy(packet + 1, public_key, CRYPTO_PUBLIC_KEY_SIZE);
-    memcpy(packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, nonce, CRYPTO_NONCE_SIZE);
-    memcpy(packet + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE, encrypted, encrypted_length);
 
     return 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE + encrypted_length;
 }
@@ -759,6 +1007,107 @@ static int client_or_ip_port_in_list(const Logger *log, const Mono_Time *mono_ti
     return 1;
 }
 
+/* Find the close list entry with an address equal to ip_port.
+ *
+ * return index or UINT32_MAX if not found.
+ */
+static uint32_t index_of_close_ip_port(const DHT *dht, const IP_Port *ip_port)
+{
+    if (ip_port->port == 0) {
+        return UINT32_MAX;
+    }
+
+    uint8_t key[IP_PORT_KEY_SIZE];
+    ip_port_key(key, ip_port);
+
+    uint32_t index;
+
+    if (!hash_index_get(dht->close_ip_port_index, key, &index)) {
+        return UINT32_MAX;
+    }
+
+    return index;
+}
+
+/* Record that the close list entry at index now has ip_port as an address. */
+static void close_ip_port_add(DHT *dht, const IP_Port *ip_port, uint32_t index)
+{
+    if (ip_port->port == 0) {
+        return;
+    }
+
+    uint8_t key[IP_PORT_KEY_SIZE];
+    ip_port_key(key, ip_port);
+
+    if (!hash_index_set(dht->close_ip_port_index, key, index)) {
+        LOGGER_WARNING(dht->log, "failed to index close list address");
+    }
+}
+
+/* Forget ip_port as an address of the close list entry at index. */
+static void close_ip_port_remove(DHT *dht, const IP_Port *ip_port, uint32_t index)
+{
+    if (index_of_close_ip_port(dht, ip_port) != index) {
+        return;
+    }
+
+    uint8_t key[IP_PORT_KEY_SIZE];
+    ip_port_key(key, ip_port);
+    hash_index_remove(dht->close_ip_port_index, key);
+}
+
+/* Like client_or_ip_port_in_list, for the close list.
+ *
+ * The entries of the close list must stay in the bucket of their key, so a
+ * new key at an address we already know is not written over the old entry.
+ * The address is taken from the old entry instead, and the caller adds the
+ * new key to its own bucket.
+ *
+ * return true if public_key is in the close list.
+ */
+static bool client_or_ip_port_in_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip_port)
+{
+    IPPTsPng *assoc;
+    uint32_t index = index_of_close_pk(dht, public_key);
+
+    if (index != UINT32_MAX) {
+        Client_data *const client = &dht->close_clientlist[index];
+
+        if (net_family_is_ipv4(ip_port.ip.family)) {
+            assoc = &client->assoc4;
+        } else if (net_family_is_ipv6(ip_port.ip.family)) {
+            assoc = &client->assoc6;
+        } else {
+            return true;
+        }
+
+        const IP_Port old_ip_port = assoc->ip_port;
+        update_client(dht->log, dht->mono_time, index, client, ip_port);
+
+        if (!ipport_equal(&old_ip_port, &assoc->ip_port)) {
+            close_ip_port_remove(dht, &old_ip_port, index);
+            close_ip_port_add(dht, &assoc->ip_port, index);
+        }
+
+        return true;
+    }
+
+    index = index_of_close_ip_port(dht, &ip_port);
+
+    if (index == UINT32_MAX) {
+        return false;
+    }
+
+    Client_data *const client = &dht->close_clientlist[index];
+    assoc = net_family_is_ipv4(ip_port.ip.family) ? &client->assoc4 : &client->assoc6;
+
+    LOGGER_DEBUG(dht->log, "coipil[%u]: address taken over by another public_key", index);
+
+    close_ip_port_remove(dht, &ip_port, index);
+    memset(assoc, 0, sizeof(IPPTsPng));
+    return false;
+}
+
 bool add_to_list(Node_format *nodes_list, uint32_t length, const uint8_t *pk, IP_Port ip_port,
                  const uint8_t *cmp_pk)
 {
@@ -808,12 +1157,6 @@ static void get_close_nodes_inner(const Mono_Time *mono_time, const uint8_t *pub
 
     for (uint32_t i = 0; i < client_list_length; ++i) {
         const Client_data *const client = &client_list[i];
-
-        /* node already in list? */
-        if (index_of_node_pk(nodes_list, MAX_SENT_NODES, client->public_key) != UINT32_MAX) {
-            continue;
-        }
-
         const IPPTsPng *ipptp = nullptr;
 
         if (net_family_is_ipv4(sa_family)) {
@@ -841,6 +1184,11 @@ static void get_close_nodes_inner(const Mono_Time *mono_time, const uint8_t *pub
             continue;
         }
 
+        /* node already in list? */
+        if (index_of_node_pk(nodes_list, MAX_SENT_NODES, client->public_key) != UINT32_MAX) {
+            continue;
+        }
+
         if (num_nodes < MAX_SENT_NODES) {
             memcpy(nodes_list[num_nodes].public_key, client->public_key, CRYPTO_PUBLIC_KEY_SIZE);
             nodes_list[num_nodes].ip_port = ipptp->ip_port;
@@ -864,9 +1212,31 @@ static void get_close_nodes_inner(const Mono_Time *mono_time, const uint8_t *pub
 static int get_somewhat_close_nodes(const DHT *dht, const uint8_t *public_key, Node_format *nodes_list,
                                     Family sa_family, bool is_LAN, uint8_t want_good)
 {
+    /* Visit the close list buckets from closest to public_key to farthest,
+     * and stop as soon as the remaining ones can't hold anything closer.
+     *
+     * Say public_key shares b leading bits with our key. Nodes in bucket b
+     * also differ from our key at bit b, so they share more than b bits with
+     * public_key and are the closest. Nodes in later buckets share exactly b
+     * bits with it, and nodes in an earlier bucket i share exactly i bits.
+     */
+    const Client_data *const close_clientlist = dht->close_clientlist;
+    const uint32_t bucket = close_bucket_index(dht, public_key);
     uint32_t num_nodes = 0;
+
     get_close_nodes_inner(dht->mono_time, public_key, nodes_list, sa_family,
-                          dht->close_clientlist, LCLIENT_LIST, &num_nodes, is_LAN, 0);
+                          &close_clientlist[bucket * LCLIENT_NODES], LCLIENT_NODES, &num_nodes, is_LAN, 0);
+
+    if (num_nodes < MAX_SENT_NODES && bucket + 1 < dht->close_buckets_used) {
+        get_close_nodes_inner(dht->mono_time, public_key, nodes_list, sa_family,
+                              &close_clientlist[(bucket + 1) * LCLIENT_NODES],
+                              (dht->close_buckets_used - bucket - 1) * LCLIENT_NODES, &num_nodes, is_LAN, 0);
+    }
+
+    for (uint32_t i = bucket; i > 0 && num_nodes < MAX_SENT_NODES; --i) {
+        get_close_nodes_inner(dht->mono_time, public_key, nodes_list, sa_family,
+                              &close_clientlist[(i - 1) * LCLIENT_NODES], LCLIENT_NODES, &num_nodes, is_LAN, 0);
+    }
 
     /* TODO(irungentoo): uncomment this when hardening is added to close friend clients */
 #if 0
@@ -895,12 +1265,6 @@ int get_close_nodes(const DHT *dht, const uint8_t *public_key, Node_format *node
     return get_somewhat_close_nodes(dht, public_key, nodes_list, sa_family, is_LAN, want_good);
 }
 
-typedef struct DHT_Cmp_data {
-    const Mono_Time *mono_time;
-    const uint8_t *base_public_key;
-    Client_data entry;
-} DHT_Cmp_data;
-
 static bool assoc_timeout(const Mono_Time *mono_time, const IPPTsPng *assoc)
 {
     return mono_time_is_timeout(mono_time, assoc->timestamp, BAD_NODE_TIMEOUT);
@@ -911,17 +1275,11 @@ static bool incorrect_hardening(const IPPTsPng *assoc)
     return hardening_correct(&assoc->hardening) != HARDENING_ALL_OK;
 }
 
-static int cmp_dht_entry(const void *a, const void *b)
+static int cmp_dht_entry(const Mono_Time *mono_time, const uint8_t *cmp_public_key, const Client_data *entry1,
+                         const Client_data *entry2)
 {
-    DHT_Cmp_data cmp1, cmp2;
-    memcpy(&cmp1, a, sizeof(DHT_Cmp_data));
-    memcpy(&cmp2, b, sizeof(DHT_Cmp_data));
-    const Client_data entry1 = cmp1.entry;
-    const Client_data entry2 = cmp2.entry;
-    const uint8_t *cmp_public_key = cmp1.base_public_key;
-
-    bool t1 = assoc_timeout(cmp1.mono_time, &entry1.assoc4) && assoc_timeout(cmp1.mono_time, &entry1.assoc6);
-    bool t2 = assoc_timeout(cmp2.mono_time, &entry2.assoc4) && assoc_timeout(cmp2.mono_time, &entry2.assoc6);
+    bool t1 = assoc_timeout(mono_time, &entry1->assoc4) && assoc_timeout(mono_time, &entry1->assoc6);
+    bool t2 = assoc_timeout(mono_time, &entry2->assoc4) && assoc_timeout(mono_time, &entry2->assoc6);
 
     if (t1 && t2) {
         return 0;
@@ -935,8 +1293,8 @@ static int cmp_dht_entry(const void *a, const void *b)
         return 1;
     }
 
-    t1 = incorrect_hardening(&entry1.assoc4) && incorrect_hardening(&entry1.assoc6);
-    t2 = incorrect_hardening(&entry2.assoc4) && incorrect_hardening(&entry2.assoc6);
+    t1 = incorrect_hardening(&entry1->assoc4) && incorrect_hardening(&entry1->assoc6);
+    t2 = incorrect_hardening(&entry2->assoc4) && incorrect_hardening(&entry2->assoc6);
 
     if (t1 && !t2) {
         return -1;
@@ -946,7 +1304,7 @@ static int cmp_dht_entry(const void *a, const void *b)
         return 1;
     }
 
-    const int close = id_closest(cmp_public_key, entry1.public_key, entry2.public_key);
+    const int close = id_closest(cmp_public_key, entry1->public_key, entry2->public_key);
 
     if (close == 1) {
         return 1;
@@ -972,23 +1330,26 @@ static unsigned int store_node_ok(const Client_data *client, const Mono_Time *mo
            || id_closest(comp_public_key, client->public_key, public_key) == 2;
 }
 
+/* Sort the list worst entry first. The lists are MAX_FRIEND_CLIENTS long and
+ * mostly sorted from the last call, so an insertion sort beats qsort here.
+ */
 static void sort_client_list(Client_data *list, const Mono_Time *mono_time, unsigned int length,
                              const uint8_t *comp_public_key)
 {
-    // Pass comp_public_key to qsort with each Client_data entry, so the
-    // comparison function can use it as the base of comparison.
-    VLA(DHT_Cmp_data, cmp_list, length);
+    for (uint32_t i = 1; i < length; ++i) {
+        if (cmp_dht_entry(mono_time, comp_public_key, &list[i - 1], &list[i]) <= 0) {
+            continue;
+        }
 
-    for (uint32_t i = 0; i < length; ++i) {
-        cmp_list[i].mono_time = mono_time;
-        cmp_list[i].base_public_key = comp_public_key;
-        cmp_list[i].entry = list[i];
-    }
+        const Client_data entry = list[i];
+        uint32_t j = i;
 
-    qsort(cmp_list, length, sizeof(DHT_Cmp_data), cmp_dht_entry);
+        do {
+            list[j] = list[j - 1];
+            --j;
+        } while (j > 0 && cmp_dht_entry(mono_time, comp_public_key, &list[j - 1], &entry) > 0);
 
-    for (uint32_t i = 0; i < length; ++i) {
-        list[i] = cmp_list[i].entry;
+        list[j] = entry;
     }
 }
 
@@ -1063,16 +1424,11 @@ static bool replace_all(const Mono_Time *mono_time,
  */
 static int add_to_close(DHT *dht, const uint8_t *public_key, IP_Port ip_port, bool simulate)
 {
-    unsigned int index = bit_by_bit_cmp(public_key, dht->self_public_key);
-
-    if (index >= LCLIENT_LENGTH) {
-        index = LCLIENT_LENGTH - 1;
-    }
+    const uint32_t bucket = close_bucket_index(dht, public_key);
 
     for (uint32_t i = 0; i < LCLIENT_NODES; ++i) {
-        /* TODO(iphydf): write bounds checking test to catch the case that
-         * index is left as >= LCLIENT_LENGTH */
-        Client_data *const client = &dht->close_clientlist[(index * LCLIENT_NODES) + i];
+        const uint32_t index = bucket * LCLIENT_NODES + i;
+        Client_data *const client = &dht->close_clientlist[index];
 
         if (!mono_time_is_timeout(dht->mono_time, client->assoc4.timestamp, BAD_NODE_TIMEOUT) ||
                 !mono_time_is_timeout(dht->mono_time, client->assoc6.timestamp, BAD_NODE_TIMEOUT)) {
@@ -1083,8 +1439,16 @@ static int add_to_close(DHT *dht, const uint8_t *public_key, IP_Port ip_port, bo
             return 0;
         }
 
+        close_ip_port_remove(dht, &client->assoc4.ip_port, index);
+        close_ip_port_remove(dht, &client->assoc6.ip_port, index);
+
+        if (bucket >= dht->close_buckets_used) {
+            dht->close_buckets_used = bucket + 1;
+        }
+
         id_copy(client->public_key, public_key);
         update_client_with_reset(dht->mono_time, client, &ip_port);
+        close_ip_port_add(dht, &ip_port, index);
         return 0;
     }
 
@@ -1116,14 +1480,8 @@ static bool is_pk_in_client_list(const Client_data *list, unsigned int client_li
 
 static bool is_pk_in_close_list(DHT *dht, const uint8_t *public_key, IP_Port ip_port)
 {
-    unsigned int index = bit_by_bit_cmp(public_key, dht->self_public_key);
-
-    if (index >= LCLIENT_LENGTH) {
-        index = LCLIENT_LENGTH - 1;
-    }
-
-    return is_pk_in_client_list(dht->close_clientlist + index * LCLIENT_NODES, LCLIENT_NODES, dht->mono_time, public_key,
-                                ip_port);
+    return is_pk_in_client_list(close_bucket(dht, close_bucket_index(dht, public_key)), LCLIENT_NODES, dht->mono_time,
+                                public_key, ip_port);
 }
 
 /* Check if the node obtained with a get_nodes with public_key should be pinged.
@@ -1210,8 +1568,7 @@ uint32_t addto_lists(DHT *dht, IP_Port ip_port, const uint8_t *public_key)
     /* NOTE: Current behavior if there are two clients with the same id is
      * to replace the first ip by the second.
      */
-    const bool in_close_list = client_or_ip_port_in_list(dht->log, dht->mono_time, dht->close_clientlist, LCLIENT_LIST,
-                               public_key, ip_port);
+    const bool in_close_list = client_or_ip_port_in_close_list(dht, public_key, ip_port);
 
     /* add_to_close should be called only if !in_list (don't extract to variable) */
     if (in_close_list || add_to_close(dht, public_key, ip_port, 0)) {
@@ -1290,7 +1647,8 @@ static void returnedip_ports(DHT *dht, IP_Port ip_port, const uint8_t *public_ke
     }
 
     if (id_equal(public_key, dht->self_public_key)) {
-        update_client_data(dht->mono_time, dht->close_clientlist, LCLIENT_LIST, ip_port, nodepublic_key);
+        const uint32_t bucket = close_bucket_index(dht, nodepublic_key);
+        update_client_data(dht->mono_time, close_bucket(dht, bucket), LCLIENT_NODES, ip_port, nodepublic_key);
         return;
     }
 
@@ -1419,7 +1777,10 @@ static int handle_getnodes(void *object, IP_Port source, const uint8_t *packet,
     uint8_t plain[CRYPTO_NODE_SIZE];
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
 
-    dht_get_shared_key_recv(dht, shared_key, packet + 1);
+    if (!dht_get_shared_key_recv_for_packet(dht, shared_key, packet + 1, source, packet, length)) {
+        return false;
+    }
+
     const int len = decrypt_data_symmetric(
                         shared_key,
                         packet + 1 + CRYPTO_PUBLIC_KEY_SIZE,
@@ -1876,20 +2237,18 @@ int dht_bootstrap_from_address(DHT *dht, const char *address, uint8_t ipv6enable
  */
 int route_packet(const DHT *dht, const uint8_t *public_key, const uint8_t *packet, uint16_t length)
 {
-    for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
-        if (id_equal(public_key, dht->close_clientlist[i].public_key)) {
-            const Client_data *const client = &dht->close_clientlist[i];
-            const IPPTsPng *const assocs[] = { &client->assoc6, &client->assoc4, nullptr };
+    const uint32_t index = index_of_close_pk(dht, public_key);
 
-            for (const IPPTsPng * const *it = assocs; *it; ++it) {
-                const IPPTsPng *const assoc = *it;
+    if (index != UINT32_MAX) {
+        const Client_data *const client = &dht->close_clientlist[index];
+        const IPPTsPng *const assocs[] = { &client->assoc6, &client->assoc4, nullptr };
 
-                if (ip_isset(&assoc->ip_port.ip)) {
-                    return sendpacket(dht->net, assoc->ip_port, packet, length);
-                }
-            }
+        for (const IPPTsPng * const *it = assocs; *it; ++it) {
+            const IPPTsPng *const assoc = *it;
 
-            break;
+            if (ip_isset(&assoc->ip_port.ip)) {
+                return sendpacket(dht->net, assoc->ip_port, packet, length);
+            }
         }
     }
 
@@ -2371,21 +2730,20 @@ static int send_hardening_getnode_res(const DHT *dht, const Node_format *sendto,
     return sendpacket(dht->net, sendto->ip_port, packet, len);
 }
 
-/* TODO(irungentoo): improve */
 static IPPTsPng *get_closelist_IPPTsPng(DHT *dht, const uint8_t *public_key, Family sa_family)
 {
-    for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
-        if (!id_equal(dht->close_clientlist[i].public_key, public_key)) {
-            continue;
-        }
+    const uint32_t index = index_of_close_pk(dht, public_key);
 
-        if (net_family_is_ipv4(sa_family)) {
-            return &dht->close_clientlist[i].assoc4;
-        }
+    if (index == UINT32_MAX) {
+        return nullptr;
+    }
 
-        if (net_family_is_ipv6(sa_family)) {
-            return &dht->close_clientlist[i].assoc6;
-        }
+    if (net_family_is_ipv4(sa_family)) {
+        return &dht->close_clientlist[index].assoc4;
+    }
+
+    if (net_family_is_ipv6(sa_family)) {
+        return &dht->close_clientlist[index].assoc6;
     }
 
     return nullptr;
@@ -2676,8 +3034,14 @@ static int cryptopacket_handle(void *object, IP_Port source, const uint8_t *pack
         uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
         uint8_t data[MAX_CRYPTO_REQUEST_SIZE];
         uint8_t number;
-        const int len = handle_request(dht->self_public_key, dht->self_secret_key, public_key,
-                                       data, &number, packet, length);
+        uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+
+        if (!dht_get_shared_key_recv_for_packet(dht, shared_key, packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, source, packet,
+                                                length)) {
+            return 0;
+        }
+
+        const int len = open_request(shared_key, public_key, data, &number, packet, length);
 
         if (len == -1 || len == 0) {
             return 1;
@@ -2704,7 +3068,8 @@ static int cryptopacket_handle(void *object, IP_Port source, const uint8_t *pack
 
 /*----------------------------------------------------------------------------------*/
 
-DHT *new_dht(const Logger *log, Mono_Time *mono_time, Networking_Core *net, bool holepunching_enabled, const uint8_t* dht_pk, const uint8_t* dht_sk)
+DHT *new_dht(const Logger *log, Mono_Time *mono_time, Networking_Core *net, bool holepunching_enabled,
+             uint32_t shared_keys_size, uint32_t shared_keys_ways, const uint8_t* dht_pk, const uint8_t* dht_sk)
 {
     if (net == nullptr) {
         return nullptr;
@@ -2722,6 +3087,16 @@ DHT *new_dht(const Logger *log, Mono_Time *mono_time, Networking_Core *net, bool
 
     dht->hole_punching_enabled = holepunching_enabled;
 
+    dht->shared_keys_recv = shared_keys_new(shared_keys_size, shared_keys_ways);
+    dht->shared_keys_sent = shared_keys_new(shared_keys_size, shared_keys_ways);
+
+    if (dht->shared_keys_recv == nullptr || dht->shared_keys_sent == nullptr) {
+        shared_keys_kill(dht->shared_keys_recv);
+        shared_keys_kill(dht->shared_keys_sent);
+        free(dht);
+        return nullptr;
+    }
+
     dht->ping = ping_new(mono_time, dht);
 
     if (dht->ping == nullptr) {
@@ -2729,6 +3104,13 @@ DHT *new_dht(const Logger *log, Mono_Time *mono_time, Networking_Core *net, bool
         return nullptr;
     }
 
+    dht->close_ip_port_index = hash_index_new(IP_PORT_KEY_SIZE);
+
+    if (dht->close_ip_port_index == nullptr) {
+        kill_dht(dht);
+        return nullptr;
+    }
+
     networking_registerhandler(dht->net, NET_PACKET_GET_NODES, &handle_getnodes, dht);
     networking_registerhandler(dht->net, NET_PACKET_SEND_NODES_IPV6, &handle_sendnodes_ipv6, dht);
     networking_registerhandler(dht->net, NET_PACKET_CRYPTO, &cryptopacket_handle, dht);
@@ -2742,8 +3124,8 @@ DHT *new_dht(const Logger *log, Mono_Time *mono_time, Networking_Core *net, bool
 		memcpy(dht->self_secret_key, dht_sk, CRYPTO_PUBLIC_KEY_SIZE);	
 	}
 
-    dht->dht_ping_array = ping_array_new(DHT_PING_ARRAY_SIZE, PING_TIMEOUT);
-    dht->dht_harden_ping_array = ping_array_new(DHT_PING_ARRAY_SIZE, PING_TIMEOUT);
+    dht->dht_ping_array = ping_array_new_inline(DHT_PING_ARRAY_SIZE, PING_TIMEOUT, sizeof(Node_format));
+    dht->dht_harden_ping_array = ping_array_new_inline(DHT_PING_ARRAY_SIZE, PING_TIMEOUT, sizeof(Node_format) * 2);
 
     for (uint32_t i = 0; i < DHT_FAKE_FRIEND_NUMBER; ++i) {
         uint8_t random_public_key_bytes[CRYPTO_PUBLIC_KEY_SIZE];
@@ -2790,6 +3172,9 @@ void kill_dht(DHT *dht)
     ping_array_kill(dht->dht_ping_array);
     ping_array_kill(dht->dht_harden_ping_array);
     ping_kill(dht->ping);
+    hash_index_kill(dht->close_ip_port_index);
+    shared_keys_kill(dht->shared_keys_recv);
+    shared_keys_kill(dht->shared_keys_sent);
     free(dht->friends_list);
     free(dht->loaded_nodes_list);
     free(dht);
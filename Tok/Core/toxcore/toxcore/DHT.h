@@ -195,21 +195,45 @@ int unpack_nodes(Node_format *nodes, uint16_t max_num_nodes, uint16_t *processed
 
 
 /*----------------------------------------------------------------------------------*/
-/* struct to store some shared keys so we don't have to regenerate them for each request. */
-#define MAX_KEYS_PER_SLOT 4
+/* Cache of shared keys so we don't have to regenerate them for each request.
+ *
+ * The cache is set associative: a key hashes to a set of ways entries, and a
+ * miss replaces one of them. Keys that were not requested again since they were
+ * stored go first, so a stream of keys seen once can't flush the set. Once all
+ * keys in a set were requested again, a CLOCK hand ages their use counts and
+ * picks the first to run out.
+ */
+#define SHARED_KEYS_DEFAULT_SIZE 1024
+#define SHARED_KEYS_DEFAULT_WAYS 4
+#define SHARED_KEYS_MAX_WAYS 64
+
+/* Entries not requested for this many seconds are replaced first. */
 #define KEYS_TIMEOUT 600
 
-typedef struct Shared_Key {
-    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
-    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    uint32_t times_requested;
-    bool stored;
-    uint64_t time_last_requested;
-} Shared_Key;
+typedef struct Shared_Keys Shared_Keys;
+
+typedef struct Shared_Keys_Stats {
+    uint64_t hits;
+    uint64_t misses;
+    /* Misses that replaced a stored key. */
+    uint64_t evictions;
+} Shared_Keys_Stats;
+
+/* Create a cache with room for at least size keys, in sets of ways entries.
+ *
+ * A size or ways of 0 selects SHARED_KEYS_DEFAULT_SIZE or SHARED_KEYS_DEFAULT_WAYS.
+ *
+ * return cache on success.
+ * return null on failure.
+ */
+Shared_Keys *shared_keys_new(uint32_t size, uint32_t ways);
+
+void shared_keys_kill(Shared_Keys *shared_keys);
+
+/* Number of keys the cache has room for. */
+uint32_t shared_keys_get_size(const Shared_Keys *shared_keys);
 
-typedef struct Shared_Keys {
-    Shared_Key keys[256 * MAX_KEYS_PER_SLOT];
-} Shared_Keys;
+void shared_keys_get_stats(const Shared_Keys *shared_keys, Shared_Keys_Stats *stats);
 
 /*----------------------------------------------------------------------------------*/
 
@@ -244,6 +268,17 @@ const uint8_t *dht_get_friend_public_key(const DHT *dht, uint32_t friend_num);
 void get_shared_key(const Mono_Time *mono_time, Shared_Keys *shared_keys, uint8_t *shared_key,
                     const uint8_t *secret_key, const uint8_t *public_key);
 
+/* Like get_shared_key, for handling packet from source. If the key isn't stored
+ * and pool isn't NULL, the packet may be queued in the pool instead, see
+ * precompute_shared_key.
+ *
+ * return true if shared_key was filled in.
+ * return false if the packet was queued, and must be dropped by the caller.
+ */
+bool get_shared_key_for_packet(const Mono_Time *mono_time, Shared_Keys *shared_keys, struct Precompute_Pool *pool,
+                               IP_Port source, const uint8_t *packet, uint16_t length, uint8_t *shared_key,
+                               const uint8_t *secret_key, const uint8_t *public_key);
+
 /* Copy shared_key to encrypt/decrypt DHT packet from public_key into shared_key
  * for packets that we receive.
  */
@@ -254,6 +289,23 @@ void dht_get_shared_key_recv(DHT *dht, uint8_t *shared_key, const uint8_t *publi
  */
 void dht_get_shared_key_sent(DHT *dht, uint8_t *shared_key, const uint8_t *public_key);
 
+/* Like dht_get_shared_key_recv and dht_get_shared_key_sent, for handling packet
+ * from source with the precompute pool of the DHT's networking core, see
+ * get_shared_key_for_packet.
+ */
+bool dht_get_shared_key_recv_for_packet(DHT *dht, uint8_t *shared_key, const uint8_t *public_key, IP_Port source,
+                                        const uint8_t *packet, uint16_t length);
+bool dht_get_shared_key_sent_for_packet(DHT *dht, uint8_t *shared_key, const uint8_t *public_key, IP_Port source,
+                                        const uint8_t *packet, uint16_t length);
+
+/* Create a cache sized like the DHT's own, for other modules that compute
+ * shared keys with the DHT secret key.
+ */
+Shared_Keys *dht_shared_keys_new(const DHT *dht);
+
+/* Counters summed over the caches for received and sent packets. */
+void dht_get_shared_keys_stats(const DHT *dht, Shared_Keys_Stats *stats);
+
 void dht_getnodes(DHT *dht, const IP_Port *from_ipp, const uint8_t *from_id, const uint8_t *which_id);
 
 typedef void dht_ip_cb(void *object, int32_t number, IP_Port ip_port);
@@ -404,8 +456,13 @@ void dht_save(const DHT *dht, uint8_t *data);
  */
 int dht_load(DHT *dht, const uint8_t *data, uint32_t length);
 
-/* Initialize DHT. */
-DHT *new_dht(const Logger *log, Mono_Time *mono_time, Networking_Core *net, bool holepunching_enabled, const uint8_t* dht_pk, const uint8_t* dht_sk);
+/* Initialize DHT.
+ *
+ * The shared key caches get room for shared_keys_size keys in sets of
+ * shared_keys_ways, see shared_keys_new.
+ */
+DHT *new_dht(const Logger *log, Mono_Time *mono_time, Networking_Core *net, bool holepunching_enabled,
+             uint32_t shared_keys_size, uint32_t shared_keys_ways, const uint8_t* dht_pk, const uint8_t* dht_sk);
 
 void kill_dht(DHT *dht);
 
@@ -0,0 +1,476 @@
+// The full scan under comparison uses static helpers, so pull in the implementation directly.
+extern "C" {
+#include "DHT.c"
+}
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using Public_Key = std::array<uint8_t, CRYPTO_PUBLIC_KEY_SIZE>;
+
+IP_Port fake_ip_port(uint32_t n) {
+  IP_Port ip_port;
+  memset(&ip_port, 0, sizeof(ip_port));
+  ip_port.ip.family = net_family_ipv4;
+  ip_port.ip.ip.v4.uint32 = net_htonl(0x2d000000 | (n >> 8));
+  ip_port.port = net_htons(33445 + (n & 0xff));
+  return ip_port;
+}
+
+unsigned int common_prefix_bits(const uint8_t *a, const uint8_t *b) {
+  for (unsigned int bit = 0; bit < CRYPTO_PUBLIC_KEY_SIZE * 8; ++bit) {
+    uint8_t const mask = 1 << (7 - bit % 8);
+
+    if ((a[bit / 8] & mask) != (b[bit / 8] & mask)) {
+      return bit;
+    }
+  }
+
+  return CRYPTO_PUBLIC_KEY_SIZE * 8;
+}
+
+std::vector<Public_Key> sorted_keys(const Node_format *nodes, uint32_t num_nodes) {
+  std::vector<Public_Key> keys(num_nodes);
+
+  for (uint32_t i = 0; i < num_nodes; ++i) {
+    memcpy(keys[i].data(), nodes[i].public_key, CRYPTO_PUBLIC_KEY_SIZE);
+  }
+
+  std::sort(keys.begin(), keys.end());
+  return keys;
+}
+
+// The closest nodes found the way get_close_nodes did before it searched the
+// close list by bucket: by scanning all of it.
+std::vector<Public_Key> full_scan_close_nodes(const DHT *dht, const uint8_t *public_key) {
+  Node_format nodes[MAX_SENT_NODES] = {};
+  uint32_t num_nodes = 0;
+  get_close_nodes_inner(dht->mono_time, public_key, nodes, net_family_unspec, dht->close_clientlist, LCLIENT_LIST,
+                        &num_nodes, false, 0);
+
+  for (uint32_t i = 0; i < dht->num_friends; ++i) {
+    get_close_nodes_inner(dht->mono_time, public_key, nodes, net_family_unspec, dht->friends_list[i].client_list,
+                          MAX_FRIEND_CLIENTS, &num_nodes, false, 0);
+  }
+
+  return sorted_keys(nodes, num_nodes);
+}
+
+std::vector<Public_Key> close_nodes(const DHT *dht, const uint8_t *public_key) {
+  Node_format nodes[MAX_SENT_NODES];
+  int const num_nodes = get_close_nodes(dht, public_key, nodes, net_family_unspec, false, 1);
+  return sorted_keys(nodes, num_nodes);
+}
+
+class DHTCloseList : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    log_ = logger_new();
+    mono_time_ = mono_time_new();
+    IP ip;
+    ip_init(&ip, false);
+    ip.ip.v4 = get_ip4_loopback();
+    net_ = new_networking_ex(log_, ip, 0, 0, nullptr);
+    ASSERT_NE(net_, nullptr);
+    dht_ = new_dht(log_, mono_time_, net_, false, 0, 0, nullptr, nullptr);
+    ASSERT_NE(dht_, nullptr);
+    memcpy(self_.data(), dht_get_self_public_key(dht_), CRYPTO_PUBLIC_KEY_SIZE);
+    rng_.seed(1);
+  }
+
+  void TearDown() override {
+    kill_dht(dht_);
+    kill_networking(net_);
+    mono_time_free(mono_time_);
+    logger_kill(log_);
+  }
+
+  Public_Key random_key() {
+    Public_Key key;
+
+    for (uint8_t &byte : key) {
+      byte = static_cast<uint8_t>(rng_());
+    }
+
+    return key;
+  }
+
+  // A key that shares exactly prefix leading bits with ours.
+  Public_Key key_with_prefix(unsigned int prefix) {
+    Public_Key key = random_key();
+
+    for (unsigned int bit = 0; bit <= prefix; ++bit) {
+      uint8_t const mask = 1 << (7 - bit % 8);
+      uint8_t const self_bit = self_[bit / 8] & mask;
+      key[bit / 8] = (key[bit / 8] & ~mask) | (bit == prefix ? self_bit ^ mask : self_bit);
+    }
+
+    return key;
+  }
+
+  // Fill the close list as it would be in a network of 2^log_size nodes.
+  void fill_close_list(unsigned int log_size) {
+    for (unsigned int bucket = 0; bucket < LCLIENT_LENGTH; ++bucket) {
+      uint32_t const count = bucket + 1 >= log_size ? 0 : std::min<uint32_t>(LCLIENT_NODES, 1u << (log_size - bucket - 1));
+
+      for (uint32_t i = 0; i < count; ++i) {
+        addto_lists(dht_, fake_ip_port(next_ip_++), key_with_prefix(bucket).data());
+      }
+    }
+  }
+
+  Logger *log_;
+  Mono_Time *mono_time_;
+  Networking_Core *net_;
+  DHT *dht_;
+  Public_Key self_;
+  std::mt19937 rng_;
+  uint32_t next_ip_ = 0;
+};
+
+TEST_F(DHTCloseList, EntriesStayInTheirBucket) {
+  fill_close_list(20);
+
+  const Client_data *const list = dht_get_close_clientlist(dht_);
+  uint32_t stored = 0;
+
+  for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
+    if (list[i].assoc4.timestamp == 0) {
+      continue;
+    }
+
+    ++stored;
+    EXPECT_EQ(std::min<unsigned int>(common_prefix_bits(list[i].public_key, self_.data()), LCLIENT_LENGTH - 1),
+              i / LCLIENT_NODES);
+  }
+
+  EXPECT_EQ(stored, next_ip_);
+}
+
+TEST_F(DHTCloseList, GetCloseNodesMatchesFullScan) {
+  fill_close_list(16);
+
+  for (uint32_t i = 0; i < 2000; ++i) {
+    Public_Key const target = i % 2 ? random_key() : key_with_prefix(rng_() % 24);
+    ASSERT_EQ(close_nodes(dht_, target.data()), full_scan_close_nodes(dht_, target.data()));
+  }
+
+  ASSERT_EQ(close_nodes(dht_, self_.data()), full_scan_close_nodes(dht_, self_.data()));
+}
+
+TEST_F(DHTCloseList, NewKeyAtKnownAddressGoesToItsOwnBucket) {
+  Public_Key const old_key = key_with_prefix(0);
+  Public_Key const new_key = key_with_prefix(5);
+
+  addto_lists(dht_, fake_ip_port(1), old_key.data());
+  addto_lists(dht_, fake_ip_port(1), new_key.data());
+
+  const Client_data *const list = dht_get_close_clientlist(dht_);
+  bool found_new = false;
+
+  for (uint32_t i = 0; i < LCLIENT_LIST; ++i) {
+    if (memcmp(list[i].public_key, old_key.data(), CRYPTO_PUBLIC_KEY_SIZE) == 0) {
+      EXPECT_EQ(list[i].assoc4.timestamp, 0);
+    }
+
+    if (memcmp(list[i].public_key, new_key.data(), CRYPTO_PUBLIC_KEY_SIZE) == 0) {
+      EXPECT_EQ(i / LCLIENT_NODES, 5);
+      IP_Port const ip_port = fake_ip_port(1);
+      EXPECT_TRUE(ipport_equal(&list[i].assoc4.ip_port, &ip_port));
+      found_new = true;
+    }
+  }
+
+  EXPECT_TRUE(found_new);
+  EXPECT_EQ(close_nodes(dht_, old_key.data()), std::vector<Public_Key>{new_key});
+}
+
+// Replays the getnodes requests a bootstrap node answers, comparing against a
+// scan of the whole close list.
+TEST_F(DHTCloseList, GetNodesReplayBenchmark) {
+  fill_close_list(16);
+
+  uint32_t const requests = 100000;
+  std::vector<Public_Key> targets(requests);
+
+  for (Public_Key &target : targets) {
+    target = random_key();
+  }
+
+  auto const start = std::chrono::steady_clock::now();
+  size_t found = 0;
+
+  for (const Public_Key &target : targets) {
+    Node_format nodes[MAX_SENT_NODES];
+    found += get_close_nodes(dht_, target.data(), nodes, net_family_unspec, false, 1);
+  }
+
+  auto const bucketed = std::chrono::steady_clock::now();
+
+  for (const Public_Key &target : targets) {
+    found -= full_scan_close_nodes(dht_, target.data()).size();
+  }
+
+  auto const scanned = std::chrono::steady_clock::now();
+
+  EXPECT_EQ(found, 0);
+
+  auto const ns = [](std::chrono::steady_clock::duration d) {
+    return std::chrono::duration<double, std::nano>(d).count();
+  };
+  std::printf("%u close nodes: get_close_nodes %.0f ns/request, full scan %.0f ns/request\n", next_ip_,
+              ns(bucketed - start) / requests, ns(scanned - bucketed) / requests);
+}
+
+Public_Key shared_key_of(const uint8_t *secret_key, const Public_Key &public_key) {
+  Public_Key shared_key;
+  encrypt_precompute(public_key.data(), secret_key, shared_key.data());
+  return shared_key;
+}
+
+class SharedKeys : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    mono_time_ = mono_time_new();
+    crypto_new_keypair(self_public_key_, self_secret_key_);
+    rng_.seed(2);
+  }
+
+  void TearDown() override { mono_time_free(mono_time_); }
+
+  Public_Key random_key() {
+    Public_Key key;
+
+    for (uint8_t &byte : key) {
+      byte = static_cast<uint8_t>(rng_());
+    }
+
+    return key;
+  }
+
+  Public_Key get(Shared_Keys *shared_keys, const Public_Key &public_key) {
+    Public_Key shared_key;
+    get_shared_key(mono_time_, shared_keys, shared_key.data(), self_secret_key_, public_key.data());
+    return shared_key;
+  }
+
+  Mono_Time *mono_time_;
+  uint8_t self_public_key_[CRYPTO_PUBLIC_KEY_SIZE];
+  uint8_t self_secret_key_[CRYPTO_SECRET_KEY_SIZE];
+  std::mt19937 rng_;
+};
+
+TEST_F(SharedKeys, SizeIsRoundedUpToWholeSets) {
+  Shared_Keys *shared_keys = shared_keys_new(10, 4);
+  ASSERT_NE(shared_keys, nullptr);
+  EXPECT_EQ(shared_keys_get_size(shared_keys), 16u);
+  shared_keys_kill(shared_keys);
+
+  shared_keys = shared_keys_new(0, 0);
+  ASSERT_NE(shared_keys, nullptr);
+  EXPECT_EQ(shared_keys_get_size(shared_keys), uint32_t{SHARED_KEYS_DEFAULT_SIZE});
+  shared_keys_kill(shared_keys);
+
+  EXPECT_EQ(shared_keys_new(64, SHARED_KEYS_MAX_WAYS + 1), nullptr);
+}
+
+TEST_F(SharedKeys, HitsReturnTheComputedKey) {
+  Shared_Keys *shared_keys = shared_keys_new(8, 2);
+  ASSERT_NE(shared_keys, nullptr);
+
+  Public_Key const key = random_key();
+  Public_Key const expected = shared_key_of(self_secret_key_, key);
+  EXPECT_EQ(get(shared_keys, key), expected);
+  EXPECT_EQ(get(shared_keys, key), expected);
+
+  Shared_Keys_Stats stats;
+  shared_keys_get_stats(shared_keys, &stats);
+  EXPECT_EQ(stats.hits, 1u);
+  EXPECT_EQ(stats.misses, 1u);
+  EXPECT_EQ(stats.evictions, 0u);
+
+  for (uint32_t i = 0; i < 100; ++i) {
+    Public_Key const other = random_key();
+    EXPECT_EQ(get(shared_keys, other), shared_key_of(self_secret_key_, other));
+  }
+
+  shared_keys_get_stats(shared_keys, &stats);
+  EXPECT_EQ(stats.misses, 101u);
+  EXPECT_EQ(stats.evictions, stats.misses - shared_keys_get_size(shared_keys));
+  shared_keys_kill(shared_keys);
+}
+
+TEST_F(SharedKeys, KeyRequestedAgainOutlivesOneOffKeys) {
+  // A single set, so that every key competes for the same entries.
+  Shared_Keys *shared_keys = shared_keys_new(4, 4);
+  ASSERT_NE(shared_keys, nullptr);
+
+  Public_Key const key = random_key();
+  get(shared_keys, key);
+  get(shared_keys, key);
+
+  // Enough to replace the key if entries were replaced oldest first.
+  for (uint32_t i = 0; i < 6; ++i) {
+    get(shared_keys, random_key());
+  }
+
+  Shared_Keys_Stats before;
+  shared_keys_get_stats(shared_keys, &before);
+  get(shared_keys, key);
+
+  Shared_Keys_Stats after;
+  shared_keys_get_stats(shared_keys, &after);
+  EXPECT_EQ(after.hits, before.hits + 1);
+  shared_keys_kill(shared_keys);
+}
+
+// The cache get_shared_key had before it could be sized: public_key[30] picked
+// a slot of 4 entries, and a miss replaced the least requested one.
+class LegacySharedKeys {
+ public:
+  explicit LegacySharedKeys(const Mono_Time *mono_time) : mono_time_(mono_time), entries_(256 * 4) {}
+
+  // Returns whether the key was cached.
+  bool get(const Public_Key &public_key) {
+    uint32_t num = UINT32_MAX;
+    uint32_t curr = 0;
+
+    for (uint32_t i = 0; i < 4; ++i) {
+      uint32_t const index = public_key[30] * 4 + i;
+      Entry &entry = entries_[index];
+
+      if (entry.stored) {
+        if (entry.public_key == public_key) {
+          ++entry.times_requested;
+          entry.time_last_requested = mono_time_get(mono_time_);
+          return true;
+        }
+
+        if (num != 0) {
+          if (mono_time_is_timeout(mono_time_, entry.time_last_requested, KEYS_TIMEOUT)) {
+            num = 0;
+            curr = index;
+          } else if (num > entry.times_requested) {
+            num = entry.times_requested;
+            curr = index;
+          }
+        }
+      } else if (num != 0) {
+        num = 0;
+        curr = index;
+      }
+    }
+
+    Entry &entry = entries_[curr];
+    entry.stored = true;
+    entry.times_requested = 1;
+    entry.public_key = public_key;
+    entry.time_last_requested = mono_time_get(mono_time_);
+    return false;
+  }
+
+ private:
+  struct Entry {
+    Public_Key public_key;
+    uint32_t times_requested = 0;
+    bool stored = false;
+    uint64_t time_last_requested = 0;
+  };
+
+  const Mono_Time *mono_time_;
+  std::vector<Entry> entries_;
+};
+
+// Replays the keys of the packets a bootstrap node decrypts: peers with
+// Zipf-distributed activity, and a share of keys seen only once (e.g. nodes
+// looking up random keys), counting the encrypt_precompute calls.
+TEST_F(SharedKeys, ReplayBenchmark) {
+  uint32_t packets = 100000;
+  char const *env = std::getenv("DHT_BENCHMARK_PACKETS");
+
+  if (env != nullptr) {
+    packets = std::max(1000, std::atoi(env));
+  }
+
+  uint32_t const peers = 20000;
+  std::vector<double> cdf(peers);
+  double total = 0;
+
+  for (uint32_t i = 0; i < peers; ++i) {
+    total += 1.0 / (i + 1);
+    cdf[i] = total;
+  }
+
+  std::vector<Public_Key> peer_keys(peers);
+
+  for (Public_Key &key : peer_keys) {
+    key = random_key();
+  }
+
+  std::uniform_real_distribution<double> uniform(0, total);
+  std::vector<Public_Key> trace(packets);
+
+  for (Public_Key &key : trace) {
+    if (rng_() % 10 < 2) {
+      key = random_key();
+    } else {
+      key = peer_keys[std::lower_bound(cdf.begin(), cdf.end(), uniform(rng_)) - cdf.begin()];
+    }
+  }
+
+  double const scale = 1000000.0 / packets;
+
+  LegacySharedKeys legacy(mono_time_);
+  uint64_t legacy_misses = 0;
+
+  for (const Public_Key &key : trace) {
+    legacy_misses += !legacy.get(key);
+  }
+
+  std::printf("legacy 1024 keys, 4 ways by public_key[30]: %.0f precomputes per 1M packets\n",
+              legacy_misses * scale);
+
+  struct Config {
+    uint32_t size;
+    uint32_t ways;
+  };
+  Config const configs[] = {{1024, 4}, {1024, 16}, {8192, 8}, {32768, 8}};
+
+  for (const Config &config : configs) {
+    Shared_Keys *shared_keys = shared_keys_new(config.size, config.ways);
+    ASSERT_NE(shared_keys, nullptr);
+
+    auto const start = std::chrono::steady_clock::now();
+
+    for (const Public_Key &key : trace) {
+      get(shared_keys, key);
+    }
+
+    auto const elapsed = std::chrono::steady_clock::now() - start;
+
+    Shared_Keys_Stats stats;
+    shared_keys_get_stats(shared_keys, &stats);
+    EXPECT_EQ(stats.hits + stats.misses, packets);
+
+    if (config.size > 1024) {
+      EXPECT_LT(stats.misses, legacy_misses);
+    }
+
+    std::printf("%u keys, %u ways: %.0f precomputes per 1M packets, %.0f evictions, %.0f ns/packet\n", config.size,
+                config.ways, stats.misses * scale, stats.evictions * scale,
+                std::chrono::duration<double, std::nano>(elapsed).count() / packets);
+    shared_keys_kill(shared_keys);
+  }
+}
+
+}  // namespace
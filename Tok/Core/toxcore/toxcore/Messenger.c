@@ -21,6 +21,10 @@
  * You should have received a copy of the GNU General Public License
  * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
  */
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 600
+#endif
+
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
@@ -28,14 +32,21 @@
 #include "Messenger.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "hash_index.h"
 #include "logger.h"
 #include "mono_time.h"
 #include "network.h"
+#include "scheduler.h"
 #include "state.h"
 #include "util.h"
 
@@ -84,15 +95,15 @@ int32_t getfriend_id(const Messenger *m, const uint8_t *real_pk)
 {
     uint32_t i;
 
-    for (i = 0; i < m->numfriends; ++i) {
-        if (m->friendlist[i].status > 0) {
-            if (id_equal(real_pk, m->friendlist[i].real_pk)) {
-                return i;
-            }
-        }
+    if (!hash_index_get(m->friend_index, real_pk, &i)) {
+        return -1;
     }
 
-    return -1;
+    if (i >= m->numfriends || m->friendlist[i].status == NOFRIEND || !id_equal(real_pk, m->friendlist[i].real_pk)) {
+        return -1;
+    }
+
+    return i;
 }
 
 /* Copies the public key associated to that friend id into real_pk buffer.
@@ -191,10 +202,16 @@ static int32_t init_new_friend(Messenger *m, const uint8_t *real_pk, uint8_t sta
         return FAERR_NOMEM;
     }
 
-    uint32_t i;
+    /* The index holds every friend, so if it is as big as the list there are no holes to fill. */
+    uint32_t i = hash_index_size(m->friend_index) == m->numfriends ? m->numfriends : 0;
 
-    for (i = 0; i <= m->numfriends; ++i) {
+    for (; i <= m->numfriends; ++i) {
         if (m->friendlist[i].status == NOFRIEND) {
+            if (!hash_index_set(m->friend_index, real_pk, i)) {
+                kill_friend_connection(m->fr_c, friendcon_id);
+                return FAERR_NOMEM;
+            }
+
             m->friendlist[i].status = status;
             m->friendlist[i].friendcon_id = friendcon_id;
             m->friendlist[i].friendrequest_lastsent = 0;
@@ -431,6 +448,7 @@ int m_delfriend(Messenger *m, int32_t friendnumber)
     }
 
     kill_friend_connection(m->fr_c, m->friendlist[friendnumber].friendcon_id);
+    hash_index_remove(m->friend_index, m->friendlist[friendnumber].real_pk);
     memset(&m->friendlist[friendnumber], 0, sizeof(Friend));
     uint32_t i;
 
@@ -475,6 +493,16 @@ int m_get_friend_connectionstatus(const Messenger *m, int32_t friendnumber)
     return CONNECTION_NONE;
 }
 
+int m_get_friend_rtt(const Messenger *m, int32_t friendnumber, uint64_t *min_rtt, uint64_t *rtt)
+{
+    if (friend_not_valid(m, friendnumber)) {
+        return -1;
+    }
+
+    int crypt_conn_id = friend_connection_crypt_connection_id(m->fr_c, m->friendlist[friendnumber].friendcon_id);
+    return crypto_connection_rtt(m->net_crypto, crypt_conn_id, min_rtt, rtt);
+}
+
 int m_friend_exists(const Messenger *m, int32_t friendnumber)
 {
     if (friend_not_valid(m, friendnumber)) {
@@ -1206,6 +1234,8 @@ long int new_filesender(const Messenger *m, int32_t friendnumber, uint32_t file_
 
     ft->paused = FILE_PAUSE_NOT;
 
+    ft->bulk = FILE_BULK_NONE;
+
     memcpy(ft->id, file_id, FILE_ID_LENGTH);
 
     ++m->friendlist[friendnumber].num_sending_files;
@@ -1498,6 +1528,212 @@ int file_data(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uin
     return -6;
 }
 
+static struct File_Transfers *file_bulk_transfer(const Messenger *m, int32_t friendnumber, uint32_t filenumber)
+{
+    uint32_t temp_filenum;
+    struct File_Transfers *ft;
+
+    if (filenumber >= (1 << 16)) {
+        temp_filenum = (filenumber >> 16) - 1;
+
+        if (temp_filenum >= MAX_CONCURRENT_FILE_PIPES) {
+            return nullptr;
+        }
+
+        ft = &m->friendlist[friendnumber].file_receiving[temp_filenum];
+    } else {
+        if (filenumber >= MAX_CONCURRENT_FILE_PIPES) {
+            return nullptr;
+        }
+
+        ft = &m->friendlist[friendnumber].file_sending[filenumber];
+    }
+
+    if (ft->status == FILESTATUS_NONE) {
+        return nullptr;
+    }
+
+    return ft;
+}
+
+int file_bulk_fd(const Messenger *m, int32_t friendnumber, uint32_t filenumber, int fd)
+{
+    if (friend_not_valid(m, friendnumber)) {
+        return -1;
+    }
+
+    struct File_Transfers *ft = file_bulk_transfer(m, friendnumber, filenumber);
+
+    if (ft == nullptr) {
+        return -2;
+    }
+
+    if (ft->requested != ft->transferred) {
+        return -3;
+    }
+
+#ifdef _WIN32
+    return -4;
+#else
+    ft->bulk = FILE_BULK_FD;
+    ft->bulk_fd = fd;
+    return 0;
+#endif
+}
+
+int file_bulk_buffer(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uint8_t *buffer)
+{
+    if (friend_not_valid(m, friendnumber)) {
+        return -1;
+    }
+
+    struct File_Transfers *ft = file_bulk_transfer(m, friendnumber, filenumber);
+
+    if (ft == nullptr) {
+        return -2;
+    }
+
+    if (ft->requested != ft->transferred) {
+        return -3;
+    }
+
+    if (ft->size == UINT64_MAX) {
+        return -4;
+    }
+
+    ft->bulk = FILE_BULK_BUFFER;
+    ft->bulk_buffer = buffer;
+    return 0;
+}
+
+/* Read up to length bytes of a bulk transfer at position.
+ *
+ * return the number of bytes read, less than length only at the end of the file.
+ * return -1 on failure.
+ */
+static int32_t file_bulk_read(const struct File_Transfers *ft, uint64_t position, uint8_t *data, uint16_t length)
+{
+    if (ft->bulk == FILE_BULK_BUFFER) {
+        memcpy(data, ft->bulk_buffer + position, length);
+        return length;
+    }
+
+#ifdef _WIN32
+    return -1;
+#else
+    uint16_t done = 0;
+
+    while (done < length) {
+        const ssize_t ret = pread(ft->bulk_fd, data + done, length - done, position + done);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret < 0) {
+            return -1;
+        }
+
+        if (ret == 0) {
+            break;
+        }
+
+        done += ret;
+    }
+
+    return done;
+#endif
+}
+
+/* return 0 on success.
+ * return -1 on failure.
+ */
+static int file_bulk_write(const struct File_Transfers *ft, uint64_t position, const uint8_t *data, uint16_t length)
+{
+    if (ft->bulk == FILE_BULK_BUFFER) {
+        memcpy(ft->bulk_buffer + position, data, length);
+        return 0;
+    }
+
+#ifdef _WIN32
+    return -1;
+#else
+    uint16_t done = 0;
+
+    while (done < length) {
+        const ssize_t ret = pwrite(ft->bulk_fd, data + done, length - done, position + done);
+
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ret <= 0) {
+            return -1;
+        }
+
+        done += ret;
+    }
+
+    return 0;
+#endif
+}
+
+/* Kill a bulk transfer whose file could not be read or written, and tell the
+ * client as if the friend had killed it.
+ */
+static void file_bulk_kill(Messenger *m, int32_t friendnumber, uint32_t filenumber, void *userdata)
+{
+    file_control(m, friendnumber, filenumber, FILECONTROL_KILL);
+
+    if (m->file_filecontrol) {
+        m->file_filecontrol(m, friendnumber, filenumber, FILECONTROL_KILL, userdata);
+    }
+}
+
+/* Send chunks of a bulk transfer until free_slots are used or the connection
+ * takes no more, reading the file data straight into the packets.
+ *
+ * return the number of slots used.
+ */
+static uint32_t file_bulk_send(Messenger *m, int32_t friendnumber, uint8_t filenumber, uint32_t free_slots,
+                               void *userdata)
+{
+    struct File_Transfers *const ft = &m->friendlist[friendnumber].file_sending[filenumber];
+    const int crypt_connection_id = friend_connection_crypt_connection_id(m->fr_c,
+                                    m->friendlist[friendnumber].friendcon_id);
+    uint8_t packet[2 + MAX_FILE_DATA_SIZE];
+    packet[0] = PACKET_ID_FILE_DATA;
+    packet[1] = filenumber;
+    uint32_t used = 0;
+
+    while (used < free_slots && ft->status == FILESTATUS_TRANSFERRING) {
+        const uint16_t wanted = min_u64(ft->size - ft->transferred, MAX_FILE_DATA_SIZE);
+        const int32_t length = file_bulk_read(ft, ft->transferred, packet + 2, wanted);
+
+        if (length == -1 || (length < wanted && ft->size != UINT64_MAX)) {
+            file_bulk_kill(m, friendnumber, filenumber, userdata);
+            break;
+        }
+
+        const int64_t ret = write_cryptpacket(m->net_crypto, crypt_connection_id, packet, 2 + length, 1);
+
+        if (ret == -1) {
+            break;
+        }
+
+        ft->transferred += length;
+        ft->requested = ft->transferred;
+        ++used;
+
+        if (length != MAX_FILE_DATA_SIZE || ft->transferred == ft->size) {
+            ft->status = FILESTATUS_FINISHED;
+            ft->last_packet_number = ret;
+        }
+    }
+
+    return used;
+}
+
 /* Give the number of bytes left to be sent/received.
  *
  *  send_receive is 0 if we want the sending files, 1 if we want the receiving.
@@ -1587,6 +1823,11 @@ static bool do_all_filetransfers(Messenger *m, int32_t friendnumber, void *userd
                 continue;
             }
 
+            if (ft->bulk != FILE_BULK_NONE) {
+                *free_slots -= file_bulk_send(m, friendnumber, i, *free_slots, userdata);
+                continue;
+            }
+
             if (ft->size == 0) {
                 /* Send 0 data to friend if file is 0 length. */
                 file_data(m, friendnumber, i, 0, nullptr, 0);
@@ -1885,17 +2126,27 @@ int m_callback_rtp_packet(Messenger *m, int32_t friendnumber, uint8_t byte, m_lo
  * are not the same set of packets.
  */
 int m_send_custom_lossy_packet(const Messenger *m, int32_t friendnumber, const uint8_t *data, uint32_t length)
+{
+    if (length > MAX_CRYPTO_DATA_SIZE) {
+        return friend_not_valid(m, friendnumber) ? -1 : -2;
+    }
+
+    return m_send_custom_lossy_packet_split(m, friendnumber, data, length, nullptr, 0);
+}
+
+int m_send_custom_lossy_packet_split(const Messenger *m, int32_t friendnumber, const uint8_t *head,
+                                     uint16_t head_length, const uint8_t *body, uint16_t body_length)
 {
     if (friend_not_valid(m, friendnumber)) {
         return -1;
     }
 
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
+    if (head_length == 0 || (uint32_t)head_length + body_length > MAX_CRYPTO_DATA_SIZE) {
         return -2;
     }
 
     // TODO(oxij): send_lossy_cryptpacket makes this check already, similarly for other similar places
-    if (data[0] < PACKET_ID_RANGE_LOSSY_START || data[0] > PACKET_ID_RANGE_LOSSY_END) {
+    if (head[0] < PACKET_ID_RANGE_LOSSY_START || head[0] > PACKET_ID_RANGE_LOSSY_END) {
         return -3;
     }
 
@@ -1903,8 +2154,8 @@ int m_send_custom_lossy_packet(const Messenger *m, int32_t friendnumber, const u
         return -4;
     }
 
-    if (send_lossy_cryptpacket(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
-                               m->friendlist[friendnumber].friendcon_id), data, length) == -1) {
+    if (send_lossy_cryptpacket_split(m->net_crypto, friend_connection_crypt_connection_id(m->fr_c,
+                                     m->friendlist[friendnumber].friendcon_id), head, head_length, body, body_length) == -1) {
         return -5;
     }
 
@@ -1993,9 +2244,21 @@ Messenger *new_messenger(Mono_Time *mono_time, Messenger_Options *options, unsig
 
     m->mono_time = mono_time;
 
+    m->friend_index = hash_index_new(CRYPTO_PUBLIC_KEY_SIZE);
+    m->scheduler = scheduler_new(mono_time);
+
+    if (m->friend_index == nullptr || m->scheduler == nullptr) {
+        hash_index_kill(m->friend_index);
+        scheduler_kill(m->scheduler);
+        free(m);
+        return nullptr;
+    }
+
     m->fr = friendreq_new();
 
     if (!m->fr) {
+        hash_index_kill(m->friend_index);
+        scheduler_kill(m->scheduler);
         free(m);
         return nullptr;
     }
@@ -2004,6 +2267,8 @@ Messenger *new_messenger(Mono_Time *mono_time, Messenger_Options *options, unsig
 
     if (m->log == nullptr) {
         friendreq_kill(m->fr);
+        hash_index_kill(m->friend_index);
+        scheduler_kill(m->scheduler);
         free(m);
         return nullptr;
     }
@@ -2029,6 +2294,8 @@ Messenger *new_messenger(Mono_Time *mono_time, Messenger_Options *options, unsig
     if (m->net == nullptr) {
         friendreq_kill(m->fr);
         logger_kill(m->log);
+        hash_index_kill(m->friend_index);
+        scheduler_kill(m->scheduler);
         free(m);
 
         if (error && net_err == 1) {
@@ -2038,12 +2305,19 @@ Messenger *new_messenger(Mono_Time *mono_time, Messenger_Options *options, unsig
         return nullptr;
     }
 
-    m->dht = new_dht(m->log, m->mono_time, m->net, options->hole_punching_enabled, options->dht_pk, options->dht_sk);
+    if (options->udp_send_queue_enabled) {
+        networking_set_send_queue(m->net, true);
+    }
+
+    m->dht = new_dht(m->log, m->mono_time, m->net, options->hole_punching_enabled, options->shared_keys_size,
+                     options->shared_keys_ways, options->dht_pk, options->dht_sk);
 
     if (m->dht == nullptr) {
         kill_networking(m->net);
         friendreq_kill(m->fr);
         logger_kill(m->log);
+        hash_index_kill(m->friend_index);
+        scheduler_kill(m->scheduler);
         free(m);
         return nullptr;
     }
@@ -2055,10 +2329,16 @@ Messenger *new_messenger(Mono_Time *mono_time, Messenger_Options *options, unsig
         kill_dht(m->dht);
         friendreq_kill(m->fr);
         logger_kill(m->log);
+        hash_index_kill(m->friend_index);
+        scheduler_kill(m->scheduler);
         free(m);
         return nullptr;
     }
 
+    if (options->congestion_control != nullptr) {
+        net_crypto_set_congestion_control(m->net_crypto, options->congestion_control);
+    }
+
     m->onion = new_onion(m->mono_time, m->dht);
     m->onion_a = new_onion_announce(m->mono_time, m->dht);
     m->onion_c =  new_onion_client(m->mono_time, m->net_crypto);
@@ -2074,6 +2354,8 @@ Messenger *new_messenger(Mono_Time *mono_time, Messenger_Options *options, unsig
         kill_networking(m->net);
         friendreq_kill(m->fr);
         logger_kill(m->log);
+        hash_index_kill(m->friend_index);
+        scheduler_kill(m->scheduler);
         free(m);
         return nullptr;
     }
@@ -2092,6 +2374,8 @@ Messenger *new_messenger(Mono_Time *mono_time, Messenger_Options *options, unsig
             kill_networking(m->net);
             friendreq_kill(m->fr);
             logger_kill(m->log);
+            hash_index_kill(m->friend_index);
+            scheduler_kill(m->scheduler);
             free(m);
 
             if (error) {
@@ -2102,6 +2386,17 @@ Messenger *new_messenger(Mono_Time *mono_time, Messenger_Options *options, unsig
         }
     }
 
+    if (options->precompute_threads != 0 && !options->udp_disabled) {
+        m->precompute_pool = precompute_pool_new(options->precompute_threads, 0);
+
+        if (m->precompute_pool == nullptr) {
+            LOGGER_WARNING(m->log, "Could not start %u precompute threads, computing shared keys inline",
+                           options->precompute_threads);
+        }
+
+        networking_set_precompute_pool(m->net, m->precompute_pool);
+    }
+
     m->options = *options;
     friendreq_init(m->fr, m->fr_c);
     set_nospam(m->fr, random_u32());
@@ -2109,6 +2404,18 @@ Messenger *new_messenger(Mono_Time *mono_time, Messenger_Options *options, unsig
 
     m->lastdump = 0;
 
+    if (!options->udp_disabled) {
+        scheduler_wake(m->scheduler, SCHEDULER_DHT);
+    }
+
+    scheduler_wake(m->scheduler, SCHEDULER_NET_CRYPTO);
+    scheduler_wake(m->scheduler, SCHEDULER_ONION_CLIENT);
+    scheduler_wake(m->scheduler, SCHEDULER_FRIEND_CONNECTIONS);
+
+    if (m->tcp_server) {
+        scheduler_wake(m->scheduler, SCHEDULER_TCP_SERVER);
+    }
+
     m_register_default_plugins(m);
 
     if (error) {
@@ -2127,6 +2434,9 @@ void kill_messenger(Messenger *m)
 
     uint32_t i;
 
+    networking_set_precompute_pool(m->net, nullptr);
+    precompute_pool_kill(m->precompute_pool);
+
     if (m->tcp_server) {
         kill_TCP_server(m->tcp_server);
     }
@@ -2145,6 +2455,8 @@ void kill_messenger(Messenger *m)
 
     logger_kill(m->log);
     free(m->friendlist);
+    hash_index_kill(m->friend_index);
+    scheduler_kill(m->scheduler);
     friendreq_kill(m->fr);
 
     free(m->options.state_plugins);
@@ -2416,6 +2728,7 @@ static int m_handle_packet(void *object, int i, const uint8_t *temp, uint16_t le
             ft->size = filesize;
             ft->transferred = 0;
             ft->paused = FILE_PAUSE_NOT;
+            ft->bulk = FILE_BULK_NONE;
             memcpy(ft->id, data + 1 + sizeof(uint32_t) + sizeof(uint64_t), FILE_ID_LENGTH);
 
             VLA(uint8_t, filename_terminated, filename_length + 1);
@@ -2505,7 +2818,12 @@ static int m_handle_packet(void *object, int i, const uint8_t *temp, uint16_t le
                 file_data_length = ft->size - ft->transferred;
             }
 
-            if (m->file_filedata) {
+            if (ft->bulk != FILE_BULK_NONE && file_data_length != 0) {
+                if (file_bulk_write(ft, position, file_data, file_data_length) == -1) {
+                    file_bulk_kill(m, i, real_filenumber, userdata);
+                    break;
+                }
+            } else if (m->file_filedata) {
                 (*m->file_filedata)(m, i, real_filenumber, position, file_data, file_data_length, userdata);
             }
 
@@ -2654,6 +2972,12 @@ static char *id_to_string(const uint8_t *pk, char *id_str, size_t length)
    TODO(mannol): A/V */
 #define MIN_RUN_INTERVAL 50
 
+/* Longest net_crypto may sleep when sockets are watched for readiness, in ms. */
+#define MAX_READY_RUN_INTERVAL 1000
+
+/* How often to look for packets whose shared keys are ready, in ms. */
+#define PRECOMPUTE_RUN_INTERVAL 1
+
 /* Return the time in milliseconds before do_messenger() should be called again
  * for optimal performance.
  *
@@ -2661,17 +2985,81 @@ static char *id_to_string(const uint8_t *pk, char *id_str, size_t length)
  */
 uint32_t messenger_run_interval(const Messenger *m)
 {
-    uint32_t crypto_interval = crypto_run_interval(m->net_crypto);
+    const uint32_t interval = scheduler_next_deadline(m->scheduler);
 
-    if (crypto_interval > MIN_RUN_INTERVAL) {
-        return MIN_RUN_INTERVAL;
+    if (m->precompute_pool != nullptr && precompute_pool_pending(m->precompute_pool) != 0) {
+        return min_u32(interval, PRECOMPUTE_RUN_INTERVAL);
     }
 
-    return crypto_interval;
+    return interval;
 }
 
-/* The main loop that needs to be run at least 20 times per second. */
-void do_messenger(Messenger *m, void *userdata)
+uint32_t messenger_sockets(Messenger *m, Socket *socks, bool *want_write, uint32_t max_socks)
+{
+    uint32_t count = 0;
+
+    if (!m->options.udp_disabled) {
+        if (count < max_socks) {
+            socks[count] = net_sock(m->net);
+            want_write[count] = false;
+        }
+
+        ++count;
+    }
+
+    if (m->tcp_server) {
+        const uint32_t offset = min_u32(count, max_socks);
+        const uint32_t num = tcp_server_sockets(m->tcp_server, socks + offset, max_socks - offset);
+
+        for (uint32_t i = offset; i < max_socks && i < count + num; ++i) {
+            want_write[i] = false;
+        }
+
+        count += num;
+    }
+
+    const uint32_t offset = min_u32(count, max_socks);
+    count += net_crypto_tcp_sockets(m->net_crypto, socks + offset, want_write + offset, max_socks - offset);
+
+    return count;
+}
+
+static bool socket_is_ready(const Socket *ready, uint32_t num_ready, Socket sock)
+{
+    for (uint32_t i = 0; i < num_ready; ++i) {
+        if (ready[i].socket == sock.socket) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool tcp_server_is_ready(const TCP_Server *tcp_server, const Socket *ready, uint32_t num_ready)
+{
+    const uint32_t num = tcp_server_sockets(tcp_server, nullptr, 0);
+
+    if (num == 0) {
+        return false;
+    }
+
+    VLA(Socket, socks, num);
+    tcp_server_sockets(tcp_server, socks, num);
+
+    for (uint32_t i = 0; i < num; ++i) {
+        if (socket_is_ready(ready, num_ready, socks[i])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* With poll_all, every socket is read and ready is ignored. Otherwise only the
+ * sockets in ready are read, and net_crypto runs when there was something to
+ * read or its own deadline passed.
+ */
+static void messenger_iterate(Messenger *m, const Socket *ready, uint32_t num_ready, bool poll_all, void *userdata)
 {
     // Add the TCP relays, but only if this is the first time calling do_messenger
     if (!m->has_added_relays) {
@@ -2695,17 +3083,58 @@ void do_messenger(Messenger *m, void *userdata)
     }
 
     if (!m->options.udp_disabled) {
-        networking_poll(m->net, userdata);
-        do_dht(m->dht);
+        if (poll_all || socket_is_ready(ready, num_ready, net_sock(m->net))) {
+            networking_poll(m->net, userdata);
+            scheduler_wake(m->scheduler, SCHEDULER_NET_CRYPTO);
+        } else if (m->precompute_pool != nullptr && precompute_pool_pending(m->precompute_pool) != 0) {
+            networking_poll_precomputed(m->net, userdata);
+            scheduler_wake(m->scheduler, SCHEDULER_NET_CRYPTO);
+        }
+
+        if (scheduler_due(m->scheduler, SCHEDULER_DHT)) {
+            do_dht(m->dht);
+            scheduler_set_next_second(m->scheduler, SCHEDULER_DHT);
+        }
     }
 
     if (m->tcp_server) {
-        do_TCP_server(m->tcp_server, m->mono_time);
+        /* Without epoll, accepted connections are only read here, so run at least once a second. */
+        const bool server_due = scheduler_due(m->scheduler, SCHEDULER_TCP_SERVER);
+
+        if (server_due) {
+            scheduler_set_next_second(m->scheduler, SCHEDULER_TCP_SERVER);
+        }
+
+        if (poll_all || server_due || tcp_server_is_ready(m->tcp_server, ready, num_ready)) {
+            do_TCP_server(m->tcp_server, m->mono_time);
+        }
+    }
+
+    if (!poll_all && num_ready > 0) {
+        do_net_crypto_tcp_ready(m->net_crypto, ready, num_ready, userdata);
+        scheduler_wake(m->scheduler, SCHEDULER_NET_CRYPTO);
+    }
+
+    if (scheduler_due(m->scheduler, SCHEDULER_NET_CRYPTO)) {
+        do_net_crypto(m->net_crypto, userdata);
+
+        /* This also reads the TCP relay sockets, so unless they are watched for
+         * readiness keep polling them at least every MIN_RUN_INTERVAL. */
+        const uint32_t max_interval = poll_all ? MIN_RUN_INTERVAL : MAX_READY_RUN_INTERVAL;
+        scheduler_set_next(m->scheduler, SCHEDULER_NET_CRYPTO, min_u32(crypto_run_interval(m->net_crypto), max_interval));
+    }
+
+    /* These only look at timestamps in whole seconds. */
+    if (scheduler_due(m->scheduler, SCHEDULER_ONION_CLIENT)) {
+        do_onion_client(m->onion_c);
+        scheduler_set_next_second(m->scheduler, SCHEDULER_ONION_CLIENT);
+    }
+
+    if (scheduler_due(m->scheduler, SCHEDULER_FRIEND_CONNECTIONS)) {
+        do_friend_connections(m->fr_c, userdata);
+        scheduler_set_next_second(m->scheduler, SCHEDULER_FRIEND_CONNECTIONS);
     }
 
-    do_net_crypto(m->net_crypto, userdata);
-    do_onion_client(m->onion_c);
-    do_friend_connections(m->fr_c, userdata);
     do_friends(m, userdata);
     connection_status_callback(m, userdata);
 
@@ -2821,6 +3250,17 @@ void do_messenger(Messenger *m, void *userdata)
     }
 }
 
+/* The main loop that needs to be run at least 20 times per second. */
+void do_messenger(Messenger *m, void *userdata)
+{
+    messenger_iterate(m, nullptr, 0, true, userdata);
+}
+
+void do_messenger_ready(Messenger *m, const Socket *ready, uint32_t num_ready, void *userdata)
+{
+    messenger_iterate(m, ready, num_ready, false, userdata);
+}
+
 /* new messenger format for load/save, more robust and forward compatible */
 
 #define SAVED_FRIEND_REQUEST_SIZE 1024
@@ -3409,46 +3849,68 @@ uint32_t copy_friendlist(Messenger const *m, uint32_t *out_list, uint32_t list_s
     return ret;
 }
 
+/* Return the shared key used to encrypt offline messages for friendnumber,
+ * computing it on first use.
+ */
+static const uint8_t *offline_shared_key(Messenger *m, uint32_t friendnumber)
+{
+    Friend *const f = &m->friendlist[friendnumber];
+
+    if (!f->offline_shared_key_set) {
+        encrypt_precompute(f->real_pk, nc_get_self_secret_key(m->net_crypto), f->offline_shared_key);
+        f->offline_shared_key_set = true;
+    }
+
+    return f->offline_shared_key;
+}
+
 int m_encrypt_offline_message(Messenger *m, const uint32_t friendnumber, const uint8_t *message, const int length , uint8_t *encrypt_message) {
+	if (friend_not_valid(m, friendnumber) || length <= 0) {
+		return 0;
+	}
 	int total_length =   CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE + length + CRYPTO_MAC_SIZE;
-	VLA(uint8_t, packet, total_length);
 	// random a nonce
-	VLA(uint8_t, nonce, CRYPTO_NONCE_SIZE);
+	uint8_t *nonce = encrypt_message + CRYPTO_PUBLIC_KEY_SIZE;
 	random_nonce(nonce);
-	uint8_t *pk = m->friendlist[friendnumber].real_pk;
-	memcpy(packet, pk, CRYPTO_PUBLIC_KEY_SIZE);
-	memcpy(packet + CRYPTO_PUBLIC_KEY_SIZE, nonce, CRYPTO_NONCE_SIZE);
-	const uint8_t *secret_key = nc_get_self_secret_key(m->net_crypto);
+	memcpy(encrypt_message, m->friendlist[friendnumber].real_pk, CRYPTO_PUBLIC_KEY_SIZE);
 
-	VLA(uint8_t, e_m, length + CRYPTO_MAC_SIZE);
-	int32_t len = encrypt_data(pk, secret_key, nonce, message, length, e_m);
-	memcpy(packet + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE, e_m, length + CRYPTO_MAC_SIZE);
-	memcpy(encrypt_message, packet, total_length);
+	encrypt_data_symmetric(offline_shared_key(m, friendnumber), nonce, message, length,
+	                       encrypt_message + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE);
 
 	return total_length;
 }
 
 int m_decrypt_offline_message(Messenger *m, uint32_t friendnumber, const uint8_t *message, const int length , uint8_t *decrypt_message) {
-	if (friendnumber == -1) {
+	if (friend_not_valid(m, friendnumber)) {
 		return 0;
 	}
 	if (length - CRYPTO_PUBLIC_KEY_SIZE - CRYPTO_NONCE_SIZE <= 0) {
 		return 0;
 	}
-	uint8_t *friendpk = m->friendlist[friendnumber].real_pk;
-	VLA(uint8_t, nonce, CRYPTO_NONCE_SIZE);
-	memcpy(nonce, message + CRYPTO_PUBLIC_KEY_SIZE, CRYPTO_NONCE_SIZE);
-	
-	VLA(uint8_t, encrypted_message, length - CRYPTO_PUBLIC_KEY_SIZE - CRYPTO_NONCE_SIZE);
-	memcpy(encrypted_message, message + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE, length - CRYPTO_PUBLIC_KEY_SIZE - CRYPTO_NONCE_SIZE);
-
-	uint8_t real_message[length - CRYPTO_PUBLIC_KEY_SIZE - CRYPTO_NONCE_SIZE - CRYPTO_MAC_SIZE];
-	
-	const uint8_t *secret_key = nc_get_self_secret_key(m->net_crypto);
-	int len = decrypt_data(friendpk, secret_key, nonce, encrypted_message, length - CRYPTO_PUBLIC_KEY_SIZE - CRYPTO_NONCE_SIZE, real_message);
-	if (-1 != len) {
-		memcpy(decrypt_message, real_message, len);
-	}
-	return len;
+	const uint8_t *nonce = message + CRYPTO_PUBLIC_KEY_SIZE;
+	const uint8_t *encrypted_message = message + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE;
+
+	return decrypt_data_symmetric(offline_shared_key(m, friendnumber), nonce, encrypted_message,
+	                              length - CRYPTO_PUBLIC_KEY_SIZE - CRYPTO_NONCE_SIZE, decrypt_message);
 }
 
+uint32_t m_decrypt_offline_messages(Messenger *m, uint32_t friendnumber, const uint8_t *const *messages,
+                                    const uint32_t *lengths, uint32_t count, uint8_t *const *decrypt_messages,
+                                    int32_t *decrypt_lengths)
+{
+    uint32_t decrypted = 0;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        int len = m_decrypt_offline_message(m, friendnumber, messages[i], lengths[i], decrypt_messages[i]);
+
+        if (len <= 0) {
+            decrypt_lengths[i] = -1;
+            continue;
+        }
+
+        decrypt_lengths[i] = len;
+        ++decrypted;
+    }
+
+    return decrypted;
+}
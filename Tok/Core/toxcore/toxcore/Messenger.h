@@ -27,8 +27,11 @@
 
 #include "friend_connection.h"
 #include "friend_requests.h"
+#include "hash_index.h"
 #include "logger.h"
 #include "net_crypto.h"
+#include "precompute.h"
+#include "scheduler.h"
 #include "state.h"
 
 #define MAX_NAME_LENGTH 128
@@ -83,6 +86,15 @@ typedef struct Messenger_Options {
 
     bool hole_punching_enabled;
     bool local_discovery_enabled;
+    bool udp_send_queue_enabled;
+    /* nullptr for the net_crypto default. */
+    const Congestion_Control *congestion_control;
+    /* 0 for the DHT defaults, see shared_keys_new. */
+    uint32_t shared_keys_size;
+    uint32_t shared_keys_ways;
+    /* Threads computing shared keys for incoming UDP packets, 0 to compute
+     * them in do_messenger. */
+    uint32_t precompute_threads;
 
     logger_cb *log_callback;
     void *log_context;
@@ -159,7 +171,17 @@ struct File_Transfers {
     uint64_t requested; /* total data requested by the request chunk callback */
     unsigned int slots_allocated; /* number of slots allocated to this transfer. */
     uint8_t id[FILE_ID_LENGTH];
+    /* Where a bulk transfer reads its data from or writes it to, instead of
+     * going through the chunk callbacks. */
+    uint8_t bulk; /* a File_Bulk value */
+    int bulk_fd;
+    uint8_t *bulk_buffer;
 };
+typedef enum File_Bulk {
+    FILE_BULK_NONE,
+    FILE_BULK_FD,
+    FILE_BULK_BUFFER
+} File_Bulk;
 typedef enum Filestatus {
     FILESTATUS_NONE,
     FILESTATUS_NOT_ACCEPTED,
@@ -266,6 +288,10 @@ typedef struct Friend {
 
     struct Receipts *receipts_start;
     struct Receipts *receipts_end;
+
+    // Precomputed shared key with real_pk for offline messages, valid if offline_shared_key_set.
+    uint8_t offline_shared_key[CRYPTO_SHARED_KEY_SIZE];
+    bool offline_shared_key_set;
 } Friend;
 
 struct Messenger {
@@ -294,6 +320,10 @@ struct Messenger {
 
     Friend *friendlist;
     uint32_t numfriends;
+    Hash_Index *friend_index; // real_pk -> friend number
+
+    Scheduler *scheduler;
+    Precompute_Pool *precompute_pool;
 
     time_t lastdump;
 
@@ -406,6 +436,13 @@ int m_delfriend(Messenger *m, int32_t friendnumber);
  */
 int m_get_friend_connectionstatus(const Messenger *m, int32_t friendnumber);
 
+/* Get the round trip time to a friend in ms, as measured by net_crypto.
+ *
+ *  return 0 on success.
+ *  return -1 if the friend is not valid or not connected.
+ */
+int m_get_friend_rtt(const Messenger *m, int32_t friendnumber, uint64_t *min_rtt, uint64_t *rtt);
+
 /* Checks if there exists a friend with given friendnumber.
  *
  *  return 1 if friend exists.
@@ -719,6 +756,35 @@ int file_seek(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uin
 int file_data(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uint64_t position, const uint8_t *data,
               uint16_t length);
 
+/* Make a file transfer a bulk transfer: file data is read from (sending) or
+ * written to (receiving) fd at its file position, with pread and pwrite,
+ * instead of going through the chunk callbacks. A sending transfer sends as
+ * many chunks as the connection takes in one go. When sending a stream of
+ * unknown size, it ends at the end of the file.
+ *
+ * The file_reqchunk or file_filedata callback is still called with length 0
+ * when the transfer is finished, and file_filecontrol with FILECONTROL_KILL if
+ * reading or writing fails. fd must stay open until then.
+ *
+ *  return 0 on success
+ *  return -1 if friend not valid.
+ *  return -2 if filenumber invalid.
+ *  return -3 if chunks were already requested through the callback.
+ *  return -4 if not supported on this platform.
+ */
+int file_bulk_fd(const Messenger *m, int32_t friendnumber, uint32_t filenumber, int fd);
+
+/* Like file_bulk_fd, but with the whole file in buffer, for example a mapped
+ * file. buffer must be the file size long and is only read from when sending.
+ *
+ *  return 0 on success
+ *  return -1 if friend not valid.
+ *  return -2 if filenumber invalid.
+ *  return -3 if chunks were already requested through the callback.
+ *  return -4 if the file size is unknown.
+ */
+int file_bulk_buffer(const Messenger *m, int32_t friendnumber, uint32_t filenumber, uint8_t *buffer);
+
 /* Give the number of bytes left to be sent/received.
  *
  *  send_receive is 0 if we want the sending files, 1 if we want the receiving.
@@ -769,6 +835,14 @@ void custom_lossy_packet_registerhandler(Messenger *m, m_friend_lossy_packet_cb
  */
 int m_send_custom_lossy_packet(const Messenger *m, int32_t friendnumber, const uint8_t *data, uint32_t length);
 
+/* Like m_send_custom_lossy_packet, but the packet is head followed by body.
+ * Neither is copied into a staging buffer first.
+ *
+ * Returns the same values as m_send_custom_lossy_packet.
+ */
+int m_send_custom_lossy_packet_split(const Messenger *m, int32_t friendnumber, const uint8_t *head,
+                                     uint16_t head_length, const uint8_t *body, uint16_t body_length);
+
 
 /* Set handlers for custom lossless packets.
  *
@@ -811,6 +885,24 @@ void kill_messenger(Messenger *m);
 /* The main loop that needs to be run at least 20 times per second. */
 void do_messenger(Messenger *m, void *userdata);
 
+/* Copy up to max_socks of the sockets do_messenger reads from to socks: the UDP
+ * socket, the TCP server sockets and the TCP relay connections. want_write[i] is
+ * set if socks[i] has data waiting for it to become writable.
+ *
+ * The set changes as connections come and go, so get it again after each
+ * do_messenger or do_messenger_ready.
+ *
+ * return the total number of sockets.
+ */
+uint32_t messenger_sockets(Messenger *m, Socket *socks, bool *want_write, uint32_t max_socks);
+
+/* Like do_messenger, but only read from the sockets in ready, which are the
+ * ones of messenger_sockets that became readable or writable. Timed work still
+ * runs when due, so call this at least every messenger_run_interval ms even if
+ * no socket is ready.
+ */
+void do_messenger_ready(Messenger *m, const Socket *ready, uint32_t num_ready, void *userdata);
+
 /* Return the time in milliseconds before do_messenger() should be called again
  * for optimal performance.
  *
@@ -867,4 +959,14 @@ int m_encrypt_offline_message(Messenger *m, const uint32_t friendnumber, const u
  */
 int m_decrypt_offline_message(Messenger *m, uint32_t friend_number, const uint8_t *message, const int length , uint8_t *decrypt_message);
 
+/**
+ * decrypt count offline messages from the same friend in one call.
+ * decrypt_lengths[i] is set to the decrypted length of messages[i], or -1 if it failed.
+ *
+ * return the number of messages decrypted successfully.
+ */
+uint32_t m_decrypt_offline_messages(Messenger *m, uint32_t friend_number, const uint8_t *const *messages,
+                                    const uint32_t *lengths, uint32_t count, uint8_t *const *decrypt_messages,
+                                    int32_t *decrypt_lengths);
+
 #endif
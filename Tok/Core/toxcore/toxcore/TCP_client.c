@@ -59,8 +59,9 @@ struct TCP_Client_Connection {
     uint16_t last_packet_length;
     uint16_t last_packet_sent;
 
-    TCP_Priority_List *priority_queue_start;
-    TCP_Priority_List *priority_queue_end;
+    /* Packets the socket didn't take yet, after last_packet. */
+    TCP_Send_Buffer send_buffer;
+    bool coalesce;
 
     uint64_t kill_at;
 
@@ -102,6 +103,22 @@ TCP_Client_Status tcp_con_status(const TCP_Client_Connection *con)
 {
     return con->status;
 }
+
+Socket tcp_con_sock(const TCP_Client_Connection *con)
+{
+    return con->sock;
+}
+
+bool tcp_con_send_pending(const TCP_Client_Connection *con)
+{
+    return con->last_packet_length != 0 || con->send_buffer.length != 0;
+}
+
+void tcp_con_set_send_buffer_limit(TCP_Client_Connection *con, uint32_t limit)
+{
+    tcp_send_buffer_set_limit(&con->send_buffer, limit);
+}
+
 void *tcp_con_custom_object(const TCP_Client_Connection *con)
 {
     return con->custom_object;
@@ -363,60 +380,16 @@ static int client_send_pending_data(TCP_Client_Connection *con)
         return -1;
     }
 
-    TCP_Priority_List *p = con->priority_queue_start;
-
-    while (p) {
-        const uint16_t left = p->size - p->sent;
-        const int len = net_send(con->sock, p->data + p->sent, left);
-
-        if (len != left) {
-            if (len > 0) {
-                p->sent += len;
-            }
-
-            break;
-        }
-
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
-    }
-
-    con->priority_queue_start = p;
-
-    if (!p) {
-        con->priority_queue_end = nullptr;
-        return 0;
-    }
-
-    return -1;
+    return tcp_send_buffer_flush(&con->send_buffer, con->sock);
 }
 
-/* return 0 on failure (only if malloc fails)
- * return 1 on success
- */
-static bool client_add_priority(TCP_Client_Connection *con, const uint8_t *packet, uint16_t size, uint16_t sent)
+void tcp_con_set_coalescing(TCP_Client_Connection *con, bool coalesce)
 {
-    TCP_Priority_List *p = con->priority_queue_end;
-    TCP_Priority_List *new_list = (TCP_Priority_List *)malloc(sizeof(TCP_Priority_List) + size);
+    con->coalesce = coalesce;
 
-    if (!new_list) {
-        return 0;
+    if (!coalesce) {
+        client_send_pending_data(con);
     }
-
-    new_list->next = nullptr;
-    new_list->size = size;
-    new_list->sent = sent;
-    memcpy(new_list->data, packet, size);
-
-    if (p) {
-        p->next = new_list;
-    } else {
-        con->priority_queue_start = new_list;
-    }
-
-    con->priority_queue_end = new_list;
-    return 1;
 }
 
 /* return 1 on success.
@@ -426,62 +399,27 @@ static bool client_add_priority(TCP_Client_Connection *con, const uint8_t *packe
 static int write_packet_TCP_client_secure_connection(TCP_Client_Connection *con, const uint8_t *data, uint16_t length,
         bool priority)
 {
-    if (length + CRYPTO_MAC_SIZE > MAX_PACKET_SIZE) {
-        return -1;
-    }
-
-    bool sendpriority = 1;
-
-    if (client_send_pending_data(con) == -1) {
-        if (priority) {
-            sendpriority = 0;
-        } else {
+    /* finish sending current non-priority packet */
+    if (client_send_pending_data_nonpriority(con) == -1) {
+        if (!priority) {
             return 0;
         }
-    }
-
-    VLA(uint8_t, packet, sizeof(uint16_t) + length + CRYPTO_MAC_SIZE);
-
-    uint16_t c_length = net_htons(length + CRYPTO_MAC_SIZE);
-    memcpy(packet, &c_length, sizeof(uint16_t));
-    int len = encrypt_data_symmetric(con->shared_key, con->sent_nonce, data, length, packet + sizeof(uint16_t));
-
-    if ((unsigned int)len != (SIZEOF_VLA(packet) - sizeof(uint16_t))) {
-        return -1;
-    }
-
-    if (priority) {
-        len = sendpriority ? net_send(con->sock, packet, SIZEOF_VLA(packet)) : 0;
-
-        if (len <= 0) {
-            len = 0;
-        }
 
-        increment_nonce(con->sent_nonce);
+        // Nothing may overtake last_packet, so the rest of it heads the queue.
+        // The queue is empty while last_packet is pending.
+        const uint16_t left = con->last_packet_length - con->last_packet_sent;
 
-        if ((unsigned int)len == SIZEOF_VLA(packet)) {
-            return 1;
+        if (!tcp_send_buffer_push(&con->send_buffer, con->last_packet + con->last_packet_sent, left)) {
+            return 0;
         }
 
-        return client_add_priority(con, packet, SIZEOF_VLA(packet), len);
-    }
-
-    len = net_send(con->sock, packet, SIZEOF_VLA(packet));
-
-    if (len <= 0) {
-        return 0;
-    }
-
-    increment_nonce(con->sent_nonce);
-
-    if ((unsigned int)len == SIZEOF_VLA(packet)) {
-        return 1;
+        con->send_buffer.blocked = true;
+        con->last_packet_length = 0;
+        con->last_packet_sent = 0;
     }
 
-    memcpy(con->last_packet, packet, SIZEOF_VLA(packet));
-    con->last_packet_length = SIZEOF_VLA(packet);
-    con->last_packet_sent = len;
-    return 1;
+    return send_packet_TCP_secure_connection(&con->send_buffer, con->sock, con->shared_key, con->sent_nonce, data,
+            length, priority, con->coalesce);
 }
 
 /* return 1 on success.
@@ -1064,7 +1002,7 @@ void kill_TCP_connection(TCP_Client_Connection *tcp_connection)
         return;
     }
 
-    wipe_priority_list(tcp_connection->priority_queue_start);
+    tcp_send_buffer_free(&tcp_connection->send_buffer);
     kill_sock(tcp_connection->sock);
     crypto_memzero(tcp_connection, sizeof(TCP_Client_Connection));
     free(tcp_connection);
@@ -56,6 +56,17 @@ typedef struct TCP_Client_Connection TCP_Client_Connection;
 const uint8_t *tcp_con_public_key(const TCP_Client_Connection *con);
 IP_Port tcp_con_ip_port(const TCP_Client_Connection *con);
 TCP_Client_Status tcp_con_status(const TCP_Client_Connection *con);
+Socket tcp_con_sock(const TCP_Client_Connection *con);
+/* return true if data is queued until the socket becomes writable. */
+bool tcp_con_send_pending(const TCP_Client_Connection *con);
+/* Set the most bytes con queues until the socket becomes writable, 0 for
+ * TCP_SEND_BUFFER_DEFAULT_LIMIT. Packets that would go over are refused.
+ */
+void tcp_con_set_send_buffer_limit(TCP_Client_Connection *con, uint32_t limit);
+/* While coalesce is set, packets are only queued, to go out together when it
+ * is cleared or the connection is next serviced.
+ */
+void tcp_con_set_coalescing(TCP_Client_Connection *con, bool coalesce);
 
 void *tcp_con_custom_object(const TCP_Client_Connection *con);
 uint32_t tcp_con_custom_uint(const TCP_Client_Connection *con);
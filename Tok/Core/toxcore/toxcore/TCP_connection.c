@@ -1413,49 +1413,56 @@ TCP_Connections *new_tcp_connections(Mono_Time *mono_time, const uint8_t *secret
     return temp;
 }
 
-static void do_tcp_conns(TCP_Connections *tcp_c, void *userdata)
+static void do_tcp_conn(TCP_Connections *tcp_c, unsigned int i, void *userdata)
 {
-    unsigned int i;
-
-    for (i = 0; i < tcp_c->tcp_connections_length; ++i) {
-        TCP_con *tcp_con = get_tcp_connection(tcp_c, i);
+    TCP_con *tcp_con = get_tcp_connection(tcp_c, i);
 
-        if (tcp_con) {
-            if (tcp_con->status != TCP_CONN_SLEEPING) {
-                do_TCP_connection(tcp_c->mono_time, tcp_con->connection, userdata);
+    if (!tcp_con) {
+        return;
+    }
 
-                /* callbacks can change TCP connection address. */
-                tcp_con = get_tcp_connection(tcp_c, i);
+    if (tcp_con->status != TCP_CONN_SLEEPING) {
+        do_TCP_connection(tcp_c->mono_time, tcp_con->connection, userdata);
 
-                // Make sure the TCP connection wasn't dropped in any of the callbacks.
-                assert(tcp_con != nullptr);
+        /* callbacks can change TCP connection address. */
+        tcp_con = get_tcp_connection(tcp_c, i);
 
-                if (tcp_con_status(tcp_con->connection) == TCP_CLIENT_DISCONNECTED) {
-                    if (tcp_con->status == TCP_CONN_CONNECTED) {
-                        reconnect_tcp_relay_connection(tcp_c, i);
-                    } else {
-                        kill_tcp_relay_connection(tcp_c, i);
-                    }
+        // Make sure the TCP connection wasn't dropped in any of the callbacks.
+        assert(tcp_con != nullptr);
 
-                    continue;
-                }
+        if (tcp_con_status(tcp_con->connection) == TCP_CLIENT_DISCONNECTED) {
+            if (tcp_con->status == TCP_CONN_CONNECTED) {
+                reconnect_tcp_relay_connection(tcp_c, i);
+            } else {
+                kill_tcp_relay_connection(tcp_c, i);
+            }
 
-                if (tcp_con->status == TCP_CONN_VALID && tcp_con_status(tcp_con->connection) == TCP_CLIENT_CONFIRMED) {
-                    tcp_relay_on_online(tcp_c, i);
-                }
+            return;
+        }
 
-                if (tcp_con->status == TCP_CONN_CONNECTED && !tcp_con->onion && tcp_con->lock_count
-                        && tcp_con->lock_count == tcp_con->sleep_count
-                        && mono_time_is_timeout(tcp_c->mono_time, tcp_con->connected_time, TCP_CONNECTION_ANNOUNCE_TIMEOUT)) {
-                    sleep_tcp_relay_connection(tcp_c, i);
-                }
-            }
+        if (tcp_con->status == TCP_CONN_VALID && tcp_con_status(tcp_con->connection) == TCP_CLIENT_CONFIRMED) {
+            tcp_relay_on_online(tcp_c, i);
+        }
 
-            if (tcp_con->status == TCP_CONN_SLEEPING && tcp_con->unsleep) {
-                unsleep_tcp_relay_connection(tcp_c, i);
-            }
+        if (tcp_con->status == TCP_CONN_CONNECTED && !tcp_con->onion && tcp_con->lock_count
+                && tcp_con->lock_count == tcp_con->sleep_count
+                && mono_time_is_timeout(tcp_c->mono_time, tcp_con->connected_time, TCP_CONNECTION_ANNOUNCE_TIMEOUT)) {
+            sleep_tcp_relay_connection(tcp_c, i);
         }
     }
+
+    if (tcp_con->status == TCP_CONN_SLEEPING && tcp_con->unsleep) {
+        unsleep_tcp_relay_connection(tcp_c, i);
+    }
+}
+
+static void do_tcp_conns(TCP_Connections *tcp_c, void *userdata)
+{
+    unsigned int i;
+
+    for (i = 0; i < tcp_c->tcp_connections_length; ++i) {
+        do_tcp_conn(tcp_c, i, userdata);
+    }
 }
 
 static void kill_nonused_tcp(TCP_Connections *tcp_c)
@@ -1500,6 +1507,61 @@ static void kill_nonused_tcp(TCP_Connections *tcp_c)
     }
 }
 
+uint32_t tcp_connections_sockets(const TCP_Connections *tcp_c, Socket *socks, bool *want_write, uint32_t max_socks)
+{
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < tcp_c->tcp_connections_length; ++i) {
+        const TCP_con *tcp_con = get_tcp_connection(tcp_c, i);
+
+        if (!tcp_con || tcp_con->status == TCP_CONN_SLEEPING) {
+            continue;
+        }
+
+        if (count < max_socks) {
+            socks[count] = tcp_con_sock(tcp_con->connection);
+            want_write[count] = tcp_con_send_pending(tcp_con->connection);
+        }
+
+        ++count;
+    }
+
+    return count;
+}
+
+void tcp_connections_set_coalescing(TCP_Connections *tcp_c, bool coalesce)
+{
+    for (uint32_t i = 0; i < tcp_c->tcp_connections_length; ++i) {
+        const TCP_con *tcp_con = get_tcp_connection(tcp_c, i);
+
+        if (!tcp_con || tcp_con->status == TCP_CONN_SLEEPING) {
+            continue;
+        }
+
+        tcp_con_set_coalescing(tcp_con->connection, coalesce);
+    }
+}
+
+void do_tcp_connections_ready(TCP_Connections *tcp_c, const Socket *ready, uint32_t num_ready, void *userdata)
+{
+    for (uint32_t i = 0; i < tcp_c->tcp_connections_length; ++i) {
+        const TCP_con *tcp_con = get_tcp_connection(tcp_c, i);
+
+        if (!tcp_con || tcp_con->status == TCP_CONN_SLEEPING) {
+            continue;
+        }
+
+        const Socket sock = tcp_con_sock(tcp_con->connection);
+
+        for (uint32_t j = 0; j < num_ready; ++j) {
+            if (ready[j].socket == sock.socket) {
+                do_tcp_conn(tcp_c, i, userdata);
+                break;
+            }
+        }
+    }
+}
+
 void do_tcp_connections(TCP_Connections *tcp_c, void *userdata)
 {
     do_tcp_conns(tcp_c, userdata);
@@ -221,6 +221,23 @@ uint32_t tcp_copy_connected_relays(TCP_Connections *tcp_c, Node_format *tcp_rela
  */
 TCP_Connections *new_tcp_connections(Mono_Time *mono_time, const uint8_t *secret_key, TCP_Proxy_Info *proxy_info);
 
+/* Copy up to max_socks of the sockets of the awake TCP relay connections to socks.
+ * want_write[i] is set if socks[i] has data queued for sending.
+ *
+ * return the total number of sockets.
+ */
+uint32_t tcp_connections_sockets(const TCP_Connections *tcp_c, Socket *socks, bool *want_write, uint32_t max_socks);
+
+/* While coalesce is set, packets for the TCP relays are only queued, to go out
+ * one write per relay when it is cleared.
+ */
+void tcp_connections_set_coalescing(TCP_Connections *tcp_c, bool coalesce);
+
+/* Like do_tcp_connections, but only service the relay connections whose
+ * socket is in ready. Timeouts and pings are left to do_tcp_connections.
+ */
+void do_tcp_connections_ready(TCP_Connections *tcp_c, const Socket *ready, uint32_t num_ready, void *userdata);
+
 void do_tcp_connections(TCP_Connections *tcp_c, void *userdata);
 void kill_tcp_connections(TCP_Connections *tcp_c);
 
@@ -35,7 +35,9 @@
 #endif
 
 #ifdef TCP_SERVER_USE_EPOLL
+#include <pthread.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #endif
 
@@ -47,6 +49,7 @@
 #define TCP_SOCKET_INCOMING 1
 #define TCP_SOCKET_UNCONFIRMED 2
 #define TCP_SOCKET_CONFIRMED 3
+#define TCP_SOCKET_WAKE 4
 #endif
 
 typedef struct TCP_Secure_Conn {
@@ -55,6 +58,7 @@ typedef struct TCP_Secure_Conn {
     // TODO(iphydf): Add an enum for this (same as in TCP_client.c, probably).
     uint8_t status; /* 0 if not used, 1 if other is offline, 2 if other is online. */
     uint8_t other_id;
+    uint16_t shard; /* shard that owns the other connection if status is 2. */
 } TCP_Secure_Conn;
 
 typedef struct TCP_Secure_Connection {
@@ -65,13 +69,11 @@ typedef struct TCP_Secure_Connection {
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
     uint16_t next_packet_length;
     TCP_Secure_Conn connections[NUM_CLIENT_CONNECTIONS];
-    uint8_t last_packet[2 + MAX_PACKET_SIZE];
     uint8_t status;
-    uint16_t last_packet_length;
-    uint16_t last_packet_sent;
 
-    TCP_Priority_List *priority_queue_start;
-    TCP_Priority_List *priority_queue_end;
+    TCP_Send_Buffer send_buffer;
+    bool recv_paused; /* Not read from until send_buffer drains. */
+    bool flush_queued; /* In the server's flushes. */
 
     uint64_t identifier;
 
@@ -79,6 +81,71 @@ typedef struct TCP_Secure_Connection {
     uint64_t ping_id;
 } TCP_Secure_Connection;
 
+#ifdef TCP_SERVER_USE_EPOLL
+/* Messages between the shards of a sharded server, and between the shards and
+ * the thread running do_TCP_server, which owns the onion.
+ */
+typedef enum TCP_Shard_Msg_Type {
+    TCP_SHARD_MSG_HANDOFF,          /* con confirmed and belongs to the receiving shard. */
+    TCP_SHARD_MSG_LINK,             /* routing request of other_index for public_key. */
+    TCP_SHARD_MSG_LINKED,           /* index/id is now linked to other_index/other_id. */
+    TCP_SHARD_MSG_UNLINK,           /* other_index/other_id dropped its link to index/id. */
+    TCP_SHARD_MSG_DATA,             /* data to send to index if still linked. */
+    TCP_SHARD_MSG_OOB,              /* OOB packet from other_public_key to public_key. */
+    TCP_SHARD_MSG_ONION_REQUEST,    /* onion request of other_index, for the onion. */
+    TCP_SHARD_MSG_ONION_RESPONSE,   /* onion response for index. */
+} TCP_Shard_Msg_Type;
+
+typedef struct TCP_Shard_Msg TCP_Shard_Msg;
+
+struct TCP_Shard_Msg {
+    TCP_Shard_Msg *next;
+    uint8_t type;
+    uint16_t from;
+
+    /* Connection on the receiving shard and on the sending one. */
+    uint32_t index;
+    uint8_t id;
+    uint32_t other_index;
+    uint8_t other_id;
+
+    uint64_t identifier;
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t other_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    TCP_Secure_Connection *con;
+
+    uint16_t length;
+    uint8_t data[];
+};
+
+#define TCP_SHARD_QUEUE_SIZE 1024
+/* How many packets may wait in an outbox before more are dropped. About what
+ * the socket buffer of a connection on the same shard would take. */
+#define TCP_SHARD_MAX_OVERFLOW 8192
+#define TCP_SHARD_CACHE_LINE 64
+
+/* Single-producer single-consumer ring of messages from one shard to another.
+ * head is only written by the consumer and tail only by the producer.
+ */
+typedef struct TCP_Shard_Queue {
+    TCP_Shard_Msg *msgs[TCP_SHARD_QUEUE_SIZE];
+    uint32_t head;
+    uint8_t head_padding[TCP_SHARD_CACHE_LINE - sizeof(uint32_t)];
+    uint32_t tail;
+    uint8_t tail_padding[TCP_SHARD_CACHE_LINE - sizeof(uint32_t)];
+} TCP_Shard_Queue;
+
+/* Messages to one shard that did not fit in its queue. They are moved over in
+ * order once there is room, and later messages wait behind them.
+ */
+typedef struct TCP_Shard_Outbox {
+    TCP_Shard_Msg *overflow_start;
+    TCP_Shard_Msg *overflow_end;
+    uint32_t overflow_count;
+    bool wake;
+} TCP_Shard_Outbox;
+#endif
+
 
 struct TCP_Server {
     Onion *onion;
@@ -86,6 +153,22 @@ struct TCP_Server {
 #ifdef TCP_SERVER_USE_EPOLL
     int efd;
     uint64_t last_run_pinged;
+
+    /* Sharded mode: each shard is a TCP_Server of its own, run by a worker
+     * thread, and the parent only relays onion packets between its shards and
+     * the onion. Shards are numbered from 0 and the parent is num_shards.
+     */
+    TCP_Server *parent;
+    TCP_Server **shards;
+    uint16_t num_shards;
+    uint16_t shard_id;
+    uint64_t shard_seed; /* Keys clients choose can't pick their shard. */
+    TCP_Shard_Queue *queues;
+    TCP_Shard_Outbox *outbox;
+    int wake_fd;
+    Mono_Time *mono_time;
+    pthread_t thread;
+    bool running;
 #endif
     Socket *socks_listening;
     unsigned int num_listening_socks;
@@ -103,6 +186,18 @@ struct TCP_Server {
 
     uint64_t counter;
 
+    /* Given to connections as they are accepted. */
+    uint32_t send_buffer_limit;
+
+    /* While packets are handled, what they send is only queued, and written
+     * per connection once the batch is done: indexes of accepted connections
+     * with packets queued since.
+     */
+    bool coalesce;
+    uint32_t *flushes;
+    uint32_t num_flushes;
+    uint32_t size_flushes;
+
     BS_List accepted_key_list;
 };
 
@@ -116,12 +211,35 @@ size_t tcp_server_listen_count(const TCP_Server *tcp_server)
     return tcp_server->num_listening_socks;
 }
 
+uint32_t tcp_server_sockets(const TCP_Server *tcp_server, Socket *socks, uint32_t max_socks)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (max_socks > 0) {
+        socks[0].socket = tcp_server->efd;
+    }
+
+    return 1;
+#else
+
+    for (uint32_t i = 0; i < tcp_server->num_listening_socks && i < max_socks; ++i) {
+        socks[i] = tcp_server->socks_listening[i];
+    }
+
+    return tcp_server->num_listening_socks;
+#endif
+}
+
 /* This is needed to compile on Android below API 21
  */
 #ifdef TCP_SERVER_USE_EPOLL
 #ifndef EPOLLRDHUP
 #define EPOLLRDHUP 0x2000
 #endif
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE (1u << 28)
+#endif
 #endif
 
 /* Increase the size of the connection list
@@ -154,19 +272,166 @@ static int alloc_new_connections(TCP_Server *tcp_server, uint32_t num)
     return 0;
 }
 
-void wipe_priority_list(TCP_Priority_List *p)
+/* Smallest ring a send buffer allocates, and the largest it keeps once empty. */
+#define TCP_SEND_BUFFER_INITIAL_SIZE 4096
+
+static uint32_t tcp_send_buffer_limit(const TCP_Send_Buffer *buf)
+{
+    return buf->limit == 0 ? TCP_SEND_BUFFER_DEFAULT_LIMIT : buf->limit;
+}
+
+void tcp_send_buffer_set_limit(TCP_Send_Buffer *buf, uint32_t limit)
+{
+    buf->limit = limit == 0 || limit >= TCP_SEND_BUFFER_MIN_LIMIT ? limit : TCP_SEND_BUFFER_MIN_LIMIT;
+}
+
+bool tcp_send_buffer_fits(const TCP_Send_Buffer *buf, uint32_t length)
+{
+    const uint32_t limit = tcp_send_buffer_limit(buf);
+
+    if (buf->length >= limit) {
+        return false;
+    }
+
+    return length <= limit - buf->length;
+}
+
+bool tcp_send_buffer_congested(const TCP_Send_Buffer *buf)
+{
+    return buf->blocked && buf->length > tcp_send_buffer_limit(buf) / 2;
+}
+
+/* Make room for length bytes, straightening the ring out if it moves. */
+static bool tcp_send_buffer_reserve(TCP_Send_Buffer *buf, uint32_t length)
+{
+    if (length <= buf->size) {
+        return true;
+    }
+
+    uint32_t size = buf->size == 0 ? TCP_SEND_BUFFER_INITIAL_SIZE : buf->size;
+
+    while (size < length) {
+        size *= 2;
+    }
+
+    uint8_t *data = (uint8_t *)malloc(size);
+
+    if (data == nullptr) {
+        return false;
+    }
+
+    if (buf->length != 0) {
+        const uint32_t first = min_u32(buf->length, buf->size - buf->start);
+        memcpy(data, buf->data + buf->start, first);
+        memcpy(data + first, buf->data, buf->length - first);
+    }
+
+    free(buf->data);
+    buf->data = data;
+    buf->size = size;
+    buf->start = 0;
+    return true;
+}
+
+bool tcp_send_buffer_push(TCP_Send_Buffer *buf, const uint8_t *data, uint32_t length)
+{
+    if (!tcp_send_buffer_fits(buf, length) || !tcp_send_buffer_reserve(buf, buf->length + length)) {
+        return false;
+    }
+
+    const uint32_t end = (buf->start + buf->length) & (buf->size - 1);
+    const uint32_t first = min_u32(length, buf->size - end);
+    memcpy(buf->data + end, data, first);
+    memcpy(buf->data, data + first, length - first);
+    buf->length += length;
+    return true;
+}
+
+/* Drop the first length bytes of buf, which the socket took. */
+static void tcp_send_buffer_consume(TCP_Send_Buffer *buf, uint32_t length)
+{
+    buf->start = (buf->start + length) & (buf->size - 1);
+    buf->length -= length;
+}
+
+/* Write buf, then length bytes of data, to sock in one call, and append what
+ * of data the socket didn't take to buf. data must fit in buf.
+ *
+ * return 0 if buf is empty now.
+ * return 1 if it isn't.
+ * return -1 if memory allocation failed.
+ */
+static int tcp_send_buffer_write(TCP_Send_Buffer *buf, Socket sock, const uint8_t *data, uint32_t length)
 {
-    while (p) {
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
+    const uint8_t *bufs[3];
+    size_t lens[3];
+    uint32_t count = 0;
+
+    if (buf->length != 0) {
+        const uint32_t first = min_u32(buf->length, buf->size - buf->start);
+        bufs[count] = buf->data + buf->start;
+        lens[count] = first;
+        ++count;
+
+        if (first != buf->length) {
+            bufs[count] = buf->data;
+            lens[count] = buf->length - first;
+            ++count;
+        }
+    }
+
+    if (length != 0) {
+        bufs[count] = data;
+        lens[count] = length;
+        ++count;
+    }
+
+    const int len = count == 0 ? 0 : net_sendv(sock, bufs, lens, count);
+    uint32_t sent = len > 0 ? (uint32_t)len : 0;
+
+    const uint32_t queued = min_u32(sent, buf->length);
+    tcp_send_buffer_consume(buf, queued);
+    sent -= queued;
+
+    if (sent != length && !tcp_send_buffer_push(buf, data + sent, length - sent)) {
+        return -1;
+    }
+
+    buf->blocked = buf->length != 0;
+
+    if (buf->length != 0) {
+        return 1;
+    }
+
+    buf->start = 0;
+
+    // Rings that grew for a burst go back to the allocator.
+    if (buf->size > TCP_SEND_BUFFER_INITIAL_SIZE) {
+        tcp_send_buffer_free(buf);
     }
+
+    return 0;
+}
+
+int tcp_send_buffer_flush(TCP_Send_Buffer *buf, Socket sock)
+{
+    return tcp_send_buffer_write(buf, sock, nullptr, 0) == 0 ? 0 : -1;
+}
+
+void tcp_send_buffer_free(TCP_Send_Buffer *buf)
+{
+    free(buf->data);
+    buf->data = nullptr;
+    buf->size = 0;
+    buf->start = 0;
+    buf->length = 0;
+    buf->blocked = false;
 }
 
 static void wipe_secure_connection(TCP_Secure_Connection *con)
 {
     if (con->status) {
-        wipe_priority_list(con->priority_queue_start);
+        tcp_send_buffer_free(&con->send_buffer);
         crypto_memzero(con, sizeof(TCP_Secure_Connection));
     }
 }
@@ -383,170 +648,319 @@ int read_packet_TCP_secure_connection(Socket sock, uint16_t *next_packet_length,
     return len;
 }
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
- */
-static int send_pending_data_nonpriority(TCP_Secure_Connection *con)
+int send_packet_TCP_secure_connection(TCP_Send_Buffer *buf, Socket sock, const uint8_t *shared_key,
+                                      uint8_t *sent_nonce, const uint8_t *data, uint16_t length, bool priority, bool coalesce)
 {
-    if (con->last_packet_length == 0) {
+    if (length + CRYPTO_MAC_SIZE > MAX_PACKET_SIZE) {
+        return -1;
+    }
+
+    if (buf->blocked && tcp_send_buffer_flush(buf, sock) == -1 && !priority) {
         return 0;
     }
 
-    const uint16_t left = con->last_packet_length - con->last_packet_sent;
-    const int len = net_send(con->sock, con->last_packet + con->last_packet_sent, left);
+    VLA(uint8_t, packet, sizeof(uint16_t) + length + CRYPTO_MAC_SIZE);
 
-    if (len <= 0) {
-        return -1;
+    // Whatever isn't sent now is queued, so it has to fit before it takes a
+    // nonce. A batch that filled buf goes out early.
+    if (!tcp_send_buffer_fits(buf, SIZEOF_VLA(packet)) && !buf->blocked) {
+        tcp_send_buffer_flush(buf, sock);
     }
 
-    if (len == left) {
-        con->last_packet_length = 0;
-        con->last_packet_sent = 0;
+    if (!tcp_send_buffer_fits(buf, SIZEOF_VLA(packet))) {
         return 0;
     }
 
-    con->last_packet_sent += len;
-    return -1;
-}
+    const uint16_t c_length = net_htons(length + CRYPTO_MAC_SIZE);
+    memcpy(packet, &c_length, sizeof(uint16_t));
+    const int len = encrypt_data_symmetric(shared_key, sent_nonce, data, length, packet + sizeof(uint16_t));
 
-/* return 0 if pending data was sent completely
- * return -1 if it wasn't
- */
-static int send_pending_data(TCP_Secure_Connection *con)
-{
-    /* finish sending current non-priority packet */
-    if (send_pending_data_nonpriority(con) == -1) {
+    if ((unsigned int)len != (SIZEOF_VLA(packet) - sizeof(uint16_t))) {
         return -1;
     }
 
-    TCP_Priority_List *p = con->priority_queue_start;
+    increment_nonce(sent_nonce);
 
-    while (p) {
-        const uint16_t left = p->size - p->sent;
-        const int len = net_send(con->sock, p->data + p->sent, left);
+    // The rest of the stream depends on this packet now.
+    if (coalesce || buf->blocked) {
+        return tcp_send_buffer_push(buf, packet, SIZEOF_VLA(packet)) ? 1 : -1;
+    }
 
-        if (len != left) {
-            if (len > 0) {
-                p->sent += len;
-            }
+    return tcp_send_buffer_write(buf, sock, packet, SIZEOF_VLA(packet)) == -1 ? -1 : 1;
+}
 
-            break;
+/* Remember to flush con once the packets being handled are all written. */
+static void tcp_server_queue_flush(TCP_Server *tcp_server, TCP_Secure_Connection *con)
+{
+    if (con->flush_queued) {
+        return;
+    }
+
+    if (tcp_server->num_flushes == tcp_server->size_flushes) {
+        const uint32_t new_size = tcp_server->size_flushes == 0 ? 64 : tcp_server->size_flushes * 2;
+        uint32_t *flushes = (uint32_t *)realloc(tcp_server->flushes, new_size * sizeof(uint32_t));
+
+        if (flushes == nullptr) {
+            tcp_send_buffer_flush(&con->send_buffer, con->sock);
+            return;
         }
 
-        TCP_Priority_List *pp = p;
-        p = p->next;
-        free(pp);
+        tcp_server->flushes = flushes;
+        tcp_server->size_flushes = new_size;
     }
 
-    con->priority_queue_start = p;
+    con->flush_queued = true;
+    tcp_server->flushes[tcp_server->num_flushes] = con - tcp_server->accepted_connection_array;
+    ++tcp_server->num_flushes;
+}
 
-    if (!p) {
-        con->priority_queue_end = nullptr;
-        return 0;
+/* Write what the packets handled since the last call queued, one call per
+ * connection.
+ */
+static void tcp_server_flush(TCP_Server *tcp_server)
+{
+    for (uint32_t i = 0; i < tcp_server->num_flushes; ++i) {
+        const uint32_t index = tcp_server->flushes[i];
+
+        if (index >= tcp_server->size_accepted_connections) {
+            continue;
+        }
+
+        TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[index];
+
+        // Killed, or even replaced, since.
+        if (!con->flush_queued) {
+            continue;
+        }
+
+        con->flush_queued = false;
+        tcp_send_buffer_flush(&con->send_buffer, con->sock);
     }
 
-    return -1;
+    tcp_server->num_flushes = 0;
 }
 
-/* return 0 on failure (only if malloc fails)
- * return 1 on success
+/* con must be one of the accepted connections.
+ *
+ * return 1 on success.
+ * return 0 if could not send packet.
+ * return -1 on failure (connection must be killed).
  */
-static bool add_priority(TCP_Secure_Connection *con, const uint8_t *packet, uint16_t size, uint16_t sent)
+static int write_packet_TCP_secure_connection(TCP_Server *tcp_server, TCP_Secure_Connection *con, const uint8_t *data,
+        uint16_t length, bool priority)
 {
-    TCP_Priority_List *p = con->priority_queue_end;
-    TCP_Priority_List *new_list = (TCP_Priority_List *)malloc(sizeof(TCP_Priority_List) + size);
+    const int ret = send_packet_TCP_secure_connection(&con->send_buffer, con->sock, con->shared_key, con->sent_nonce,
+                    data, length, priority, tcp_server->coalesce);
 
-    if (!new_list) {
-        return 0;
+    if (ret == 1 && tcp_server->coalesce && !con->send_buffer.blocked && con->send_buffer.length != 0) {
+        tcp_server_queue_flush(tcp_server, con);
     }
 
-    new_list->next = nullptr;
-    new_list->size = size;
-    new_list->sent = sent;
-    memcpy(new_list->data, packet, size);
+    return ret;
+}
 
-    if (p) {
-        p->next = new_list;
-    } else {
-        con->priority_queue_start = new_list;
+/* Kill a TCP_Secure_Connection
+ */
+static void kill_TCP_secure_connection(TCP_Secure_Connection *con)
+{
+    if (con->status == TCP_STATUS_NO_STATUS) {
+        return;
     }
 
-    con->priority_queue_end = new_list;
-    return 1;
+    kill_sock(con->sock);
+    wipe_secure_connection(con);
 }
 
-/* return 1 on success.
- * return 0 if could not send packet.
- * return -1 on failure (connection must be killed).
+static uint16_t tcp_server_shard_id(const TCP_Server *tcp_server)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+    return tcp_server->shard_id;
+#else
+    return 0;
+#endif
+}
+
+#ifdef TCP_SERVER_USE_EPOLL
+static TCP_Server *tcp_shard_root(TCP_Server *tcp_server)
+{
+    return tcp_server->parent ? tcp_server->parent : tcp_server;
+}
+
+/* return the shard that owns the connection of public_key.
  */
-static int write_packet_TCP_secure_connection(TCP_Secure_Connection *con, const uint8_t *data, uint16_t length,
-        bool priority)
+static uint16_t tcp_shard_of_key(const TCP_Server *root, const uint8_t *public_key)
 {
-    if (length + CRYPTO_MAC_SIZE > MAX_PACKET_SIZE) {
-        return -1;
+    uint64_t h = root->shard_seed;
+
+    for (uint32_t i = 0; i < CRYPTO_PUBLIC_KEY_SIZE; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, public_key + i, sizeof(word));
+        h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 32;
     }
 
-    bool sendpriority = 1;
+    return h % root->num_shards;
+}
 
-    if (send_pending_data(con) == -1) {
-        if (priority) {
-            sendpriority = 0;
-        } else {
-            return 0;
-        }
+/* return true if connections of public_key are owned by another shard than
+ * this one.
+ */
+static bool tcp_shard_is_remote(const TCP_Server *tcp_server, const uint8_t *public_key)
+{
+    return tcp_server->parent != nullptr && tcp_shard_of_key(tcp_server->parent, public_key) != tcp_server->shard_id;
+}
+
+/* With data nullptr, the length bytes of data are left zeroed for the caller
+ * to fill in.
+ */
+static TCP_Shard_Msg *tcp_shard_msg_new(uint8_t type, const uint8_t *data, uint16_t length)
+{
+    TCP_Shard_Msg *msg = (TCP_Shard_Msg *)calloc(1, sizeof(TCP_Shard_Msg) + length);
+
+    if (msg == nullptr) {
+        return nullptr;
     }
 
-    VLA(uint8_t, packet, sizeof(uint16_t) + length + CRYPTO_MAC_SIZE);
+    msg->type = type;
+    msg->length = length;
 
-    const uint16_t c_length = net_htons(length + CRYPTO_MAC_SIZE);
-    memcpy(packet, &c_length, sizeof(uint16_t));
-    int len = encrypt_data_symmetric(con->shared_key, con->sent_nonce, data, length, packet + sizeof(uint16_t));
+    if (data != nullptr) {
+        memcpy(msg->data, data, length);
+    }
 
-    if ((unsigned int)len != (SIZEOF_VLA(packet) - sizeof(uint16_t))) {
-        return -1;
+    return msg;
+}
+
+static void tcp_shard_msg_free(TCP_Shard_Msg *msg)
+{
+    if (msg->con != nullptr) {
+        kill_TCP_secure_connection(msg->con);
+        free(msg->con);
     }
 
-    if (priority) {
-        len = sendpriority ? net_send(con->sock, packet, SIZEOF_VLA(packet)) : 0;
+    free(msg);
+}
 
-        if (len <= 0) {
-            len = 0;
-        }
+static TCP_Shard_Queue *tcp_shard_queue(TCP_Server *root, uint16_t from, uint16_t to)
+{
+    return &root->queues[from * (root->num_shards + 1) + to];
+}
 
-        increment_nonce(con->sent_nonce);
+static bool tcp_shard_queue_push(TCP_Shard_Queue *queue, TCP_Shard_Msg *msg)
+{
+    const uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
 
-        if ((unsigned int)len == SIZEOF_VLA(packet)) {
-            return 1;
-        }
+    if (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == TCP_SHARD_QUEUE_SIZE) {
+        return false;
+    }
+
+    queue->msgs[tail % TCP_SHARD_QUEUE_SIZE] = msg;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
 
-        return add_priority(con, packet, SIZEOF_VLA(packet), len);
+static TCP_Shard_Msg *tcp_shard_queue_pop(TCP_Shard_Queue *queue)
+{
+    const uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+    if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+        return nullptr;
     }
 
-    len = net_send(con->sock, packet, SIZEOF_VLA(packet));
+    TCP_Shard_Msg *msg = queue->msgs[head % TCP_SHARD_QUEUE_SIZE];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return msg;
+}
 
-    if (len <= 0) {
-        return 0;
+/* Send msg to shard to, taking ownership of it.
+ *
+ * A packet (droppable) is dropped when the outbox is full too, like it would
+ * be when the socket of its connection is. Anything else always waits in the
+ * outbox.
+ *
+ * return true if msg was or will be delivered.
+ */
+static bool tcp_shard_send(TCP_Server *tcp_server, uint16_t to, TCP_Shard_Msg *msg, bool droppable)
+{
+    if (msg == nullptr) {
+        return false;
     }
 
-    increment_nonce(con->sent_nonce);
+    TCP_Shard_Outbox *outbox = &tcp_server->outbox[to];
+    msg->from = tcp_server->shard_id;
 
-    if ((unsigned int)len == SIZEOF_VLA(packet)) {
-        return 1;
+    if (outbox->overflow_start == nullptr
+            && tcp_shard_queue_push(tcp_shard_queue(tcp_shard_root(tcp_server), tcp_server->shard_id, to), msg)) {
+        outbox->wake = true;
+        return true;
     }
 
-    memcpy(con->last_packet, packet, SIZEOF_VLA(packet));
-    con->last_packet_length = SIZEOF_VLA(packet);
-    con->last_packet_sent = len;
-    return 1;
+    if (droppable && outbox->overflow_count >= TCP_SHARD_MAX_OVERFLOW) {
+        tcp_shard_msg_free(msg);
+        return false;
+    }
+
+    msg->next = nullptr;
+    ++outbox->overflow_count;
+
+    if (outbox->overflow_end != nullptr) {
+        outbox->overflow_end->next = msg;
+    } else {
+        outbox->overflow_start = msg;
+    }
+
+    outbox->overflow_end = msg;
+    return true;
 }
 
-/* Kill a TCP_Secure_Connection
+static bool tcp_shard_overflowing(const TCP_Server *tcp_server, uint16_t num_nodes)
+{
+    for (uint16_t i = 0; i < num_nodes; ++i) {
+        if (tcp_server->outbox[i].overflow_start != nullptr) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void tcp_shard_wake(int wake_fd)
+{
+    const uint64_t one = 1;
+
+    if (write(wake_fd, &one, sizeof(one)) != sizeof(one)) {
+        // The counter is only full if the shard has plenty of wakeups pending.
+    }
+}
+
+/* Move what fits of the outboxes into the queues and wake up the shards that
+ * got messages since the last call.
  */
-static void kill_TCP_secure_connection(TCP_Secure_Connection *con)
+static void tcp_shard_flush(TCP_Server *tcp_server)
 {
-    kill_sock(con->sock);
-    wipe_secure_connection(con);
+    TCP_Server *root = tcp_shard_root(tcp_server);
+
+    for (uint16_t to = 0; to <= root->num_shards; ++to) {
+        TCP_Shard_Outbox *outbox = &tcp_server->outbox[to];
+        TCP_Shard_Queue *queue = tcp_shard_queue(root, tcp_server->shard_id, to);
+
+        while (outbox->overflow_start != nullptr && tcp_shard_queue_push(queue, outbox->overflow_start)) {
+            outbox->overflow_start = outbox->overflow_start->next;
+            --outbox->overflow_count;
+            outbox->wake = true;
+        }
+
+        if (outbox->overflow_start == nullptr) {
+            outbox->overflow_end = nullptr;
+        }
+
+        if (outbox->wake) {
+            outbox->wake = false;
+            tcp_shard_wake(to == root->num_shards ? root->wake_fd : root->shards[to]->wake_fd);
+        }
+    }
 }
+#endif
 
 static int rm_connection_index(TCP_Server *tcp_server, TCP_Secure_Connection *con, uint8_t con_number);
 
@@ -648,34 +1062,34 @@ static int read_connection_handshake(TCP_Secure_Connection *con, const uint8_t *
  * return 0 if could not send packet.
  * return -1 on failure (connection must be killed).
  */
-static int send_routing_response(TCP_Secure_Connection *con, uint8_t rpid, const uint8_t *public_key)
+static int send_routing_response(TCP_Server *tcp_server, TCP_Secure_Connection *con, uint8_t rpid, const uint8_t *public_key)
 {
     uint8_t data[1 + 1 + CRYPTO_PUBLIC_KEY_SIZE];
     data[0] = TCP_PACKET_ROUTING_RESPONSE;
     data[1] = rpid;
     memcpy(data + 2, public_key, CRYPTO_PUBLIC_KEY_SIZE);
 
-    return write_packet_TCP_secure_connection(con, data, sizeof(data), 1);
+    return write_packet_TCP_secure_connection(tcp_server, con, data, sizeof(data), 1);
 }
 
 /* return 1 on success.
  * return 0 if could not send packet.
  * return -1 on failure (connection must be killed).
  */
-static int send_connect_notification(TCP_Secure_Connection *con, uint8_t id)
+static int send_connect_notification(TCP_Server *tcp_server, TCP_Secure_Connection *con, uint8_t id)
 {
     uint8_t data[2] = {TCP_PACKET_CONNECTION_NOTIFICATION, (uint8_t)(id + NUM_RESERVED_PORTS)};
-    return write_packet_TCP_secure_connection(con, data, sizeof(data), 1);
+    return write_packet_TCP_secure_connection(tcp_server, con, data, sizeof(data), 1);
 }
 
 /* return 1 on success.
  * return 0 if could not send packet.
  * return -1 on failure (connection must be killed).
  */
-static int send_disconnect_notification(TCP_Secure_Connection *con, uint8_t id)
+static int send_disconnect_notification(TCP_Server *tcp_server, TCP_Secure_Connection *con, uint8_t id)
 {
     uint8_t data[2] = {TCP_PACKET_DISCONNECT_NOTIFICATION, (uint8_t)(id + NUM_RESERVED_PORTS)};
-    return write_packet_TCP_secure_connection(con, data, sizeof(data), 1);
+    return write_packet_TCP_secure_connection(tcp_server, con, data, sizeof(data), 1);
 }
 
 /* return 0 on success.
@@ -689,7 +1103,7 @@ static int handle_TCP_routing_req(TCP_Server *tcp_server, uint32_t con_id, const
 
     /* If person tries to cennect to himself we deny the request*/
     if (public_key_cmp(con->public_key, public_key) == 0) {
-        if (send_routing_response(con, 0, public_key) == -1) {
+        if (send_routing_response(tcp_server, con, 0, public_key) == -1) {
             return -1;
         }
 
@@ -699,7 +1113,7 @@ static int handle_TCP_routing_req(TCP_Server *tcp_server, uint32_t con_id, const
     for (i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
         if (con->connections[i].status != 0) {
             if (public_key_cmp(public_key, con->connections[i].public_key) == 0) {
-                if (send_routing_response(con, i + NUM_RESERVED_PORTS, public_key) == -1) {
+                if (send_routing_response(tcp_server, con, i + NUM_RESERVED_PORTS, public_key) == -1) {
                     return -1;
                 }
 
@@ -711,14 +1125,14 @@ static int handle_TCP_routing_req(TCP_Server *tcp_server, uint32_t con_id, const
     }
 
     if (index == (uint32_t)~0) {
-        if (send_routing_response(con, 0, public_key) == -1) {
+        if (send_routing_response(tcp_server, con, 0, public_key) == -1) {
             return -1;
         }
 
         return 0;
     }
 
-    int ret = send_routing_response(con, index + NUM_RESERVED_PORTS, public_key);
+    int ret = send_routing_response(tcp_server, con, index + NUM_RESERVED_PORTS, public_key);
 
     if (ret == 0) {
         return 0;
@@ -730,6 +1144,24 @@ static int handle_TCP_routing_req(TCP_Server *tcp_server, uint32_t con_id, const
 
     con->connections[index].status = 1;
     memcpy(con->connections[index].public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (tcp_shard_is_remote(tcp_server, public_key)) {
+        TCP_Shard_Msg *msg = tcp_shard_msg_new(TCP_SHARD_MSG_LINK, nullptr, 0);
+
+        if (msg != nullptr) {
+            msg->other_index = con_id;
+            msg->other_id = index;
+            memcpy(msg->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+            memcpy(msg->other_public_key, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        }
+
+        tcp_shard_send(tcp_server, tcp_shard_of_key(tcp_server->parent, public_key), msg, false);
+        return 0;
+    }
+
+#endif
     int other_index = get_TCP_connection_index(tcp_server, public_key);
 
     if (other_index != -1) {
@@ -748,12 +1180,14 @@ static int handle_TCP_routing_req(TCP_Server *tcp_server, uint32_t con_id, const
             con->connections[index].status = 2;
             con->connections[index].index = other_index;
             con->connections[index].other_id = other_id;
+            con->connections[index].shard = tcp_server_shard_id(tcp_server);
             other_conn->connections[other_id].status = 2;
             other_conn->connections[other_id].index = con_id;
             other_conn->connections[other_id].other_id = index;
+            other_conn->connections[other_id].shard = tcp_server_shard_id(tcp_server);
             // TODO(irungentoo): return values?
-            send_connect_notification(con, index);
-            send_connect_notification(other_conn, other_id);
+            send_connect_notification(tcp_server, con, index);
+            send_connect_notification(tcp_server, other_conn, other_id);
         }
     }
 
@@ -772,14 +1206,29 @@ static int handle_TCP_oob_send(TCP_Server *tcp_server, uint32_t con_id, const ui
 
     TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[con_id];
 
-    int other_index = get_TCP_connection_index(tcp_server, public_key);
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (tcp_shard_is_remote(tcp_server, public_key)) {
+        TCP_Shard_Msg *msg = tcp_shard_msg_new(TCP_SHARD_MSG_OOB, data, length);
+
+        if (msg != nullptr) {
+            memcpy(msg->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+            memcpy(msg->other_public_key, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        }
+
+        tcp_shard_send(tcp_server, tcp_shard_of_key(tcp_server->parent, public_key), msg, true);
+        return 0;
+    }
+
+#endif
+    int other_index = get_TCP_connection_index(tcp_server, public_key);
 
     if (other_index != -1) {
         VLA(uint8_t, resp_packet, 1 + CRYPTO_PUBLIC_KEY_SIZE + length);
         resp_packet[0] = TCP_PACKET_OOB_RECV;
         memcpy(resp_packet + 1, con->public_key, CRYPTO_PUBLIC_KEY_SIZE);
         memcpy(resp_packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, data, length);
-        write_packet_TCP_secure_connection(&tcp_server->accepted_connection_array[other_index], resp_packet,
+        write_packet_TCP_secure_connection(tcp_server, &tcp_server->accepted_connection_array[other_index], resp_packet,
                                            SIZEOF_VLA(resp_packet), 0);
     }
 
@@ -801,7 +1250,20 @@ static int rm_connection_index(TCP_Server *tcp_server, TCP_Secure_Connection *co
         uint32_t index = con->connections[con_number].index;
         uint8_t other_id = con->connections[con_number].other_id;
 
-        if (con->connections[con_number].status == 2) {
+        if (con->connections[con_number].status == 2 && con->connections[con_number].shard != tcp_server_shard_id(tcp_server)) {
+#ifdef TCP_SERVER_USE_EPOLL
+            TCP_Shard_Msg *msg = tcp_shard_msg_new(TCP_SHARD_MSG_UNLINK, nullptr, 0);
+
+            if (msg != nullptr) {
+                msg->index = index;
+                msg->id = other_id;
+                msg->other_index = con - tcp_server->accepted_connection_array;
+                msg->other_id = con_number;
+            }
+
+            tcp_shard_send(tcp_server, con->connections[con_number].shard, msg, false);
+#endif
+        } else if (con->connections[con_number].status == 2) {
 
             if (index >= tcp_server->size_accepted_connections) {
                 return -1;
@@ -811,7 +1273,7 @@ static int rm_connection_index(TCP_Server *tcp_server, TCP_Secure_Connection *co
             tcp_server->accepted_connection_array[index].connections[other_id].index = 0;
             tcp_server->accepted_connection_array[index].connections[other_id].status = 1;
             // TODO(irungentoo): return values?
-            send_disconnect_notification(&tcp_server->accepted_connection_array[index], other_id);
+            send_disconnect_notification(tcp_server, &tcp_server->accepted_connection_array[index], other_id);
         }
 
         con->connections[con_number].index = 0;
@@ -828,6 +1290,36 @@ static int handle_onion_recv_1(void *object, IP_Port dest, const uint8_t *data,
     TCP_Server *tcp_server = (TCP_Server *)object;
     uint32_t index = dest.ip.ip.v6.uint32[0];
 
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (tcp_server->shards != nullptr) {
+        const uint32_t shard = dest.ip.ip.v6.uint32[1];
+
+        if (shard >= tcp_server->num_shards) {
+            return 1;
+        }
+
+        TCP_Shard_Msg *msg = tcp_shard_msg_new(TCP_SHARD_MSG_ONION_RESPONSE, nullptr, 1 + length);
+
+        if (msg == nullptr) {
+            return 1;
+        }
+
+        msg->index = index;
+        msg->identifier = dest.ip.ip.v6.uint64[1];
+        msg->data[0] = TCP_PACKET_ONION_RESPONSE;
+        memcpy(msg->data + 1, data, length);
+
+        if (!tcp_shard_send(tcp_server, shard, msg, true)) {
+            return 1;
+        }
+
+        tcp_shard_flush(tcp_server);
+        return 0;
+    }
+
+#endif
+
     if (index >= tcp_server->size_accepted_connections) {
         return 1;
     }
@@ -842,7 +1334,7 @@ static int handle_onion_recv_1(void *object, IP_Port dest, const uint8_t *data,
     memcpy(packet + 1, data, length);
     packet[0] = TCP_PACKET_ONION_RESPONSE;
 
-    if (write_packet_TCP_secure_connection(con, packet, SIZEOF_VLA(packet), 0) != 1) {
+    if (write_packet_TCP_secure_connection(tcp_server, con, packet, SIZEOF_VLA(packet), 0) != 1) {
         return 1;
     }
 
@@ -893,7 +1385,7 @@ static int handle_TCP_packet(TCP_Server *tcp_server, uint32_t con_id, const uint
             uint8_t response[1 + sizeof(uint64_t)];
             response[0] = TCP_PACKET_PONG;
             memcpy(response + 1, data + 1, sizeof(uint64_t));
-            write_packet_TCP_secure_connection(con, response, sizeof(response), 1);
+            write_packet_TCP_secure_connection(tcp_server, con, response, sizeof(response), 1);
             return 0;
         }
 
@@ -926,6 +1418,29 @@ static int handle_TCP_packet(TCP_Server *tcp_server, uint32_t con_id, const uint
         }
 
         case TCP_PACKET_ONION_REQUEST: {
+#ifdef TCP_SERVER_USE_EPOLL
+
+            if (tcp_server->parent != nullptr) {
+                if (tcp_server->parent->onion) {
+                    if (length <= 1 + CRYPTO_NONCE_SIZE + ONION_SEND_BASE * 2) {
+                        return -1;
+                    }
+
+                    TCP_Shard_Msg *msg = tcp_shard_msg_new(TCP_SHARD_MSG_ONION_REQUEST, data + 1, length - 1);
+
+                    if (msg != nullptr) {
+                        msg->other_index = con_id;
+                        msg->identifier = con->identifier;
+                    }
+
+                    tcp_shard_send(tcp_server, tcp_server->parent->num_shards, msg, true);
+                }
+
+                return 0;
+            }
+
+#endif
+
             if (tcp_server->onion) {
                 if (length <= 1 + CRYPTO_NONCE_SIZE + ONION_SEND_BASE * 2) {
                     return -1;
@@ -969,10 +1484,29 @@ static int handle_TCP_packet(TCP_Server *tcp_server, uint32_t con_id, const uint
 
             uint32_t index = con->connections[c_id].index;
             uint8_t other_c_id = con->connections[c_id].other_id + NUM_RESERVED_PORTS;
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+            if (con->connections[c_id].shard != tcp_server->shard_id) {
+                TCP_Shard_Msg *msg = tcp_shard_msg_new(TCP_SHARD_MSG_DATA, data, length);
+
+                if (msg != nullptr) {
+                    msg->data[0] = other_c_id;
+                    msg->index = index;
+                    msg->id = con->connections[c_id].other_id;
+                    msg->other_index = con_id;
+                    msg->other_id = c_id;
+                }
+
+                tcp_shard_send(tcp_server, con->connections[c_id].shard, msg, true);
+                return 0;
+            }
+
+#endif
             VLA(uint8_t, new_data, length);
             memcpy(new_data, data, length);
             new_data[0] = other_c_id;
-            int ret = write_packet_TCP_secure_connection(&tcp_server->accepted_connection_array[index], new_data, length, 0);
+            int ret = write_packet_TCP_secure_connection(tcp_server, &tcp_server->accepted_connection_array[index], new_data, length, 0);
 
             if (ret == -1) {
                 return -1;
@@ -985,11 +1519,41 @@ static int handle_TCP_packet(TCP_Server *tcp_server, uint32_t con_id, const uint
     return 0;
 }
 
+#ifdef TCP_SERVER_USE_EPOLL
+/* Pass a connection that was just confirmed on to the shard that owns its
+ * public key, together with its first packet.
+ */
+static void tcp_shard_handoff(TCP_Server *tcp_server, TCP_Secure_Connection *con, const uint8_t *data, uint16_t length)
+{
+    epoll_ctl(tcp_server->efd, EPOLL_CTL_DEL, con->sock.socket, nullptr);
+
+    TCP_Shard_Msg *msg = tcp_shard_msg_new(TCP_SHARD_MSG_HANDOFF, data, length);
+    TCP_Secure_Connection *moved = msg ? (TCP_Secure_Connection *)malloc(sizeof(TCP_Secure_Connection)) : nullptr;
+
+    if (moved == nullptr) {
+        free(msg);
+        kill_TCP_secure_connection(con);
+        return;
+    }
+
+    move_secure_connection(moved, con);
+    msg->con = moved;
+    tcp_shard_send(tcp_server, tcp_shard_of_key(tcp_server->parent, moved->public_key), msg, false);
+}
+#endif
 
 static int confirm_TCP_connection(TCP_Server *tcp_server, const Mono_Time *mono_time, TCP_Secure_Connection *con,
                                   const uint8_t *data,
                                   uint16_t length)
 {
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (tcp_shard_is_remote(tcp_server, con->public_key)) {
+        tcp_shard_handoff(tcp_server, con, data, length);
+        return -1;
+    }
+
+#endif
     int index = add_accepted(tcp_server, mono_time, con);
 
     if (index == -1) {
@@ -1007,6 +1571,29 @@ static int confirm_TCP_connection(TCP_Server *tcp_server, const Mono_Time *mono_
     return index;
 }
 
+static uint32_t tcp_server_send_buffer_limit(const TCP_Server *tcp_server)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+    return __atomic_load_n(&tcp_server->send_buffer_limit, __ATOMIC_RELAXED);
+#else
+    return tcp_server->send_buffer_limit;
+#endif
+}
+
+void tcp_server_set_send_buffer_limit(TCP_Server *tcp_server, uint32_t limit)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+    // Shards accept connections on their own threads.
+    for (uint16_t i = 0; i < tcp_server->num_shards; ++i) {
+        __atomic_store_n(&tcp_server->shards[i]->send_buffer_limit, limit, __ATOMIC_RELAXED);
+    }
+
+    __atomic_store_n(&tcp_server->send_buffer_limit, limit, __ATOMIC_RELAXED);
+#else
+    tcp_server->send_buffer_limit = limit;
+#endif
+}
+
 /* return index on success
  * return -1 on failure
  */
@@ -1037,6 +1624,7 @@ static int accept_connection(TCP_Server *tcp_server, Socket sock)
     conn->status = TCP_STATUS_CONNECTED;
     conn->sock = sock;
     conn->next_packet_length = 0;
+    tcp_send_buffer_set_limit(&conn->send_buffer, tcp_server_send_buffer_limit(tcp_server));
 
     ++tcp_server->incoming_connection_queue_index;
     return index;
@@ -1095,6 +1683,7 @@ TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uin
     }
 
 #ifdef TCP_SERVER_USE_EPOLL
+    temp->wake_fd = -1;
     temp->efd = epoll_create(8);
 
     if (temp->efd == -1) {
@@ -1244,12 +1833,278 @@ static bool tcp_process_secure_packet(TCP_Server *tcp_server, uint32_t i)
 
 static void do_confirmed_recv(TCP_Server *tcp_server, uint32_t i)
 {
-    while (tcp_process_secure_packet(tcp_server, i)) {
-        // Keep reading until an error occurs or there is no more data to read.
-        continue;
+    do {
+        TCP_Secure_Connection *const conn = &tcp_server->accepted_connection_array[i];
+
+        // Leave the rest in the socket until the peer reads what it was sent.
+        conn->recv_paused = tcp_send_buffer_congested(&conn->send_buffer);
+
+        if (conn->recv_paused) {
+            return;
+        }
+    } while (tcp_process_secure_packet(tcp_server, i));
+}
+
+#ifdef TCP_SERVER_USE_EPOLL
+/* return the confirmed connection at index, or nullptr if there is none.
+ */
+static TCP_Secure_Connection *tcp_shard_connection(TCP_Server *tcp_server, uint32_t index)
+{
+    if (index >= tcp_server->size_accepted_connections) {
+        return nullptr;
+    }
+
+    TCP_Secure_Connection *con = &tcp_server->accepted_connection_array[index];
+
+    if (con->status != TCP_STATUS_CONFIRMED) {
+        return nullptr;
+    }
+
+    return con;
+}
+
+/* return the slot of con linked to the connection msg came from, or nullptr
+ * if it was unlinked since.
+ */
+static TCP_Secure_Conn *tcp_shard_linked_slot(TCP_Secure_Connection *con, const TCP_Shard_Msg *msg)
+{
+    if (con == nullptr) {
+        return nullptr;
+    }
+
+    TCP_Secure_Conn *slot = &con->connections[msg->id];
+
+    if (slot->status != 2 || slot->shard != msg->from || slot->index != msg->other_index
+            || slot->other_id != msg->other_id) {
+        return nullptr;
+    }
+
+    return slot;
+}
+
+static void tcp_shard_adopt(TCP_Server *tcp_server, const Mono_Time *mono_time, TCP_Shard_Msg *msg)
+{
+    TCP_Secure_Connection *con = msg->con;
+    msg->con = nullptr;
+
+    const Socket sock = con->sock;
+    const int index = confirm_TCP_connection(tcp_server, mono_time, con, msg->data, msg->length);
+    free(con);
+
+    if (index == -1) {
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
+    ev.data.u64 = sock.socket | ((uint64_t)TCP_SOCKET_CONFIRMED << 32) | ((uint64_t)index << 40);
+
+    if (epoll_ctl(tcp_server->efd, EPOLL_CTL_ADD, sock.socket, &ev) == -1) {
+        kill_accepted(tcp_server, index);
+        return;
+    }
+
+    // Anything that arrived while the connection was in flight.
+    do_confirmed_recv(tcp_server, index);
+}
+
+static void tcp_shard_link(TCP_Server *tcp_server, const TCP_Shard_Msg *msg)
+{
+    const int other_index = get_TCP_connection_index(tcp_server, msg->public_key);
+
+    if (other_index == -1) {
+        return;
+    }
+
+    TCP_Secure_Connection *other_conn = &tcp_server->accepted_connection_array[other_index];
+
+    for (uint32_t i = 0; i < NUM_CLIENT_CONNECTIONS; ++i) {
+        TCP_Secure_Conn *slot = &other_conn->connections[i];
+
+        if (slot->status != 1 || public_key_cmp(slot->public_key, msg->other_public_key) != 0) {
+            continue;
+        }
+
+        slot->status = 2;
+        slot->index = msg->other_index;
+        slot->other_id = msg->other_id;
+        slot->shard = msg->from;
+        send_connect_notification(tcp_server, other_conn, i);
+
+        TCP_Shard_Msg *reply = tcp_shard_msg_new(TCP_SHARD_MSG_LINKED, nullptr, 0);
+
+        if (reply != nullptr) {
+            reply->index = msg->other_index;
+            reply->id = msg->other_id;
+            reply->other_index = other_index;
+            reply->other_id = i;
+            memcpy(reply->public_key, other_conn->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        }
+
+        tcp_shard_send(tcp_server, msg->from, reply, false);
+        return;
+    }
+}
+
+static void tcp_shard_linked(TCP_Server *tcp_server, const TCP_Shard_Msg *msg)
+{
+    TCP_Secure_Connection *con = tcp_shard_connection(tcp_server, msg->index);
+
+    if (tcp_shard_linked_slot(con, msg) != nullptr) {
+        // Both sides asked at the same time, and the link request of the
+        // other one already got here.
+        return;
+    }
+
+    if (con != nullptr && con->connections[msg->id].status == 1
+            && public_key_cmp(con->connections[msg->id].public_key, msg->public_key) == 0) {
+        TCP_Secure_Conn *slot = &con->connections[msg->id];
+        slot->status = 2;
+        slot->index = msg->other_index;
+        slot->other_id = msg->other_id;
+        slot->shard = msg->from;
+        send_connect_notification(tcp_server, con, msg->id);
+        return;
+    }
+
+    // The connection gave up on the other one in the meantime.
+    TCP_Shard_Msg *reply = tcp_shard_msg_new(TCP_SHARD_MSG_UNLINK, nullptr, 0);
+
+    if (reply != nullptr) {
+        reply->index = msg->other_index;
+        reply->id = msg->other_id;
+        reply->other_index = msg->index;
+        reply->other_id = msg->id;
     }
+
+    tcp_shard_send(tcp_server, msg->from, reply, false);
+}
+
+static void tcp_shard_unlink(TCP_Server *tcp_server, const TCP_Shard_Msg *msg)
+{
+    TCP_Secure_Connection *con = tcp_shard_connection(tcp_server, msg->index);
+    TCP_Secure_Conn *slot = tcp_shard_linked_slot(con, msg);
+
+    if (slot == nullptr) {
+        return;
+    }
+
+    slot->status = 1;
+    slot->index = 0;
+    slot->other_id = 0;
+    send_disconnect_notification(tcp_server, con, msg->id);
 }
 
+static void tcp_shard_oob(TCP_Server *tcp_server, const TCP_Shard_Msg *msg)
+{
+    const int other_index = get_TCP_connection_index(tcp_server, msg->public_key);
+
+    if (other_index == -1) {
+        return;
+    }
+
+    VLA(uint8_t, resp_packet, 1 + CRYPTO_PUBLIC_KEY_SIZE + msg->length);
+    resp_packet[0] = TCP_PACKET_OOB_RECV;
+    memcpy(resp_packet + 1, msg->other_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(resp_packet + 1 + CRYPTO_PUBLIC_KEY_SIZE, msg->data, msg->length);
+    write_packet_TCP_secure_connection(tcp_server, &tcp_server->accepted_connection_array[other_index], resp_packet,
+                                       SIZEOF_VLA(resp_packet), 0);
+}
+
+static void tcp_shard_onion_request(TCP_Server *tcp_server, const TCP_Shard_Msg *msg)
+{
+    IP_Port source;
+    source.port = 0;  // dummy initialise
+    source.ip.family = net_family_tcp_onion;
+    source.ip.ip.v6.uint32[0] = msg->other_index;
+    source.ip.ip.v6.uint32[1] = msg->from;
+    source.ip.ip.v6.uint64[1] = msg->identifier;
+    onion_send_1(tcp_server->onion, msg->data + CRYPTO_NONCE_SIZE, msg->length - CRYPTO_NONCE_SIZE, source, msg->data);
+}
+
+static void tcp_shard_receive_msg(TCP_Server *tcp_server, const Mono_Time *mono_time, TCP_Shard_Msg *msg)
+{
+    switch (msg->type) {
+        case TCP_SHARD_MSG_HANDOFF: {
+            tcp_shard_adopt(tcp_server, mono_time, msg);
+            break;
+        }
+
+        case TCP_SHARD_MSG_LINK: {
+            tcp_shard_link(tcp_server, msg);
+            break;
+        }
+
+        case TCP_SHARD_MSG_LINKED: {
+            tcp_shard_linked(tcp_server, msg);
+            break;
+        }
+
+        case TCP_SHARD_MSG_UNLINK: {
+            tcp_shard_unlink(tcp_server, msg);
+            break;
+        }
+
+        case TCP_SHARD_MSG_DATA: {
+            TCP_Secure_Connection *con = tcp_shard_connection(tcp_server, msg->index);
+
+            if (tcp_shard_linked_slot(con, msg) != nullptr) {
+                write_packet_TCP_secure_connection(tcp_server, con, msg->data, msg->length, 0);
+            }
+
+            break;
+        }
+
+        case TCP_SHARD_MSG_OOB: {
+            tcp_shard_oob(tcp_server, msg);
+            break;
+        }
+
+        case TCP_SHARD_MSG_ONION_REQUEST: {
+            tcp_shard_onion_request(tcp_server, msg);
+            break;
+        }
+
+        case TCP_SHARD_MSG_ONION_RESPONSE: {
+            TCP_Secure_Connection *con = tcp_shard_connection(tcp_server, msg->index);
+
+            if (con != nullptr && con->identifier == msg->identifier) {
+                write_packet_TCP_secure_connection(tcp_server, con, msg->data, msg->length, 0);
+            }
+
+            break;
+        }
+    }
+}
+
+/* Handle everything the other shards sent to this one.
+ */
+static void tcp_shard_receive(TCP_Server *tcp_server, const Mono_Time *mono_time)
+{
+    uint64_t wakeups;
+
+    if (read(tcp_server->wake_fd, &wakeups, sizeof(wakeups)) != sizeof(wakeups)) {
+        // Nothing new since the last read, but the queues are cheap to check.
+    }
+
+    TCP_Server *root = tcp_shard_root(tcp_server);
+
+    for (uint16_t from = 0; from <= root->num_shards; ++from) {
+        if (from == tcp_server->shard_id) {
+            continue;
+        }
+
+        TCP_Shard_Queue *queue = tcp_shard_queue(root, from, tcp_server->shard_id);
+        TCP_Shard_Msg *msg;
+
+        while ((msg = tcp_shard_queue_pop(queue)) != nullptr) {
+            tcp_shard_receive_msg(tcp_server, mono_time, msg);
+            tcp_shard_msg_free(msg);
+        }
+    }
+}
+#endif
+
 #ifndef TCP_SERVER_USE_EPOLL
 static void do_TCP_incoming(TCP_Server *tcp_server)
 {
@@ -1295,7 +2150,7 @@ static void do_TCP_confirmed(TCP_Server *tcp_server, const Mono_Time *mono_time)
             }
 
             memcpy(ping + 1, &ping_id, sizeof(uint64_t));
-            int ret = write_packet_TCP_secure_connection(conn, ping, sizeof(ping), 1);
+            int ret = write_packet_TCP_secure_connection(tcp_server, conn, ping, sizeof(ping), 1);
 
             if (ret == 1) {
                 conn->last_pinged = mono_time_get(mono_time);
@@ -1313,9 +2168,16 @@ static void do_TCP_confirmed(TCP_Server *tcp_server, const Mono_Time *mono_time)
             continue;
         }
 
-        send_pending_data(conn);
+        tcp_send_buffer_flush(&conn->send_buffer, conn->sock);
 
-#ifndef TCP_SERVER_USE_EPOLL
+#ifdef TCP_SERVER_USE_EPOLL
+
+        // Reads that stopped for a full send buffer don't get another event.
+        if (conn->recv_paused) {
+            do_confirmed_recv(tcp_server, i);
+        }
+
+#else
 
         do_confirmed_recv(tcp_server, i);
 
@@ -1324,11 +2186,11 @@ static void do_TCP_confirmed(TCP_Server *tcp_server, const Mono_Time *mono_time)
 }
 
 #ifdef TCP_SERVER_USE_EPOLL
-static bool tcp_epoll_process(TCP_Server *tcp_server, const Mono_Time *mono_time)
+static bool tcp_epoll_process(TCP_Server *tcp_server, const Mono_Time *mono_time, int timeout)
 {
 #define MAX_EVENTS 16
     struct epoll_event events[MAX_EVENTS];
-    const int nfds = epoll_wait(tcp_server->efd, events, MAX_EVENTS, 0);
+    const int nfds = epoll_wait(tcp_server->efd, events, MAX_EVENTS, timeout);
 #undef MAX_EVENTS
 
     for (int n = 0; n < nfds; ++n) {
@@ -1354,7 +2216,11 @@ static bool tcp_epoll_process(TCP_Server *tcp_server, const Mono_Time *mono_time
                 }
 
                 case TCP_SOCKET_CONFIRMED: {
-                    kill_accepted(tcp_server, index);
+                    if ((uint32_t)index < tcp_server->size_accepted_connections
+                            && tcp_server->accepted_connection_array[index].sock.socket == sock.socket) {
+                        kill_accepted(tcp_server, index);
+                    }
+
                     break;
                 }
             }
@@ -1435,15 +2301,33 @@ static bool tcp_epoll_process(TCP_Server *tcp_server, const Mono_Time *mono_time
                 do_confirmed_recv(tcp_server, index);
                 break;
             }
+
+            case TCP_SOCKET_WAKE: {
+                tcp_shard_receive(tcp_server, mono_time);
+                break;
+            }
         }
     }
 
+    tcp_server_flush(tcp_server);
+
+    if (tcp_server->outbox != nullptr) {
+        tcp_shard_flush(tcp_server);
+    }
+
     return nfds > 0;
 }
 
-static void do_TCP_epoll(TCP_Server *tcp_server, const Mono_Time *mono_time)
+/* Wait up to timeout milliseconds for a socket to become ready, then process
+ * packets until there are no more ready.
+ */
+static void do_TCP_epoll(TCP_Server *tcp_server, const Mono_Time *mono_time, int timeout)
 {
-    while (tcp_epoll_process(tcp_server, mono_time)) {
+    if (!tcp_epoll_process(tcp_server, mono_time, timeout)) {
+        return;
+    }
+
+    while (tcp_epoll_process(tcp_server, mono_time, 0)) {
         // Keep processing packets until there are no more FDs ready for reading.
         continue;
     }
@@ -1452,8 +2336,10 @@ static void do_TCP_epoll(TCP_Server *tcp_server, const Mono_Time *mono_time)
 
 void do_TCP_server(TCP_Server *tcp_server, Mono_Time *mono_time)
 {
+    tcp_server->coalesce = true;
+
 #ifdef TCP_SERVER_USE_EPOLL
-    do_TCP_epoll(tcp_server, mono_time);
+    do_TCP_epoll(tcp_server, mono_time, 0);
 
 #else
     do_TCP_accept_new(tcp_server);
@@ -1462,31 +2348,254 @@ void do_TCP_server(TCP_Server *tcp_server, Mono_Time *mono_time)
 #endif
 
     do_TCP_confirmed(tcp_server, mono_time);
+
+    tcp_server_flush(tcp_server);
+    tcp_server->coalesce = false;
 }
 
-void kill_TCP_server(TCP_Server *tcp_server)
+/* Free everything but the listening sockets, which shards share with their
+ * parent.
+ */
+static void free_TCP_server_state(TCP_Server *tcp_server)
 {
-    for (uint32_t i = 0; i < tcp_server->num_listening_socks; ++i) {
-        kill_sock(tcp_server->socks_listening[i]);
+    bs_list_free(&tcp_server->accepted_key_list);
+    free(tcp_server->flushes);
+
+#ifdef TCP_SERVER_USE_EPOLL
+    close(tcp_server->efd);
+
+    if (tcp_server->wake_fd != -1) {
+        close(tcp_server->wake_fd);
     }
 
-    if (tcp_server->onion) {
-        set_callback_handle_recv_1(tcp_server->onion, nullptr, nullptr);
+    if (tcp_server->outbox != nullptr) {
+        const uint16_t num_nodes = tcp_shard_root(tcp_server)->num_shards + 1;
+
+        for (uint16_t i = 0; i < num_nodes; ++i) {
+            while (tcp_server->outbox[i].overflow_start != nullptr) {
+                TCP_Shard_Msg *msg = tcp_server->outbox[i].overflow_start;
+                tcp_server->outbox[i].overflow_start = msg->next;
+                tcp_shard_msg_free(msg);
+            }
+        }
+
+        free(tcp_server->outbox);
     }
 
-    bs_list_free(&tcp_server->accepted_key_list);
+    if (tcp_server->mono_time != nullptr) {
+        mono_time_free(tcp_server->mono_time);
+    }
 
-#ifdef TCP_SERVER_USE_EPOLL
-    close(tcp_server->efd);
 #endif
 
     for (uint32_t i = 0; i < MAX_INCOMING_CONNECTIONS; ++i) {
-        wipe_secure_connection(&tcp_server->incoming_connection_queue[i]);
-        wipe_secure_connection(&tcp_server->unconfirmed_connection_queue[i]);
+        kill_TCP_secure_connection(&tcp_server->incoming_connection_queue[i]);
+        kill_TCP_secure_connection(&tcp_server->unconfirmed_connection_queue[i]);
+    }
+
+    for (uint32_t i = 0; i < tcp_server->size_accepted_connections; ++i) {
+        kill_TCP_secure_connection(&tcp_server->accepted_connection_array[i]);
     }
 
     free_accepted_connection_array(tcp_server);
+}
+
+#ifdef TCP_SERVER_USE_EPOLL
+static void *tcp_shard_run(void *arg)
+{
+    TCP_Server *shard = (TCP_Server *)arg;
+    const uint16_t num_nodes = shard->parent->num_shards + 1;
+
+    // Nothing but this thread writes to the shard's connections.
+    shard->coalesce = true;
+
+    while (__atomic_load_n(&shard->running, __ATOMIC_ACQUIRE)) {
+        // Only the pings need a timeout, unless messages to other shards are
+        // waiting for room in their queues.
+        const int timeout = tcp_shard_overflowing(shard, num_nodes) ? 1 : 1000;
+
+        mono_time_update(shard->mono_time);
+        do_TCP_epoll(shard, shard->mono_time, timeout);
+        mono_time_update(shard->mono_time);
+        do_TCP_confirmed(shard, shard->mono_time);
+        tcp_server_flush(shard);
+        tcp_shard_flush(shard);
+    }
+
+    return nullptr;
+}
+
+static bool tcp_epoll_add_wake(TCP_Server *tcp_server)
+{
+    tcp_server->wake_fd = eventfd(0, EFD_NONBLOCK);
+
+    if (tcp_server->wake_fd == -1) {
+        return false;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.u64 = (uint32_t)tcp_server->wake_fd | ((uint64_t)TCP_SOCKET_WAKE << 32);
+
+    return epoll_ctl(tcp_server->efd, EPOLL_CTL_ADD, tcp_server->wake_fd, &ev) == 0;
+}
+
+static TCP_Server *new_TCP_shard(TCP_Server *parent, uint16_t shard_id)
+{
+    TCP_Server *shard = (TCP_Server *)calloc(1, sizeof(TCP_Server));
+
+    if (shard == nullptr) {
+        return nullptr;
+    }
+
+    shard->parent = parent;
+    shard->shard_id = shard_id;
+    shard->wake_fd = -1;
+    shard->socks_listening = parent->socks_listening;
+    shard->num_listening_socks = parent->num_listening_socks;
+    memcpy(shard->public_key, parent->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(shard->secret_key, parent->secret_key, CRYPTO_SECRET_KEY_SIZE);
+    bs_list_init(&shard->accepted_key_list, CRYPTO_PUBLIC_KEY_SIZE, 8);
+
+    shard->efd = epoll_create(8);
+    shard->outbox = (TCP_Shard_Outbox *)calloc(parent->num_shards + 1, sizeof(TCP_Shard_Outbox));
+    shard->mono_time = mono_time_new();
+
+    if (shard->efd == -1 || shard->outbox == nullptr || shard->mono_time == nullptr || !tcp_epoll_add_wake(shard)) {
+        free_TCP_server_state(shard);
+        free(shard);
+        return nullptr;
+    }
+
+    // Every shard accepts connections, but only one is woken up for each.
+    for (uint32_t i = 0; i < shard->num_listening_socks; ++i) {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+        ev.data.u64 = shard->socks_listening[i].socket | ((uint64_t)TCP_SOCKET_LISTENING << 32);
+
+        if (epoll_ctl(shard->efd, EPOLL_CTL_ADD, shard->socks_listening[i].socket, &ev) == -1) {
+            free_TCP_server_state(shard);
+            free(shard);
+            return nullptr;
+        }
+    }
+
+    return shard;
+}
+
+static bool tcp_server_start_shards(TCP_Server *tcp_server, uint16_t num_shards)
+{
+    // The shards take over the listening sockets.
+    for (uint32_t i = 0; i < tcp_server->num_listening_socks; ++i) {
+        epoll_ctl(tcp_server->efd, EPOLL_CTL_DEL, tcp_server->socks_listening[i].socket, nullptr);
+    }
+
+    const uint32_t num_nodes = num_shards + 1;
+    tcp_server->num_shards = num_shards;
+    tcp_server->shard_id = num_shards;
+    tcp_server->shard_seed = random_u64();
+    tcp_server->queues = (TCP_Shard_Queue *)calloc(num_nodes * num_nodes, sizeof(TCP_Shard_Queue));
+    tcp_server->outbox = (TCP_Shard_Outbox *)calloc(num_nodes, sizeof(TCP_Shard_Outbox));
+    tcp_server->shards = (TCP_Server **)calloc(num_shards, sizeof(TCP_Server *));
+
+    if (tcp_server->queues == nullptr || tcp_server->outbox == nullptr || tcp_server->shards == nullptr
+            || !tcp_epoll_add_wake(tcp_server)) {
+        return false;
+    }
+
+    for (uint16_t i = 0; i < num_shards; ++i) {
+        tcp_server->shards[i] = new_TCP_shard(tcp_server, i);
+
+        if (tcp_server->shards[i] == nullptr) {
+            return false;
+        }
+    }
+
+    for (uint16_t i = 0; i < num_shards; ++i) {
+        TCP_Server *shard = tcp_server->shards[i];
+        shard->running = true;
+
+        if (pthread_create(&shard->thread, nullptr, tcp_shard_run, shard) != 0) {
+            shard->running = false;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void tcp_server_stop_shards(TCP_Server *tcp_server)
+{
+    if (tcp_server->shards == nullptr) {
+        free(tcp_server->queues);
+        return;
+    }
+
+    for (uint16_t i = 0; i < tcp_server->num_shards; ++i) {
+        TCP_Server *shard = tcp_server->shards[i];
+
+        if (shard != nullptr && shard->running) {
+            __atomic_store_n(&shard->running, false, __ATOMIC_RELEASE);
+            tcp_shard_wake(shard->wake_fd);
+            pthread_join(shard->thread, nullptr);
+        }
+    }
+
+    for (uint16_t i = 0; i < tcp_server->num_shards; ++i) {
+        if (tcp_server->shards[i] != nullptr) {
+            free_TCP_server_state(tcp_server->shards[i]);
+            free(tcp_server->shards[i]);
+        }
+    }
+
+    const uint32_t num_nodes = tcp_server->num_shards + 1;
+
+    for (uint32_t i = 0; i < num_nodes * num_nodes; ++i) {
+        TCP_Shard_Msg *msg;
+
+        while ((msg = tcp_shard_queue_pop(&tcp_server->queues[i])) != nullptr) {
+            tcp_shard_msg_free(msg);
+        }
+    }
+
+    free(tcp_server->queues);
+    free(tcp_server->shards);
+}
+#endif
+
+TCP_Server *new_TCP_server_sharded(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports,
+                                   const uint8_t *secret_key, Onion *onion, uint16_t num_shards)
+{
+    TCP_Server *tcp_server = new_TCP_server(ipv6_enabled, num_sockets, ports, secret_key, onion);
+
+#ifdef TCP_SERVER_USE_EPOLL
+
+    if (tcp_server != nullptr && num_shards > 0 && !tcp_server_start_shards(tcp_server, num_shards)) {
+        kill_TCP_server(tcp_server);
+        return nullptr;
+    }
+
+#endif
+
+    return tcp_server;
+}
+
+void kill_TCP_server(TCP_Server *tcp_server)
+{
+#ifdef TCP_SERVER_USE_EPOLL
+    // Stop the shards before anything they use goes away.
+    tcp_server_stop_shards(tcp_server);
+#endif
+
+    for (uint32_t i = 0; i < tcp_server->num_listening_socks; ++i) {
+        kill_sock(tcp_server->socks_listening[i]);
+    }
+
+    if (tcp_server->onion) {
+        set_callback_handle_recv_1(tcp_server->onion, nullptr, nullptr);
+    }
 
+    free_TCP_server_state(tcp_server);
     free(tcp_server->socks_listening);
     free(tcp_server);
 }
@@ -66,27 +66,102 @@ typedef enum TCP_Status {
     TCP_STATUS_CONFIRMED,
 } TCP_Status;
 
-typedef struct TCP_Priority_List TCP_Priority_List;
+/* Most bytes a connection queues for its socket by default. Packets that would
+ * go over are refused, see write_packet_TCP_secure_connection.
+ */
+#define TCP_SEND_BUFFER_DEFAULT_LIMIT (64 * 1024)
+
+/* The limit can't go lower than this: room for a packet that was partly sent
+ * and a priority packet behind it.
+ */
+#define TCP_SEND_BUFFER_MIN_LIMIT (2 * (2 + MAX_PACKET_SIZE))
 
-struct TCP_Priority_List {
-    TCP_Priority_List *next;
-    uint16_t size;
-    uint16_t sent;
-    uint8_t data[];
-};
+/* Bytes of encrypted packets waiting for a connection's socket to take them,
+ * in a ring that grows as needed up to limit. Once empty, a ring that grew
+ * past its initial 4 KiB is released; a smaller one is kept for reuse until
+ * tcp_send_buffer_free. A zeroed TCP_Send_Buffer is an empty one with the
+ * default limit.
+ */
+typedef struct TCP_Send_Buffer {
+    uint8_t *data;
+    uint32_t size;   /* 0 or a power of 2. */
+    uint32_t start;
+    uint32_t length;
+    uint32_t limit;  /* 0 for TCP_SEND_BUFFER_DEFAULT_LIMIT. */
+    bool blocked;    /* The socket didn't take all of it last time. */
+} TCP_Send_Buffer;
+
+/* Set the most bytes buf may hold, 0 for the default. */
+void tcp_send_buffer_set_limit(TCP_Send_Buffer *buf, uint32_t limit);
+
+/* return true if length more bytes fit in buf. Nothing does while it holds
+ * more than a limit that was lowered.
+ */
+bool tcp_send_buffer_fits(const TCP_Send_Buffer *buf, uint32_t length);
 
-void wipe_priority_list(TCP_Priority_List *p);
+/* return true if buf is more than half full of data the socket refused, and
+ * the connection should stop taking requests that add to it.
+ */
+bool tcp_send_buffer_congested(const TCP_Send_Buffer *buf);
+
+/* Append length bytes to buf.
+ *
+ * return false if they don't fit or memory allocation fails.
+ */
+bool tcp_send_buffer_push(TCP_Send_Buffer *buf, const uint8_t *data, uint32_t length);
+
+/* Write as much of buf to sock as it takes, in one call.
+ *
+ * return 0 if buf is empty now.
+ * return -1 if it isn't.
+ */
+int tcp_send_buffer_flush(TCP_Send_Buffer *buf, Socket sock);
+
+void tcp_send_buffer_free(TCP_Send_Buffer *buf);
 
 typedef struct TCP_Server TCP_Server;
 
 const uint8_t *tcp_server_public_key(const TCP_Server *tcp_server);
 size_t tcp_server_listen_count(const TCP_Server *tcp_server);
 
+/* Copy up to max_socks of the sockets do_TCP_server reads from to socks.
+ * With epoll this is the one epoll descriptor covering every connection, or
+ * in sharded mode the onion packets the shards pass to do_TCP_server.
+ * Otherwise it is the listening sockets only, and accepted connections are
+ * still only read when do_TCP_server runs.
+ *
+ * return the total number of sockets.
+ */
+uint32_t tcp_server_sockets(const TCP_Server *tcp_server, Socket *socks, uint32_t max_socks);
+
 /* Create new TCP server instance.
  */
 TCP_Server *new_TCP_server(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports, const uint8_t *secret_key,
                            Onion *onion);
 
+/* Create new TCP server instance that runs its connections on num_shards
+ * worker threads, each with its own epoll set.
+ *
+ * Every connection belongs to the shard its public key hashes to. Any shard
+ * may accept a connection and do the handshake, and then hands it off to the
+ * shard it belongs to. Packets between connections on different shards go
+ * through lock-free queues. do_TCP_server still has to be called, as the
+ * onion is only used from its thread.
+ *
+ * With num_shards 0, or without epoll, this is the same as new_TCP_server.
+ */
+TCP_Server *new_TCP_server_sharded(uint8_t ipv6_enabled, uint16_t num_sockets, const uint16_t *ports,
+                                   const uint8_t *secret_key, Onion *onion, uint16_t num_shards);
+
+/* Set the most bytes each connection accepted from now on queues for its
+ * socket, 0 for TCP_SEND_BUFFER_DEFAULT_LIMIT. Values under
+ * TCP_SEND_BUFFER_MIN_LIMIT are raised to it.
+ *
+ * A connection whose queue is more than half full isn't read from until it
+ * drains, so that a peer that doesn't read can't make the relay queue more.
+ */
+void tcp_server_set_send_buffer_limit(TCP_Server *tcp_server, uint32_t limit);
+
 /* Run the TCP_server
  */
 void do_TCP_server(TCP_Server *tcp_server, Mono_Time *mono_time);
@@ -118,5 +193,23 @@ int read_TCP_packet(Socket sock, uint8_t *data, uint16_t length);
 int read_packet_TCP_secure_connection(Socket sock, uint16_t *next_packet_length, const uint8_t *shared_key,
                                       uint8_t *recv_nonce, uint8_t *data, uint16_t max_len);
 
+/* Encrypt data with shared_key and sent_nonce, and write the packet to sock
+ * behind what buf holds.
+ *
+ * With coalesce, the packet is only appended to buf, for a later
+ * tcp_send_buffer_flush to write with the packets after it. Otherwise buf and
+ * the packet go out in one call, and buf keeps what the socket didn't take.
+ * The bytes on the wire are the same either way.
+ *
+ * Packets wait only behind data the socket refused: while it does, packets
+ * that aren't priority are refused too.
+ *
+ * return 1 on success.
+ * return 0 if could not send packet.
+ * return -1 on failure (connection must be killed).
+ */
+int send_packet_TCP_secure_connection(TCP_Send_Buffer *buf, Socket sock, const uint8_t *shared_key,
+                                      uint8_t *sent_nonce, const uint8_t *data, uint16_t length, bool priority, bool coalesce);
+
 
 #endif
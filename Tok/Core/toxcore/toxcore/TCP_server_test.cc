@@ -0,0 +1,883 @@
+extern "C" {
+#include "DHT.h"
+#include "TCP_client.h"
+#include "TCP_server.h"
+#include "logger.h"
+#include "onion.h"
+}
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr uint16_t kFirstPort = 34100;
+constexpr uint16_t kPacketSize = 128;
+constexpr size_t kMaxHandshaking = 16;
+
+struct Server_Deleter {
+  void operator()(TCP_Server *server) { kill_TCP_server(server); }
+};
+
+using Server_Ptr = std::unique_ptr<TCP_Server, Server_Deleter>;
+
+// A relay on a free loopback port, with a thread calling do_TCP_server the way
+// an event loop would: whenever its socket is ready.
+class Relay {
+ public:
+  explicit Relay(uint16_t num_shards, Onion *onion = nullptr) : onion_(onion) {
+    crypto_new_keypair(public_key_, secret_key_);
+
+    for (port_ = kFirstPort; port_ < kFirstPort + 100 && server_ == nullptr; ++port_) {
+      server_.reset(new_TCP_server_sharded(false, 1, &port_, secret_key_, onion, num_shards));
+    }
+
+    --port_;
+
+    if (server_ != nullptr) {
+      thread_ = std::thread([this] { run(); });
+    }
+  }
+
+  ~Relay() {
+    if (thread_.joinable()) {
+      stop_ = true;
+      thread_.join();
+    }
+  }
+
+  bool ok() const { return server_ != nullptr; }
+  void set_send_buffer_limit(uint32_t limit) { tcp_server_set_send_buffer_limit(server_.get(), limit); }
+  const uint8_t *public_key() const { return public_key_; }
+
+  IP_Port ip_port() const {
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, false);
+    ip_port.ip.ip.v4 = get_ip4_loopback();
+    ip_port.port = net_htons(port_);
+    return ip_port;
+  }
+
+ private:
+  void run() {
+    Mono_Time *mono_time = mono_time_new();
+    Socket sock;
+    tcp_server_sockets(server_.get(), &sock, 1);
+
+    while (!stop_) {
+      pollfd pfd = {sock.socket, POLLIN, 0};
+      poll(&pfd, 1, 10);
+      mono_time_update(mono_time);
+
+      if (onion_ != nullptr) {
+        networking_poll(onion_->net, nullptr);
+      }
+
+      do_TCP_server(server_.get(), mono_time);
+    }
+
+    mono_time_free(mono_time);
+  }
+
+  uint8_t public_key_[CRYPTO_PUBLIC_KEY_SIZE];
+  uint8_t secret_key_[CRYPTO_SECRET_KEY_SIZE];
+  uint16_t port_;
+  Onion *onion_;
+  Server_Ptr server_;
+  std::thread thread_;
+  std::atomic<bool> stop_{false};
+};
+
+class Load_Generator;
+
+// One end of a pair of clients that talk to each other through the relay.
+struct Peer {
+  uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+  uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+  const Peer *partner = nullptr;
+  Load_Generator *generator = nullptr;
+  TCP_Client_Connection *con = nullptr;
+  bool requested = false;
+  int connection_id = -1;
+  bool online = false;
+  uint32_t sent = 0;
+};
+
+// Opens a connection to the relay for each of a set of peers, routes each to
+// its partner and sends it packets stamped with the time they were sent.
+// Several of them run at once, each on its own thread.
+class Load_Generator {
+ public:
+  struct Stats {
+    std::atomic<uint32_t> online{0};
+    std::atomic<uint32_t> received{0};
+    std::atomic<uint32_t> oob{0};
+    std::atomic<bool> sending{false};
+    std::atomic<bool> stop{false};
+  };
+
+  Load_Generator(const Relay &relay, std::vector<Peer *> peers, uint32_t packets, Stats *stats)
+      : relay_(relay), peers_(std::move(peers)), packets_(packets), stats_(stats), mono_time_(mono_time_new()) {}
+
+  ~Load_Generator() {
+    for (size_t i = 0; i < num_open_; ++i) {
+      kill_TCP_connection(peers_[i]->con);
+    }
+
+    mono_time_free(mono_time_);
+  }
+
+  void run() {
+    std::vector<pollfd> pfds(peers_.size());
+
+    while (!stats_->stop) {
+      mono_time_update(mono_time_);
+      open_connections();
+
+      for (size_t i = 0; i < num_open_; ++i) {
+        Peer *peer = peers_[i];
+        do_TCP_connection(mono_time_, peer->con, nullptr);
+
+        if (!peer->requested && tcp_con_status(peer->con) == TCP_CLIENT_CONFIRMED) {
+          uint8_t partner_key[CRYPTO_PUBLIC_KEY_SIZE];
+          memcpy(partner_key, peer->partner->public_key, sizeof(partner_key));
+          peer->requested = send_routing_request(peer->con, partner_key) == 1;
+        }
+
+        if (stats_->sending && peer->online && peer->sent < packets_) {
+          uint8_t packet[kPacketSize] = {};
+          int64_t const now = Clock::now().time_since_epoch().count();
+          memcpy(packet, &now, sizeof(now));
+
+          if (send_data(peer->con, peer->connection_id, packet, sizeof(packet)) == 1) {
+            ++peer->sent;
+          }
+        }
+
+        pfds[i] = {tcp_con_sock(peer->con).socket, POLLIN, 0};
+      }
+
+      poll(pfds.data(), num_open_, stats_->sending ? 0 : 1);
+    }
+  }
+
+  // Once everyone is online, say hello out of band as well.
+  void send_oob() {
+    for (size_t i = 0; i < num_open_; ++i) {
+      Peer *peer = peers_[i];
+      uint8_t partner_key[CRYPTO_PUBLIC_KEY_SIZE];
+      memcpy(partner_key, peer->partner->public_key, sizeof(partner_key));
+      send_oob_packet(peer->con, partner_key, peer->public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    }
+  }
+
+  const std::vector<double> &latencies_us() const { return latencies_us_; }
+
+ private:
+  // A relay only keeps so many connections waiting for their handshake, so
+  // open them a few at a time like clients coming online would.
+  void open_connections() {
+    size_t handshaking = 0;
+
+    for (size_t i = 0; i < num_open_; ++i) {
+      handshaking += tcp_con_status(peers_[i]->con) != TCP_CLIENT_CONFIRMED;
+    }
+
+    for (; num_open_ < peers_.size() && handshaking < kMaxHandshaking; ++num_open_, ++handshaking) {
+      Peer *peer = peers_[num_open_];
+      peer->generator = this;
+      peer->con = new_TCP_connection(mono_time_, relay_.ip_port(), relay_.public_key(), peer->public_key,
+                                     peer->secret_key, nullptr);
+      routing_response_handler(peer->con, &handle_routing_response, peer);
+      routing_status_handler(peer->con, &handle_routing_status, peer);
+      routing_data_handler(peer->con, &handle_routing_data, peer);
+      oob_data_handler(peer->con, &handle_oob_data, peer);
+    }
+  }
+
+  static int handle_routing_response(void *object, uint8_t connection_id, const uint8_t *public_key) {
+    static_cast<Peer *>(object)->connection_id = connection_id;
+    return 0;
+  }
+
+  static int handle_routing_status(void *object, uint32_t number, uint8_t connection_id, uint8_t status) {
+    Peer *peer = static_cast<Peer *>(object);
+
+    if (status == 2 && !peer->online) {
+      peer->online = true;
+      ++peer->generator->stats_->online;
+    }
+
+    return 0;
+  }
+
+  static int handle_routing_data(void *object, uint32_t number, uint8_t connection_id, const uint8_t *data,
+                                 uint16_t length, void *userdata) {
+    Load_Generator *self = static_cast<Peer *>(object)->generator;
+    int64_t sent_at;
+    memcpy(&sent_at, data, sizeof(sent_at));
+    self->latencies_us_.push_back((Clock::now().time_since_epoch().count() - sent_at) / 1000.0);
+    ++self->stats_->received;
+    return 0;
+  }
+
+  static int handle_oob_data(void *object, const uint8_t *public_key, const uint8_t *data, uint16_t length,
+                             void *userdata) {
+    Peer *peer = static_cast<Peer *>(object);
+
+    if (length == CRYPTO_PUBLIC_KEY_SIZE && memcmp(public_key, peer->partner->public_key, length) == 0
+        && memcmp(data, public_key, length) == 0) {
+      ++peer->generator->stats_->oob;
+    }
+
+    return 0;
+  }
+
+  const Relay &relay_;
+  std::vector<Peer *> peers_;
+  size_t num_open_ = 0;
+  uint32_t packets_;
+  Stats *stats_;
+  Mono_Time *mono_time_;
+  std::vector<double> latencies_us_;
+};
+
+struct Load_Result {
+  uint32_t online;
+  uint32_t oob;
+  uint32_t delivered;
+  double seconds;
+  double p50_us;
+  double p99_us;
+};
+
+void raise_fd_limit() {
+  rlimit limit;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+// Connect num_peers clients from num_threads threads, pair them up and have
+// each send packets packets to its partner.
+Load_Result run_load(const Relay &relay, uint32_t num_peers, uint32_t num_threads, uint32_t packets) {
+  std::vector<Peer> peers(num_peers);
+
+  for (uint32_t i = 0; i < num_peers; ++i) {
+    crypto_new_keypair(peers[i].public_key, peers[i].secret_key);
+    peers[i].partner = &peers[i ^ 1];
+  }
+
+  Load_Generator::Stats stats;
+  std::vector<std::unique_ptr<Load_Generator>> generators;
+
+  for (uint32_t t = 0; t < num_threads; ++t) {
+    std::vector<Peer *> own;
+
+    for (uint32_t i = t; i < num_peers; i += num_threads) {
+      own.push_back(&peers[i]);
+    }
+
+    generators.emplace_back(new Load_Generator(relay, own, packets, &stats));
+  }
+
+  std::vector<std::thread> threads;
+
+  for (auto &generator : generators) {
+    threads.emplace_back([&generator] { generator->run(); });
+  }
+
+  auto const wait_for = [](const std::atomic<uint32_t> &counter, uint32_t target, Clock::duration timeout) {
+    auto const deadline = Clock::now() + timeout;
+
+    while (counter < target && Clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  };
+
+  wait_for(stats.online, num_peers, std::chrono::seconds(20));
+
+  auto const start = Clock::now();
+  stats.sending = true;
+  wait_for(stats.received, num_peers * packets, std::chrono::seconds(20));
+  auto const end = Clock::now();
+
+  stats.stop = true;
+
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  // Out of band packets go through the same queues, with the loops stopped
+  // they can be checked in isolation.
+  stats.stop = false;
+
+  for (auto &generator : generators) {
+    generator->send_oob();
+  }
+
+  threads.clear();
+
+  for (auto &generator : generators) {
+    threads.emplace_back([&generator] { generator->run(); });
+  }
+
+  wait_for(stats.oob, num_peers, std::chrono::seconds(5));
+  stats.stop = true;
+
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  std::vector<double> latencies;
+
+  for (auto const &generator : generators) {
+    latencies.insert(latencies.end(), generator->latencies_us().begin(), generator->latencies_us().end());
+  }
+
+  std::sort(latencies.begin(), latencies.end());
+
+  Load_Result result;
+  result.online = stats.online;
+  result.oob = stats.oob;
+  result.delivered = stats.received;
+  result.seconds = std::chrono::duration<double>(end - start).count();
+  result.p50_us = latencies.empty() ? 0 : latencies[latencies.size() / 2];
+  result.p99_us = latencies.empty() ? 0 : latencies[latencies.size() * 99 / 100];
+  return result;
+}
+
+TEST(TCPSendBuffer, KeepsOrderAndLimit) {
+  int fds[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  int const sndbuf = 4096;
+  setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  Socket const sock = {fds[0]};
+  ASSERT_TRUE(set_socket_nonblock(sock));
+
+  TCP_Send_Buffer buf = {};
+  tcp_send_buffer_set_limit(&buf, 1);
+  EXPECT_EQ(buf.limit, uint32_t{TCP_SEND_BUFFER_MIN_LIMIT});
+  tcp_send_buffer_set_limit(&buf, 32768);
+
+  std::vector<uint8_t> sent;
+  std::vector<uint8_t> received;
+  uint8_t chunk[1000];
+  uint8_t next = 0;
+
+  // Fill it up, then keep it full while the reader takes a little at a time,
+  // so that the ring wraps around.
+  for (int round = 0; round < 200; ++round) {
+    for (uint8_t &byte : chunk) {
+      byte = next++;
+    }
+
+    if (tcp_send_buffer_push(&buf, chunk, sizeof(chunk))) {
+      sent.insert(sent.end(), chunk, chunk + sizeof(chunk));
+    } else {
+      EXPECT_FALSE(tcp_send_buffer_fits(&buf, sizeof(chunk)));
+      next -= sizeof(chunk);
+    }
+
+    EXPECT_LE(buf.length, 32768u);
+    tcp_send_buffer_flush(&buf, sock);
+
+    uint8_t in[700];
+    ssize_t const len = read(fds[1], in, sizeof(in));
+
+    if (len > 0) {
+      received.insert(received.end(), in, in + len);
+    }
+  }
+
+  EXPECT_TRUE(tcp_send_buffer_congested(&buf));
+
+  while (tcp_send_buffer_flush(&buf, sock) != 0 || received.size() < sent.size()) {
+    uint8_t in[4096];
+    ssize_t const len = read(fds[1], in, sizeof(in));
+    ASSERT_GT(len, 0);
+    received.insert(received.end(), in, in + len);
+  }
+
+  EXPECT_EQ(received, sent);
+  EXPECT_FALSE(tcp_send_buffer_congested(&buf));
+  // Drained rings that grew are given back.
+  EXPECT_EQ(buf.data, nullptr);
+
+  tcp_send_buffer_free(&buf);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+TEST(TCPSendBuffer, NothingFitsAboveALoweredLimit) {
+  TCP_Send_Buffer buf = {};
+  std::vector<uint8_t> const data(2 * TCP_SEND_BUFFER_MIN_LIMIT);
+  ASSERT_TRUE(tcp_send_buffer_push(&buf, data.data(), data.size()));
+
+  tcp_send_buffer_set_limit(&buf, TCP_SEND_BUFFER_MIN_LIMIT);
+  EXPECT_FALSE(tcp_send_buffer_fits(&buf, 1));
+  EXPECT_FALSE(tcp_send_buffer_push(&buf, data.data(), 1));
+  EXPECT_EQ(buf.length, data.size());
+
+  tcp_send_buffer_free(&buf);
+}
+
+// Reads everything from fd until it is closed.
+std::vector<uint8_t> read_all(int fd) {
+  std::vector<uint8_t> received;
+  uint8_t in[65536];
+  ssize_t len;
+
+  while ((len = read(fd, in, sizeof(in))) > 0) {
+    received.insert(received.end(), in, in + len);
+  }
+
+  return received;
+}
+
+// Sends packets of the given lengths over a fresh socketpair and returns the
+// bytes that came out the other end.
+std::vector<uint8_t> send_packets(const uint8_t *shared_key, const std::vector<uint16_t> &lengths, bool coalesce) {
+  int fds[2];
+  EXPECT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  Socket const sock = {fds[0]};
+  EXPECT_TRUE(set_socket_nonblock(sock));
+
+  std::vector<uint8_t> received;
+  std::thread reader([&]() { received = read_all(fds[1]); });
+
+  TCP_Send_Buffer buf = {};
+  uint8_t nonce[CRYPTO_NONCE_SIZE] = {0};
+  uint8_t data[MAX_PACKET_SIZE];
+
+  for (size_t i = 0; i < lengths.size(); ++i) {
+    memset(data, static_cast<int>(i), lengths[i]);
+
+    while (send_packet_TCP_secure_connection(&buf, sock, shared_key, nonce, data, lengths[i], false, coalesce) == 0) {
+      tcp_send_buffer_flush(&buf, sock);
+      std::this_thread::yield();
+    }
+  }
+
+  while (tcp_send_buffer_flush(&buf, sock) != 0) {
+    std::this_thread::yield();
+  }
+
+  tcp_send_buffer_free(&buf);
+  close(fds[0]);
+  reader.join();
+  close(fds[1]);
+  return received;
+}
+
+TEST(TCPSendBuffer, CoalescingKeepsTheBytesOnTheWire) {
+  uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+  new_symmetric_key(shared_key);
+
+  std::vector<uint16_t> lengths;
+
+  for (uint16_t i = 0; i < 1000; ++i) {
+    lengths.push_back(1 + (i * 37) % (MAX_PACKET_SIZE - CRYPTO_MAC_SIZE));
+  }
+
+  std::vector<uint8_t> const separate = send_packets(shared_key, lengths, false);
+  std::vector<uint8_t> const coalesced = send_packets(shared_key, lengths, true);
+
+  size_t expected = 0;
+
+  for (uint16_t length : lengths) {
+    expected += sizeof(uint16_t) + length + CRYPTO_MAC_SIZE;
+  }
+
+  EXPECT_EQ(separate.size(), expected);
+  EXPECT_EQ(coalesced, separate);
+}
+
+TEST(TCPSendBuffer, CoalescingBenchmark) {
+  uint32_t packets = 200000;
+  char const *env = std::getenv("TCP_COALESCING_BENCHMARK_PACKETS");
+
+  if (env != nullptr) {
+    packets = std::max(1000, std::atoi(env));
+  }
+
+  // The packets a net_crypto tick sends to one relay at a time.
+  constexpr uint32_t kBatch = 32;
+
+  uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+  new_symmetric_key(shared_key);
+
+  for (bool const coalesce : {false, true}) {
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+    Socket const sock = {fds[0]};
+    ASSERT_TRUE(set_socket_nonblock(sock));
+
+    size_t received = 0;
+    std::thread reader([&]() { received = read_all(fds[1]).size(); });
+
+    TCP_Send_Buffer buf = {};
+    uint8_t nonce[CRYPTO_NONCE_SIZE] = {0};
+    uint8_t data[kPacketSize] = {0};
+
+    auto const start = Clock::now();
+
+    for (uint32_t sent = 0; sent < packets; sent += kBatch) {
+      for (uint32_t i = 0; i < kBatch; ++i) {
+        while (send_packet_TCP_secure_connection(&buf, sock, shared_key, nonce, data, sizeof(data), false, coalesce) ==
+               0) {
+          tcp_send_buffer_flush(&buf, sock);
+          std::this_thread::yield();
+        }
+      }
+
+      tcp_send_buffer_flush(&buf, sock);
+    }
+
+    while (tcp_send_buffer_flush(&buf, sock) != 0) {
+      std::this_thread::yield();
+    }
+
+    close(fds[0]);
+    reader.join();
+    double const seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    size_t const total = (packets + kBatch - 1) / kBatch * kBatch;
+    EXPECT_EQ(received, total * (sizeof(uint16_t) + kPacketSize + CRYPTO_MAC_SIZE));
+    std::printf("%s writes: %u packets of %u bytes in %.3f s, %.0f packets/s, %.1f MB/s\n",
+                coalesce ? "coalesced" : "per-packet", static_cast<unsigned>(total), kPacketSize, seconds,
+                total / seconds, received / seconds / 1e6);
+
+    tcp_send_buffer_free(&buf);
+    close(fds[1]);
+  }
+}
+
+TEST(TCPServer, RelaysBetweenShards) {
+  for (uint16_t num_shards : {0, 1, 3}) {
+    Relay relay(num_shards);
+    ASSERT_TRUE(relay.ok());
+
+    // With 32 pairs, some are all but sure to end up on different shards.
+    Load_Result const result = run_load(relay, 64, 2, 10);
+    EXPECT_EQ(result.online, 64) << num_shards << " shards";
+    EXPECT_EQ(result.delivered, 64 * 10) << num_shards << " shards";
+    EXPECT_EQ(result.oob, 64) << num_shards << " shards";
+  }
+}
+
+// The load generator: a few thousand clients over loopback, relaying through
+// the single-threaded server and through increasing numbers of shards.
+// A node on a loopback UDP port with the onion that a relay hands the onion
+// requests of its clients to.
+class Onion_Node {
+ public:
+  Onion_Node() : log_(logger_new()), mono_time_(mono_time_new()) {
+    IP ip;
+    ip_init(&ip, false);
+    ip.ip.v4 = get_ip4_loopback();
+    net_ = new_networking_ex(log_, ip, kFirstPort + 200, kFirstPort + 300, nullptr);
+    dht_ = new_dht(log_, mono_time_, net_, false, 0, 0, nullptr, nullptr);
+    onion_ = new_onion(mono_time_, dht_);
+  }
+
+  ~Onion_Node() {
+    kill_onion(onion_);
+    kill_dht(dht_);
+    kill_networking(net_);
+    mono_time_free(mono_time_);
+    logger_kill(log_);
+  }
+
+  bool ok() const { return onion_ != nullptr; }
+  Onion *onion() const { return onion_; }
+  uint16_t port() const { return net_port(net_); }
+
+ private:
+  Logger *log_;
+  Mono_Time *mono_time_;
+  Networking_Core *net_ = nullptr;
+  DHT *dht_ = nullptr;
+  Onion *onion_ = nullptr;
+};
+
+int handle_onion_response(void *object, const uint8_t *data, uint16_t length, void *userdata) {
+  static_cast<std::vector<uint8_t> *>(object)->assign(data, data + length);
+  return 0;
+}
+
+// An onion request sent through a shard goes out through the onion of the
+// parent, and the response to it comes back to the shard of the client.
+TEST(TCPServer, RelaysOnionResponsesToShards) {
+  Onion_Node node;
+  ASSERT_TRUE(node.ok());
+  Relay relay(4, node.onion());
+  ASSERT_TRUE(relay.ok());
+
+  // Stands in for the first node of the onion path.
+  int const udp = socket(AF_INET, SOCK_DGRAM, 0);
+  ASSERT_GE(udp, 0);
+  sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ASSERT_EQ(bind(udp, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)), 0);
+  socklen_t addr_len = sizeof(addr);
+  ASSERT_EQ(getsockname(udp, reinterpret_cast<sockaddr *>(&addr), &addr_len), 0);
+
+  Mono_Time *mono_time = mono_time_new();
+  uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+  uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+  crypto_new_keypair(public_key, secret_key);
+  TCP_Client_Connection *con =
+      new_TCP_connection(mono_time, relay.ip_port(), relay.public_key(), public_key, secret_key, nullptr);
+  ASSERT_NE(con, nullptr);
+  std::vector<uint8_t> response;
+  onion_response_handler(con, &handle_onion_response, &response);
+
+  // Service the client until done() or the deadline.
+  auto const run_until = [&](const std::function<bool()> &done) {
+    auto const deadline = Clock::now() + std::chrono::seconds(10);
+
+    while (Clock::now() < deadline) {
+      if (done()) {
+        return true;
+      }
+
+      mono_time_update(mono_time);
+      do_TCP_connection(mono_time, con, nullptr);
+      pollfd pfd = {tcp_con_sock(con).socket, POLLIN, 0};
+      poll(&pfd, 1, 10);
+    }
+
+    return false;
+  };
+
+  ASSERT_TRUE(run_until([&]() { return tcp_con_status(con) == TCP_CLIENT_CONFIRMED; }));
+
+  // A nonce, then where the node sends the rest of the request.
+  std::vector<uint8_t> request(CRYPTO_NONCE_SIZE + SIZE_IPPORT + 200, 7);
+  random_nonce(request.data());
+  uint8_t *const dest = request.data() + CRYPTO_NONCE_SIZE;
+  memset(dest, 0, SIZE_IPPORT);
+  dest[0] = net_family_ipv4.value;
+  memcpy(dest + 1, &addr.sin_addr, SIZE_IP4);
+  memcpy(dest + SIZE_IP, &addr.sin_port, SIZE_PORT);
+  ASSERT_EQ(send_onion_request(con, request.data(), request.size()), 1);
+
+  uint8_t forwarded[ONION_MAX_PACKET_SIZE];
+  ssize_t forwarded_len = 0;
+  ASSERT_TRUE(run_until([&]() {
+    forwarded_len = recv(udp, forwarded, sizeof(forwarded), MSG_DONTWAIT);
+    return forwarded_len > 0;
+  }));
+  ASSERT_GT(forwarded_len, ONION_RETURN_1);
+  EXPECT_EQ(forwarded[0], NET_PACKET_ONION_SEND_1);
+
+  // Answer with the return path the node appended.
+  std::vector<uint8_t> payload(100, 9);
+  payload[0] = NET_PACKET_ANNOUNCE_RESPONSE;
+  std::vector<uint8_t> reply = {NET_PACKET_ONION_RECV_1};
+  reply.insert(reply.end(), forwarded + forwarded_len - ONION_RETURN_1, forwarded + forwarded_len);
+  reply.insert(reply.end(), payload.begin(), payload.end());
+
+  sockaddr_in node_addr = addr;
+  node_addr.sin_port = node.port();
+  ASSERT_EQ(sendto(udp, reply.data(), reply.size(), 0, reinterpret_cast<sockaddr *>(&node_addr), sizeof(node_addr)),
+            static_cast<ssize_t>(reply.size()));
+
+  EXPECT_TRUE(run_until([&]() { return !response.empty(); }));
+  EXPECT_EQ(response, payload);
+
+  kill_TCP_connection(con);
+  mono_time_free(mono_time);
+  close(udp);
+}
+
+TEST(TCPServer, ShardedLoadBenchmark) {
+  raise_fd_limit();
+
+  uint32_t const num_peers = 2000;
+  uint32_t const packets = 20;
+  uint32_t const num_cpus = std::max(1u, std::thread::hardware_concurrency());
+
+  for (uint16_t num_shards : {0, 1, 2, 4}) {
+    Relay relay(num_shards);
+    ASSERT_TRUE(relay.ok());
+
+    Load_Result const result = run_load(relay, num_peers, 4, packets);
+    EXPECT_EQ(result.online, num_peers);
+
+    std::printf("%u clients, %u shards (%u cpus): %u/%u packets in %.2f s, %.0f packets/s, "
+                "latency p50 %.0f us, p99 %.0f us\n",
+                num_peers, num_shards, num_cpus, result.delivered, num_peers * packets, result.seconds,
+                result.delivered / result.seconds, result.p50_us, result.p99_us);
+  }
+}
+
+// Resident set size in kB, 0 where /proc isn't there.
+long rss_kb() {
+  FILE *status = std::fopen("/proc/self/status", "r");
+
+  if (status == nullptr) {
+    return 0;
+  }
+
+  char line[256];
+  long kb = 0;
+
+  while (std::fgets(line, sizeof(line), status) != nullptr) {
+    if (std::sscanf(line, "VmRSS: %ld kB", &kb) == 1) {
+      break;
+    }
+  }
+
+  std::fclose(status);
+  return kb;
+}
+
+// Clients that keep asking the relay for a route and never read the answers.
+// Their socket buffers are tiny, so what neither end's kernel takes is queued
+// by the relay and by the clients themselves.
+class Slow_Readers {
+ public:
+  Slow_Readers(const Relay &relay, uint32_t count, uint32_t limit) : mono_time_(mono_time_new()) {
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+    auto const deadline = Clock::now() + std::chrono::seconds(10);
+
+    for (uint32_t i = 0; i < count; ++i) {
+      uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+      crypto_new_keypair(public_key, secret_key);
+      TCP_Client_Connection *con =
+          new_TCP_connection(mono_time_, relay.ip_port(), relay.public_key(), public_key, secret_key, nullptr);
+      tcp_con_set_send_buffer_limit(con, limit);
+
+      while (tcp_con_status(con) != TCP_CLIENT_CONFIRMED && Clock::now() < deadline) {
+        mono_time_update(mono_time_);
+        do_TCP_connection(mono_time_, con, nullptr);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+
+      int const bufsize = 4096;
+      setsockopt(tcp_con_sock(con).socket, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+      setsockopt(tcp_con_sock(con).socket, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+      cons_.push_back(con);
+    }
+
+    thread_ = std::thread([this] { run(); });
+  }
+
+  ~Slow_Readers() {
+    stop_ = true;
+    thread_.join();
+
+    for (TCP_Client_Connection *con : cons_) {
+      kill_TCP_connection(con);
+    }
+
+    mono_time_free(mono_time_);
+  }
+
+  uint64_t requests() const { return requests_; }
+  uint64_t refused() const { return refused_; }
+
+ private:
+  void run() {
+    uint8_t nobody[CRYPTO_PUBLIC_KEY_SIZE] = {1};
+
+    while (!stop_) {
+      bool any = false;
+
+      for (TCP_Client_Connection *con : cons_) {
+        for (int i = 0; i < 64; ++i) {
+          if (send_routing_request(con, nobody) == 1) {
+            ++requests_;
+            any = true;
+          } else {
+            ++refused_;
+            break;
+          }
+        }
+      }
+
+      if (!any) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    }
+  }
+
+  Mono_Time *mono_time_;
+  std::vector<TCP_Client_Connection *> cons_;
+  std::thread thread_;
+  std::atomic<bool> stop_{false};
+  std::atomic<uint64_t> requests_{0};
+  std::atomic<uint64_t> refused_{0};
+};
+
+// Pairs relaying packets while other clients flood the relay without reading,
+// with the default send buffer limit and with send buffers as good as
+// unlimited. The default goes first, as memory freed after the unlimited run
+// stays resident.
+TEST(TCPServer, SlowReaderBenchmark) {
+  raise_fd_limit();
+
+  uint32_t const num_slow = 50;
+
+  for (uint32_t limit : {0u, UINT32_MAX}) {
+    Relay relay(0);
+    ASSERT_TRUE(relay.ok());
+    relay.set_send_buffer_limit(limit);
+
+    long const rss_before = rss_kb();
+    Load_Result result;
+    long rss_during;
+    uint64_t requests;
+    uint64_t refused;
+
+    {
+      Slow_Readers slow(relay, num_slow, limit);
+      std::this_thread::sleep_for(std::chrono::seconds(2));
+      result = run_load(relay, 200, 2, 50);
+      rss_during = rss_kb();
+      requests = slow.requests();
+      refused = slow.refused();
+    }
+
+    EXPECT_EQ(result.online, 200u);
+
+    if (limit == 0) {
+      // The relay and the slow readers hold at most a full buffer per
+      // connection, plus whatever the load generator uses.
+      EXPECT_LT(rss_during - rss_before, long{2 * num_slow * TCP_SEND_BUFFER_DEFAULT_LIMIT / 1024 + 16384});
+    }
+
+    std::printf("%u slow readers, %s send buffers: %u/%u packets in %.2f s, %.0f packets/s, p99 %.0f us; "
+                "%llu requests queued, %llu refused; RSS +%ld kB\n",
+                num_slow, limit == UINT32_MAX ? "unlimited" : "default", result.delivered, 200 * 50,
+                result.seconds, result.delivered / result.seconds, result.p99_us,
+                static_cast<unsigned long long>(requests), static_cast<unsigned long long>(refused),
+                rss_during - rss_before);
+  }
+}
+
+}  // namespace
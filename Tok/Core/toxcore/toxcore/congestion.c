@@ -0,0 +1,263 @@
+/*
+ * Congestion controllers for lossless net_crypto connections.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "congestion.h"
+
+#include "ccompat.h"
+
+/* If the send queue is SEND_QUEUE_RATIO times larger than the
+ * calculated link speed the packet send speed will be reduced
+ * by a value depending on this number.
+ */
+#define SEND_QUEUE_RATIO 2.0
+
+typedef struct Queue_State {
+    uint32_t last_sendqueue_size[CONGESTION_QUEUE_ARRAY_SIZE];
+    uint32_t last_sendqueue_counter;
+    long signed int last_num_packets_sent[CONGESTION_LAST_SENT_ARRAY_SIZE];
+    long signed int last_num_packets_resent[CONGESTION_LAST_SENT_ARRAY_SIZE];
+} Queue_State;
+
+static void queue_update(void *state, const Congestion_Sample *sample, double *send_rate, double *send_rate_requested)
+{
+    Queue_State *const q = (Queue_State *)state;
+
+    unsigned int pos = q->last_sendqueue_counter % CONGESTION_QUEUE_ARRAY_SIZE;
+    q->last_sendqueue_size[pos] = sample->send_queue_size;
+
+    long signed int sum = 0;
+    sum = (long signed int)q->last_sendqueue_size[pos] -
+          (long signed int)q->last_sendqueue_size[(pos + 1) % CONGESTION_QUEUE_ARRAY_SIZE];
+
+    unsigned int n_p_pos = q->last_sendqueue_counter % CONGESTION_LAST_SENT_ARRAY_SIZE;
+    q->last_num_packets_sent[n_p_pos] = sample->packets_sent;
+    q->last_num_packets_resent[n_p_pos] = sample->packets_resent;
+
+    q->last_sendqueue_counter = (q->last_sendqueue_counter + 1) %
+                                (CONGESTION_QUEUE_ARRAY_SIZE * CONGESTION_LAST_SENT_ARRAY_SIZE);
+
+    if (sample->hold_rates) {
+        return;
+    }
+
+    long signed int total_sent = 0, total_resent = 0;
+
+    // TODO(irungentoo): use real delay
+    unsigned int delay = (unsigned int)((sample->min_rtt / CONGESTION_SAMPLE_INTERVAL) + 0.5);
+    unsigned int packets_set_rem_array = (CONGESTION_LAST_SENT_ARRAY_SIZE - CONGESTION_QUEUE_ARRAY_SIZE);
+
+    if (delay > packets_set_rem_array) {
+        delay = packets_set_rem_array;
+    }
+
+    for (unsigned j = 0; j < CONGESTION_QUEUE_ARRAY_SIZE; ++j) {
+        unsigned int ind = (j + (packets_set_rem_array  - delay) + n_p_pos) % CONGESTION_LAST_SENT_ARRAY_SIZE;
+        total_sent += q->last_num_packets_sent[ind];
+        total_resent += q->last_num_packets_resent[ind];
+    }
+
+    if (sum > 0) {
+        total_sent -= sum;
+    } else {
+        if (total_resent > -sum) {
+            total_resent = -sum;
+        }
+    }
+
+    /* if queue is too big only allow resending packets. */
+    uint32_t npackets = sample->send_queue_size;
+    double min_speed = 1000.0 * (((double)(total_sent)) / ((double)(CONGESTION_QUEUE_ARRAY_SIZE) *
+                                 CONGESTION_SAMPLE_INTERVAL));
+
+    double min_speed_request = 1000.0 * (((double)(total_sent + total_resent)) / ((double)(
+            CONGESTION_QUEUE_ARRAY_SIZE) * CONGESTION_SAMPLE_INTERVAL));
+
+    if (min_speed < sample->min_rate) {
+        min_speed = sample->min_rate;
+    }
+
+    double send_array_ratio = (((double)npackets) / min_speed);
+
+    // TODO(irungentoo): Improve formula?
+    if (send_array_ratio > SEND_QUEUE_RATIO && sample->min_queue_length < npackets) {
+        *send_rate = min_speed * (1.0 / (send_array_ratio / SEND_QUEUE_RATIO));
+    } else if (sample->last_congestion_event + CONGESTION_EVENT_TIMEOUT < sample->time) {
+        *send_rate = min_speed * 1.2;
+    } else {
+        *send_rate = min_speed * 0.9;
+    }
+
+    *send_rate_requested = min_speed_request * 1.2;
+}
+
+const Congestion_Control congestion_control_queue = {
+    "queue",
+    sizeof(Queue_State),
+    queue_update,
+};
+
+/* The base delay is the lowest round trip time in the last
+ * LEDBAT_BASE_HISTORY periods of LEDBAT_BASE_PERIOD ms, so that it follows
+ * route changes.
+ */
+#define LEDBAT_BASE_HISTORY 10
+#define LEDBAT_BASE_PERIOD 60000
+
+/* How much the rate may grow (when there is no queueing delay) or shrink
+ * (when the queueing delay is twice the target) per round trip.
+ */
+#define LEDBAT_GAIN 1.0
+#define LEDBAT_DECREASE 0.5
+
+/* The delivery rate is the highest seen in the last LEDBAT_DELIVERY_HISTORY samples. */
+#define LEDBAT_DELIVERY_HISTORY 4
+
+typedef struct Ledbat_State {
+    /* Lowest round trip time plus one in each period, 0 if none yet. */
+    uint64_t base_delay[LEDBAT_BASE_HISTORY];
+    uint32_t base_index;
+    uint64_t base_period_start;
+    uint64_t last_decrease;
+
+    /* Packets per second the peer acknowledged. */
+    double delivered[LEDBAT_DELIVERY_HISTORY];
+    uint32_t delivered_index;
+    uint32_t last_send_queue_size;
+} Ledbat_State;
+
+static uint64_t ledbat_base_delay(Ledbat_State *l, uint64_t time, uint64_t rtt)
+{
+    if (l->base_period_start + LEDBAT_BASE_PERIOD <= time) {
+        l->base_index = (l->base_index + 1) % LEDBAT_BASE_HISTORY;
+        l->base_delay[l->base_index] = 0;
+        l->base_period_start = time;
+    }
+
+    if (l->base_delay[l->base_index] == 0 || rtt + 1 < l->base_delay[l->base_index]) {
+        l->base_delay[l->base_index] = rtt + 1;
+    }
+
+    uint64_t base = UINT64_MAX;
+
+    for (uint32_t i = 0; i < LEDBAT_BASE_HISTORY; ++i) {
+        if (l->base_delay[i] != 0 && l->base_delay[i] - 1 < base) {
+            base = l->base_delay[i] - 1;
+        }
+    }
+
+    return base;
+}
+
+/* The rate at which the peer has recently been acknowledging packets. A rate
+ * based sender has no window to stop it, so this is what keeps it from running
+ * far ahead of the path while the delay it causes is still on its way back.
+ */
+static double ledbat_delivery_rate(Ledbat_State *l, const Congestion_Sample *sample)
+{
+    /* New packets join the send queue, and acknowledged ones leave it. */
+    int64_t acked = (int64_t)l->last_send_queue_size + sample->packets_sent - sample->send_queue_size;
+    l->last_send_queue_size = sample->send_queue_size;
+
+    if (acked < 0) {
+        acked = 0;
+    }
+
+    l->delivered_index = (l->delivered_index + 1) % LEDBAT_DELIVERY_HISTORY;
+    l->delivered[l->delivered_index] = (acked * 1000.0) / sample->interval;
+
+    double delivered = 0;
+
+    for (uint32_t i = 0; i < LEDBAT_DELIVERY_HISTORY; ++i) {
+        if (l->delivered[i] > delivered) {
+            delivered = l->delivered[i];
+        }
+    }
+
+    return delivered;
+}
+
+static void ledbat_update(void *state, const Congestion_Sample *sample, double *send_rate, double *send_rate_requested)
+{
+    Ledbat_State *const l = (Ledbat_State *)state;
+
+    if (sample->hold_rates || sample->interval == 0) {
+        /* The next delivery rate counts from this sample's queue. */
+        l->last_send_queue_size = sample->send_queue_size;
+        return;
+    }
+
+    const double delivered = ledbat_delivery_rate(l, sample);
+    double rate = *send_rate;
+
+    /* The resends for one burst of losses trickle out over several round
+     * trips, so only the first of them counts. */
+    if (sample->packets_resent != 0 && l->last_decrease + sample->min_rtt + CONGESTION_EVENT_TIMEOUT <= sample->time) {
+        rate /= 2;
+        l->last_decrease = sample->time;
+    } else if (sample->rtt != UINT64_MAX) {
+        const uint64_t base = ledbat_base_delay(l, sample->time, sample->rtt);
+        double off_target = (CONGESTION_LEDBAT_TARGET - (double)(sample->rtt - base)) / CONGESTION_LEDBAT_TARGET;
+
+        if (off_target < -1.0) {
+            off_target = -1.0;
+        }
+
+        /* Changes are made per round trip, spread over its samples. A sample
+         * shows the rate of up to a round trip and a sample interval ago, so
+         * short round trips count as two intervals. */
+        const double rtt = sample->rtt > 2 * sample->interval ? sample->rtt : 2 * sample->interval;
+        const double step = sample->interval / rtt;
+
+        /* Give slow connections a packet of slack: they send less than one per sample. */
+        const double used = ((sample->packets_sent + sample->packets_resent + 1) * 1000.0) / sample->interval;
+
+        if (off_target < 0) {
+            /* Drain the queue: send slower than the path delivers. */
+            if (rate > delivered) {
+                rate = delivered;
+            }
+
+            rate *= 1.0 + LEDBAT_DECREASE * off_target * step;
+        } else if (used * 2 >= rate) {
+            /* Only grow a rate the connection is actually using, and by at
+             * most twice what gets through. */
+            rate *= 1.0 + LEDBAT_GAIN * off_target * step;
+
+            if (rate > delivered * 2) {
+                rate = delivered * 2;
+            }
+        }
+    }
+
+    *send_rate = rate;
+    *send_rate_requested = rate;
+}
+
+const Congestion_Control congestion_control_ledbat = {
+    "ledbat",
+    sizeof(Ledbat_State),
+    ledbat_update,
+};
@@ -0,0 +1,130 @@
+/*
+ * Congestion controllers for lossless net_crypto connections.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef C_TOXCORE_TOXCORE_CONGESTION_H
+#define C_TOXCORE_TOXCORE_CONGESTION_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Interval in ms between the samples net_crypto gives a congestion controller. */
+#define CONGESTION_SAMPLE_INTERVAL 50
+
+/* Timeout for increasing speed after congestion event (in ms). */
+#define CONGESTION_EVENT_TIMEOUT 1000
+
+/* Base current transfer speed on last CONGESTION_QUEUE_ARRAY_SIZE number of points taken
+   every CONGESTION_SAMPLE_INTERVAL ms. */
+#define CONGESTION_QUEUE_ARRAY_SIZE 12
+#define CONGESTION_LAST_SENT_ARRAY_SIZE (CONGESTION_QUEUE_ARRAY_SIZE * 2)
+
+/* Maximum size in bytes of the per connection state of a congestion controller. */
+#define CONGESTION_MAX_STATE_SIZE 512
+
+/**
+ * What net_crypto measured on a connection since the previous sample. A
+ * sample is taken about every CONGESTION_SAMPLE_INTERVAL ms while the
+ * connection is established.
+ */
+typedef struct Congestion_Sample {
+    /* Current time in ms. */
+    uint64_t time;
+    /* Time in ms since the previous sample. */
+    uint32_t interval;
+
+    /* New packets sent in the interval. */
+    uint32_t packets_sent;
+    /* Packets sent again because the peer asked for them. */
+    uint32_t packets_resent;
+    /* Packets sent but not yet acknowledged by the peer. */
+    uint32_t send_queue_size;
+
+    /* Lowest round trip time seen on the connection, in ms. */
+    uint64_t min_rtt;
+    /* Lowest round trip time seen in the interval, in ms, or UINT64_MAX if
+     * the peer acknowledged nothing. */
+    uint64_t rtt;
+
+    /* Last time the connection used up all the packets it was allowed to send. */
+    uint64_t last_congestion_event;
+
+    /* The connection just switched from TCP to UDP: keep the rates as they are. */
+    bool hold_rates;
+
+    /* Limits set by net_crypto. */
+    double min_rate;
+    uint32_t min_queue_length;
+} Congestion_Sample;
+
+/**
+ * A congestion controller decides how many packets per second a connection
+ * may send.
+ *
+ * update is called with each sample and the current rates. It sets send_rate
+ * to the rate for new packets and send_rate_requested to the rate for new and
+ * resent packets together. net_crypto keeps both at least min_rate, and
+ * send_rate_requested at least send_rate.
+ *
+ * state points to state_size bytes (at most CONGESTION_MAX_STATE_SIZE),
+ * zeroed when the connection is created.
+ */
+typedef struct Congestion_Control {
+    const char *name;
+    uint32_t state_size;
+    void (*update)(void *state, const Congestion_Sample *sample, double *send_rate, double *send_rate_requested);
+} Congestion_Control;
+
+/**
+ * The original net_crypto controller. It estimates the link speed from the
+ * packets sent a round trip ago, and slows down when the send queue grows
+ * past twice that speed.
+ */
+extern const Congestion_Control congestion_control_queue;
+
+/**
+ * A LEDBAT style delay based controller. It takes the lowest round trip time
+ * of the last few minutes as the base delay, and adjusts the rate so that
+ * packets spend about CONGESTION_LEDBAT_TARGET ms queued on the path. It halves
+ * the rate when packets are lost, at most once per round trip and congestion
+ * event timeout.
+ *
+ * In the link emulation of net_crypto_test it gets less through than the
+ * queue controller on every link, and with a deep buffer (the mobile profile)
+ * it does not keep the queue shorter either: about a third of the goodput at
+ * twice the median queueing delay. The queue controller stays the default,
+ * and this one is not offered in Tox_Options; net_crypto_set_congestion_control
+ * still selects it for experiments.
+ */
+extern const Congestion_Control congestion_control_ledbat;
+
+/* Queueing delay in ms the LEDBAT controller aims for. */
+#define CONGESTION_LEDBAT_TARGET 50
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif
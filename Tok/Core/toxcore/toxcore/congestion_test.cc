@@ -0,0 +1,183 @@
+#include "congestion.h"
+
+#include <algorithm>
+#include <array>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+// Drives a controller with samples taken every CONGESTION_SAMPLE_INTERVAL ms.
+class Controller {
+ public:
+  explicit Controller(const Congestion_Control &control) : control_(control) {
+    EXPECT_LE(control.state_size, CONGESTION_MAX_STATE_SIZE);
+    state_.fill(0);
+  }
+
+  // One interval in which the connection sent at the current rate and saw
+  // the given round trip time (UINT64_MAX for none).
+  void sample(uint64_t rtt, uint32_t resent = 0, uint32_t queue = 0) {
+    time_ += CONGESTION_SAMPLE_INTERVAL;
+
+    Congestion_Sample sample = {};
+    sample.time = time_;
+    sample.interval = CONGESTION_SAMPLE_INTERVAL;
+    credit_ += std::min(send_rate, max_rate) * CONGESTION_SAMPLE_INTERVAL / 1000;
+    sample.packets_sent = static_cast<uint32_t>(credit_);
+    credit_ -= sample.packets_sent;
+    sample.packets_resent = resent;
+    sample.send_queue_size = queue;
+    if (rtt < min_rtt_) {
+      min_rtt_ = rtt;
+    }
+
+    sample.min_rtt = min_rtt_;
+    sample.rtt = rtt;
+    sample.hold_rates = hold_rates;
+    sample.min_rate = 4.0;
+    sample.min_queue_length = 64;
+
+    if (!use_rate) {
+      sample.packets_sent = 0;
+    }
+
+    control_.update(state_.data(), &sample, &send_rate, &send_rate_requested);
+
+    // As net_crypto does.
+    send_rate = std::max(send_rate, sample.min_rate);
+    send_rate_requested = std::max(send_rate_requested, send_rate);
+  }
+
+  double send_rate = 1000;
+  double send_rate_requested = 1000;
+  bool hold_rates = false;
+  bool use_rate = true;
+  // The most the application has to send.
+  double max_rate = 10000;
+
+ private:
+  const Congestion_Control &control_;
+  std::array<uint8_t, CONGESTION_MAX_STATE_SIZE> state_;
+  uint64_t time_ = 100000;
+  uint64_t min_rtt_ = 1000;
+  double credit_ = 0;
+};
+
+TEST(CongestionQueue, SpeedsUpWhileTheQueueStaysShort) {
+  Controller c(congestion_control_queue);
+  c.send_rate = 4;
+
+  // 1.2 times the rate packets were sent at, every sample.
+  for (int i = 0; i < 100; ++i) {
+    c.sample(20);
+  }
+
+  EXPECT_GT(c.send_rate, 40);
+  EXPECT_GE(c.send_rate_requested, c.send_rate);
+}
+
+TEST(CongestionQueue, SlowsDownWhenTheQueueGrows) {
+  Controller c(congestion_control_queue);
+
+  for (int i = 0; i < CONGESTION_LAST_SENT_ARRAY_SIZE; ++i) {
+    c.sample(20, 0, 5000);
+  }
+
+  EXPECT_LT(c.send_rate, 1000);
+}
+
+TEST(CongestionQueue, HoldsTheRatesWhenAsked) {
+  Controller c(congestion_control_queue);
+  c.hold_rates = true;
+
+  for (int i = 0; i < CONGESTION_LAST_SENT_ARRAY_SIZE; ++i) {
+    c.sample(20, 0, 5000);
+  }
+
+  EXPECT_EQ(c.send_rate, 1000);
+  EXPECT_EQ(c.send_rate_requested, 1000);
+}
+
+TEST(CongestionLedbat, GrowsWithoutQueueingDelay) {
+  Controller c(congestion_control_ledbat);
+
+  for (int i = 0; i < 20; ++i) {
+    c.sample(20);
+  }
+
+  EXPECT_GT(c.send_rate, 2000);
+}
+
+TEST(CongestionLedbat, DoesNotGrowAnUnusedRate) {
+  Controller c(congestion_control_ledbat);
+  c.use_rate = false;
+
+  for (int i = 0; i < 20; ++i) {
+    c.sample(20);
+  }
+
+  EXPECT_EQ(c.send_rate, 1000);
+}
+
+TEST(CongestionLedbat, ShrinksAboveTheTargetDelay) {
+  Controller c(congestion_control_ledbat);
+  c.sample(20);
+  double const rate = c.send_rate;
+
+  for (int i = 0; i < 5; ++i) {
+    c.sample(20 + 2 * CONGESTION_LEDBAT_TARGET);
+  }
+
+  EXPECT_LT(c.send_rate, rate * 0.8);
+}
+
+TEST(CongestionLedbat, SettlesAtTheTargetDelay) {
+  Controller c(congestion_control_ledbat);
+  c.sample(20);
+  double const rate = c.send_rate;
+
+  for (int i = 0; i < 20; ++i) {
+    c.sample(20 + CONGESTION_LEDBAT_TARGET);
+  }
+
+  EXPECT_DOUBLE_EQ(c.send_rate, rate);
+}
+
+TEST(CongestionLedbat, HalvesOnLossOncePerLossEvent) {
+  Controller c(congestion_control_ledbat);
+  c.sample(200, 10);
+  EXPECT_EQ(c.send_rate, 500);
+
+  // The resends for the same losses keep coming for a round trip and the
+  // congestion event timeout.
+  for (int i = 1; i < (200 + CONGESTION_EVENT_TIMEOUT) / CONGESTION_SAMPLE_INTERVAL; ++i) {
+    c.sample(UINT64_MAX, 10);
+  }
+
+  EXPECT_EQ(c.send_rate, 500);
+
+  c.sample(UINT64_MAX, 10);
+  EXPECT_EQ(c.send_rate, 250);
+}
+
+TEST(CongestionLedbat, ForgetsAnOldBaseDelay) {
+  Controller c(congestion_control_ledbat);
+  c.sample(20);
+
+  // The route changed: every round trip is now 200ms. Until the base delay
+  // history has passed, that is seen as queueing delay.
+  for (int i = 0; i < 9 * 60000 / CONGESTION_SAMPLE_INTERVAL; ++i) {
+    c.sample(200);
+  }
+
+  EXPECT_LT(c.send_rate, 100);
+
+  for (int i = 0; i < 2 * 60000 / CONGESTION_SAMPLE_INTERVAL; ++i) {
+    c.sample(200);
+  }
+
+  EXPECT_GT(c.send_rate, 1000);
+}
+
+}  // namespace
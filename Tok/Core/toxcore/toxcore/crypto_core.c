@@ -83,6 +83,8 @@
 #error "CRYPTO_PUBLIC_KEY_SIZE is required to be 32 bytes for public_key_cmp to work,"
 #endif
 
+#ifdef VANILLA_NACL
+/* Scratch space for the zero padding the NaCl box API needs. */
 static uint8_t *crypto_malloc(size_t bytes)
 {
     return (uint8_t *)malloc(bytes);
@@ -96,6 +98,7 @@ static void crypto_free(uint8_t *ptr, size_t bytes)
 
     free(ptr);
 }
+#endif
 
 int32_t public_key_cmp(const uint8_t *pk1, const uint8_t *pk2)
 {
@@ -150,13 +153,20 @@ int32_t encrypt_precompute(const uint8_t *public_key, const uint8_t *secret_key,
     return crypto_box_beforenm(shared_key, public_key, secret_key);
 }
 
-int32_t encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
-                               const uint8_t *plain, size_t length, uint8_t *encrypted)
+int32_t encrypt_data_symmetric_detached(const uint8_t *shared_key, const uint8_t *nonce,
+                                        const uint8_t *plain, size_t length, uint8_t *encrypted, uint8_t *mac)
 {
-    if (length == 0 || !secret_key || !nonce || !plain || !encrypted) {
+    if (length == 0 || !shared_key || !nonce || !plain || !encrypted || !mac) {
         return -1;
     }
 
+#ifndef VANILLA_NACL
+
+    if (crypto_box_detached_afternm(encrypted, mac, plain, length, nonce, shared_key) != 0) {
+        return -1;
+    }
+
+#else
     const size_t size_temp_plain = length + crypto_box_ZEROBYTES;
     const size_t size_temp_encrypted = length + crypto_box_MACBYTES + crypto_box_BOXZEROBYTES;
 
@@ -174,30 +184,39 @@ int32_t encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
     memcpy(temp_plain + crypto_box_ZEROBYTES, plain, length);
 
     if (crypto_box_afternm(temp_encrypted, temp_plain, length + crypto_box_ZEROBYTES, nonce,
-                           secret_key) != 0) {
+                           shared_key) != 0) {
         crypto_free(temp_plain, size_temp_plain);
         crypto_free(temp_encrypted, size_temp_encrypted);
         return -1;
     }
 
     // Unpad the encrypted message.
-    memcpy(encrypted, temp_encrypted + crypto_box_BOXZEROBYTES, length + crypto_box_MACBYTES);
+    memcpy(mac, temp_encrypted + crypto_box_BOXZEROBYTES, crypto_box_MACBYTES);
+    memcpy(encrypted, temp_encrypted + crypto_box_ZEROBYTES, length);
 
     crypto_free(temp_plain, size_temp_plain);
     crypto_free(temp_encrypted, size_temp_encrypted);
+#endif
 
-    return length + crypto_box_MACBYTES;
+    return length;
 }
 
-int32_t decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
-                               const uint8_t *encrypted, size_t length, uint8_t *plain)
+int32_t decrypt_data_symmetric_detached(const uint8_t *shared_key, const uint8_t *nonce,
+                                        const uint8_t *encrypted, size_t length, const uint8_t *mac, uint8_t *plain)
 {
-    if (length <= crypto_box_BOXZEROBYTES || !secret_key || !nonce || !encrypted || !plain) {
+    if (length == 0 || !shared_key || !nonce || !encrypted || !mac || !plain) {
+        return -1;
+    }
+
+#ifndef VANILLA_NACL
+
+    if (crypto_box_open_detached_afternm(plain, encrypted, mac, length, nonce, shared_key) != 0) {
         return -1;
     }
 
+#else
     const size_t size_temp_plain = length + crypto_box_ZEROBYTES;
-    const size_t size_temp_encrypted = length + crypto_box_BOXZEROBYTES;
+    const size_t size_temp_encrypted = length + crypto_box_MACBYTES + crypto_box_BOXZEROBYTES;
 
     uint8_t *temp_plain = crypto_malloc(size_temp_plain);
     uint8_t *temp_encrypted = crypto_malloc(size_temp_encrypted);
@@ -210,20 +229,50 @@ int32_t decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
 
     memset(temp_encrypted, 0, crypto_box_BOXZEROBYTES);
     // Pad the message with 16 0 bytes.
-    memcpy(temp_encrypted + crypto_box_BOXZEROBYTES, encrypted, length);
+    memcpy(temp_encrypted + crypto_box_BOXZEROBYTES, mac, crypto_box_MACBYTES);
+    memcpy(temp_encrypted + crypto_box_ZEROBYTES, encrypted, length);
 
-    if (crypto_box_open_afternm(temp_plain, temp_encrypted, length + crypto_box_BOXZEROBYTES, nonce,
-                                secret_key) != 0) {
+    if (crypto_box_open_afternm(temp_plain, temp_encrypted, length + crypto_box_ZEROBYTES, nonce,
+                                shared_key) != 0) {
         crypto_free(temp_plain, size_temp_plain);
         crypto_free(temp_encrypted, size_temp_encrypted);
         return -1;
     }
 
-    memcpy(plain, temp_plain + crypto_box_ZEROBYTES, length - crypto_box_MACBYTES);
+    memcpy(plain, temp_plain + crypto_box_ZEROBYTES, length);
 
     crypto_free(temp_plain, size_temp_plain);
     crypto_free(temp_encrypted, size_temp_encrypted);
-    return length - crypto_box_MACBYTES;
+#endif
+
+    return length;
+}
+
+int32_t encrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
+                               const uint8_t *plain, size_t length, uint8_t *encrypted)
+{
+    if (!encrypted) {
+        return -1;
+    }
+
+    // The MAC goes in front of the encrypted data.
+    if (encrypt_data_symmetric_detached(secret_key, nonce, plain, length, encrypted + crypto_box_MACBYTES,
+                                        encrypted) == -1) {
+        return -1;
+    }
+
+    return length + crypto_box_MACBYTES;
+}
+
+int32_t decrypt_data_symmetric(const uint8_t *secret_key, const uint8_t *nonce,
+                               const uint8_t *encrypted, size_t length, uint8_t *plain)
+{
+    if (length <= crypto_box_MACBYTES || !encrypted) {
+        return -1;
+    }
+
+    return decrypt_data_symmetric_detached(secret_key, nonce, encrypted + crypto_box_MACBYTES,
+                                           length - crypto_box_MACBYTES, encrypted, plain);
 }
 
 int32_t encrypt_data(const uint8_t *public_key, const uint8_t *secret_key, const uint8_t *nonce,
@@ -228,6 +228,33 @@ int32_t encrypt_data_symmetric(const uint8_t *shared_key, const uint8_t *nonce,
 int32_t decrypt_data_symmetric(const uint8_t *shared_key, const uint8_t *nonce, const uint8_t *encrypted, size_t length,
                                uint8_t *plain);
 
+/**
+ * Encrypts plain of length length to encrypted of the same length, and writes
+ * the CRYPTO_MAC_SIZE byte authenticator to mac, using a shared key
+ * CRYPTO_SHARED_KEY_SIZE big and a CRYPTO_NONCE_SIZE byte nonce.
+ *
+ * plain and encrypted may be the same buffer, so a packet can be encrypted in
+ * place with the MAC going wherever its layout wants it.
+ *
+ * @return -1 if there was a problem, length of encrypted data if everything
+ * was fine.
+ */
+int32_t encrypt_data_symmetric_detached(const uint8_t *shared_key, const uint8_t *nonce, const uint8_t *plain,
+                                        size_t length, uint8_t *encrypted, uint8_t *mac);
+
+/**
+ * Decrypts encrypted of length length, authenticated by the CRYPTO_MAC_SIZE
+ * byte mac, to plain of the same length using a shared key
+ * CRYPTO_SHARED_KEY_SIZE big and a CRYPTO_NONCE_SIZE byte nonce.
+ *
+ * encrypted and plain may overlap.
+ *
+ * @return -1 if there was a problem (decryption failed), length of plain data
+ * if everything was fine.
+ */
+int32_t decrypt_data_symmetric_detached(const uint8_t *shared_key, const uint8_t *nonce, const uint8_t *encrypted,
+                                        size_t length, const uint8_t *mac, uint8_t *plain);
+
 /**
  * Increment the given nonce by 1 in big endian (rightmost byte incremented
  * first).
@@ -182,6 +182,12 @@ static Group_c *get_group_c(const Group_Chats *g_c, uint32_t groupnumber)
     return &g_c->chats[groupnumber];
 }
 
+/* Have do_groupchats run on the next iteration, for work it would otherwise only notice within a second. */
+static void schedule_groupchats(Group_Chats *g_c)
+{
+    scheduler_wake(g_c->m->scheduler, SCHEDULER_GROUPCHATS);
+}
+
 /*
  * check if peer with real_pk is in peer array.
  *
@@ -359,6 +365,7 @@ static int add_to_closest(Group_Chats *g_c, uint32_t groupnumber, const uint8_t
 
     if (!g->changed) {
         g->changed = GROUPCHAT_CLOSEST_ADDED;
+        schedule_groupchats(g_c);
     }
 
     return 0;
@@ -552,6 +559,7 @@ static int note_peer_active(Group_Chats *g_c, uint32_t groupnumber, uint16_t pee
     }
 
     g->need_send_name = true;
+    schedule_groupchats(g_c);
 
     return g->numpeers - 1;
 }
@@ -716,6 +724,10 @@ static int delpeer(Group_Chats *g_c, uint32_t groupnumber, int peer_index, void
 
     remove_from_closest(g, peer_index);
 
+    if (g->changed) {
+        schedule_groupchats(g_c);
+    }
+
     const int friendcon_id = getfriend_conn_id_pk(g_c->fr_c, g->group[peer_index].real_pk);
 
     if (friendcon_id != -1 && !keep_connection) {
@@ -2028,6 +2040,7 @@ static int handle_packet_online(Group_Chats *g_c, int friendcon_id, const uint8_
         }
 
         g->need_send_name = true;
+        schedule_groupchats(g_c);
     }
 
     ping_groupchat(g_c, groupnumber);
@@ -2186,6 +2199,7 @@ static int handle_send_peers(Group_Chats *g_c, uint32_t groupnumber, const uint8
             }
 
             g->need_send_name = true;
+            schedule_groupchats(g_c);
         }
 
         const int peer_index = addpeer(g_c, groupnumber, d, d + CRYPTO_PUBLIC_KEY_SIZE, peer_num, userdata, false, true);
@@ -3291,6 +3305,7 @@ Group_Chats *new_groupchats(Mono_Time *mono_time, Messenger *m)
     m_callback_conference_invite(m, &handle_friend_invite_packet);
 
     set_global_status_callback(m->fr_c, &g_handle_any_status, temp);
+    scheduler_wake(m->scheduler, SCHEDULER_GROUPCHATS);
 
     return temp;
 }
@@ -3298,6 +3313,13 @@ Group_Chats *new_groupchats(Mono_Time *mono_time, Messenger *m)
 /* main groupchats loop. */
 void do_groupchats(Group_Chats *g_c, void *userdata)
 {
+    /* Pings and timeouts are kept in whole seconds, anything sooner wakes us with schedule_groupchats. */
+    if (!scheduler_due(g_c->m->scheduler, SCHEDULER_GROUPCHATS)) {
+        return;
+    }
+
+    scheduler_set_next_second(g_c->m->scheduler, SCHEDULER_GROUPCHATS);
+
     for (uint16_t i = 0; i < g_c->num_chats; ++i) {
         Group_c *g = get_group_c(g_c, i);
 
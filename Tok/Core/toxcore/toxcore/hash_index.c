@@ -0,0 +1,250 @@
+/*
+ * Open-addressing hash index from fixed-size byte keys to 32 bit values.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "hash_index.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ccompat.h"
+#include "crypto_core.h"
+
+#define HASH_INDEX_MIN_CAPACITY 16
+
+/* Linear probing with backward-shift deletion, so there are no tombstones. */
+struct Hash_Index {
+    uint32_t key_size;
+    uint32_t capacity; /* Always a power of 2. */
+    uint32_t size;
+    uint64_t seed;
+
+    uint8_t *used;
+    uint8_t *keys;
+    uint32_t *values;
+};
+
+static uint64_t hash_key(const Hash_Index *index, const uint8_t *key)
+{
+    uint64_t h = index->seed;
+    uint32_t i = 0;
+
+    for (; i + sizeof(uint64_t) <= index->key_size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, key + i, sizeof(word));
+        h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 32;
+    }
+
+    for (; i < index->key_size; ++i) {
+        h = (h ^ key[i]) * 0x100000001b3ULL;
+    }
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static uint32_t home_slot(const Hash_Index *index, const uint8_t *key)
+{
+    return (uint32_t)hash_key(index, key) & (index->capacity - 1);
+}
+
+static const uint8_t *slot_key(const Hash_Index *index, uint32_t slot)
+{
+    return &index->keys[(size_t)slot * index->key_size];
+}
+
+/* Find the slot holding key, or the empty slot where it would go. */
+static uint32_t find_slot(const Hash_Index *index, const uint8_t *key)
+{
+    const uint32_t mask = index->capacity - 1;
+    uint32_t slot = home_slot(index, key);
+
+    while (index->used[slot] && memcmp(slot_key(index, slot), key, index->key_size) != 0) {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+static bool alloc_table(Hash_Index *index, uint32_t capacity)
+{
+    uint8_t *used = (uint8_t *)calloc(capacity, sizeof(uint8_t));
+    uint8_t *keys = (uint8_t *)malloc((size_t)capacity * index->key_size);
+    uint32_t *values = (uint32_t *)malloc(capacity * sizeof(uint32_t));
+
+    if (used == nullptr || keys == nullptr || values == nullptr) {
+        free(used);
+        free(keys);
+        free(values);
+        return false;
+    }
+
+    index->used = used;
+    index->keys = keys;
+    index->values = values;
+    index->capacity = capacity;
+    return true;
+}
+
+static bool grow(Hash_Index *index)
+{
+    const uint32_t old_capacity = index->capacity;
+    uint8_t *const old_used = index->used;
+    uint8_t *const old_keys = index->keys;
+    uint32_t *const old_values = index->values;
+
+    if (old_capacity > UINT32_MAX / 2 || !alloc_table(index, old_capacity * 2)) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < old_capacity; ++i) {
+        if (!old_used[i]) {
+            continue;
+        }
+
+        const uint8_t *key = &old_keys[(size_t)i * index->key_size];
+        const uint32_t slot = find_slot(index, key);
+        index->used[slot] = 1;
+        memcpy(&index->keys[(size_t)slot * index->key_size], key, index->key_size);
+        index->values[slot] = old_values[i];
+    }
+
+    free(old_used);
+    free(old_keys);
+    free(old_values);
+    return true;
+}
+
+Hash_Index *hash_index_new(uint32_t key_size)
+{
+    if (key_size == 0) {
+        return nullptr;
+    }
+
+    Hash_Index *index = (Hash_Index *)calloc(1, sizeof(Hash_Index));
+
+    if (index == nullptr) {
+        return nullptr;
+    }
+
+    index->key_size = key_size;
+    index->seed = random_u64();
+
+    if (!alloc_table(index, HASH_INDEX_MIN_CAPACITY)) {
+        free(index);
+        return nullptr;
+    }
+
+    return index;
+}
+
+void hash_index_kill(Hash_Index *index)
+{
+    if (index == nullptr) {
+        return;
+    }
+
+    free(index->used);
+    free(index->keys);
+    free(index->values);
+    free(index);
+}
+
+bool hash_index_set(Hash_Index *index, const uint8_t *key, uint32_t value)
+{
+    uint32_t slot = find_slot(index, key);
+
+    if (index->used[slot]) {
+        index->values[slot] = value;
+        return true;
+    }
+
+    /* Keep the load factor at or below 1/2. */
+    if ((index->size + 1) * 2 > index->capacity) {
+        if (!grow(index)) {
+            return false;
+        }
+
+        slot = find_slot(index, key);
+    }
+
+    index->used[slot] = 1;
+    memcpy(&index->keys[(size_t)slot * index->key_size], key, index->key_size);
+    index->values[slot] = value;
+    ++index->size;
+    return true;
+}
+
+bool hash_index_get(const Hash_Index *index, const uint8_t *key, uint32_t *value)
+{
+    const uint32_t slot = find_slot(index, key);
+
+    if (!index->used[slot]) {
+        return false;
+    }
+
+    *value = index->values[slot];
+    return true;
+}
+
+bool hash_index_remove(Hash_Index *index, const uint8_t *key)
+{
+    const uint32_t mask = index->capacity - 1;
+    uint32_t hole = find_slot(index, key);
+
+    if (!index->used[hole]) {
+        return false;
+    }
+
+    /* Shift later entries of the probe run back into the hole. */
+    for (uint32_t next = (hole + 1) & mask; index->used[next]; next = (next + 1) & mask) {
+        const uint32_t home = home_slot(index, slot_key(index, next));
+
+        /* The entry at next may move to hole only if its home is not in (hole, next]. */
+        const bool home_in_range = hole <= next
+                                   ? (home > hole && home <= next)
+                                   : (home > hole || home <= next);
+
+        if (home_in_range) {
+            continue;
+        }
+
+        memcpy(&index->keys[(size_t)hole * index->key_size], slot_key(index, next), index->key_size);
+        index->values[hole] = index->values[next];
+        hole = next;
+    }
+
+    index->used[hole] = 0;
+    --index->size;
+    return true;
+}
+
+uint32_t hash_index_size(const Hash_Index *index)
+{
+    return index->size;
+}
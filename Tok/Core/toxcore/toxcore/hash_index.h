@@ -0,0 +1,82 @@
+/*
+ * Open-addressing hash index from fixed-size byte keys to 32 bit values.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef C_TOXCORE_TOXCORE_HASH_INDEX_H
+#define C_TOXCORE_TOXCORE_HASH_INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Keys are compared bytewise, so callers must make sure equal keys have equal
+ * bytes (e.g. no uninitialised struct padding). The hash is seeded randomly
+ * per index, so peers choosing keys cannot predict collisions.
+ */
+typedef struct Hash_Index Hash_Index;
+
+/**
+ * Create an empty index for keys of key_size bytes.
+ *
+ * @return nullptr on failure.
+ */
+Hash_Index *hash_index_new(uint32_t key_size);
+
+/**
+ * Free all the memory held by the index.
+ */
+void hash_index_kill(Hash_Index *index);
+
+/**
+ * Map key to value, replacing any previous value for key.
+ *
+ * @return true on success, false if memory allocation failed.
+ */
+bool hash_index_set(Hash_Index *index, const uint8_t *key, uint32_t value);
+
+/**
+ * Look up the value stored for key.
+ *
+ * @return true and set value if the key is present, false otherwise.
+ */
+bool hash_index_get(const Hash_Index *index, const uint8_t *key, uint32_t *value);
+
+/**
+ * Remove key from the index.
+ *
+ * @return true if the key was present.
+ */
+bool hash_index_remove(Hash_Index *index, const uint8_t *key);
+
+/**
+ * @return the number of keys in the index.
+ */
+uint32_t hash_index_size(const Hash_Index *index);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif // C_TOXCORE_TOXCORE_HASH_INDEX_H
@@ -0,0 +1,148 @@
+#include "hash_index.h"
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "crypto_core.h"
+
+namespace {
+
+using Public_Key = std::array<uint8_t, CRYPTO_PUBLIC_KEY_SIZE>;
+
+std::vector<Public_Key> random_keys(uint32_t count, uint32_t seed) {
+  std::mt19937 rng(seed);
+  std::vector<Public_Key> keys(count);
+
+  for (Public_Key &key : keys) {
+    for (uint8_t &byte : key) {
+      byte = static_cast<uint8_t>(rng());
+    }
+  }
+
+  return keys;
+}
+
+struct Hash_Index_Deleter {
+  void operator()(Hash_Index *index) { hash_index_kill(index); }
+};
+
+using Hash_Index_Ptr = std::unique_ptr<Hash_Index, Hash_Index_Deleter>;
+
+TEST(HashIndex, SetGetAndReplace) {
+  Hash_Index_Ptr index(hash_index_new(CRYPTO_PUBLIC_KEY_SIZE));
+  ASSERT_NE(index, nullptr);
+
+  std::vector<Public_Key> const keys = random_keys(2, 1);
+  uint32_t value;
+
+  EXPECT_FALSE(hash_index_get(index.get(), keys[0].data(), &value));
+
+  EXPECT_TRUE(hash_index_set(index.get(), keys[0].data(), 7));
+  EXPECT_TRUE(hash_index_get(index.get(), keys[0].data(), &value));
+  EXPECT_EQ(value, 7);
+  EXPECT_FALSE(hash_index_get(index.get(), keys[1].data(), &value));
+
+  EXPECT_TRUE(hash_index_set(index.get(), keys[0].data(), 9));
+  EXPECT_TRUE(hash_index_get(index.get(), keys[0].data(), &value));
+  EXPECT_EQ(value, 9);
+  EXPECT_EQ(hash_index_size(index.get()), 1);
+}
+
+TEST(HashIndex, OddKeySizesAreSupported) {
+  Hash_Index_Ptr index(hash_index_new(3));
+  ASSERT_NE(index, nullptr);
+
+  uint8_t const a[3] = {1, 2, 3};
+  uint8_t const b[3] = {1, 2, 4};
+  uint32_t value;
+
+  EXPECT_TRUE(hash_index_set(index.get(), a, 1));
+  EXPECT_TRUE(hash_index_set(index.get(), b, 2));
+  EXPECT_TRUE(hash_index_get(index.get(), b, &value));
+  EXPECT_EQ(value, 2);
+  EXPECT_EQ(hash_index_new(0), nullptr);
+}
+
+TEST(HashIndex, RemoveKeepsOtherKeysReachable) {
+  Hash_Index_Ptr index(hash_index_new(CRYPTO_PUBLIC_KEY_SIZE));
+  std::vector<Public_Key> const keys = random_keys(5000, 2);
+
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    ASSERT_TRUE(hash_index_set(index.get(), keys[i].data(), i));
+  }
+
+  for (uint32_t i = 0; i < keys.size(); i += 3) {
+    EXPECT_TRUE(hash_index_remove(index.get(), keys[i].data()));
+    EXPECT_FALSE(hash_index_remove(index.get(), keys[i].data()));
+  }
+
+  for (uint32_t i = 0; i < keys.size(); ++i) {
+    uint32_t value;
+    bool const found = hash_index_get(index.get(), keys[i].data(), &value);
+
+    if (i % 3 == 0) {
+      EXPECT_FALSE(found);
+    } else {
+      ASSERT_TRUE(found);
+      EXPECT_EQ(value, i);
+    }
+  }
+
+  EXPECT_EQ(hash_index_size(index.get()), keys.size() - (keys.size() + 2) / 3);
+}
+
+// Adds and looks up 50k friend keys, comparing against the linear scan that
+// getfriend_id used to do over the friend list.
+TEST(HashIndexBenchmark, FiftyThousandFriends) {
+  uint32_t const count = 50000;
+  std::vector<Public_Key> const keys = random_keys(count, 3);
+  Hash_Index_Ptr index(hash_index_new(CRYPTO_PUBLIC_KEY_SIZE));
+
+  auto const start = std::chrono::steady_clock::now();
+
+  for (uint32_t i = 0; i < count; ++i) {
+    ASSERT_TRUE(hash_index_set(index.get(), keys[i].data(), i));
+  }
+
+  auto const inserted = std::chrono::steady_clock::now();
+
+  for (uint32_t i = 0; i < count; ++i) {
+    uint32_t value;
+    ASSERT_TRUE(hash_index_get(index.get(), keys[i].data(), &value));
+    ASSERT_EQ(value, i);
+  }
+
+  auto const looked_up = std::chrono::steady_clock::now();
+
+  // The scan is quadratic over all keys, so only time a sample.
+  uint32_t const scan_samples = 1000;
+  uint32_t found = 0;
+
+  for (uint32_t i = 0; i < count; i += count / scan_samples) {
+    for (uint32_t j = 0; j < count; ++j) {
+      if (std::memcmp(keys[j].data(), keys[i].data(), CRYPTO_PUBLIC_KEY_SIZE) == 0) {
+        ++found;
+        break;
+      }
+    }
+  }
+
+  auto const scanned = std::chrono::steady_clock::now();
+
+  EXPECT_EQ(found, scan_samples);
+
+  auto const ns = [](std::chrono::steady_clock::duration d) {
+    return std::chrono::duration<double, std::nano>(d).count();
+  };
+  std::printf("%u friends: insert %.0f ns/op, lookup %.0f ns/op, linear scan %.0f ns/op\n", count,
+              ns(inserted - start) / count, ns(looked_up - inserted) / count, ns(scanned - looked_up) / scan_samples);
+}
+
+}  // namespace
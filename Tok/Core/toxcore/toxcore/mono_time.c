@@ -11,6 +11,7 @@
 #ifdef __APPLE__
 #include <mach/clock.h>
 #include <mach/mach.h>
+#include <mach/mach_time.h>
 #endif
 
 #ifndef OS_WIN32
@@ -136,3 +137,29 @@ uint64_t current_time_monotonic(Mono_Time *mono_time)
 {
     return mono_time->current_time_callback(mono_time, mono_time->user_data);
 }
+
+/* return current monotonic time in microseconds (us). */
+uint64_t current_time_monotonic_us(void)
+{
+#ifdef OS_WIN32
+    LARGE_INTEGER freq;
+    LARGE_INTEGER count;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&count);
+    const uint64_t f = (uint64_t)freq.QuadPart;
+    const uint64_t c = (uint64_t)count.QuadPart;
+    return c / f * 1000000ULL + c % f * 1000000ULL / f;
+#elif defined(__APPLE__)
+    static mach_timebase_info_data_t timebase;
+
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+
+    return mach_absolute_time() / 1000ULL * timebase.numer / timebase.denom;
+#else
+    struct timespec clock_mono;
+    clock_gettime(CLOCK_MONOTONIC, &clock_mono);
+    return 1000000ULL * clock_mono.tv_sec + (clock_mono.tv_nsec / 1000ULL);
+#endif
+}
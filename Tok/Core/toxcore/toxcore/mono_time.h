@@ -67,6 +67,12 @@ bool mono_time_is_timeout(const Mono_Time *mono_time, uint64_t timestamp, uint64
  */
 uint64_t current_time_monotonic(Mono_Time *mono_time);
 
+/**
+ * Return current monotonic time in microseconds (us), for measuring how long
+ * something took. Unlike current_time_monotonic, it can't be overridden.
+ */
+uint64_t current_time_monotonic_us(void);
+
 typedef uint64_t mono_time_current_time_cb(Mono_Time *mono_time, void *user_data);
 
 /* Override implementation of current_time_monotonic() (for tests).
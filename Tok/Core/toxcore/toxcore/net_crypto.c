@@ -33,19 +33,58 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "hash_index.h"
 #include "mono_time.h"
+#include "precompute.h"
 #include "util.h"
 
 typedef struct Packet_Data {
     uint64_t sent_time;
+    bool resent; /* Requested again by the peer, so its acknowledgement gives no rtt sample. */
     uint16_t length;
     uint8_t data[MAX_CRYPTO_DATA_SIZE];
 } Packet_Data;
 
+/* Packet_Data for the packet arrays of all connections comes from chunks of
+ * PACKET_SLAB_CHUNK_SLOTS slots, so buffering a packet does not cost a
+ * malloc. A chunk is freed once it is empty, except for one kept in reserve
+ * so that a steady stream of packets does not allocate at all.
+ */
+#define PACKET_SLAB_CHUNK_SLOTS (CRYPTO_PACKET_BUFFER_SIZE / 512)
+
+typedef struct Packet_Chunk Packet_Chunk;
+typedef struct Packet_Slot Packet_Slot;
+
+struct Packet_Slot {
+    Packet_Data data; /* Must be first, slots are handed out as their data. */
+    Packet_Chunk *chunk;
+    Packet_Slot *next_free;
+};
+
+struct Packet_Chunk {
+    /* List of chunks with free slots. Full chunks are in no list. */
+    Packet_Chunk *prev;
+    Packet_Chunk *next;
+
+    Packet_Slot *free_slots;
+    uint32_t used;
+    Packet_Slot slots[PACKET_SLAB_CHUNK_SLOTS];
+};
+
+typedef struct Packet_Slab {
+    /* Connections are written to from other threads under their own mutex. */
+    pthread_mutex_t mutex;
+    Packet_Chunk *partial;
+    Packet_Chunk *reserve;
+    uint32_t num_chunks;
+    uint64_t chunks_allocated;
+} Packet_Slab;
+
 typedef struct Packets_Array {
     Packet_Data *buffer[CRYPTO_PACKET_BUFFER_SIZE];
     uint32_t  buffer_start;
     uint32_t  buffer_end; /* packet numbers in array: {buffer_start, buffer_end) */
+    Packet_Slab *slab;
 } Packets_Array;
 
 typedef struct Crypto_Connection {
@@ -111,14 +150,20 @@ typedef struct Crypto_Connection {
     uint64_t last_packets_left_requested_set;
     double last_packets_left_requested_rem;
 
-    uint32_t last_sendqueue_size[CONGESTION_QUEUE_ARRAY_SIZE];
-    uint32_t last_sendqueue_counter;
-    long signed int last_num_packets_sent[CONGESTION_LAST_SENT_ARRAY_SIZE];
-    long signed int last_num_packets_resent[CONGESTION_LAST_SENT_ARRAY_SIZE];
+    const Congestion_Control *congestion_control;
+    uint64_t congestion_state[CONGESTION_MAX_STATE_SIZE / sizeof(uint64_t)];
     uint32_t packets_sent;
     uint32_t packets_resent;
     uint64_t last_congestion_event;
     uint64_t rtt_time;
+    uint64_t rtt_sample; /* Lowest rtt since the last congestion sample, UINT64_MAX if none. */
+    uint64_t rtt_smoothed; /* Moving average of the rtt samples plus 1, 0 if there was none yet. */
+
+    /* No packet in send_array before this one waits to be (re)sent. */
+    uint32_t resend_start;
+
+    bool peer_request_bitmap; /* The peer understands bitmap request packets. */
+    uint8_t request_bitmap_announcements;
 
     /* TCP_connection connection_number */
     unsigned int connection_number_tcp;
@@ -160,7 +205,16 @@ struct Net_Crypto {
     /* The current optimal sleep time */
     uint32_t current_sleep_time;
 
-    BS_List ip_port_list;
+    /* Real public key -> connection id, and normalized IP_Port -> connection id. */
+    Hash_Index *public_key_index;
+    Hash_Index *ip_port_index;
+
+    Packet_Slab packet_slab;
+
+    /* Congestion controller for new connections. */
+    const Congestion_Control *congestion_control;
+
+    bool request_bitmap_enabled;
 };
 
 const uint8_t *nc_get_self_public_key(const Net_Crypto *c)
@@ -330,18 +384,28 @@ static int create_cookie_response(const Net_Crypto *c, uint8_t *packet, const ui
  * Put what was in the request in request_plain (must be of size COOKIE_REQUEST_PLAIN_LENGTH)
  * Put the key used to decrypt the request into shared_key (of size CRYPTO_SHARED_KEY_SIZE) for use in the response.
  *
+ * udp_source is where the packet came from if it came over UDP, else NULL. Such
+ * packets may be queued in the precompute pool, see precompute_shared_key.
+ *
  * return -1 on failure.
  * return 0 on success.
+ * return 1 if the packet was queued.
  */
-static int handle_cookie_request(const Net_Crypto *c, uint8_t *request_plain, uint8_t *shared_key,
-                                 uint8_t *dht_public_key, const uint8_t *packet, uint16_t length)
+static int handle_cookie_request(const Net_Crypto *c, const IP_Port *udp_source, uint8_t *request_plain,
+                                 uint8_t *shared_key, uint8_t *dht_public_key, const uint8_t *packet, uint16_t length)
 {
     if (length != COOKIE_REQUEST_LENGTH) {
         return -1;
     }
 
     memcpy(dht_public_key, packet + 1, CRYPTO_PUBLIC_KEY_SIZE);
-    dht_get_shared_key_sent(c->dht, shared_key, dht_public_key);
+
+    if (udp_source == nullptr) {
+        dht_get_shared_key_sent(c->dht, shared_key, dht_public_key);
+    } else if (!dht_get_shared_key_sent_for_packet(c->dht, shared_key, dht_public_key, *udp_source, packet, length)) {
+        return 1;
+    }
+
     int len = decrypt_data_symmetric(shared_key, packet + 1 + CRYPTO_PUBLIC_KEY_SIZE,
                                      packet + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE, COOKIE_REQUEST_PLAIN_LENGTH + CRYPTO_MAC_SIZE,
                                      request_plain);
@@ -362,9 +426,10 @@ static int udp_handle_cookie_request(void *object, IP_Port source, const uint8_t
     uint8_t request_plain[COOKIE_REQUEST_PLAIN_LENGTH];
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
     uint8_t dht_public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    const int ret = handle_cookie_request(c, &source, request_plain, shared_key, dht_public_key, packet, length);
 
-    if (handle_cookie_request(c, request_plain, shared_key, dht_public_key, packet, length) != 0) {
-        return 1;
+    if (ret != 0) {
+        return ret == 1 ? 0 : 1;
     }
 
     uint8_t data[COOKIE_RESPONSE_LENGTH];
@@ -388,7 +453,7 @@ static int tcp_handle_cookie_request(Net_Crypto *c, int connections_number, cons
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
     uint8_t dht_public_key[CRYPTO_PUBLIC_KEY_SIZE];
 
-    if (handle_cookie_request(c, request_plain, shared_key, dht_public_key, packet, length) != 0) {
+    if (handle_cookie_request(c, nullptr, request_plain, shared_key, dht_public_key, packet, length) != 0) {
         return -1;
     }
 
@@ -411,7 +476,7 @@ static int tcp_oob_handle_cookie_request(const Net_Crypto *c, unsigned int tcp_c
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
     uint8_t dht_public_key_temp[CRYPTO_PUBLIC_KEY_SIZE];
 
-    if (handle_cookie_request(c, request_plain, shared_key, dht_public_key_temp, packet, length) != 0) {
+    if (handle_cookie_request(c, nullptr, request_plain, shared_key, dht_public_key_temp, packet, length) != 0) {
         return -1;
     }
 
@@ -507,6 +572,9 @@ static int create_crypto_handshake(const Net_Crypto *c, uint8_t *packet, const u
  * if expected_real_pk isn't NULL it denotes the real public key
  * the packet should be from.
  *
+ * udp_source is where the packet came from if it came over UDP, else NULL. Such
+ * packets may be queued in the precompute pool, see precompute_shared_key.
+ *
  * nonce must be at least CRYPTO_NONCE_SIZE
  * session_pk must be at least CRYPTO_PUBLIC_KEY_SIZE
  * peer_real_pk must be at least CRYPTO_PUBLIC_KEY_SIZE
@@ -514,9 +582,11 @@ static int create_crypto_handshake(const Net_Crypto *c, uint8_t *packet, const u
  *
  * return -1 on failure.
  * return 0 on success.
+ * return 1 if the packet was queued.
  */
-static int handle_crypto_handshake(const Net_Crypto *c, uint8_t *nonce, uint8_t *session_pk, uint8_t *peer_real_pk,
-                                   uint8_t *dht_public_key, uint8_t *cookie, const uint8_t *packet, uint16_t length, const uint8_t *expected_real_pk)
+static int handle_crypto_handshake(const Net_Crypto *c, const IP_Port *udp_source, uint8_t *nonce, uint8_t *session_pk,
+                                   uint8_t *peer_real_pk, uint8_t *dht_public_key, uint8_t *cookie, const uint8_t *packet, uint16_t length,
+                                   const uint8_t *expected_real_pk)
 {
     if (length != HANDSHAKE_PACKET_LENGTH) {
         return -1;
@@ -537,10 +607,20 @@ static int handle_crypto_handshake(const Net_Crypto *c, uint8_t *nonce, uint8_t
     uint8_t cookie_hash[CRYPTO_SHA512_SIZE];
     crypto_sha512(cookie_hash, packet + 1, COOKIE_LENGTH);
 
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+
+    if (udp_source == nullptr) {
+        encrypt_precompute(cookie_plain, c->self_secret_key, shared_key);
+    } else if (!precompute_shared_key(networking_get_precompute_pool(dht_get_net(c->dht)), *udp_source, packet, length,
+                                      cookie_plain, c->self_secret_key, shared_key)) {
+        return 1;
+    }
+
     uint8_t plain[CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_SHA512_SIZE + COOKIE_LENGTH];
-    int len = decrypt_data(cookie_plain, c->self_secret_key, packet + 1 + COOKIE_LENGTH,
-                           packet + 1 + COOKIE_LENGTH + CRYPTO_NONCE_SIZE,
-                           HANDSHAKE_PACKET_LENGTH - (1 + COOKIE_LENGTH + CRYPTO_NONCE_SIZE), plain);
+    int len = decrypt_data_symmetric(shared_key, packet + 1 + COOKIE_LENGTH,
+                                     packet + 1 + COOKIE_LENGTH + CRYPTO_NONCE_SIZE,
+                                     HANDSHAKE_PACKET_LENGTH - (1 + COOKIE_LENGTH + CRYPTO_NONCE_SIZE), plain);
+    crypto_memzero(shared_key, sizeof(shared_key));
 
     if (len != sizeof(plain)) {
         return -1;
@@ -569,6 +649,33 @@ static Crypto_Connection *get_crypto_connection(const Net_Crypto *c, int crypt_c
     return &c->crypto_connections[crypt_connection_id];
 }
 
+/* Map ip_port to the connection, unless another connection already has it. */
+static bool ip_port_index_add(Net_Crypto *c, const IP_Port *ip_port, int crypt_connection_id)
+{
+    uint8_t key[IP_PORT_KEY_SIZE];
+    ip_port_key(key, ip_port);
+
+    uint32_t id;
+
+    if (hash_index_get(c->ip_port_index, key, &id)) {
+        return false;
+    }
+
+    return hash_index_set(c->ip_port_index, key, crypt_connection_id);
+}
+
+/* Unmap ip_port if it belongs to the connection. */
+static void ip_port_index_remove(Net_Crypto *c, const IP_Port *ip_port, int crypt_connection_id)
+{
+    uint8_t key[IP_PORT_KEY_SIZE];
+    ip_port_key(key, ip_port);
+
+    uint32_t id;
+
+    if (hash_index_get(c->ip_port_index, key, &id) && id == (uint32_t)crypt_connection_id) {
+        hash_index_remove(c->ip_port_index, key);
+    }
+}
 
 /* Associate an ip_port to a connection.
  *
@@ -585,21 +692,21 @@ static int add_ip_port_connection(Net_Crypto *c, int crypt_connection_id, IP_Por
 
     if (net_family_is_ipv4(ip_port.ip.family)) {
         if (!ipport_equal(&ip_port, &conn->ip_portv4) && !ip_is_lan(conn->ip_portv4.ip)) {
-            if (!bs_list_add(&c->ip_port_list, (uint8_t *)&ip_port, crypt_connection_id)) {
+            if (!ip_port_index_add(c, &ip_port, crypt_connection_id)) {
                 return -1;
             }
 
-            bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv4, crypt_connection_id);
+            ip_port_index_remove(c, &conn->ip_portv4, crypt_connection_id);
             conn->ip_portv4 = ip_port;
             return 0;
         }
     } else if (net_family_is_ipv6(ip_port.ip.family)) {
         if (!ipport_equal(&ip_port, &conn->ip_portv6)) {
-            if (!bs_list_add(&c->ip_port_list, (uint8_t *)&ip_port, crypt_connection_id)) {
+            if (!ip_port_index_add(c, &ip_port, crypt_connection_id)) {
                 return -1;
             }
 
-            bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv6, crypt_connection_id);
+            ip_port_index_remove(c, &conn->ip_portv6, crypt_connection_id);
             conn->ip_portv6 = ip_port;
             return 0;
         }
@@ -747,6 +854,134 @@ static int send_packet_to(Net_Crypto *c, int crypt_connection_id, const uint8_t
 /** START: Array Related functions **/
 
 
+static void packet_chunk_link(Packet_Slab *slab, Packet_Chunk *chunk)
+{
+    chunk->prev = nullptr;
+    chunk->next = slab->partial;
+
+    if (slab->partial != nullptr) {
+        slab->partial->prev = chunk;
+    }
+
+    slab->partial = chunk;
+}
+
+static void packet_chunk_unlink(Packet_Slab *slab, Packet_Chunk *chunk)
+{
+    if (chunk->prev != nullptr) {
+        chunk->prev->next = chunk->next;
+    } else {
+        slab->partial = chunk->next;
+    }
+
+    if (chunk->next != nullptr) {
+        chunk->next->prev = chunk->prev;
+    }
+
+    chunk->prev = nullptr;
+    chunk->next = nullptr;
+}
+
+static Packet_Chunk *packet_chunk_new(void)
+{
+    Packet_Chunk *chunk = (Packet_Chunk *)malloc(sizeof(Packet_Chunk));
+
+    if (chunk == nullptr) {
+        return nullptr;
+    }
+
+    chunk->free_slots = nullptr;
+    chunk->used = 0;
+
+    for (uint32_t i = PACKET_SLAB_CHUNK_SLOTS; i != 0; --i) {
+        chunk->slots[i - 1].chunk = chunk;
+        chunk->slots[i - 1].next_free = chunk->free_slots;
+        chunk->free_slots = &chunk->slots[i - 1];
+    }
+
+    return chunk;
+}
+
+/* return a copy of data in a slot of the slab on success.
+ * return NULL on failure.
+ */
+static Packet_Data *packet_slab_add(Packet_Slab *slab, const Packet_Data *data)
+{
+    pthread_mutex_lock(&slab->mutex);
+    Packet_Chunk *chunk = slab->partial;
+
+    if (chunk == nullptr) {
+        chunk = packet_chunk_new();
+
+        if (chunk == nullptr) {
+            pthread_mutex_unlock(&slab->mutex);
+            return nullptr;
+        }
+
+        packet_chunk_link(slab, chunk);
+        ++slab->num_chunks;
+        ++slab->chunks_allocated;
+    }
+
+    Packet_Slot *slot = chunk->free_slots;
+    chunk->free_slots = slot->next_free;
+    ++chunk->used;
+
+    if (chunk == slab->reserve) {
+        slab->reserve = nullptr;
+    }
+
+    if (chunk->used == PACKET_SLAB_CHUNK_SLOTS) {
+        packet_chunk_unlink(slab, chunk);
+    }
+
+    pthread_mutex_unlock(&slab->mutex);
+
+    memcpy(&slot->data, data, sizeof(Packet_Data));
+    return &slot->data;
+}
+
+static void packet_slab_remove(Packet_Slab *slab, Packet_Data *data)
+{
+    Packet_Slot *slot = (Packet_Slot *)data;
+    Packet_Chunk *chunk = slot->chunk;
+
+    pthread_mutex_lock(&slab->mutex);
+
+    if (chunk->used == PACKET_SLAB_CHUNK_SLOTS) {
+        packet_chunk_link(slab, chunk);
+    }
+
+    slot->next_free = chunk->free_slots;
+    chunk->free_slots = slot;
+    --chunk->used;
+
+    if (chunk->used == 0) {
+        if (slab->reserve == nullptr) {
+            slab->reserve = chunk;
+        } else {
+            packet_chunk_unlink(slab, chunk);
+            --slab->num_chunks;
+            free(chunk);
+        }
+    }
+
+    pthread_mutex_unlock(&slab->mutex);
+}
+
+/* Free the slab. All its slots must have been removed.
+ */
+static void packet_slab_free(Packet_Slab *slab)
+{
+    while (slab->partial != nullptr) {
+        Packet_Chunk *chunk = slab->partial;
+        packet_chunk_unlink(slab, chunk);
+        free(chunk);
+    }
+
+    pthread_mutex_destroy(&slab->mutex);
+}
+
 /* Return number of packets in array
  * Note that holes are counted too.
  */
@@ -772,13 +1007,12 @@ static int add_data_to_buffer(const Logger *log, Packets_Array *array, uint32_t
         return -1;
     }
 
-    Packet_Data *new_d = (Packet_Data *)malloc(sizeof(Packet_Data));
+    Packet_Data *new_d = packet_slab_add(array->slab, data);
 
     if (new_d == nullptr) {
         return -1;
     }
 
-    memcpy(new_d, data, sizeof(Packet_Data));
     array->buffer[num] = new_d;
 
     if (number - array->buffer_start >= num_packets_array(array)) {
@@ -825,13 +1059,12 @@ static int64_t add_data_end_of_buffer(const Logger *log, Packets_Array *array, c
         return -1;
     }
 
-    Packet_Data *new_d = (Packet_Data *)malloc(sizeof(Packet_Data));
+    Packet_Data *new_d = packet_slab_add(array->slab, data);
 
     if (new_d == nullptr) {
         return -1;
     }
 
-    memcpy(new_d, data, sizeof(Packet_Data));
     uint32_t id = array->buffer_end;
     array->buffer[id % CRYPTO_PACKET_BUFFER_SIZE] = new_d;
     ++array->buffer_end;
@@ -858,7 +1091,7 @@ static int64_t read_data_beg_buffer(const Logger *log, Packets_Array *array, Pac
     memcpy(data, array->buffer[num], sizeof(Packet_Data));
     uint32_t id = array->buffer_start;
     ++array->buffer_start;
-    free(array->buffer[num]);
+    packet_slab_remove(array->slab, array->buffer[num]);
     array->buffer[num] = nullptr;
     return id;
 }
@@ -882,7 +1115,7 @@ static int clear_buffer_until(const Logger *log, Packets_Array *array, uint32_t
         uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
 
         if (array->buffer[num]) {
-            free(array->buffer[num]);
+            packet_slab_remove(array->slab, array->buffer[num]);
             array->buffer[num] = nullptr;
         }
     }
@@ -899,7 +1132,7 @@ static int clear_buffer(Packets_Array *array)
         uint32_t num = i % CRYPTO_PACKET_BUFFER_SIZE;
 
         if (array->buffer[num]) {
-            free(array->buffer[num]);
+            packet_slab_remove(array->slab, array->buffer[num]);
             array->buffer[num] = nullptr;
         }
     }
@@ -980,6 +1213,52 @@ static int generate_request_packet(const Logger *log, uint8_t *data, uint16_t le
     return cur_len;
 }
 
+/* Bitmap request packets: PACKET_ID_REQUEST_BITMAP, then the number of slots
+ * (uint16_t, network byte order) from recv_array's buffer_start they describe,
+ * then one bit per slot, lowest bit first, set if the packet is missing.
+ *
+ * Unlike the run length list of a normal request packet, which needs a byte
+ * per missing packet, this describes every slot a single packet can hold bits
+ * for, so losses spread across a large window are all requested at once.
+ */
+#define REQUEST_BITMAP_HEADER_SIZE (1 + sizeof(uint16_t))
+
+/* Number of empty bitmap request packets sent to a peer that hasn't sent one. */
+#define REQUEST_BITMAP_ANNOUNCEMENTS 16
+
+/* Create a bitmap request packet from recv_array into data of length.
+ *
+ * return -1 on failure.
+ * return length of packet on success.
+ */
+static int generate_request_bitmap(uint8_t *data, uint16_t length, const Packets_Array *recv_array)
+{
+    if (length < REQUEST_BITMAP_HEADER_SIZE) {
+        return -1;
+    }
+
+    uint32_t slots = num_packets_array(recv_array);
+
+    if (slots > (uint32_t)(length - REQUEST_BITMAP_HEADER_SIZE) * 8) {
+        slots = (uint32_t)(length - REQUEST_BITMAP_HEADER_SIZE) * 8;
+    }
+
+    data[0] = PACKET_ID_REQUEST_BITMAP;
+    net_pack_u16(data + 1, (uint16_t)slots);
+
+    uint8_t *bitmap = data + REQUEST_BITMAP_HEADER_SIZE;
+    const uint32_t bitmap_length = (slots + 7) / 8;
+    memset(bitmap, 0, bitmap_length);
+
+    for (uint32_t i = 0; i < slots; ++i) {
+        if (!recv_array->buffer[(recv_array->buffer_start + i) % CRYPTO_PACKET_BUFFER_SIZE]) {
+            bitmap[i / 8] |= 1 << (i % 8);
+        }
+    }
+
+    return REQUEST_BITMAP_HEADER_SIZE + bitmap_length;
+}
+
 /* Handle a request data packet.
  * Remove all the packets the other received from the array.
  *
@@ -1023,6 +1302,7 @@ static int handle_request_packet(Mono_Time *mono_time, const Logger *log, Packet
 
                 if ((sent_time + rtt_time) < temp_time) {
                     send_array->buffer[num]->sent_time = 0;
+                    send_array->buffer[num]->resent = true;
                 }
             }
 
@@ -1038,7 +1318,7 @@ static int handle_request_packet(Mono_Time *mono_time, const Logger *log, Packet
                     l_sent_time = sent_time;
                 }
 
-                free(send_array->buffer[num]);
+                packet_slab_remove(send_array->slab, send_array->buffer[num]);
                 send_array->buffer[num] = nullptr;
             }
         }
@@ -1064,18 +1344,81 @@ static int handle_request_packet(Mono_Time *mono_time, const Logger *log, Packet
     return requested;
 }
 
+/* Handle a bitmap request packet.
+ * Remove all the packets the other received from the array.
+ *
+ * return -1 on failure.
+ * return number of requested packets on success.
+ */
+static int handle_request_bitmap(Mono_Time *mono_time, Packets_Array *send_array, const uint8_t *data,
+                                 uint16_t length, uint64_t *latest_send_time, uint64_t rtt_time)
+{
+    if (length < REQUEST_BITMAP_HEADER_SIZE || data[0] != PACKET_ID_REQUEST_BITMAP) {
+        return -1;
+    }
+
+    uint16_t slots;
+    net_unpack_u16(data + 1, &slots);
+
+    if ((uint32_t)(slots + 7) / 8 != length - REQUEST_BITMAP_HEADER_SIZE) {
+        return -1;
+    }
+
+    const uint8_t *bitmap = data + REQUEST_BITMAP_HEADER_SIZE;
+    uint32_t count = slots;
+
+    if (count > num_packets_array(send_array)) {
+        count = num_packets_array(send_array);
+    }
+
+    uint32_t requested = 0;
+
+    const uint64_t temp_time = current_time_monotonic(mono_time);
+    uint64_t l_sent_time = 0;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        const uint32_t num = (send_array->buffer_start + i) % CRYPTO_PACKET_BUFFER_SIZE;
+        Packet_Data *dt = send_array->buffer[num];
+
+        if (bitmap[i / 8] & (1 << (i % 8))) {
+            if (dt && (dt->sent_time + rtt_time) < temp_time) {
+                dt->sent_time = 0;
+                dt->resent = true;
+            }
+
+            ++requested;
+        } else if (dt) {
+            if (l_sent_time < dt->sent_time && !dt->resent) {
+                l_sent_time = dt->sent_time;
+            }
+
+            packet_slab_remove(send_array->slab, dt);
+            send_array->buffer[num] = nullptr;
+        }
+    }
+
+    if (*latest_send_time < l_sent_time) {
+        *latest_send_time = l_sent_time;
+    }
+
+    return requested;
+}
+
 /** END: Array Related functions **/
 
 #define MAX_DATA_DATA_PACKET_SIZE (MAX_CRYPTO_PACKET_SIZE - (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE))
 
-/* Creates and sends a data packet to the peer using the fastest route.
+#define DATA_PACKET_PLAIN_OFFSET (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE)
+
+/* Encrypts the length bytes of data at packet + DATA_PACKET_PLAIN_OFFSET in
+ * place and sends the data packet to the peer using the fastest route.
  *
  * return -1 on failure.
  * return 0 on success.
  */
-static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
+static int send_data_packet(Net_Crypto *c, int crypt_connection_id, uint8_t *packet, uint16_t length)
 {
-    const uint16_t max_length = MAX_CRYPTO_PACKET_SIZE - (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE);
+    const uint16_t max_length = MAX_CRYPTO_PACKET_SIZE - DATA_PACKET_PLAIN_OFFSET;
 
     if (length == 0 || length > max_length) {
         return -1;
@@ -1087,13 +1430,15 @@ static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_
         return -1;
     }
 
+    uint8_t *plain = packet + DATA_PACKET_PLAIN_OFFSET;
+
     pthread_mutex_lock(&conn->mutex);
-    VLA(uint8_t, packet, 1 + sizeof(uint16_t) + length + CRYPTO_MAC_SIZE);
     packet[0] = NET_PACKET_CRYPTO_DATA;
     memcpy(packet + 1, conn->sent_nonce + (CRYPTO_NONCE_SIZE - sizeof(uint16_t)), sizeof(uint16_t));
-    const int len = encrypt_data_symmetric(conn->shared_key, conn->sent_nonce, data, length, packet + 1 + sizeof(uint16_t));
+    const int len = encrypt_data_symmetric_detached(conn->shared_key, conn->sent_nonce, plain, length, plain,
+                    packet + 1 + sizeof(uint16_t));
 
-    if (len + 1 + sizeof(uint16_t) != SIZEOF_VLA(packet)) {
+    if (len != length) {
         pthread_mutex_unlock(&conn->mutex);
         return -1;
     }
@@ -1101,7 +1446,7 @@ static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_
     increment_nonce(conn->sent_nonce);
     pthread_mutex_unlock(&conn->mutex);
 
-    return send_packet_to(c, crypt_connection_id, packet, SIZEOF_VLA(packet));
+    return send_packet_to(c, crypt_connection_id, packet, DATA_PACKET_PLAIN_OFFSET + length);
 }
 
 /* Creates and sends a data packet with buffer_start and num to the peer using the fastest route.
@@ -1109,23 +1454,58 @@ static int send_data_packet(Net_Crypto *c, int crypt_connection_id, const uint8_
  * return -1 on failure.
  * return 0 on success.
  */
-static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
-                                   const uint8_t *data, uint16_t length)
+static int send_data_packet_helper_split(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
+        const uint8_t *head, uint16_t head_length, const uint8_t *body, uint16_t body_length)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
+    const uint32_t length = (uint32_t)head_length + body_length;
+
+    if (head_length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
         return -1;
     }
 
     num = net_htonl(num);
     buffer_start = net_htonl(buffer_start);
     uint16_t padding_length = (MAX_CRYPTO_DATA_SIZE - length) % CRYPTO_MAX_PADDING;
-    VLA(uint8_t, packet, sizeof(uint32_t) + sizeof(uint32_t) + padding_length + length);
-    memcpy(packet, &buffer_start, sizeof(uint32_t));
-    memcpy(packet + sizeof(uint32_t), &num, sizeof(uint32_t));
-    memset(packet + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
-    memcpy(packet + (sizeof(uint32_t) * 2) + padding_length, data, length);
+    const uint16_t plain_length = sizeof(uint32_t) + sizeof(uint32_t) + padding_length + length;
+
+    /* The plain data is laid out where send_data_packet encrypts it. */
+    VLA(uint8_t, packet, DATA_PACKET_PLAIN_OFFSET + plain_length);
+    uint8_t *plain = packet + DATA_PACKET_PLAIN_OFFSET;
+    memcpy(plain, &buffer_start, sizeof(uint32_t));
+    memcpy(plain + sizeof(uint32_t), &num, sizeof(uint32_t));
+    memset(plain + (sizeof(uint32_t) * 2), PACKET_ID_PADDING, padding_length);
+    memcpy(plain + (sizeof(uint32_t) * 2) + padding_length, head, head_length);
+
+    if (body_length != 0) {
+        memcpy(plain + (sizeof(uint32_t) * 2) + padding_length + head_length, body, body_length);
+    }
 
-    return send_data_packet(c, crypt_connection_id, packet, SIZEOF_VLA(packet));
+    return send_data_packet(c, crypt_connection_id, packet, plain_length);
+}
+
+static int send_data_packet_helper(Net_Crypto *c, int crypt_connection_id, uint32_t buffer_start, uint32_t num,
+                                   const uint8_t *data, uint16_t length)
+{
+    return send_data_packet_helper_split(c, crypt_connection_id, buffer_start, num, data, length, nullptr, 0);
+}
+
+/* Make send_requested_packets look at packet_num again.
+ *
+ * Must be called with conn->mutex held: packets are added from other threads
+ * while send_requested_packets moves resend_start forward.
+ */
+static void lower_resend_start_locked(Crypto_Connection *conn, uint32_t packet_num)
+{
+    if (packet_num - conn->send_array.buffer_start < conn->resend_start - conn->send_array.buffer_start) {
+        conn->resend_start = packet_num;
+    }
+}
+
+static void lower_resend_start(Crypto_Connection *conn, uint32_t packet_num)
+{
+    pthread_mutex_lock(&conn->mutex);
+    lower_resend_start_locked(conn, packet_num);
+    pthread_mutex_unlock(&conn->mutex);
 }
 
 static int reset_max_speed_reached(Net_Crypto *c, int crypt_connection_id)
@@ -1184,6 +1564,7 @@ static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, cons
 
     Packet_Data dt;
     dt.sent_time = 0;
+    dt.resent = false;
     dt.length = length;
     memcpy(dt.data, data, length);
     pthread_mutex_lock(&conn->mutex);
@@ -1195,6 +1576,7 @@ static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, cons
     }
 
     if (!congestion_control && conn->maximum_speed_reached) {
+        lower_resend_start(conn, packet_num);
         return packet_num;
     }
 
@@ -1206,6 +1588,7 @@ static int64_t send_lossless_packet(Net_Crypto *c, int crypt_connection_id, cons
         }
     } else {
         conn->maximum_speed_reached = 1;
+        lower_resend_start(conn, packet_num);
         LOGGER_DEBUG(c->log, "send_data_packet failed");
     }
 
@@ -1281,12 +1664,30 @@ static int send_request_packet(Net_Crypto *c, int crypt_connection_id)
     }
 
     uint8_t data[MAX_CRYPTO_DATA_SIZE];
-    int len = generate_request_packet(c->log, data, sizeof(data), &conn->recv_array);
+    int len;
+
+    if (c->request_bitmap_enabled && conn->peer_request_bitmap) {
+        len = generate_request_bitmap(data, sizeof(data), &conn->recv_array);
+    } else {
+        len = generate_request_packet(c->log, data, sizeof(data), &conn->recv_array);
+    }
 
     if (len == -1) {
         return -1;
     }
 
+    /* Until the peer sends one, let it know bitmap requests are understood
+     * with an empty one. Peers that don't understand them drop it. */
+    if (c->request_bitmap_enabled && !conn->peer_request_bitmap
+            && conn->request_bitmap_announcements < REQUEST_BITMAP_ANNOUNCEMENTS) {
+        const uint8_t announcement[REQUEST_BITMAP_HEADER_SIZE] = {PACKET_ID_REQUEST_BITMAP, 0, 0};
+
+        if (send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end,
+                                    announcement, sizeof(announcement)) == 0) {
+            ++conn->request_bitmap_announcements;
+        }
+    }
+
     return send_data_packet_helper(c, crypt_connection_id, conn->recv_array.buffer_start, conn->send_array.buffer_end, data,
                                    len);
 }
@@ -1311,7 +1712,19 @@ static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32
     const uint64_t temp_time = current_time_monotonic(c->mono_time);
     uint32_t i, num_sent = 0, array_size = num_packets_array(&conn->send_array);
 
-    for (i = 0; i < array_size; ++i) {
+    /* Skip the packets that are known to have been sent. */
+    pthread_mutex_lock(&conn->mutex);
+    const uint32_t scan_start = conn->resend_start;
+    pthread_mutex_unlock(&conn->mutex);
+    i = scan_start - conn->send_array.buffer_start;
+
+    if (i > array_size) {
+        i = 0;
+    }
+
+    uint32_t resend_start = conn->send_array.buffer_end;
+
+    for (; i < array_size; ++i) {
         Packet_Data *dt;
         const uint32_t packet_num = i + conn->send_array.buffer_start;
         const int ret = get_data_pointer(c->log, &conn->send_array, &dt, packet_num);
@@ -1332,13 +1745,29 @@ static int send_requested_packets(Net_Crypto *c, int crypt_connection_id, uint32
                                     dt->length) == 0) {
             dt->sent_time = temp_time;
             ++num_sent;
+        } else if (resend_start == conn->send_array.buffer_end) {
+            resend_start = packet_num;
         }
 
         if (num_sent >= max_num) {
+            if (resend_start == conn->send_array.buffer_end) {
+                resend_start = packet_num + 1;
+            }
+
             break;
         }
     }
 
+    pthread_mutex_lock(&conn->mutex);
+
+    /* A packet queued during the scan may have lowered it; don't skip that. */
+    if (conn->resend_start == scan_start) {
+        conn->resend_start = resend_start;
+    } else {
+        lower_resend_start_locked(conn, resend_start);
+    }
+
+    pthread_mutex_unlock(&conn->mutex);
     return num_sent;
 }
 
@@ -1525,6 +1954,7 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
     num = net_ntohl(num);
 
     uint64_t rtt_calc_time = 0;
+    uint64_t rtt_sample_time = 0;
 
     if (buffer_start != conn->send_array.buffer_start) {
         Packet_Data *packet_time;
@@ -1533,6 +1963,12 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
             rtt_calc_time = packet_time->sent_time;
         }
 
+        /* The newest packet acknowledged arrived just before this one was
+         * sent, so it gives the round trip time with the least ack delay. */
+        if (get_data_pointer(c->log, &conn->send_array, &packet_time, buffer_start - 1) == 1 && !packet_time->resent) {
+            rtt_sample_time = packet_time->sent_time;
+        }
+
         if (clear_buffer_until(c->log, &conn->send_array, buffer_start) != 0) {
             return -1;
         }
@@ -1565,7 +2001,7 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
         }
     }
 
-    if (real_data[0] == PACKET_ID_REQUEST) {
+    if (real_data[0] == PACKET_ID_REQUEST || real_data[0] == PACKET_ID_REQUEST_BITMAP) {
         uint64_t rtt_time;
 
         if (udp) {
@@ -1574,13 +2010,32 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
             rtt_time = DEFAULT_TCP_PING_CONNECTION;
         }
 
-        int requested = handle_request_packet(c->mono_time, c->log, &conn->send_array, real_data, real_length, &rtt_calc_time,
+        int requested;
+
+        if (real_data[0] == PACKET_ID_REQUEST_BITMAP) {
+            requested = handle_request_bitmap(c->mono_time, &conn->send_array, real_data, real_length, &rtt_calc_time,
                                               rtt_time);
+            conn->peer_request_bitmap = 1;
+        } else {
+            requested = handle_request_packet(c->mono_time, c->log, &conn->send_array, real_data, real_length,
+                                              &rtt_calc_time, rtt_time);
+        }
 
         if (requested == -1) {
             return -1;
         }
 
+        if (requested > 0) {
+            pthread_mutex_lock(&conn->mutex);
+            conn->resend_start = conn->send_array.buffer_start;
+            pthread_mutex_unlock(&conn->mutex);
+        }
+
+        // Plain request packets leave rtt_calc_time at ~0, which is no sample.
+        if (rtt_sample_time < rtt_calc_time && rtt_calc_time != UINT64_MAX) {
+            rtt_sample_time = rtt_calc_time;
+        }
+
         set_buffer_end(c->log, &conn->recv_array, num);
     } else if (real_data[0] >= PACKET_ID_RANGE_LOSSLESS_START && real_data[0] <= PACKET_ID_RANGE_LOSSLESS_END) {
         Packet_Data dt = {0};
@@ -1635,6 +2090,20 @@ static int handle_data_packet_core(Net_Crypto *c, int crypt_connection_id, const
         }
     }
 
+    if (rtt_sample_time != 0) {
+        const uint64_t rtt_time = current_time_monotonic(c->mono_time) - rtt_sample_time;
+
+        if (rtt_time < conn->rtt_sample) {
+            conn->rtt_sample = rtt_time;
+        }
+
+        if (conn->rtt_smoothed == 0) {
+            conn->rtt_smoothed = rtt_time + 1;
+        } else {
+            conn->rtt_smoothed = (conn->rtt_smoothed * 7 + rtt_time + 1) / 8;
+        }
+    }
+
     return 0;
 }
 
@@ -1692,8 +2161,8 @@ static int handle_packet_connection(Net_Crypto *c, int crypt_connection_id, cons
             uint8_t dht_public_key[CRYPTO_PUBLIC_KEY_SIZE];
             uint8_t cookie[COOKIE_LENGTH];
 
-            if (handle_crypto_handshake(c, conn->recv_nonce, conn->peersessionpublic_key, peer_real_pk, dht_public_key, cookie,
-                                        packet, length, conn->public_key) != 0) {
+            if (handle_crypto_handshake(c, nullptr, conn->recv_nonce, conn->peersessionpublic_key, peer_real_pk, dht_public_key,
+                                        cookie, packet, length, conn->public_key) != 0) {
                 return -1;
             }
 
@@ -1755,16 +2224,26 @@ static int realloc_cryptoconnection(Net_Crypto *c, uint32_t num)
 }
 
 
-/* Create a new empty crypto connection.
+/* Create a new empty crypto connection to the peer with the given real public key.
  *
  * return -1 on failure.
  * return connection id on success.
  */
-static int create_crypto_connection(Net_Crypto *c)
+static int create_crypto_connection(Net_Crypto *c, const uint8_t *public_key)
 {
-    for (uint32_t i = 0; i < c->crypto_connections_length; ++i) {
-        if (c->crypto_connections[i].status == CRYPTO_CONN_NO_CONNECTION) {
-            return i;
+    /* Every live connection is in the index, so if it is as big as the array there are no holes. */
+    if (hash_index_size(c->public_key_index) < c->crypto_connections_length) {
+        for (uint32_t i = 0; i < c->crypto_connections_length; ++i) {
+            if (c->crypto_connections[i].status == CRYPTO_CONN_NO_CONNECTION) {
+                if (!hash_index_set(c->public_key_index, public_key, i)) {
+                    return -1;
+                }
+
+                memcpy(c->crypto_connections[i].public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+                c->crypto_connections[i].send_array.slab = &c->packet_slab;
+                c->crypto_connections[i].recv_array.slab = &c->packet_slab;
+                return i;
+            }
         }
     }
 
@@ -1795,12 +2274,39 @@ static int create_crypto_connection(Net_Crypto *c)
             pthread_mutex_unlock(&c->connections_mutex);
             return -1;
         }
+
+        if (!hash_index_set(c->public_key_index, public_key, id)) {
+            pthread_mutex_unlock(&c->connections_mutex);
+            return -1;
+        }
+
+        memcpy(c->crypto_connections[id].public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+        c->crypto_connections[id].send_array.slab = &c->packet_slab;
+        c->crypto_connections[id].recv_array.slab = &c->packet_slab;
     }
 
     pthread_mutex_unlock(&c->connections_mutex);
     return id;
 }
 
+/* Give back a connection from create_crypto_connection that failed to start.
+ * It stays in the array as a free slot.
+ */
+static void abort_crypto_connection(Net_Crypto *c, int crypt_connection_id)
+{
+    Crypto_Connection *conn = &c->crypto_connections[crypt_connection_id];
+    hash_index_remove(c->public_key_index, conn->public_key);
+    conn->status = CRYPTO_CONN_NO_CONNECTION;
+}
+
+/* Give a new connection a fresh state of the current congestion controller. */
+static void start_congestion_control(const Net_Crypto *c, Crypto_Connection *conn)
+{
+    conn->congestion_control = c->congestion_control;
+    memset(conn->congestion_state, 0, sizeof(conn->congestion_state));
+    conn->rtt_sample = UINT64_MAX;
+}
+
 /* Wipe a crypto connection.
  *
  * return -1 on failure.
@@ -1814,6 +2320,11 @@ static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
 
     uint32_t i;
 
+    Crypto_Connection *conn = &c->crypto_connections[crypt_connection_id];
+    hash_index_remove(c->public_key_index, conn->public_key);
+    ip_port_index_remove(c, &conn->ip_portv4, crypt_connection_id);
+    ip_port_index_remove(c, &conn->ip_portv6, crypt_connection_id);
+
     /* Keep mutex, only destroy it when connection is realloced out. */
     pthread_mutex_t mutex = c->crypto_connections[crypt_connection_id].mutex;
     crypto_memzero(&c->crypto_connections[crypt_connection_id], sizeof(Crypto_Connection));
@@ -1842,15 +2353,13 @@ static int wipe_crypto_connection(Net_Crypto *c, int crypt_connection_id)
  */
 static int getcryptconnection_id(const Net_Crypto *c, const uint8_t *public_key)
 {
-    for (uint32_t i = 0; i < c->crypto_connections_length; ++i) {
-        if (c->crypto_connections[i].status != CRYPTO_CONN_NO_CONNECTION) {
-            if (public_key_cmp(public_key, c->crypto_connections[i].public_key) == 0) {
-                return i;
-            }
-        }
+    uint32_t id;
+
+    if (!hash_index_get(c->public_key_index, public_key, &id) || crypt_connection_id_not_valid(c, id)) {
+        return -1;
     }
 
-    return -1;
+    return id;
 }
 
 /* Add a source to the crypto connection.
@@ -1910,8 +2419,8 @@ void new_connection_handler(Net_Crypto *c, new_connection_cb *new_connection_cal
  * return -1 on failure.
  * return 0 on success.
  */
-static int handle_new_connection_handshake(Net_Crypto *c, IP_Port source, const uint8_t *data, uint16_t length,
-        void *userdata)
+static int handle_new_connection_handshake(Net_Crypto *c, IP_Port source, bool udp, const uint8_t *data,
+        uint16_t length, void *userdata)
 {
     New_Connection n_c;
     n_c.cookie = (uint8_t *)malloc(COOKIE_LENGTH);
@@ -1923,10 +2432,12 @@ static int handle_new_connection_handshake(Net_Crypto *c, IP_Port source, const
     n_c.source = source;
     n_c.cookie_length = COOKIE_LENGTH;
 
-    if (handle_crypto_handshake(c, n_c.recv_nonce, n_c.peersessionpublic_key, n_c.public_key, n_c.dht_public_key,
-                                n_c.cookie, data, length, nullptr) != 0) {
+    const int handled = handle_crypto_handshake(c, udp ? &source : nullptr, n_c.recv_nonce, n_c.peersessionpublic_key,
+                        n_c.public_key, n_c.dht_public_key, n_c.cookie, data, length, nullptr);
+
+    if (handled != 0) {
         free(n_c.cookie);
-        return -1;
+        return handled == 1 ? 0 : -1;
     }
 
     const int crypt_connection_id = getcryptconnection_id(c, n_c.public_key);
@@ -1979,7 +2490,11 @@ int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
         return -1;
     }
 
-    const int crypt_connection_id = create_crypto_connection(c);
+    if (n_c->cookie_length != COOKIE_LENGTH) {
+        return -1;
+    }
+
+    const int crypt_connection_id = create_crypto_connection(c, n_c->public_key);
 
     if (crypt_connection_id == -1) {
         LOGGER_ERROR(c->log, "Could not create new crypto connection");
@@ -1988,20 +2503,16 @@ int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
 
     Crypto_Connection *conn = &c->crypto_connections[crypt_connection_id];
 
-    if (n_c->cookie_length != COOKIE_LENGTH) {
-        return -1;
-    }
-
     pthread_mutex_lock(&c->tcp_mutex);
     const int connection_number_tcp = new_tcp_connection_to(c->tcp_c, n_c->dht_public_key, crypt_connection_id);
     pthread_mutex_unlock(&c->tcp_mutex);
 
     if (connection_number_tcp == -1) {
+        abort_crypto_connection(c, crypt_connection_id);
         return -1;
     }
 
     conn->connection_number_tcp = connection_number_tcp;
-    memcpy(conn->public_key, n_c->public_key, CRYPTO_PUBLIC_KEY_SIZE);
     memcpy(conn->recv_nonce, n_c->recv_nonce, CRYPTO_NONCE_SIZE);
     memcpy(conn->peersessionpublic_key, n_c->peersessionpublic_key, CRYPTO_PUBLIC_KEY_SIZE);
     random_nonce(conn->sent_nonce);
@@ -2013,7 +2524,7 @@ int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
         pthread_mutex_lock(&c->tcp_mutex);
         kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
         pthread_mutex_unlock(&c->tcp_mutex);
-        conn->status = CRYPTO_CONN_NO_CONNECTION;
+        abort_crypto_connection(c, crypt_connection_id);
         return -1;
     }
 
@@ -2022,6 +2533,7 @@ int accept_crypto_connection(Net_Crypto *c, New_Connection *n_c)
     conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
     conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
     conn->rtt_time = DEFAULT_PING_CONNECTION;
+    start_congestion_control(c, conn);
     crypto_connection_add_source(c, crypt_connection_id, n_c->source);
     return crypt_connection_id;
 }
@@ -2040,7 +2552,7 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
         return crypt_connection_id;
     }
 
-    crypt_connection_id = create_crypto_connection(c);
+    crypt_connection_id = create_crypto_connection(c, real_public_key);
 
     if (crypt_connection_id == -1) {
         return -1;
@@ -2053,11 +2565,11 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
     pthread_mutex_unlock(&c->tcp_mutex);
 
     if (connection_number_tcp == -1) {
+        abort_crypto_connection(c, crypt_connection_id);
         return -1;
     }
 
     conn->connection_number_tcp = connection_number_tcp;
-    memcpy(conn->public_key, real_public_key, CRYPTO_PUBLIC_KEY_SIZE);
     random_nonce(conn->sent_nonce);
     crypto_new_keypair(conn->sessionpublic_key, conn->sessionsecret_key);
     conn->status = CRYPTO_CONN_COOKIE_REQUESTING;
@@ -2065,6 +2577,7 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
     conn->packet_send_rate_requested = CRYPTO_PACKET_MIN_RATE;
     conn->packets_left = CRYPTO_MIN_QUEUE_LENGTH;
     conn->rtt_time = DEFAULT_PING_CONNECTION;
+    start_congestion_control(c, conn);
     memcpy(conn->dht_public_key, dht_public_key, CRYPTO_PUBLIC_KEY_SIZE);
 
     conn->cookie_request_number = random_u64();
@@ -2076,7 +2589,7 @@ int new_crypto_connection(Net_Crypto *c, const uint8_t *real_public_key, const u
         pthread_mutex_lock(&c->tcp_mutex);
         kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
         pthread_mutex_unlock(&c->tcp_mutex);
-        conn->status = CRYPTO_CONN_NO_CONNECTION;
+        abort_crypto_connection(c, crypt_connection_id);
         return -1;
     }
 
@@ -2166,7 +2679,7 @@ static int tcp_oob_callback(void *object, const uint8_t *public_key, unsigned in
         source.ip.family = net_family_tcp_family;
         source.ip.ip.v6.uint32[0] = tcp_connections_number;
 
-        if (handle_new_connection_handshake(c, source, data, length, userdata) != 0) {
+        if (handle_new_connection_handshake(c, source, false, data, length, userdata) != 0) {
             return -1;
         }
 
@@ -2258,6 +2771,22 @@ unsigned int copy_connected_tcp_relays(Net_Crypto *c, Node_format *tcp_relays, u
     return ret;
 }
 
+uint32_t net_crypto_tcp_sockets(Net_Crypto *c, Socket *socks, bool *want_write, uint32_t max_socks)
+{
+    pthread_mutex_lock(&c->tcp_mutex);
+    const uint32_t ret = tcp_connections_sockets(c->tcp_c, socks, want_write, max_socks);
+    pthread_mutex_unlock(&c->tcp_mutex);
+
+    return ret;
+}
+
+void do_net_crypto_tcp_ready(Net_Crypto *c, const Socket *ready, uint32_t num_ready, void *userdata)
+{
+    pthread_mutex_lock(&c->tcp_mutex);
+    do_tcp_connections_ready(c->tcp_c, ready, num_ready, userdata);
+    pthread_mutex_unlock(&c->tcp_mutex);
+}
+
 static void do_tcp(Net_Crypto *c, void *userdata)
 {
     pthread_mutex_lock(&c->tcp_mutex);
@@ -2394,7 +2923,16 @@ int nc_dht_pk_callback(Net_Crypto *c, int crypt_connection_id, dht_pk_cb *functi
  */
 static int crypto_id_ip_port(const Net_Crypto *c, IP_Port ip_port)
 {
-    return bs_list_find(&c->ip_port_list, (uint8_t *)&ip_port);
+    uint8_t key[IP_PORT_KEY_SIZE];
+    ip_port_key(key, &ip_port);
+
+    uint32_t id;
+
+    if (!hash_index_get(c->ip_port_index, key, &id)) {
+        return -1;
+    }
+
+    return id;
 }
 
 #define CRYPTO_MIN_PACKET_SIZE (1 + sizeof(uint16_t) + CRYPTO_MAC_SIZE)
@@ -2422,7 +2960,7 @@ static int udp_handle_packet(void *object, IP_Port source, const uint8_t *packet
             return 1;
         }
 
-        if (handle_new_connection_handshake(c, source, packet, length, userdata) != 0) {
+        if (handle_new_connection_handshake(c, source, true, packet, length, userdata) != 0) {
             return 1;
         }
 
@@ -2453,22 +2991,13 @@ static int udp_handle_packet(void *object, IP_Port source, const uint8_t *packet
 
 /* The dT for the average packet receiving rate calculations.
    Also used as the */
-#define PACKET_COUNTER_AVERAGE_INTERVAL 50
+#define PACKET_COUNTER_AVERAGE_INTERVAL CONGESTION_SAMPLE_INTERVAL
 
 /* Ratio of recv queue size / recv packet rate (in seconds) times
  * the number of ms between request packets to send at that ratio
  */
 #define REQUEST_PACKETS_COMPARE_CONSTANT (0.125 * 100.0)
 
-/* Timeout for increasing speed after congestion event (in ms). */
-#define CONGESTION_EVENT_TIMEOUT 1000
-
-/* If the send queue is SEND_QUEUE_RATIO times larger than the
- * calculated link speed the packet send speed will be reduced
- * by a value depending on this number.
- */
-#define SEND_QUEUE_RATIO 2.0
-
 static void send_crypto_packets(Net_Crypto *c)
 {
     const uint64_t temp_time = current_time_monotonic(c->mono_time);
@@ -2531,91 +3060,36 @@ static void send_crypto_packets(Net_Crypto *c)
                 conn->packet_counter = 0;
                 conn->packet_counter_set = temp_time;
 
-                uint32_t packets_sent = conn->packets_sent;
-                conn->packets_sent = 0;
-
-                uint32_t packets_resent = conn->packets_resent;
-                conn->packets_resent = 0;
-
-                /* conjestion control
-                    calculate a new value of conn->packet_send_rate based on some data
-                 */
-
-                unsigned int pos = conn->last_sendqueue_counter % CONGESTION_QUEUE_ARRAY_SIZE;
-                conn->last_sendqueue_size[pos] = num_packets_array(&conn->send_array);
-
-                long signed int sum = 0;
-                sum = (long signed int)conn->last_sendqueue_size[pos] -
-                      (long signed int)conn->last_sendqueue_size[(pos + 1) % CONGESTION_QUEUE_ARRAY_SIZE];
-
-                unsigned int n_p_pos = conn->last_sendqueue_counter % CONGESTION_LAST_SENT_ARRAY_SIZE;
-                conn->last_num_packets_sent[n_p_pos] = packets_sent;
-                conn->last_num_packets_resent[n_p_pos] = packets_resent;
-
-                conn->last_sendqueue_counter = (conn->last_sendqueue_counter + 1) %
-                                               (CONGESTION_QUEUE_ARRAY_SIZE * CONGESTION_LAST_SENT_ARRAY_SIZE);
-
                 bool direct_connected = 0;
                 crypto_connection_status(c, i, &direct_connected, nullptr);
 
+                Congestion_Sample sample;
+                sample.time = temp_time;
+                sample.interval = dt;
+                sample.packets_sent = conn->packets_sent;
+                sample.packets_resent = conn->packets_resent;
+                sample.send_queue_size = num_packets_array(&conn->send_array);
+                sample.min_rtt = conn->rtt_time;
+                sample.rtt = conn->rtt_sample;
+                sample.last_congestion_event = conn->last_congestion_event;
                 /* When switching from TCP to UDP, don't change the packet send rate for CONGESTION_EVENT_TIMEOUT ms. */
-                if (!(direct_connected && conn->last_tcp_sent + CONGESTION_EVENT_TIMEOUT > temp_time)) {
-                    long signed int total_sent = 0, total_resent = 0;
-
-                    // TODO(irungentoo): use real delay
-                    unsigned int delay = (unsigned int)((conn->rtt_time / PACKET_COUNTER_AVERAGE_INTERVAL) + 0.5);
-                    unsigned int packets_set_rem_array = (CONGESTION_LAST_SENT_ARRAY_SIZE - CONGESTION_QUEUE_ARRAY_SIZE);
-
-                    if (delay > packets_set_rem_array) {
-                        delay = packets_set_rem_array;
-                    }
-
-                    for (unsigned j = 0; j < CONGESTION_QUEUE_ARRAY_SIZE; ++j) {
-                        unsigned int ind = (j + (packets_set_rem_array  - delay) + n_p_pos) % CONGESTION_LAST_SENT_ARRAY_SIZE;
-                        total_sent += conn->last_num_packets_sent[ind];
-                        total_resent += conn->last_num_packets_resent[ind];
-                    }
-
-                    if (sum > 0) {
-                        total_sent -= sum;
-                    } else {
-                        if (total_resent > -sum) {
-                            total_resent = -sum;
-                        }
-                    }
-
-                    /* if queue is too big only allow resending packets. */
-                    uint32_t npackets = num_packets_array(&conn->send_array);
-                    double min_speed = 1000.0 * (((double)(total_sent)) / ((double)(CONGESTION_QUEUE_ARRAY_SIZE) *
-                                                 PACKET_COUNTER_AVERAGE_INTERVAL));
+                sample.hold_rates = direct_connected && conn->last_tcp_sent + CONGESTION_EVENT_TIMEOUT > temp_time;
+                sample.min_rate = CRYPTO_PACKET_MIN_RATE;
+                sample.min_queue_length = CRYPTO_MIN_QUEUE_LENGTH;
 
-                    double min_speed_request = 1000.0 * (((double)(total_sent + total_resent)) / ((double)(
-                            CONGESTION_QUEUE_ARRAY_SIZE) * PACKET_COUNTER_AVERAGE_INTERVAL));
-
-                    if (min_speed < CRYPTO_PACKET_MIN_RATE) {
-                        min_speed = CRYPTO_PACKET_MIN_RATE;
-                    }
-
-                    double send_array_ratio = (((double)npackets) / min_speed);
-
-                    // TODO(irungentoo): Improve formula?
-                    if (send_array_ratio > SEND_QUEUE_RATIO && CRYPTO_MIN_QUEUE_LENGTH < npackets) {
-                        conn->packet_send_rate = min_speed * (1.0 / (send_array_ratio / SEND_QUEUE_RATIO));
-                    } else if (conn->last_congestion_event + CONGESTION_EVENT_TIMEOUT < temp_time) {
-                        conn->packet_send_rate = min_speed * 1.2;
-                    } else {
-                        conn->packet_send_rate = min_speed * 0.9;
-                    }
+                conn->packets_sent = 0;
+                conn->packets_resent = 0;
+                conn->rtt_sample = UINT64_MAX;
 
-                    conn->packet_send_rate_requested = min_speed_request * 1.2;
+                conn->congestion_control->update(conn->congestion_state, &sample, &conn->packet_send_rate,
+                                                 &conn->packet_send_rate_requested);
 
-                    if (conn->packet_send_rate < CRYPTO_PACKET_MIN_RATE) {
-                        conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
-                    }
+                if (conn->packet_send_rate < CRYPTO_PACKET_MIN_RATE) {
+                    conn->packet_send_rate = CRYPTO_PACKET_MIN_RATE;
+                }
 
-                    if (conn->packet_send_rate_requested < conn->packet_send_rate) {
-                        conn->packet_send_rate_requested = conn->packet_send_rate;
-                    }
+                if (conn->packet_send_rate_requested < conn->packet_send_rate) {
+                    conn->packet_send_rate_requested = conn->packet_send_rate;
                 }
             }
 
@@ -2731,6 +3205,33 @@ uint32_t crypto_num_free_sendqueue_slots(const Net_Crypto *c, int crypt_connecti
     return max_packets;
 }
 
+/* Get the round trip time of a connection in ms.
+ *
+ * min_rtt is set to the lowest round trip time seen, rtt to a moving average of
+ * the recent ones. Both are 0 if nothing was measured yet.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int crypto_connection_rtt(const Net_Crypto *c, int crypt_connection_id, uint64_t *min_rtt, uint64_t *rtt)
+{
+    const Crypto_Connection *conn = get_crypto_connection(c, crypt_connection_id);
+
+    if (conn == nullptr) {
+        return -1;
+    }
+
+    if (conn->rtt_smoothed == 0) {
+        *min_rtt = 0;
+        *rtt = 0;
+    } else {
+        *min_rtt = conn->rtt_time;
+        *rtt = conn->rtt_smoothed - 1;
+    }
+
+    return 0;
+}
+
 /* Sends a lossless cryptopacket.
  *
  * return -1 if data could not be put in packet queue.
@@ -2821,11 +3322,17 @@ int cryptpacket_received(Net_Crypto *c, int crypt_connection_id, uint32_t packet
  */
 int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length)
 {
-    if (length == 0 || length > MAX_CRYPTO_DATA_SIZE) {
+    return send_lossy_cryptpacket_split(c, crypt_connection_id, data, length, nullptr, 0);
+}
+
+int send_lossy_cryptpacket_split(Net_Crypto *c, int crypt_connection_id, const uint8_t *head, uint16_t head_length,
+                                 const uint8_t *body, uint16_t body_length)
+{
+    if (head_length == 0 || (uint32_t)head_length + body_length > MAX_CRYPTO_DATA_SIZE) {
         return -1;
     }
 
-    if (data[0] < PACKET_ID_RANGE_LOSSY_START || data[0] > PACKET_ID_RANGE_LOSSY_END) {
+    if (head[0] < PACKET_ID_RANGE_LOSSY_START || head[0] > PACKET_ID_RANGE_LOSSY_END) {
         return -1;
     }
 
@@ -2842,7 +3349,8 @@ int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t
         uint32_t buffer_start = conn->recv_array.buffer_start;
         uint32_t buffer_end = conn->send_array.buffer_end;
         pthread_mutex_unlock(&conn->mutex);
-        ret = send_data_packet_helper(c, crypt_connection_id, buffer_start, buffer_end, data, length);
+        ret = send_data_packet_helper_split(c, crypt_connection_id, buffer_start, buffer_end, head, head_length,
+                                            body, body_length);
     }
 
     pthread_mutex_lock(&c->connections_mutex);
@@ -2882,8 +3390,6 @@ int crypto_kill(Net_Crypto *c, int crypt_connection_id)
         kill_tcp_connection_to(c->tcp_c, conn->connection_number_tcp);
         pthread_mutex_unlock(&c->tcp_mutex);
 
-        bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv4, crypt_connection_id);
-        bs_list_remove(&c->ip_port_list, (uint8_t *)&conn->ip_portv6, crypt_connection_id);
         clear_temp_packet(c, crypt_connection_id);
         clear_buffer(&conn->send_array);
         clear_buffer(&conn->recv_array);
@@ -2973,9 +3479,21 @@ Net_Crypto *new_net_crypto(const Logger *log, Mono_Time *mono_time, DHT *dht, TC
     temp->log = log;
     temp->mono_time = mono_time;
 
+    temp->public_key_index = hash_index_new(CRYPTO_PUBLIC_KEY_SIZE);
+    temp->ip_port_index = hash_index_new(IP_PORT_KEY_SIZE);
+
+    if (temp->public_key_index == nullptr || temp->ip_port_index == nullptr) {
+        hash_index_kill(temp->public_key_index);
+        hash_index_kill(temp->ip_port_index);
+        free(temp);
+        return nullptr;
+    }
+
     temp->tcp_c = new_tcp_connections(mono_time, dht_get_self_secret_key(dht), proxy_info);
 
     if (temp->tcp_c == nullptr) {
+        hash_index_kill(temp->public_key_index);
+        hash_index_kill(temp->ip_port_index);
         free(temp);
         return nullptr;
     }
@@ -2984,8 +3502,11 @@ Net_Crypto *new_net_crypto(const Logger *log, Mono_Time *mono_time, DHT *dht, TC
     set_oob_packet_tcp_connection_callback(temp->tcp_c, &tcp_oob_callback, temp);
 
     if (create_recursive_mutex(&temp->tcp_mutex) != 0 ||
-            pthread_mutex_init(&temp->connections_mutex, nullptr) != 0) {
+            pthread_mutex_init(&temp->connections_mutex, nullptr) != 0 ||
+            pthread_mutex_init(&temp->packet_slab.mutex, nullptr) != 0) {
         kill_tcp_connections(temp->tcp_c);
+        hash_index_kill(temp->public_key_index);
+        hash_index_kill(temp->ip_port_index);
         free(temp);
         return nullptr;
     }
@@ -2996,14 +3517,14 @@ Net_Crypto *new_net_crypto(const Logger *log, Mono_Time *mono_time, DHT *dht, TC
     new_symmetric_key(temp->secret_symmetric_key);
 
     temp->current_sleep_time = CRYPTO_SEND_PACKET_INTERVAL;
+    temp->congestion_control = &congestion_control_queue;
+    temp->request_bitmap_enabled = 1;
 
     networking_registerhandler(dht_get_net(dht), NET_PACKET_COOKIE_REQUEST, &udp_handle_cookie_request, temp);
     networking_registerhandler(dht_get_net(dht), NET_PACKET_COOKIE_RESPONSE, &udp_handle_packet, temp);
     networking_registerhandler(dht_get_net(dht), NET_PACKET_CRYPTO_HS, &udp_handle_packet, temp);
     networking_registerhandler(dht_get_net(dht), NET_PACKET_CRYPTO_DATA, &udp_handle_packet, temp);
 
-    bs_list_init(&temp->ip_port_list, sizeof(IP_Port), 8);
-
     return temp;
 }
 
@@ -3040,6 +3561,21 @@ static void kill_timedout(Net_Crypto *c, void *userdata)
     }
 }
 
+int net_crypto_set_congestion_control(Net_Crypto *c, const Congestion_Control *congestion_control)
+{
+    if (congestion_control->state_size > CONGESTION_MAX_STATE_SIZE) {
+        return -1;
+    }
+
+    c->congestion_control = congestion_control;
+    return 0;
+}
+
+void net_crypto_set_request_bitmap(Net_Crypto *c, bool enabled)
+{
+    c->request_bitmap_enabled = enabled;
+}
+
 /* return the optimal interval in ms for running do_net_crypto.
  */
 uint32_t crypto_run_interval(const Net_Crypto *c)
@@ -3052,7 +3588,17 @@ void do_net_crypto(Net_Crypto *c, void *userdata)
 {
     kill_timedout(c, userdata);
     do_tcp(c, userdata);
+
+    // Packets for the same relay go out in one write.
+    pthread_mutex_lock(&c->tcp_mutex);
+    tcp_connections_set_coalescing(c->tcp_c, true);
+    pthread_mutex_unlock(&c->tcp_mutex);
+
     send_crypto_packets(c);
+
+    pthread_mutex_lock(&c->tcp_mutex);
+    tcp_connections_set_coalescing(c->tcp_c, false);
+    pthread_mutex_unlock(&c->tcp_mutex);
 }
 
 void kill_net_crypto(Net_Crypto *c)
@@ -3065,9 +3611,11 @@ void kill_net_crypto(Net_Crypto *c)
 
     pthread_mutex_destroy(&c->tcp_mutex);
     pthread_mutex_destroy(&c->connections_mutex);
+    packet_slab_free(&c->packet_slab);
 
     kill_tcp_connections(c->tcp_c);
-    bs_list_free(&c->ip_port_list);
+    hash_index_kill(c->public_key_index);
+    hash_index_kill(c->ip_port_index);
     networking_registerhandler(dht_get_net(c->dht), NET_PACKET_COOKIE_REQUEST, nullptr, nullptr);
     networking_registerhandler(dht_get_net(c->dht), NET_PACKET_COOKIE_RESPONSE, nullptr, nullptr);
     networking_registerhandler(dht_get_net(c->dht), NET_PACKET_CRYPTO_HS, nullptr, nullptr);
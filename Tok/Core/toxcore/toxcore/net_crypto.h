@@ -27,6 +27,7 @@
 #include "DHT.h"
 #include "LAN_discovery.h"
 #include "TCP_connection.h"
+#include "congestion.h"
 #include "logger.h"
 
 #include <pthread.h>
@@ -61,6 +62,7 @@
 #define PACKET_ID_PADDING 0 // Denotes padding
 #define PACKET_ID_REQUEST 1 // Used to request unreceived packets
 #define PACKET_ID_KILL    2 // Used to kill connection
+#define PACKET_ID_REQUEST_BITMAP 3 // Used to request unreceived packets with a bitmap
 
 #define PACKET_ID_ONLINE 24
 #define PACKET_ID_OFFLINE 25
@@ -127,11 +129,6 @@ typedef enum Crypto_Conn_State {
 /* All packets will be padded a number of bytes based on this number. */
 #define CRYPTO_MAX_PADDING 8
 
-/* Base current transfer speed on last CONGESTION_QUEUE_ARRAY_SIZE number of points taken
-   at the dT defined in net_crypto.c */
-#define CONGESTION_QUEUE_ARRAY_SIZE 12
-#define CONGESTION_LAST_SENT_ARRAY_SIZE (CONGESTION_QUEUE_ARRAY_SIZE * 2)
-
 /* Default connection ping in ms. */
 #define DEFAULT_PING_CONNECTION 1000
 #define DEFAULT_TCP_PING_CONNECTION 500
@@ -244,6 +241,16 @@ int nc_dht_pk_callback(Net_Crypto *c, int crypt_connection_id, dht_pk_cb *functi
  */
 uint32_t crypto_num_free_sendqueue_slots(const Net_Crypto *c, int crypt_connection_id);
 
+/* Get the round trip time of a connection in ms.
+ *
+ * min_rtt is set to the lowest round trip time seen, rtt to a moving average of
+ * the recent ones. Both are 0 if nothing was measured yet.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+int crypto_connection_rtt(const Net_Crypto *c, int crypt_connection_id, uint64_t *min_rtt, uint64_t *rtt);
+
 /* Return 1 if max speed was reached for this connection (no more data can be physically through the pipe).
  * Return 0 if it wasn't reached.
  */
@@ -279,6 +286,17 @@ int cryptpacket_received(Net_Crypto *c, int crypt_connection_id, uint32_t packet
  */
 int send_lossy_cryptpacket(Net_Crypto *c, int crypt_connection_id, const uint8_t *data, uint16_t length);
 
+/* Sends a lossy cryptopacket made of head followed by body, without first
+ * copying them into one buffer. body may be NULL if body_length is 0.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ *
+ * The first byte of head must be in the PACKET_ID_RANGE_LOSSY.
+ */
+int send_lossy_cryptpacket_split(Net_Crypto *c, int crypt_connection_id, const uint8_t *head, uint16_t head_length,
+                                 const uint8_t *body, uint16_t body_length);
+
 /* Add a tcp relay, associating it to a crypt_connection_id.
  *
  * return 0 if it was added.
@@ -315,6 +333,15 @@ int send_tcp_onion_request(Net_Crypto *c, unsigned int tcp_connections_number, c
  */
 unsigned int copy_connected_tcp_relays(Net_Crypto *c, Node_format *tcp_relays, uint16_t num);
 
+/* Copy up to max_socks of the TCP relay sockets to socks, see tcp_connections_sockets.
+ *
+ * return the total number of sockets.
+ */
+uint32_t net_crypto_tcp_sockets(Net_Crypto *c, Socket *socks, bool *want_write, uint32_t max_socks);
+
+/* Service the TCP relay connections whose socket is in ready. */
+void do_net_crypto_tcp_ready(Net_Crypto *c, const Socket *ready, uint32_t num_ready, void *userdata);
+
 /* Kill a crypto connection.
  *
  * return -1 on failure.
@@ -350,6 +377,20 @@ void load_secret_key(Net_Crypto *c, const uint8_t *sk);
  */
 Net_Crypto *new_net_crypto(const Logger *log, Mono_Time *mono_time, DHT *dht, TCP_Proxy_Info *proxy_info);
 
+/* Set the congestion controller used by connections created from now on.
+ * The default is congestion_control_queue.
+ *
+ * return -1 if its state is larger than CONGESTION_MAX_STATE_SIZE.
+ * return 0 on success.
+ */
+int net_crypto_set_congestion_control(Net_Crypto *c, const Congestion_Control *congestion_control);
+
+/* Set whether connections may use bitmap request packets. They are only sent
+ * to peers that have shown they understand them by sending one. Enabled by
+ * default.
+ */
+void net_crypto_set_request_bitmap(Net_Crypto *c, bool enabled);
+
 /* return the optimal interval in ms for running do_net_crypto.
  */
 uint32_t crypto_run_interval(const Net_Crypto *c);
@@ -0,0 +1,921 @@
+// The lookups under test are static, so pull in the implementation directly.
+extern "C" {
+#include "net_crypto.c"
+}
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using Public_Key = std::array<uint8_t, CRYPTO_PUBLIC_KEY_SIZE>;
+
+IP_Port fake_ip_port(uint32_t n, uint8_t padding = 0xaa) {
+  IP_Port ip_port;
+  // Garbage in the padding must not affect lookups.
+  memset(&ip_port, padding, sizeof(ip_port));
+  ip_port.ip.family = net_family_ipv4;
+  ip_port.ip.ip.v4.uint32 = net_htonl(0x2d000000 | (n >> 8));
+  ip_port.port = net_htons(33445 + (n & 0xff));
+  return ip_port;
+}
+
+class NetCrypto : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    log_ = logger_new();
+    mono_time_ = mono_time_new();
+    IP ip;
+    ip_init(&ip, false);
+    ip.ip.v4 = get_ip4_loopback();
+    net_ = new_networking_ex(log_, ip, 0, 0, nullptr);
+    ASSERT_NE(net_, nullptr);
+    dht_ = new_dht(log_, mono_time_, net_, false, 0, 0, nullptr, nullptr);
+    ASSERT_NE(dht_, nullptr);
+    TCP_Proxy_Info proxy_info = {{{{0}}}};
+    c_ = new_net_crypto(log_, mono_time_, dht_, &proxy_info);
+    ASSERT_NE(c_, nullptr);
+    rng_.seed(1);
+  }
+
+  void TearDown() override {
+    kill_net_crypto(c_);
+    kill_dht(dht_);
+    kill_networking(net_);
+    mono_time_free(mono_time_);
+    logger_kill(log_);
+  }
+
+  Public_Key random_key() {
+    Public_Key key;
+
+    for (uint8_t &byte : key) {
+      byte = static_cast<uint8_t>(rng_());
+    }
+
+    return key;
+  }
+
+  /* A connection as far as the lookup structures are concerned. */
+  int add_connection(const Public_Key &pk, IP_Port ip_port) {
+    int const id = create_crypto_connection(c_, pk.data());
+
+    if (id == -1) {
+      return -1;
+    }
+
+    c_->crypto_connections[id].status = CRYPTO_CONN_NOT_CONFIRMED;
+
+    if (add_ip_port_connection(c_, id, ip_port) != 0) {
+      return -1;
+    }
+
+    return id;
+  }
+
+  Logger *log_;
+  Mono_Time *mono_time_;
+  Networking_Core *net_;
+  DHT *dht_;
+  Net_Crypto *c_;
+  std::mt19937 rng_;
+};
+
+TEST_F(NetCrypto, LookupByPublicKeyAndIpPort) {
+  Public_Key const a = random_key();
+  Public_Key const b = random_key();
+
+  int const id_a = add_connection(a, fake_ip_port(1));
+  int const id_b = add_connection(b, fake_ip_port(2));
+  ASSERT_NE(id_a, -1);
+  ASSERT_NE(id_b, -1);
+
+  EXPECT_EQ(getcryptconnection_id(c_, a.data()), id_a);
+  EXPECT_EQ(getcryptconnection_id(c_, b.data()), id_b);
+  EXPECT_EQ(getcryptconnection_id(c_, random_key().data()), -1);
+
+  EXPECT_EQ(crypto_id_ip_port(c_, fake_ip_port(2, 0x55)), id_b);
+  EXPECT_EQ(crypto_id_ip_port(c_, fake_ip_port(3)), -1);
+}
+
+TEST_F(NetCrypto, IpPortBelongsToOneConnection) {
+  int const id_a = add_connection(random_key(), fake_ip_port(1));
+  int const id_b = add_connection(random_key(), fake_ip_port(2));
+
+  EXPECT_EQ(add_ip_port_connection(c_, id_b, fake_ip_port(1)), -1);
+  EXPECT_EQ(crypto_id_ip_port(c_, fake_ip_port(1)), id_a);
+
+  // Moving to a new address releases the old one.
+  EXPECT_EQ(add_ip_port_connection(c_, id_a, fake_ip_port(3)), 0);
+  EXPECT_EQ(crypto_id_ip_port(c_, fake_ip_port(1)), -1);
+  EXPECT_EQ(crypto_id_ip_port(c_, fake_ip_port(3)), id_a);
+}
+
+TEST_F(NetCrypto, WipeRemovesConnectionFromBothIndexes) {
+  Public_Key const pk = random_key();
+  int const id = add_connection(pk, fake_ip_port(1));
+  add_connection(random_key(), fake_ip_port(2));
+
+  EXPECT_EQ(wipe_crypto_connection(c_, id), 0);
+  EXPECT_EQ(getcryptconnection_id(c_, pk.data()), -1);
+  EXPECT_EQ(crypto_id_ip_port(c_, fake_ip_port(1)), -1);
+
+  // The freed slot is reused.
+  EXPECT_EQ(add_connection(random_key(), fake_ip_port(1)), id);
+}
+
+TEST_F(NetCrypto, PacketSlabReusesSlots) {
+  Packet_Slab *const slab = &c_->packet_slab;
+  Packet_Data data{};
+  std::vector<Packet_Data *> held;
+
+  for (uint32_t i = 0; i < PACKET_SLAB_CHUNK_SLOTS + 1; ++i) {
+    data.length = static_cast<uint16_t>(i);
+    held.push_back(packet_slab_add(slab, &data));
+    ASSERT_NE(held.back(), nullptr);
+    EXPECT_EQ(held.back()->length, i);
+  }
+
+  EXPECT_EQ(slab->num_chunks, 2);
+
+  // Emptied chunks beyond the reserve are released.
+  for (Packet_Data *d : held) {
+    packet_slab_remove(slab, d);
+  }
+
+  EXPECT_EQ(slab->num_chunks, 1);
+  uint64_t const allocated = slab->chunks_allocated;
+
+  // A steady stream of packets lives off the reserve.
+  for (uint32_t i = 0; i < 10 * PACKET_SLAB_CHUNK_SLOTS; ++i) {
+    Packet_Data *d = packet_slab_add(slab, &data);
+    ASSERT_NE(d, nullptr);
+    packet_slab_remove(slab, d);
+  }
+
+  EXPECT_EQ(slab->chunks_allocated, allocated);
+}
+
+TEST_F(NetCrypto, PacketArraysUseTheSlab) {
+  int const id = add_connection(random_key(), fake_ip_port(1));
+  ASSERT_NE(id, -1);
+  Crypto_Connection *conn = &c_->crypto_connections[id];
+  ASSERT_EQ(conn->send_array.slab, &c_->packet_slab);
+  ASSERT_EQ(conn->recv_array.slab, &c_->packet_slab);
+
+  Packet_Data data{};
+  data.length = 1;
+
+  for (uint32_t i = 0; i < 3 * PACKET_SLAB_CHUNK_SLOTS; ++i) {
+    ASSERT_NE(add_data_end_of_buffer(log_, &conn->send_array, &data), -1);
+  }
+
+  EXPECT_EQ(c_->packet_slab.num_chunks, 3);
+  ASSERT_EQ(clear_buffer_until(log_, &conn->send_array, PACKET_SLAB_CHUNK_SLOTS), 0);
+  EXPECT_EQ(c_->packet_slab.num_chunks, 3);
+
+  ASSERT_EQ(crypto_kill(c_, id), 0);
+  EXPECT_EQ(c_->packet_slab.num_chunks, 1);
+}
+
+// A receive window of REQUEST_WINDOW packets with every third one missing.
+constexpr uint32_t REQUEST_WINDOW = 6000;
+
+uint32_t packets_in(const Packets_Array &array) {
+  uint32_t n = 0;
+
+  for (uint32_t i = array.buffer_start; i != array.buffer_end; ++i) {
+    n += array.buffer[i % CRYPTO_PACKET_BUFFER_SIZE] != nullptr;
+  }
+
+  return n;
+}
+
+TEST_F(NetCrypto, BitmapRequestCoversTheWholeWindow) {
+  int const receiver = add_connection(random_key(), fake_ip_port(1));
+  int const run_length_sender = add_connection(random_key(), fake_ip_port(2));
+  int const bitmap_sender = add_connection(random_key(), fake_ip_port(3));
+  ASSERT_NE(receiver, -1);
+  ASSERT_NE(run_length_sender, -1);
+  ASSERT_NE(bitmap_sender, -1);
+
+  Packets_Array *recv_array = &c_->crypto_connections[receiver].recv_array;
+  Packets_Array *run_length_array = &c_->crypto_connections[run_length_sender].send_array;
+  Packets_Array *bitmap_array = &c_->crypto_connections[bitmap_sender].send_array;
+
+  Packet_Data data{};
+  data.length = 1;
+
+  for (uint32_t i = 0; i < REQUEST_WINDOW; ++i) {
+    ASSERT_NE(add_data_end_of_buffer(log_, run_length_array, &data), -1);
+    ASSERT_NE(add_data_end_of_buffer(log_, bitmap_array, &data), -1);
+
+    if (i % 3 != 0) {
+      ASSERT_EQ(add_data_to_buffer(log_, recv_array, i, &data), 0);
+    }
+  }
+
+  ASSERT_EQ(recv_array->buffer_end, REQUEST_WINDOW);
+  uint32_t const missing = REQUEST_WINDOW / 3;
+
+  std::array<uint8_t, MAX_CRYPTO_DATA_SIZE> packet;
+  uint64_t latest_send_time = 0;
+
+  // A byte per missing packet: the list stops short of the end of the window.
+  int length = generate_request_packet(log_, packet.data(), packet.size(), recv_array);
+  ASSERT_EQ(length, packet.size());
+  int const run_length_requested =
+      handle_request_packet(mono_time_, log_, run_length_array, packet.data(), length, &latest_send_time, 0);
+  EXPECT_EQ(run_length_requested, packet.size() - 1);
+  EXPECT_GT(packets_in(*run_length_array), missing);
+
+  length = generate_request_bitmap(packet.data(), packet.size(), recv_array);
+  ASSERT_EQ(length, REQUEST_BITMAP_HEADER_SIZE + REQUEST_WINDOW / 8);
+  EXPECT_EQ(handle_request_bitmap(mono_time_, bitmap_array, packet.data(), length - 1, &latest_send_time, 0), -1);
+  EXPECT_EQ(handle_request_bitmap(mono_time_, bitmap_array, packet.data(), length, &latest_send_time, 0), missing);
+  EXPECT_EQ(packets_in(*bitmap_array), missing);
+
+  std::printf("%u of %u packets missing: run length request asks for %d, bitmap request for %u in %d bytes\n",
+              missing, REQUEST_WINDOW, run_length_requested, missing, length);
+}
+
+// Two Net_Crypto instances talking over loopback UDP.
+class Crypto_Peer {
+ public:
+  explicit Crypto_Peer(Logger *log) {
+    mono_time_ = mono_time_new();
+    IP ip;
+    ip_init(&ip, false);
+    ip.ip.v4 = get_ip4_loopback();
+    net_ = new_networking_ex(log, ip, 0, 0, nullptr);
+    dht_ = new_dht(log, mono_time_, net_, false, 0, 0, nullptr, nullptr);
+    TCP_Proxy_Info proxy_info = {{{{0}}}};
+    c_ = new_net_crypto(log, mono_time_, dht_, &proxy_info);
+    new_connection_handler(c_, &Crypto_Peer::accept, this);
+  }
+
+  ~Crypto_Peer() {
+    kill_net_crypto(c_);
+    kill_dht(dht_);
+    kill_networking(net_);
+    mono_time_free(mono_time_);
+  }
+
+  IP_Port ip_port() const {
+    IP_Port ip_port;
+    ip_init(&ip_port.ip, false);
+    ip_port.ip.ip.v4 = get_ip4_loopback();
+    ip_port.port = net_port(net_);
+    return ip_port;
+  }
+
+  void connect(const Crypto_Peer &other) {
+    id_ = new_crypto_connection(c_, nc_get_self_public_key(other.c_), dht_get_self_public_key(other.dht_));
+    set_direct_ip_port(c_, id_, other.ip_port(), true);
+    handlers();
+  }
+
+  void iterate() {
+    mono_time_update(mono_time_);
+    networking_poll(net_, nullptr);
+    do_net_crypto(c_, nullptr);
+  }
+
+  bool connected() const {
+    bool direct;
+    unsigned int online_tcp;
+    return id_ != -1 && crypto_connection_status(c_, id_, &direct, &online_tcp) == CRYPTO_CONN_ESTABLISHED;
+  }
+
+  Networking_Core *net() const { return net_; }
+
+  Net_Crypto *c_;
+  int id_ = -1;
+  uint64_t received_ = 0;
+  std::vector<uint8_t> lossy_;
+
+ private:
+  static int accept(void *object, New_Connection *n_c) {
+    Crypto_Peer *self = static_cast<Crypto_Peer *>(object);
+    self->id_ = accept_crypto_connection(self->c_, n_c);
+
+    if (self->id_ == -1) {
+      return -1;
+    }
+
+    self->handlers();
+    return 0;
+  }
+
+  static int on_data(void *object, int id, const uint8_t *data, uint16_t length, void *userdata) {
+    static_cast<Crypto_Peer *>(object)->received_ += length;
+    return 0;
+  }
+
+  static int on_lossy_data(void *object, int id, const uint8_t *data, uint16_t length, void *userdata) {
+    static_cast<Crypto_Peer *>(object)->lossy_.assign(data, data + length);
+    return 0;
+  }
+
+  void handlers() {
+    connection_data_handler(c_, id_, &Crypto_Peer::on_data, this, 0);
+    connection_lossy_data_handler(c_, id_, &Crypto_Peer::on_lossy_data, this, 0);
+  }
+
+  Mono_Time *mono_time_;
+  Networking_Core *net_;
+  DHT *dht_;
+};
+
+// Set NET_CRYPTO_STREAM_BYTES=1073741824 to stream 1 GB.
+TEST(NetCryptoStreamBenchmark, LosslessLoopback) {
+  char const *env = std::getenv("NET_CRYPTO_STREAM_BYTES");
+  uint64_t const total = env != nullptr ? std::strtoull(env, nullptr, 0) : 4 << 20;
+
+  Logger *log = logger_new();
+  {
+    Crypto_Peer sender(log);
+    Crypto_Peer receiver(log);
+    sender.connect(receiver);
+
+    auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+
+    while (!(sender.connected() && receiver.connected())) {
+      ASSERT_LT(std::chrono::steady_clock::now(), deadline);
+      sender.iterate();
+      receiver.iterate();
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    std::array<uint8_t, MAX_CRYPTO_DATA_SIZE> packet{};
+    packet[0] = PACKET_ID_RANGE_LOSSLESS_CUSTOM_START;
+
+    uint64_t const chunks_before = sender.c_->packet_slab.chunks_allocated + receiver.c_->packet_slab.chunks_allocated;
+    uint64_t sent = 0;
+    uint64_t packets = 0;
+    auto const start = std::chrono::steady_clock::now();
+
+    while (receiver.received_ < total) {
+      while (sent < total &&
+             write_cryptpacket(sender.c_, sender.id_, packet.data(), packet.size(), true) != -1) {
+        sent += packet.size();
+        ++packets;
+      }
+
+      sender.iterate();
+      receiver.iterate();
+      ASSERT_TRUE(sender.connected());
+    }
+
+    double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uint64_t const chunks = sender.c_->packet_slab.chunks_allocated + receiver.c_->packet_slab.chunks_allocated -
+                            chunks_before;
+
+    EXPECT_EQ(receiver.received_, sent);
+    std::printf("streamed %llu bytes in %.2f s (%.1f MB/s): %llu packets, %llu slab chunk allocations\n",
+                static_cast<unsigned long long>(sent), seconds, sent / seconds / 1e6,
+                static_cast<unsigned long long>(packets), static_cast<unsigned long long>(chunks));
+  }
+  logger_kill(log);
+}
+
+TEST(NetCryptoLossy, SplitPacketArrivesWhole) {
+  Logger *log = logger_new();
+  {
+    Crypto_Peer sender(log);
+    Crypto_Peer receiver(log);
+    sender.connect(receiver);
+
+    auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+
+    while (!(sender.connected() && receiver.connected())) {
+      ASSERT_LT(std::chrono::steady_clock::now(), deadline);
+      sender.iterate();
+      receiver.iterate();
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    uint8_t const head[] = {PACKET_ID_RANGE_LOSSY_START, 1, 2};
+    std::vector<uint8_t> body(MAX_CRYPTO_DATA_SIZE - sizeof(head));
+
+    for (size_t i = 0; i < body.size(); ++i) {
+      body[i] = static_cast<uint8_t>(i);
+    }
+
+    EXPECT_EQ(send_lossy_cryptpacket_split(sender.c_, sender.id_, head, sizeof(head), body.data(), body.size() + 1),
+              -1);
+    ASSERT_EQ(send_lossy_cryptpacket_split(sender.c_, sender.id_, head, sizeof(head), body.data(), body.size()), 0);
+
+    while (receiver.lossy_.empty()) {
+      ASSERT_LT(std::chrono::steady_clock::now(), deadline);
+      receiver.iterate();
+    }
+
+    std::vector<uint8_t> expected(head, head + sizeof(head));
+    expected.insert(expected.end(), body.begin(), body.end());
+    EXPECT_EQ(receiver.lossy_, expected);
+  }
+  logger_kill(log);
+}
+
+// Handshakes from as many different peers as there are packets, all arriving
+// at once, each needing a shared key the server never computed before.
+class HandshakeFloodBenchmark : public ::testing::TestWithParam<uint32_t> {
+ protected:
+  static int on_new_connection(void *object, New_Connection *n_c) {
+    auto *const handled = static_cast<std::vector<Public_Key> *>(object);
+    Public_Key public_key;
+    std::copy(n_c->public_key, n_c->public_key + CRYPTO_PUBLIC_KEY_SIZE, public_key.begin());
+    handled->push_back(public_key);
+    return -1;
+  }
+};
+
+// Set NET_CRYPTO_HANDSHAKE_FLOOD=100000 for a bigger flood.
+TEST_P(HandshakeFloodBenchmark, HandledInOrder) {
+  char const *env = std::getenv("NET_CRYPTO_HANDSHAKE_FLOOD");
+  uint32_t const count = env != nullptr ? std::strtoul(env, nullptr, 0) : 10000;
+  uint32_t const threads = GetParam();
+  constexpr uint32_t kBurst = 500;
+
+  Logger *log = logger_new();
+  {
+    Crypto_Peer server(log);
+    Crypto_Peer client(log);
+    Net_Crypto *const c = server.c_;
+
+    std::vector<Public_Key> sent(count);
+    std::vector<std::vector<uint8_t>> packets(count, std::vector<uint8_t>(HANDSHAKE_PACKET_LENGTH));
+
+    for (uint32_t i = 0; i < count; ++i) {
+      new_keys(client.c_);
+      std::copy(client.c_->self_public_key, client.c_->self_public_key + CRYPTO_PUBLIC_KEY_SIZE, sent[i].begin());
+
+      uint8_t cookie_plain[COOKIE_DATA_LENGTH];
+      memcpy(cookie_plain, client.c_->self_public_key, CRYPTO_PUBLIC_KEY_SIZE);
+      random_bytes(cookie_plain + CRYPTO_PUBLIC_KEY_SIZE, CRYPTO_PUBLIC_KEY_SIZE);
+      uint8_t cookie[COOKIE_LENGTH];
+      ASSERT_EQ(create_cookie(log, c->mono_time, cookie, cookie_plain, c->secret_symmetric_key), 0);
+
+      uint8_t nonce[CRYPTO_NONCE_SIZE];
+      random_nonce(nonce);
+      uint8_t session_pk[CRYPTO_PUBLIC_KEY_SIZE];
+      random_bytes(session_pk, sizeof(session_pk));
+      ASSERT_EQ(create_crypto_handshake(client.c_, packets[i].data(), cookie, nonce, session_pk,
+                                        c->self_public_key, cookie_plain + CRYPTO_PUBLIC_KEY_SIZE),
+                HANDSHAKE_PACKET_LENGTH);
+    }
+
+    Precompute_Pool *const pool = threads == 0 ? nullptr : precompute_pool_new(threads, count);
+
+    if (threads != 0) {
+      ASSERT_NE(pool, nullptr);
+    }
+
+    networking_set_precompute_pool(server.net(), pool);
+
+    std::vector<Public_Key> handled;
+    new_connection_handler(c, &HandshakeFloodBenchmark::on_new_connection, &handled);
+
+    auto const start = std::chrono::steady_clock::now();
+    auto const deadline = start + std::chrono::seconds(60);
+    std::chrono::steady_clock::duration longest{};
+    uint32_t next = 0;
+
+    while (handled.size() < count && std::chrono::steady_clock::now() < deadline) {
+      for (uint32_t end = std::min(next + kBurst, count); next < end; ++next) {
+        sendpacket(client.net(), server.ip_port(), packets[next].data(), packets[next].size());
+      }
+
+      auto const before = std::chrono::steady_clock::now();
+      server.iterate();
+      longest = std::max(longest, std::chrono::steady_clock::now() - before);
+
+      if (next == count) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+      }
+    }
+
+    double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    networking_set_precompute_pool(server.net(), nullptr);
+    precompute_pool_kill(pool);
+
+    ASSERT_EQ(handled.size(), count);
+    EXPECT_EQ(handled, sent);
+
+    std::printf("%u handshakes, %u worker threads: %.2f s, longest iteration %.1f ms\n", count, threads, seconds,
+                std::chrono::duration<double, std::milli>(longest).count());
+  }
+  logger_kill(log);
+}
+
+INSTANTIATE_TEST_CASE_P(Threads, HandshakeFloodBenchmark, ::testing::Values(0, 1, 4));
+
+// Sends video frames the way rtp_send_data cuts them up: an 81 byte packet id
+// and RTP header in front of each piece. Frame sizes are those of raw I420
+// frames, an upper bound for keyframes at each resolution.
+class RtpFrameSendBenchmark : public ::testing::TestWithParam<std::pair<uint32_t, uint32_t>> {};
+
+TEST_P(RtpFrameSendBenchmark, StagedAndSplit) {
+  uint32_t const width = GetParam().first;
+  uint32_t const height = GetParam().second;
+  uint32_t const length = width * height * 3 / 2;
+  uint16_t const head_length = 1 + 80;
+  uint32_t const max_piece = MAX_CRYPTO_DATA_SIZE - head_length;
+
+  Logger *log = logger_new();
+  {
+    Crypto_Peer sender(log);
+    Crypto_Peer receiver(log);
+    sender.connect(receiver);
+
+    auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+
+    while (!(sender.connected() && receiver.connected())) {
+      ASSERT_LT(std::chrono::steady_clock::now(), deadline);
+      sender.iterate();
+      receiver.iterate();
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    std::vector<uint8_t> frame(length, 0x5a);
+    std::array<uint8_t, head_length> head{};
+    head[0] = PACKET_ID_RANGE_LOSSY_AV_START + 1;
+    int const frames = 20;
+
+    auto const start = std::chrono::steady_clock::now();
+
+    // The old path: the whole frame is staged, then each piece copied again.
+    for (int i = 0; i < frames; ++i) {
+      std::vector<uint8_t> staged(length + head_length);
+      memset(staged.data(), 0, staged.size());
+      memcpy(staged.data(), head.data(), head_length);
+
+      for (uint32_t sent = 0; sent < length; sent += max_piece) {
+        uint32_t const piece = std::min(length - sent, max_piece);
+        memcpy(staged.data() + head_length, frame.data() + sent, piece);
+        ASSERT_EQ(send_lossy_cryptpacket(sender.c_, sender.id_, staged.data(), head_length + piece), 0);
+      }
+
+      receiver.iterate();
+    }
+
+    auto const staged_done = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < frames; ++i) {
+      for (uint32_t sent = 0; sent < length; sent += max_piece) {
+        uint32_t const piece = std::min(length - sent, max_piece);
+        ASSERT_EQ(send_lossy_cryptpacket_split(sender.c_, sender.id_, head.data(), head_length,
+                                               frame.data() + sent, piece),
+                  0);
+      }
+
+      receiver.iterate();
+    }
+
+    auto const split_done = std::chrono::steady_clock::now();
+
+    auto const us = [](std::chrono::steady_clock::duration d) {
+      return std::chrono::duration<double, std::micro>(d).count();
+    };
+    std::printf("%ux%u frame of %u bytes: staged %.0f us/frame, split %.0f us/frame\n", width, height, length,
+                us(staged_done - start) / frames, us(split_done - staged_done) / frames);
+  }
+  logger_kill(log);
+}
+
+INSTANTIATE_TEST_CASE_P(Resolutions, RtpFrameSendBenchmark,
+                        ::testing::Values(std::make_pair(640u, 360u), std::make_pair(1280u, 720u),
+                                          std::make_pair(1920u, 1080u)));
+
+struct Link_Params {
+  char const *name;
+  double mbit_per_s;
+  uint32_t delay_ms;  // One way.
+  double loss;
+  uint32_t buffer_ms;  // Longest a packet can wait in the bottleneck queue.
+};
+
+// Emulates the path to a Crypto_Peer for its UDP data packets. They wait in a
+// bottleneck queue drained at the link bandwidth, then arrive after the
+// propagation delay, unless lost at random or dropped from a full queue.
+class Emulated_Link {
+ public:
+  Emulated_Link(Crypto_Peer *peer, Link_Params const &params, uint32_t seed)
+      : peer_(peer), params_(params), rng_(seed) {
+    networking_registerhandler(peer->net(), NET_PACKET_CRYPTO_DATA, &Emulated_Link::on_packet, this);
+  }
+
+  ~Emulated_Link() {
+    networking_registerhandler(peer_->net(), NET_PACKET_CRYPTO_DATA, &udp_handle_packet, peer_->c_);
+  }
+
+  // Hand the peer the packets that have arrived by now.
+  void deliver() {
+    auto const now = Clock::now();
+
+    while (!in_flight_.empty() && in_flight_.front().arrival <= now) {
+      Packet const &packet = in_flight_.front();
+      udp_handle_packet(peer_->c_, packet.source, packet.data.data(), packet.data.size(), nullptr);
+      in_flight_.pop_front();
+    }
+  }
+
+  // Time packets spent in the bottleneck queue, in ms.
+  std::vector<double> queue_delays_;
+  uint32_t dropped_ = 0;
+  // Packets of the largest size handed to the link, lost or not.
+  uint32_t full_packets_ = 0;
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  struct Packet {
+    Clock::time_point arrival;
+    IP_Port source;
+    std::vector<uint8_t> data;
+  };
+
+  static int on_packet(void *object, IP_Port source, const uint8_t *data, uint16_t length, void *userdata) {
+    static_cast<Emulated_Link *>(object)->enqueue(source, data, length);
+    return 0;
+  }
+
+  void enqueue(IP_Port source, const uint8_t *data, uint16_t length) {
+    auto const now = Clock::now();
+
+    if (length == MAX_CRYPTO_PACKET_SIZE) {
+      ++full_packets_;
+    }
+
+    if (std::uniform_real_distribution<double>(0, 1)(rng_) < params_.loss) {
+      ++dropped_;
+      return;
+    }
+
+    std::chrono::duration<double, std::micro> const serialization(length * 8 / params_.mbit_per_s);
+    Clock::time_point const departure =
+        std::max(now, last_departure_) + std::chrono::duration_cast<Clock::duration>(serialization);
+    double const queued = std::chrono::duration<double, std::milli>(departure - now).count();
+
+    if (queued > params_.buffer_ms) {
+      ++dropped_;
+      return;
+    }
+
+    last_departure_ = departure;
+    queue_delays_.push_back(queued);
+    in_flight_.push_back({departure + std::chrono::milliseconds(params_.delay_ms), source,
+                          std::vector<uint8_t>(data, data + length)});
+  }
+
+  Crypto_Peer *peer_;
+  Link_Params params_;
+  std::mt19937 rng_;
+  Clock::time_point last_departure_;
+  std::deque<Packet> in_flight_;
+};
+
+double percentile(std::vector<double> values, double p) {
+  if (values.empty()) {
+    return 0;
+  }
+
+  std::sort(values.begin(), values.end());
+  return values[static_cast<size_t>(p * (values.size() - 1))];
+}
+
+// Compares the congestion controllers on emulated links, streaming lossless
+// packets for NET_CRYPTO_EMULATION_MS (default 3000) each.
+class NetCryptoCongestionBenchmark : public ::testing::TestWithParam<Link_Params> {};
+
+TEST_P(NetCryptoCongestionBenchmark, GoodputAndQueueingDelay) {
+  Link_Params const link = GetParam();
+  char const *env = std::getenv("NET_CRYPTO_EMULATION_MS");
+  auto const duration = std::chrono::milliseconds(env != nullptr ? std::strtoul(env, nullptr, 0) : 3000);
+
+  for (Congestion_Control const *control : {&congestion_control_queue, &congestion_control_ledbat}) {
+    Logger *log = logger_new();
+    {
+      Crypto_Peer sender(log);
+      Crypto_Peer receiver(log);
+      ASSERT_EQ(net_crypto_set_congestion_control(sender.c_, control), 0);
+      Emulated_Link to_receiver(&receiver, link, 1);
+      Emulated_Link to_sender(&sender, link, 2);
+      sender.connect(receiver);
+
+      auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+
+      while (!(sender.connected() && receiver.connected())) {
+        ASSERT_LT(std::chrono::steady_clock::now(), deadline);
+        sender.iterate();
+        receiver.iterate();
+        to_receiver.deliver();
+        to_sender.deliver();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+
+      std::array<uint8_t, MAX_CRYPTO_DATA_SIZE> packet{};
+      packet[0] = PACKET_ID_RANGE_LOSSLESS_CUSTOM_START;
+      to_receiver.queue_delays_.clear();
+
+      auto const start = std::chrono::steady_clock::now();
+
+      while (std::chrono::steady_clock::now() - start < duration) {
+        while (write_cryptpacket(sender.c_, sender.id_, packet.data(), packet.size(), true) != -1) {
+        }
+
+        sender.iterate();
+        receiver.iterate();
+        to_receiver.deliver();
+        to_sender.deliver();
+      }
+
+      double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      EXPECT_GT(receiver.received_, 0);
+      std::printf("%-7s %-6s: goodput %5.2f of %5.2f Mbit/s, queueing delay p50 %4.0f ms p95 %4.0f ms, "
+                  "%u packets dropped\n",
+                  link.name, control->name, receiver.received_ * 8 / seconds / 1e6, link.mbit_per_s,
+                  percentile(to_receiver.queue_delays_, 0.5), percentile(to_receiver.queue_delays_, 0.95),
+                  to_receiver.dropped_);
+    }
+    logger_kill(log);
+  }
+}
+
+INSTANTIATE_TEST_CASE_P(Links, NetCryptoCongestionBenchmark,
+                        ::testing::Values(Link_Params{"wired", 10, 10, 0, 100},
+                                          Link_Params{"lossy", 10, 10, 0.01, 100},
+                                          Link_Params{"mobile", 2, 40, 0.001, 1000}));
+
+// Crypto_Connection is too large to allocate 50k of them in a test, so this
+// drives the lookup structures directly. The old sorted BS_List is measured
+// alongside for comparison.
+class NetCryptoLookupBenchmark : public ::testing::TestWithParam<uint32_t> {};
+
+TEST_P(NetCryptoLookupBenchmark, DispatchAndChurn) {
+  uint32_t const count = GetParam();
+  std::mt19937 rng(count);
+  std::uniform_int_distribution<uint32_t> pick(0, count - 1);
+
+  Net_Crypto c{};
+  c.public_key_index = hash_index_new(CRYPTO_PUBLIC_KEY_SIZE);
+  c.ip_port_index = hash_index_new(IP_PORT_KEY_SIZE);
+  BS_List list;
+  bs_list_init(&list, sizeof(IP_Port), 8);
+
+  std::vector<Public_Key> keys(count);
+  std::vector<IP_Port> ip_ports(count);
+
+  for (uint32_t i = 0; i < count; ++i) {
+    for (uint8_t &byte : keys[i]) {
+      byte = static_cast<uint8_t>(rng());
+    }
+
+    ip_ports[i] = fake_ip_port(i, 0);
+    ASSERT_TRUE(hash_index_set(c.public_key_index, keys[i].data(), i));
+    ASSERT_TRUE(ip_port_index_add(&c, &ip_ports[i], i));
+    ASSERT_TRUE(bs_list_add(&list, reinterpret_cast<const uint8_t *>(&ip_ports[i]), i));
+  }
+
+  uint32_t const packets = 200000;
+  uint32_t const churn = 20000;
+  std::vector<uint32_t> order(packets);
+
+  for (uint32_t &n : order) {
+    n = pick(rng);
+  }
+
+  auto const start = std::chrono::steady_clock::now();
+
+  // Every incoming UDP data packet resolves its source address.
+  int found = 0;
+
+  for (uint32_t n : order) {
+    found += crypto_id_ip_port(&c, ip_ports[n]) == static_cast<int>(n);
+  }
+
+  auto const dispatched = std::chrono::steady_clock::now();
+
+  for (uint32_t n : order) {
+    found += bs_list_find(&list, reinterpret_cast<const uint8_t *>(&ip_ports[n])) == static_cast<int>(n);
+  }
+
+  auto const bs_dispatched = std::chrono::steady_clock::now();
+
+  // A peer goes away and another one takes its connection id.
+  for (uint32_t i = 0; i < churn; ++i) {
+    uint32_t const n = order[i];
+    hash_index_remove(c.public_key_index, keys[n].data());
+    ip_port_index_remove(&c, &ip_ports[n], n);
+    keys[n][0] ^= 1;
+    ASSERT_TRUE(hash_index_set(c.public_key_index, keys[n].data(), n));
+    ASSERT_TRUE(ip_port_index_add(&c, &ip_ports[n], n));
+  }
+
+  auto const churned = std::chrono::steady_clock::now();
+
+  for (uint32_t i = 0; i < churn; ++i) {
+    uint32_t const n = order[i];
+    bs_list_remove(&list, reinterpret_cast<const uint8_t *>(&ip_ports[n]), n);
+    ASSERT_TRUE(bs_list_add(&list, reinterpret_cast<const uint8_t *>(&ip_ports[n]), n));
+  }
+
+  auto const bs_churned = std::chrono::steady_clock::now();
+
+  EXPECT_EQ(found, 2 * packets);
+
+  auto const ns = [](std::chrono::steady_clock::duration d) {
+    return std::chrono::duration<double, std::nano>(d).count();
+  };
+  std::printf("%u connections: dispatch %.0f ns/packet (BS_List %.0f), churn %.0f ns/op (BS_List %.0f)\n", count,
+              ns(dispatched - start) / packets, ns(bs_dispatched - dispatched) / packets,
+              ns(churned - bs_dispatched) / churn, ns(bs_churned - churned) / churn);
+
+  bs_list_free(&list);
+  hash_index_kill(c.public_key_index);
+  hash_index_kill(c.ip_port_index);
+}
+
+INSTANTIATE_TEST_CASE_P(Connections, NetCryptoLookupBenchmark, ::testing::Values(1000, 10000, 50000));
+
+// Streams a fixed number of packets over lossy emulated links, once with
+// run length request packets and once with bitmap ones.
+class NetCryptoRecoveryBenchmark : public ::testing::TestWithParam<Link_Params> {};
+
+TEST_P(NetCryptoRecoveryBenchmark, RunLengthAndBitmapRequests) {
+  Link_Params const link = GetParam();
+  uint32_t const packets = 300;
+
+  for (bool const bitmap : {false, true}) {
+    Logger *log = logger_new();
+    {
+      Crypto_Peer sender(log);
+      Crypto_Peer receiver(log);
+      net_crypto_set_request_bitmap(sender.c_, bitmap);
+      net_crypto_set_request_bitmap(receiver.c_, bitmap);
+      Emulated_Link to_receiver(&receiver, link, 1);
+      Emulated_Link to_sender(&sender, link, 2);
+      sender.connect(receiver);
+
+      auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+
+      while (!(sender.connected() && receiver.connected())) {
+        ASSERT_LT(std::chrono::steady_clock::now(), deadline);
+        sender.iterate();
+        receiver.iterate();
+        to_receiver.deliver();
+        to_sender.deliver();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+
+      std::array<uint8_t, MAX_CRYPTO_DATA_SIZE> packet{};
+      packet[0] = PACKET_ID_RANGE_LOSSLESS_CUSTOM_START;
+      uint32_t const full_packets_before = to_receiver.full_packets_;
+      uint32_t sent = 0;
+
+      auto const start = std::chrono::steady_clock::now();
+      deadline = start + std::chrono::seconds(60);
+
+      while (receiver.received_ < uint64_t{packets} * packet.size()) {
+        ASSERT_LT(std::chrono::steady_clock::now(), deadline);
+
+        while (sent < packets && write_cryptpacket(sender.c_, sender.id_, packet.data(), packet.size(), true) != -1) {
+          ++sent;
+        }
+
+        sender.iterate();
+        receiver.iterate();
+        to_receiver.deliver();
+        to_sender.deliver();
+      }
+
+      double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      EXPECT_EQ(sender.c_->crypto_connections[sender.id_].peer_request_bitmap, bitmap);
+      EXPECT_EQ(receiver.c_->crypto_connections[receiver.id_].peer_request_bitmap, bitmap);
+
+      uint32_t const resent = to_receiver.full_packets_ - full_packets_before - packets;
+      std::printf("%-7s %-10s requests: %u packets in %.2f s, %u sent again (%.1f%%)\n", link.name,
+                  bitmap ? "bitmap" : "run length", packets, seconds, resent, 100.0 * resent / packets);
+    }
+    logger_kill(log);
+  }
+}
+
+INSTANTIATE_TEST_CASE_P(Links, NetCryptoRecoveryBenchmark,
+                        ::testing::Values(Link_Params{"lossy", 10, 10, 0.02, 100},
+                                          Link_Params{"long", 20, 100, 0.05, 500}));
+
+}  // namespace
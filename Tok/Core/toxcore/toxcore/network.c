@@ -34,6 +34,11 @@
 #define __EXTENSIONS__ 1
 #endif
 
+// For recvmmsg()/sendmmsg() on Linux.
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 // For Linux (and some BSDs).
 #ifndef _XOPEN_SOURCE
 #define _XOPEN_SOURCE 700
@@ -176,12 +181,14 @@ static int inet_pton(int family, const char *addrString, void *addrbuf)
 #endif
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "logger.h"
 #include "mono_time.h"
+#include "precompute.h"
 #include "util.h"
 
 // Disable MSG_NOSIGNAL on systems not supporting it, e.g. Windows, FreeBSD
@@ -195,6 +202,14 @@ static int inet_pton(int family, const char *addrString, void *addrbuf)
 #endif
 #endif
 
+/* recvmmsg() and sendmmsg() are Linux-only; everywhere else we fall back to
+ * one recvfrom()/sendto() per datagram.
+ */
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define NET_HAVE_RECVMMSG
+#define NET_HAVE_SENDMMSG
+#endif
+
 #if TOX_INET6_ADDRSTRLEN < INET6_ADDRSTRLEN
 #error "TOX_INET6_ADDRSTRLEN should be greater or equal to INET6_ADDRSTRLEN (#INET6_ADDRSTRLEN)"
 #endif
@@ -455,6 +470,38 @@ typedef struct Packet_Handler {
     void *object;
 } Packet_Handler;
 
+#ifdef NET_HAVE_RECVMMSG
+/* Number of datagrams drained per recvmmsg() call. */
+#define NET_RECV_BATCH_SIZE 32
+
+typedef struct Net_Recv_Batch {
+    struct mmsghdr msgs[NET_RECV_BATCH_SIZE];
+    struct iovec iovecs[NET_RECV_BATCH_SIZE];
+    struct sockaddr_storage addrs[NET_RECV_BATCH_SIZE];
+    uint8_t data[NET_RECV_BATCH_SIZE][MAX_UDP_PACKET_SIZE];
+} Net_Recv_Batch;
+#endif
+
+/* Number of datagrams that can be queued before the send queue flushes itself. */
+#define NET_SEND_QUEUE_SIZE 64
+
+typedef struct Net_Send_Queue {
+    pthread_mutex_t mutex;
+    uint32_t length;
+
+    struct sockaddr_storage addrs[NET_SEND_QUEUE_SIZE];
+    size_t addrsizes[NET_SEND_QUEUE_SIZE];
+    uint16_t lengths[NET_SEND_QUEUE_SIZE];
+    uint8_t data[NET_SEND_QUEUE_SIZE][MAX_UDP_PACKET_SIZE];
+
+#ifdef NET_HAVE_SENDMMSG
+    struct mmsghdr msgs[NET_SEND_QUEUE_SIZE];
+    struct iovec iovecs[NET_SEND_QUEUE_SIZE];
+#endif
+
+    Net_Send_Queue_Stats stats;
+} Net_Send_Queue;
+
 struct Networking_Core {
     const Logger *log;
     Packet_Handler packethandlers[256];
@@ -463,6 +510,17 @@ struct Networking_Core {
     uint16_t port;
     /* Our UDP socket. */
     Socket sock;
+
+#ifdef NET_HAVE_RECVMMSG
+    /* Reusable receive buffers, NULL if batched receive is disabled. */
+    Net_Recv_Batch *recv_batch;
+#endif
+
+    /* Outgoing datagrams waiting for networking_flush, NULL if disabled. */
+    Net_Send_Queue *send_queue;
+
+    /* Not owned, NULL to compute shared keys inline. */
+    Precompute_Pool *precompute_pool;
 };
 
 Family net_family(const Networking_Core *net)
@@ -470,15 +528,23 @@ Family net_family(const Networking_Core *net)
     return net->family;
 }
 
+Socket net_sock(const Networking_Core *net)
+{
+    return net->sock;
+}
+
 uint16_t net_port(const Networking_Core *net)
 {
     return net->port;
 }
 
-/* Basic network functions:
- * Function to send packet(data) of length length to ip_port.
+/* Convert ip_port into a socket address usable on our socket.
+ *
+ * return 0 on success.
+ * return -1 if the packet can't be sent to ip_port from this socket.
  */
-int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+static int ip_port_to_sockaddr(const Networking_Core *net, IP_Port ip_port, struct sockaddr_storage *addr,
+                               size_t *addrsize, uint16_t length)
 {
     if (net_family_is_unspec(net->family)) { /* Socket not initialized */
         LOGGER_ERROR(net->log, "attempted to send message of length %u on uninitialised socket", (unsigned)length);
@@ -507,21 +573,17 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
         ip_port.ip.ip.v6 = ip6;
     }
 
-    struct sockaddr_storage addr;
-
-    size_t addrsize;
-
     if (net_family_is_ipv4(ip_port.ip.family)) {
-        struct sockaddr_in *const addr4 = (struct sockaddr_in *)&addr;
+        struct sockaddr_in *const addr4 = (struct sockaddr_in *)addr;
 
-        addrsize = sizeof(struct sockaddr_in);
+        *addrsize = sizeof(struct sockaddr_in);
         addr4->sin_family = AF_INET;
         addr4->sin_port = ip_port.port;
         fill_addr4(ip_port.ip.ip.v4, &addr4->sin_addr);
     } else if (net_family_is_ipv6(ip_port.ip.family)) {
-        struct sockaddr_in6 *const addr6 = (struct sockaddr_in6 *)&addr;
+        struct sockaddr_in6 *const addr6 = (struct sockaddr_in6 *)addr;
 
-        addrsize = sizeof(struct sockaddr_in6);
+        *addrsize = sizeof(struct sockaddr_in6);
         addr6->sin6_family = AF_INET6;
         addr6->sin6_port = ip_port.port;
         fill_addr6(ip_port.ip.ip.v6, &addr6->sin6_addr);
@@ -533,6 +595,63 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
         return -1;
     }
 
+    return 0;
+}
+
+static uint32_t send_queue_flush(Networking_Core *net, Net_Send_Queue *queue);
+
+/* Copy a packet into the send queue, flushing it first if it is full.
+ *
+ * return length.
+ */
+static int send_queue_add(Networking_Core *net, const struct sockaddr_storage *addr, size_t addrsize,
+                          const uint8_t *data, uint16_t length)
+{
+    Net_Send_Queue *const queue = net->send_queue;
+
+    pthread_mutex_lock(&queue->mutex);
+
+    if (queue->length == NET_SEND_QUEUE_SIZE) {
+        send_queue_flush(net, queue);
+    }
+
+    const uint32_t i = queue->length;
+    memcpy(&queue->addrs[i], addr, addrsize);
+    queue->addrsizes[i] = addrsize;
+    queue->lengths[i] = length;
+    memcpy(queue->data[i], data, length);
+    ++queue->length;
+
+    ++queue->stats.packets_queued;
+    queue->stats.depth = queue->length;
+
+    if (queue->length > queue->stats.max_depth) {
+        queue->stats.max_depth = queue->length;
+    }
+
+    pthread_mutex_unlock(&queue->mutex);
+
+    return length;
+}
+
+/* Basic network functions:
+ * Function to send packet(data) of length length to ip_port.
+ */
+int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length)
+{
+    struct sockaddr_storage addr;
+    size_t addrsize;
+
+    if (ip_port_to_sockaddr(net, ip_port, &addr, &addrsize, length) == -1) {
+        return -1;
+    }
+
+    if (net->send_queue != nullptr && length <= MAX_UDP_PACKET_SIZE) {
+        const int res = send_queue_add(net, &addr, addrsize, data, length);
+        loglogdata(net->log, "O=>", data, length, ip_port, res);
+        return res;
+    }
+
     const int res = sendto(net->sock.socket, (const char *)data, length, 0, (struct sockaddr *)&addr, addrsize);
 
     loglogdata(net->log, "O=>", data, length, ip_port, res);
@@ -540,39 +659,147 @@ int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint1
     return res;
 }
 
-/* Function to receive data
- *  ip and port of sender is put into ip_port.
- *  Packet data is put into data.
- *  Packet length is put into length.
+/* Send everything in the queue. Must be called with queue->mutex held.
+ *
+ * return number of packets handed to the kernel.
  */
-static int receivepacket(const Logger *log, Socket sock, IP_Port *ip_port, uint8_t *data, uint32_t *length)
+static uint32_t send_queue_flush(Networking_Core *net, Net_Send_Queue *queue)
 {
-    memset(ip_port, 0, sizeof(IP_Port));
-    struct sockaddr_storage addr;
-#ifdef OS_WIN32
-    int addrlen = sizeof(addr);
-#else
-    socklen_t addrlen = sizeof(addr);
-#endif
-    *length = 0;
-    int fail_or_len = recvfrom(sock.socket, (char *) data, MAX_UDP_PACKET_SIZE, 0, (struct sockaddr *)&addr, &addrlen);
+    if (queue->length == 0) {
+        return 0;
+    }
 
-    if (fail_or_len < 0) {
-        int error = net_error();
+    uint32_t sent = 0;
 
-        if (fail_or_len < 0 && error != TOX_EWOULDBLOCK) {
+#ifdef NET_HAVE_SENDMMSG
+
+    for (uint32_t i = 0; i < queue->length; ++i) {
+        queue->iovecs[i].iov_base = queue->data[i];
+        queue->iovecs[i].iov_len = queue->lengths[i];
+        queue->msgs[i].msg_hdr.msg_name = &queue->addrs[i];
+        queue->msgs[i].msg_hdr.msg_namelen = queue->addrsizes[i];
+        queue->msgs[i].msg_hdr.msg_iov = &queue->iovecs[i];
+        queue->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    uint32_t done = 0;
+
+    while (done < queue->length) {
+        const int res = sendmmsg(net->sock.socket, &queue->msgs[done], queue->length - done, 0);
+        ++queue->stats.send_syscalls;
+
+        if (res <= 0) {
+            /* sendmmsg only fails if the first packet failed: drop it like sendto would. */
+            const int error = net_error();
             const char *strerror = net_new_strerror(error);
-            LOGGER_ERROR(log, "Unexpected error reading from socket: %u, %s", error, strerror);
+            LOGGER_TRACE(net->log, "sendmmsg failed for queued packet of length %u: %d, %s",
+                         queue->lengths[done], error, strerror);
             net_kill_strerror(strerror);
+            ++done;
+            continue;
         }
 
-        return -1; /* Nothing received. */
+        done += res;
+        sent += res;
     }
 
-    *length = (uint32_t)fail_or_len;
+#else
+
+    for (uint32_t i = 0; i < queue->length; ++i) {
+        const int res = sendto(net->sock.socket, (const char *)queue->data[i], queue->lengths[i], 0,
+                               (struct sockaddr *)&queue->addrs[i], queue->addrsizes[i]);
+        ++queue->stats.send_syscalls;
+
+        if (res >= 0) {
+            ++sent;
+        }
+    }
+
+#endif
+
+    ++queue->stats.flushes;
+    queue->stats.packets_flushed += queue->length;
+    queue->stats.last_flush_size = queue->length;
+    queue->length = 0;
+    queue->stats.depth = 0;
+
+    return sent;
+}
+
+uint32_t networking_flush(Networking_Core *net)
+{
+    Net_Send_Queue *const queue = net->send_queue;
+
+    if (queue == nullptr) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&queue->mutex);
+    const uint32_t sent = send_queue_flush(net, queue);
+    pthread_mutex_unlock(&queue->mutex);
+
+    return sent;
+}
+
+bool networking_set_send_queue(Networking_Core *net, bool enabled)
+{
+    if (!enabled) {
+        if (net->send_queue != nullptr) {
+            networking_flush(net);
+            pthread_mutex_destroy(&net->send_queue->mutex);
+            free(net->send_queue);
+            net->send_queue = nullptr;
+        }
+
+        return false;
+    }
+
+    if (net_family_is_unspec(net->family)) {
+        return false;
+    }
+
+    if (net->send_queue != nullptr) {
+        return true;
+    }
+
+    Net_Send_Queue *queue = (Net_Send_Queue *)calloc(1, sizeof(Net_Send_Queue));
+
+    if (queue == nullptr) {
+        return false;
+    }
 
-    if (addr.ss_family == AF_INET) {
-        struct sockaddr_in *addr_in = (struct sockaddr_in *)&addr;
+    if (pthread_mutex_init(&queue->mutex, nullptr) != 0) {
+        free(queue);
+        return false;
+    }
+
+    net->send_queue = queue;
+    return true;
+}
+
+void networking_get_send_queue_stats(Networking_Core *net, Net_Send_Queue_Stats *stats)
+{
+    if (net->send_queue == nullptr) {
+        memset(stats, 0, sizeof(Net_Send_Queue_Stats));
+        return;
+    }
+
+    pthread_mutex_lock(&net->send_queue->mutex);
+    *stats = net->send_queue->stats;
+    pthread_mutex_unlock(&net->send_queue->mutex);
+}
+
+/* Convert the source address of a received datagram into an IP_Port.
+ *
+ * return 0 on success.
+ * return -1 if the address family is not supported.
+ */
+static int ip_port_from_sockaddr(const struct sockaddr_storage *addr, IP_Port *ip_port)
+{
+    memset(ip_port, 0, sizeof(IP_Port));
+
+    if (addr->ss_family == AF_INET) {
+        const struct sockaddr_in *addr_in = (const struct sockaddr_in *)addr;
 
         const Family *const family = make_tox_family(addr_in->sin_family);
         assert(family != nullptr);
@@ -584,8 +811,8 @@ static int receivepacket(const Logger *log, Socket sock, IP_Port *ip_port, uint8
         ip_port->ip.family = *family;
         get_ip4(&ip_port->ip.ip.v4, &addr_in->sin_addr);
         ip_port->port = addr_in->sin_port;
-    } else if (addr.ss_family == AF_INET6) {
-        struct sockaddr_in6 *addr_in6 = (struct sockaddr_in6 *)&addr;
+    } else if (addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6 *addr_in6 = (const struct sockaddr_in6 *)addr;
         const Family *const family = make_tox_family(addr_in6->sin6_family);
         assert(family != nullptr);
 
@@ -605,11 +832,107 @@ static int receivepacket(const Logger *log, Socket sock, IP_Port *ip_port, uint8
         return -1;
     }
 
+    return 0;
+}
+
+/* Function to receive data
+ *  ip and port of sender is put into ip_port.
+ *  Packet data is put into data.
+ *  Packet length is put into length.
+ */
+static int receivepacket(const Logger *log, Socket sock, IP_Port *ip_port, uint8_t *data, uint32_t *length)
+{
+    memset(ip_port, 0, sizeof(IP_Port));
+    struct sockaddr_storage addr;
+#ifdef OS_WIN32
+    int addrlen = sizeof(addr);
+#else
+    socklen_t addrlen = sizeof(addr);
+#endif
+    *length = 0;
+    int fail_or_len = recvfrom(sock.socket, (char *) data, MAX_UDP_PACKET_SIZE, 0, (struct sockaddr *)&addr, &addrlen);
+
+    if (fail_or_len < 0) {
+        int error = net_error();
+
+        if (fail_or_len < 0 && error != TOX_EWOULDBLOCK) {
+            const char *strerror = net_new_strerror(error);
+            LOGGER_ERROR(log, "Unexpected error reading from socket: %u, %s", error, strerror);
+            net_kill_strerror(strerror);
+        }
+
+        return -1; /* Nothing received. */
+    }
+
+    *length = (uint32_t)fail_or_len;
+
+    if (ip_port_from_sockaddr(&addr, ip_port) == -1) {
+        return -1;
+    }
+
     loglogdata(log, "=>O", data, MAX_UDP_PACKET_SIZE, *ip_port, *length);
 
     return 0;
 }
 
+#ifdef NET_HAVE_RECVMMSG
+static Net_Recv_Batch *recv_batch_new(void)
+{
+    Net_Recv_Batch *batch = (Net_Recv_Batch *)calloc(1, sizeof(Net_Recv_Batch));
+
+    if (batch == nullptr) {
+        return nullptr;
+    }
+
+    for (uint32_t i = 0; i < NET_RECV_BATCH_SIZE; ++i) {
+        batch->iovecs[i].iov_base = batch->data[i];
+        batch->iovecs[i].iov_len = MAX_UDP_PACKET_SIZE;
+        batch->msgs[i].msg_hdr.msg_iov = &batch->iovecs[i];
+        batch->msgs[i].msg_hdr.msg_iovlen = 1;
+        batch->msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+    }
+
+    return batch;
+}
+
+/* Function to receive up to NET_RECV_BATCH_SIZE datagrams with one syscall.
+ * Packets are left in net->recv_batch.
+ *
+ * return number of packets received (0 if there was nothing to read).
+ * return -1 if recvmmsg() is not supported by the kernel.
+ */
+static int receivepacket_batch(Networking_Core *net)
+{
+    Net_Recv_Batch *const batch = net->recv_batch;
+
+    for (uint32_t i = 0; i < NET_RECV_BATCH_SIZE; ++i) {
+        batch->msgs[i].msg_hdr.msg_namelen = sizeof(batch->addrs[i]);
+        batch->msgs[i].msg_hdr.msg_flags = 0;
+        batch->msgs[i].msg_len = 0;
+    }
+
+    const int count = recvmmsg(net->sock.socket, batch->msgs, NET_RECV_BATCH_SIZE, 0, nullptr);
+
+    if (count < 0) {
+        const int error = net_error();
+
+        if (error == ENOSYS) {
+            return -1;
+        }
+
+        if (error != TOX_EWOULDBLOCK) {
+            const char *strerror = net_new_strerror(error);
+            LOGGER_ERROR(net->log, "Unexpected error reading from socket: %u, %s", error, strerror);
+            net_kill_strerror(strerror);
+        }
+
+        return 0;
+    }
+
+    return count;
+}
+#endif
+
 void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_cb *cb, void *object)
 {
     net->packethandlers[byte].function = cb;
@@ -653,6 +976,104 @@ bool networking_test(Networking_Core *net, IP_Port dstIpPort, int nWaitMilliseco
     
     return false;
 }
+static void networking_dispatch(const Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint32_t length,
+                                void *userdata)
+{
+    if (length < 1) {
+        return;
+    }
+
+    if (!(net->packethandlers[data[0]].function)) {
+        LOGGER_WARNING(net->log, "[%02u] -- Packet has no handler", data[0]);
+        return;
+    }
+
+    net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length, userdata);
+}
+
+#ifdef NET_HAVE_RECVMMSG
+/* return false if recvmmsg() turned out to be unsupported and nothing was read. */
+static bool networking_poll_batch(Networking_Core *net, void *userdata)
+{
+    int count;
+
+    do {
+        count = receivepacket_batch(net);
+
+        if (count < 0) {
+            return false;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            const uint8_t *const data = net->recv_batch->data[i];
+            const uint32_t length = net->recv_batch->msgs[i].msg_len;
+            IP_Port ip_port;
+
+            if (ip_port_from_sockaddr(&net->recv_batch->addrs[i], &ip_port) == -1) {
+                continue;
+            }
+
+            loglogdata(net->log, "=>O", data, MAX_UDP_PACKET_SIZE, ip_port, length);
+            networking_dispatch(net, ip_port, data, length, userdata);
+        }
+
+        /* A short batch means the socket is drained. */
+    } while (count == NET_RECV_BATCH_SIZE);
+
+    return true;
+}
+#endif
+
+bool networking_set_batched_recv(Networking_Core *net, bool enabled)
+{
+#ifdef NET_HAVE_RECVMMSG
+
+    if (net_family_is_unspec(net->family)) {
+        return false;
+    }
+
+    if (!enabled) {
+        free(net->recv_batch);
+        net->recv_batch = nullptr;
+        return false;
+    }
+
+    if (net->recv_batch == nullptr) {
+        net->recv_batch = recv_batch_new();
+    }
+
+    return net->recv_batch != nullptr;
+#else
+    return false;
+#endif
+}
+
+static void precomputed_dispatch(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                                 void *userdata)
+{
+    networking_dispatch((const Networking_Core *)object, source, packet, length, userdata);
+}
+
+void networking_set_precompute_pool(Networking_Core *net, Precompute_Pool *pool)
+{
+    net->precompute_pool = pool;
+}
+
+Precompute_Pool *networking_get_precompute_pool(const Networking_Core *net)
+{
+    return net->precompute_pool;
+}
+
+bool networking_poll_precomputed(Networking_Core *net, void *userdata)
+{
+    if (net->precompute_pool == nullptr) {
+        return false;
+    }
+
+    precompute_pool_drain(net->precompute_pool, precomputed_dispatch, net, userdata);
+    return precompute_pool_pending(net->precompute_pool) != 0;
+}
+
 void networking_poll(Networking_Core *net, void *userdata)
 {
     if (net_family_is_unspec(net->family)) {
@@ -660,21 +1081,27 @@ void networking_poll(Networking_Core *net, void *userdata)
         return;
     }
 
+    networking_poll_precomputed(net, userdata);
+
+#ifdef NET_HAVE_RECVMMSG
+
+    if (net->recv_batch != nullptr) {
+        if (networking_poll_batch(net, userdata)) {
+            return;
+        }
+
+        LOGGER_WARNING(net->log, "recvmmsg() not supported, falling back to recvfrom()");
+        networking_set_batched_recv(net, false);
+    }
+
+#endif
+
     IP_Port ip_port;
     uint8_t data[MAX_UDP_PACKET_SIZE];
     uint32_t length;
 
     while (receivepacket(net->log, net->sock, &ip_port, data, &length) != -1) {
-        if (length < 1) {
-            continue;
-        }
-
-        if (!(net->packethandlers[data[0]].function)) {
-            LOGGER_WARNING(net->log, "[%02u] -- Packet has no handler", data[0]);
-            continue;
-        }
-
-        net->packethandlers[data[0]].function(net->packethandlers[data[0]].object, ip_port, data, length, userdata);
+        networking_dispatch(net, ip_port, data, length, userdata);
     }
 }
 
@@ -935,6 +1362,9 @@ Networking_Core *new_networking_ex(const Logger *log, IP ip, uint16_t port_from,
                 *error = 0;
             }
 
+            /* Batched receive is an optimisation; without it we still work. */
+            networking_set_batched_recv(temp, true);
+
             return temp;
         }
 
@@ -983,11 +1413,18 @@ void kill_networking(Networking_Core *net)
         return;
     }
 
+    /* Anything still queued goes out before the socket is closed. */
+    networking_set_send_queue(net, false);
+
     if (!net_family_is_unspec(net->family)) {
         /* Socket is initialized, so we close it. */
         kill_sock(net->sock);
     }
 
+#ifdef NET_HAVE_RECVMMSG
+    free(net->recv_batch);
+#endif
+
     free(net);
 }
 
@@ -1047,6 +1484,20 @@ bool ipport_equal(const IP_Port *a, const IP_Port *b)
     return ip_equal(&a->ip, &b->ip);
 }
 
+void ip_port_key(uint8_t *key, const IP_Port *ip_port)
+{
+    memset(key, 0, IP_PORT_KEY_SIZE);
+    key[0] = ip_port->ip.family.value;
+
+    if (net_family_is_ipv4(ip_port->ip.family)) {
+        memcpy(key + 1, &ip_port->ip.ip.v4, sizeof(IP4));
+    } else if (net_family_is_ipv6(ip_port->ip.family)) {
+        memcpy(key + 1, &ip_port->ip.ip.v6, sizeof(IP6));
+    }
+
+    memcpy(key + 1 + sizeof(IP6), &ip_port->port, sizeof(uint16_t));
+}
+
 /* nulls out ip */
 void ip_reset(IP *ip)
 {
@@ -1480,6 +1931,46 @@ int net_send(Socket sock, const void *buf, size_t len)
     return send(sock.socket, (const char *)buf, len, MSG_NOSIGNAL);
 }
 
+int net_sendv(Socket sock, const uint8_t *const *bufs, const size_t *lens, uint32_t count)
+{
+#ifdef OS_WIN32
+    int total = 0;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        const int len = net_send(sock, bufs[i], lens[i]);
+
+        if (len <= 0) {
+            return total == 0 ? len : total;
+        }
+
+        total += len;
+
+        if ((size_t)len != lens[i]) {
+            break;
+        }
+    }
+
+    return total;
+#else
+    struct iovec iov[NET_SENDV_MAX_BUFS];
+
+    if (count > NET_SENDV_MAX_BUFS) {
+        count = NET_SENDV_MAX_BUFS;
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        iov[i].iov_base = (void *)bufs[i];
+        iov[i].iov_len = lens[i];
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    return sendmsg(sock.socket, &msg, MSG_NOSIGNAL);
+#endif
+}
+
 int net_recv(Socket sock, void *buf, size_t len)
 {
     return recv(sock.socket, (char *)buf, len, MSG_NOSIGNAL);
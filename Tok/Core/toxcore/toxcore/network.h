@@ -77,6 +77,16 @@ extern const Socket net_invalid_socket;
  * Calls send(sockfd, buf, len, MSG_NOSIGNAL).
  */
 int net_send(Socket sock, const void *buf, size_t len);
+
+#define NET_SENDV_MAX_BUFS 8
+
+/**
+ * Calls sendmsg(sockfd, msg, MSG_NOSIGNAL) with up to NET_SENDV_MAX_BUFS
+ * buffers, so that they go out one after the other in one call as with
+ * writev(). Where there is no sendmsg(), calls net_send for each until one is
+ * not taken in full.
+ */
+int net_sendv(Socket sock, const uint8_t *const *bufs, const size_t *lens, uint32_t count);
 /**
  * Calls recv(sockfd, buf, len, MSG_NOSIGNAL).
  */
@@ -279,6 +289,15 @@ bool ip_equal(const IP *a, const IP *b);
  */
 bool ipport_equal(const IP_Port *a, const IP_Port *b);
 
+#define IP_PORT_KEY_SIZE (sizeof(uint8_t) + sizeof(IP6) + sizeof(uint16_t))
+
+/**
+ * Write the family, address and port of ip_port into key, with no padding
+ * bytes, for use as a hash or memcmp key. Unlike ipport_equal, an IPv4 address
+ * and the same address embedded in IPv6 give different keys.
+ */
+void ip_port_key(uint8_t *key, const IP_Port *ip_port);
+
 /* nulls out ip */
 void ip_reset(IP *ip);
 /* nulls out ip, sets family according to flag */
@@ -337,6 +356,8 @@ typedef struct Networking_Core Networking_Core;
 
 Family net_family(const Networking_Core *net);
 uint16_t net_port(const Networking_Core *net);
+/* The UDP socket, invalid if UDP is disabled. */
+Socket net_sock(const Networking_Core *net);
 
 /* Run this before creating sockets.
  *
@@ -379,15 +400,73 @@ bool set_socket_dualstack(Socket sock);
 
 /* Basic network functions: */
 
-/* Function to send packet(data) of length length to ip_port. */
+/* Function to send packet(data) of length length to ip_port.
+ *
+ * If the send queue is enabled the packet is only queued, and the return value
+ * is length as long as the destination is valid for this socket.
+ */
 int sendpacket(Networking_Core *net, IP_Port ip_port, const uint8_t *data, uint16_t length);
 
+typedef struct Net_Send_Queue_Stats {
+    uint32_t depth;           /* Packets currently waiting in the queue. */
+    uint32_t max_depth;       /* Highest depth seen so far. */
+    uint32_t last_flush_size; /* Packets sent by the most recent flush. */
+    uint64_t packets_queued;
+    uint64_t packets_flushed;
+    uint64_t flushes;
+    uint64_t send_syscalls;   /* sendmmsg()/sendto() calls made by flushes. */
+} Net_Send_Queue_Stats;
+
+/* Enable or disable the transmit queue. While enabled, sendpacket() only
+ * queues packets and networking_flush() sends them with as few syscalls as
+ * the platform allows (sendmmsg() on Linux). Disabling flushes the queue.
+ *
+ * Queued packets are delayed until the next flush, so this is meant for
+ * nodes that flush at the end of every iteration (see tox_iterate), not for
+ * latency-sensitive audio/video traffic sent from other threads.
+ *
+ * return true if the send queue is active after this call.
+ */
+bool networking_set_send_queue(Networking_Core *net, bool enabled);
+
+/* Send all packets waiting in the send queue.
+ *
+ * return number of packets handed to the kernel.
+ */
+uint32_t networking_flush(Networking_Core *net);
+
+/* Copy the send queue counters into stats. All zero if the queue is disabled. */
+void networking_get_send_queue_stats(Networking_Core *net, Net_Send_Queue_Stats *stats);
+
 /* Function to call when packet beginning with byte is received. */
 void networking_registerhandler(Networking_Core *net, uint8_t byte, packet_handler_cb *cb, void *object);
 
 /* Call this several times a second. */
 void networking_poll(Networking_Core *net, void *userdata);
 
+/* Enable or disable draining the UDP socket with one recvmmsg() call per
+ * batch of datagrams instead of one recvfrom() call per datagram. Batched
+ * receive is enabled by default on platforms that support it.
+ *
+ * return true if batched receive is active after this call.
+ */
+bool networking_set_batched_recv(Networking_Core *net, bool enabled);
+
+/* Let packet handlers queue packets that need a shared key computed in pool
+ * (see precompute.h), or compute keys inline if pool is NULL. net does not own
+ * the pool.
+ */
+struct Precompute_Pool;
+void networking_set_precompute_pool(Networking_Core *net, struct Precompute_Pool *pool);
+struct Precompute_Pool *networking_get_precompute_pool(const Networking_Core *net);
+
+/* Dispatch the packets whose shared keys are ready. networking_poll does this
+ * too, but keys become ready while the socket is idle.
+ *
+ * return true if packets are still waiting for their keys.
+ */
+bool networking_poll_precomputed(Networking_Core *net, void *userdata);
+
 /* Call this several times a second. */
 bool networking_test(Networking_Core *net, IP_Port dstIpPort, int nWaitMilliseconds);
 
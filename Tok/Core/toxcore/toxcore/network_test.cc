@@ -0,0 +1,179 @@
+#include "network.h"
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+struct Logger_Deleter {
+  void operator()(Logger *log) { logger_kill(log); }
+};
+
+using Logger_Ptr = std::unique_ptr<Logger, Logger_Deleter>;
+
+struct Networking_Core_Deleter {
+  void operator()(Networking_Core *net) { kill_networking(net); }
+};
+
+using Networking_Core_Ptr = std::unique_ptr<Networking_Core, Networking_Core_Deleter>;
+
+constexpr uint8_t kTestPacketId = 0xf1;
+constexpr uint32_t kPacketCount = 50000;
+constexpr uint32_t kBurstSize = 256;
+
+int count_packet(void *object, IP_Port ip_port, const uint8_t *data, uint16_t len, void *userdata) {
+  ++*static_cast<uint32_t *>(object);
+  return 0;
+}
+
+IP loopback_ip() {
+  IP ip;
+  ip_init(&ip, false);
+  ip.ip.v4 = get_ip4_loopback();
+  return ip;
+}
+
+/**
+ * Sends kPacketCount small datagrams over loopback in bursts and polls the
+ * receiver after each burst.
+ *
+ * @return received packets per second.
+ */
+double loopback_packets_per_second(bool batched, uint32_t *received) {
+  Logger_Ptr log(logger_new());
+  Networking_Core_Ptr sender(new_networking_ex(log.get(), loopback_ip(), 0, 0, nullptr));
+  Networking_Core_Ptr receiver(new_networking_ex(log.get(), loopback_ip(), 0, 0, nullptr));
+  EXPECT_NE(sender, nullptr);
+  EXPECT_NE(receiver, nullptr);
+
+  if (sender == nullptr || receiver == nullptr) {
+    return 0;
+  }
+
+  networking_set_batched_recv(receiver.get(), batched);
+  networking_registerhandler(receiver.get(), kTestPacketId, &count_packet, received);
+
+  IP_Port dest;
+  dest.ip = loopback_ip();
+  dest.port = net_port(receiver.get());
+
+  std::vector<uint8_t> packet(100, 0);
+  packet[0] = kTestPacketId;
+
+  auto const start = std::chrono::steady_clock::now();
+
+  for (uint32_t sent = 0; sent < kPacketCount; sent += kBurstSize) {
+    for (uint32_t i = 0; i < kBurstSize && sent + i < kPacketCount; ++i) {
+      sendpacket(sender.get(), dest, packet.data(), packet.size());
+    }
+
+    networking_poll(receiver.get(), nullptr);
+  }
+
+  networking_poll(receiver.get(), nullptr);
+
+  auto const elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+  return *received / elapsed.count();
+}
+
+TEST(Network, LoopbackPacketsAreDispatchedToHandler) {
+  for (bool const batched : {false, true}) {
+    uint32_t received = 0;
+    double const pps = loopback_packets_per_second(batched, &received);
+    std::printf("%s receive: %u/%u packets, %.0f packets/sec\n", batched ? "batched" : "single", received,
+                kPacketCount, pps);
+
+    // Loopback may drop under load, but the bulk of the packets must arrive.
+    EXPECT_GT(received, kPacketCount / 2);
+  }
+}
+
+TEST(Network, SendQueueBatchesPacketsUntilFlush) {
+  Logger_Ptr log(logger_new());
+  Networking_Core_Ptr sender(new_networking_ex(log.get(), loopback_ip(), 0, 0, nullptr));
+  Networking_Core_Ptr receiver(new_networking_ex(log.get(), loopback_ip(), 0, 0, nullptr));
+  ASSERT_NE(sender, nullptr);
+  ASSERT_NE(receiver, nullptr);
+
+  uint32_t received = 0;
+  networking_registerhandler(receiver.get(), kTestPacketId, &count_packet, &received);
+  ASSERT_TRUE(networking_set_send_queue(sender.get(), true));
+
+  IP_Port dest;
+  dest.ip = loopback_ip();
+  dest.port = net_port(receiver.get());
+
+  std::vector<uint8_t> packet(100, 0);
+  packet[0] = kTestPacketId;
+
+  for (uint32_t i = 0; i < 40; ++i) {
+    EXPECT_EQ(sendpacket(sender.get(), dest, packet.data(), packet.size()), int(packet.size()));
+  }
+
+  Net_Send_Queue_Stats stats;
+  networking_get_send_queue_stats(sender.get(), &stats);
+  EXPECT_EQ(stats.depth, 40);
+  EXPECT_EQ(stats.flushes, 0);
+
+  networking_poll(receiver.get(), nullptr);
+  EXPECT_EQ(received, 0);
+
+  EXPECT_EQ(networking_flush(sender.get()), 40);
+  networking_get_send_queue_stats(sender.get(), &stats);
+  EXPECT_EQ(stats.depth, 0);
+  EXPECT_EQ(stats.max_depth, 40);
+  EXPECT_EQ(stats.last_flush_size, 40);
+  EXPECT_EQ(stats.packets_flushed, 40);
+  EXPECT_EQ(stats.flushes, 1);
+  EXPECT_GE(stats.send_syscalls, 1);
+  EXPECT_LE(stats.send_syscalls, 40);
+
+  networking_poll(receiver.get(), nullptr);
+  EXPECT_EQ(received, 40);
+}
+
+TEST(Network, SendQueueThroughput) {
+  Logger_Ptr log(logger_new());
+  Networking_Core_Ptr sender(new_networking_ex(log.get(), loopback_ip(), 0, 0, nullptr));
+  Networking_Core_Ptr receiver(new_networking_ex(log.get(), loopback_ip(), 0, 0, nullptr));
+  ASSERT_NE(sender, nullptr);
+  ASSERT_NE(receiver, nullptr);
+
+  uint32_t received = 0;
+  networking_registerhandler(receiver.get(), kTestPacketId, &count_packet, &received);
+  ASSERT_TRUE(networking_set_send_queue(sender.get(), true));
+
+  IP_Port dest;
+  dest.ip = loopback_ip();
+  dest.port = net_port(receiver.get());
+
+  std::vector<uint8_t> packet(100, 0);
+  packet[0] = kTestPacketId;
+
+  auto const start = std::chrono::steady_clock::now();
+
+  for (uint32_t sent = 0; sent < kPacketCount; sent += kBurstSize) {
+    for (uint32_t i = 0; i < kBurstSize && sent + i < kPacketCount; ++i) {
+      sendpacket(sender.get(), dest, packet.data(), packet.size());
+    }
+
+    networking_flush(sender.get());
+    networking_poll(receiver.get(), nullptr);
+  }
+
+  auto const elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+
+  Net_Send_Queue_Stats stats;
+  networking_get_send_queue_stats(sender.get(), &stats);
+  std::printf("queued send: %u/%u packets, %.0f packets/sec, %llu send syscalls\n", received, kPacketCount,
+              received / elapsed.count(), static_cast<unsigned long long>(stats.send_syscalls));
+
+  EXPECT_GT(received, kPacketCount / 2);
+  EXPECT_EQ(stats.packets_flushed, kPacketCount);
+}
+
+}  // namespace
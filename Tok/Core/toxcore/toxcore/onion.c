@@ -42,6 +42,10 @@
 #define SEND_2 ONION_SEND_2
 #define SEND_1 ONION_SEND_1
 
+#if 1 + CRYPTO_NONCE_SIZE < SIZE_IPPORT
+#error "handle_send_1 decrypts the address of the next hop in front of the packet it forwards"
+#endif
+
 /* Change symmetric keys every 2 hours to make paths expire eventually. */
 #define KEY_REFRESH_INTERVAL (2 * 60 * 60)
 static void change_symmetric_key(Onion *onion)
@@ -171,6 +175,21 @@ int onion_path_to_nodes(Node_format *nodes, unsigned int num_nodes, const Onion_
     return 0;
 }
 
+/* Onion layers are laid out inside the packet where they end up and encrypted
+ * in place, each one behind the CRYPTO_MAC_SIZE bytes that receive its MAC.
+ *
+ * return -1 on failure.
+ * return 0 on success.
+ */
+static int onion_encrypt_layer(const uint8_t *shared_key, const uint8_t *nonce, uint8_t *plain, uint16_t length)
+{
+    if (encrypt_data_symmetric_detached(shared_key, nonce, plain, length, plain, plain - CRYPTO_MAC_SIZE) != length) {
+        return -1;
+    }
+
+    return 0;
+}
+
 /* Create a onion packet.
  *
  * Use Onion_Path path to create packet for data of length to dest.
@@ -187,32 +206,31 @@ int create_onion_packet(uint8_t *packet, uint16_t max_packet_length, const Onion
         return -1;
     }
 
-    VLA(uint8_t, step1, SIZE_IPPORT + length);
+    uint8_t nonce[CRYPTO_NONCE_SIZE];
+    random_nonce(nonce);
+
+    uint8_t *step3 = packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_MAC_SIZE;
+    uint8_t *step2 = step3 + SEND_BASE;
+    uint8_t *step1 = step2 + SEND_BASE;
 
     ipport_pack(step1, &dest);
     memcpy(step1 + SIZE_IPPORT, data, length);
 
-    uint8_t nonce[CRYPTO_NONCE_SIZE];
-    random_nonce(nonce);
+    if (onion_encrypt_layer(path->shared_key3, nonce, step1, SIZE_IPPORT + length) == -1) {
+        return -1;
+    }
 
-    VLA(uint8_t, step2, SIZE_IPPORT + SEND_BASE + length);
     ipport_pack(step2, &path->ip_port3);
     memcpy(step2 + SIZE_IPPORT, path->public_key3, CRYPTO_PUBLIC_KEY_SIZE);
 
-    int len = encrypt_data_symmetric(path->shared_key3, nonce, step1, SIZEOF_VLA(step1),
-                                     step2 + SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE);
-
-    if (len != SIZE_IPPORT + length + CRYPTO_MAC_SIZE) {
+    if (onion_encrypt_layer(path->shared_key2, nonce, step2, SIZE_IPPORT + SEND_BASE + length) == -1) {
         return -1;
     }
 
-    VLA(uint8_t, step3, SIZE_IPPORT + SEND_BASE * 2 + length);
     ipport_pack(step3, &path->ip_port2);
     memcpy(step3 + SIZE_IPPORT, path->public_key2, CRYPTO_PUBLIC_KEY_SIZE);
-    len = encrypt_data_symmetric(path->shared_key2, nonce, step2, SIZEOF_VLA(step2),
-                                 step3 + SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE);
 
-    if (len != SIZE_IPPORT + SEND_BASE + length + CRYPTO_MAC_SIZE) {
+    if (onion_encrypt_layer(path->shared_key1, nonce, step3, SIZE_IPPORT + SEND_BASE * 2 + length) == -1) {
         return -1;
     }
 
@@ -220,14 +238,7 @@ int create_onion_packet(uint8_t *packet, uint16_t max_packet_length, const Onion
     memcpy(packet + 1, nonce, CRYPTO_NONCE_SIZE);
     memcpy(packet + 1 + CRYPTO_NONCE_SIZE, path->public_key1, CRYPTO_PUBLIC_KEY_SIZE);
 
-    len = encrypt_data_symmetric(path->shared_key1, nonce, step3, SIZEOF_VLA(step3),
-                                 packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE);
-
-    if (len != SIZE_IPPORT + SEND_BASE * 2 + length + CRYPTO_MAC_SIZE) {
-        return -1;
-    }
-
-    return 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + len;
+    return 1 + SEND_1 + length;
 }
 
 /* Create a onion packet to be sent over tcp.
@@ -246,37 +257,31 @@ int create_onion_packet_tcp(uint8_t *packet, uint16_t max_packet_length, const O
         return -1;
     }
 
-    VLA(uint8_t, step1, SIZE_IPPORT + length);
-
-    ipport_pack(step1, &dest);
-    memcpy(step1 + SIZE_IPPORT, data, length);
-
     uint8_t nonce[CRYPTO_NONCE_SIZE];
     random_nonce(nonce);
 
-    VLA(uint8_t, step2, SIZE_IPPORT + SEND_BASE + length);
-    ipport_pack(step2, &path->ip_port3);
-    memcpy(step2 + SIZE_IPPORT, path->public_key3, CRYPTO_PUBLIC_KEY_SIZE);
+    uint8_t *step2 = packet + CRYPTO_NONCE_SIZE + SEND_BASE;
+    uint8_t *step1 = step2 + SEND_BASE;
 
-    int len = encrypt_data_symmetric(path->shared_key3, nonce, step1, SIZEOF_VLA(step1),
-                                     step2 + SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE);
+    ipport_pack(step1, &dest);
+    memcpy(step1 + SIZE_IPPORT, data, length);
 
-    if (len != SIZE_IPPORT + length + CRYPTO_MAC_SIZE) {
+    if (onion_encrypt_layer(path->shared_key3, nonce, step1, SIZE_IPPORT + length) == -1) {
         return -1;
     }
 
-    ipport_pack(packet + CRYPTO_NONCE_SIZE, &path->ip_port2);
-    memcpy(packet + CRYPTO_NONCE_SIZE + SIZE_IPPORT, path->public_key2, CRYPTO_PUBLIC_KEY_SIZE);
-    len = encrypt_data_symmetric(path->shared_key2, nonce, step2, SIZEOF_VLA(step2),
-                                 packet + CRYPTO_NONCE_SIZE + SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE);
+    ipport_pack(step2, &path->ip_port3);
+    memcpy(step2 + SIZE_IPPORT, path->public_key3, CRYPTO_PUBLIC_KEY_SIZE);
 
-    if (len != SIZE_IPPORT + SEND_BASE + length + CRYPTO_MAC_SIZE) {
+    if (onion_encrypt_layer(path->shared_key2, nonce, step2, SIZE_IPPORT + SEND_BASE + length) == -1) {
         return -1;
     }
 
     memcpy(packet, nonce, CRYPTO_NONCE_SIZE);
+    ipport_pack(packet + CRYPTO_NONCE_SIZE, &path->ip_port2);
+    memcpy(packet + CRYPTO_NONCE_SIZE + SIZE_IPPORT, path->public_key2, CRYPTO_PUBLIC_KEY_SIZE);
 
-    return CRYPTO_NONCE_SIZE + SIZE_IPPORT + CRYPTO_PUBLIC_KEY_SIZE + len;
+    return CRYPTO_NONCE_SIZE + SIZE_IPPORT + SEND_BASE * 2 + length;
 }
 
 /* Create and send a onion packet.
@@ -343,8 +348,13 @@ static int handle_send_initial(void *object, IP_Port source, const uint8_t *pack
 
     uint8_t plain[ONION_MAX_PACKET_SIZE];
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(onion->mono_time, &onion->shared_keys_1, shared_key, dht_get_self_secret_key(onion->dht),
-                   packet + 1 + CRYPTO_NONCE_SIZE);
+
+    if (!get_shared_key_for_packet(onion->mono_time, onion->shared_keys_1, networking_get_precompute_pool(onion->net),
+                                   source, packet, length, shared_key, dht_get_self_secret_key(onion->dht),
+                                   packet + 1 + CRYPTO_NONCE_SIZE)) {
+        return 0;
+    }
+
     int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE,
                                      length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE), plain);
 
@@ -411,10 +421,19 @@ static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, ui
 
     change_symmetric_key(onion);
 
-    uint8_t plain[ONION_MAX_PACKET_SIZE];
+    /* The next layer is decrypted straight into the packet we forward. Its
+     * leading address is read before the header overwrites it.
+     */
+    uint8_t data[ONION_MAX_PACKET_SIZE];
+    uint8_t *plain = data + 1 + CRYPTO_NONCE_SIZE - SIZE_IPPORT;
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(onion->mono_time, &onion->shared_keys_2, shared_key, dht_get_self_secret_key(onion->dht),
-                   packet + 1 + CRYPTO_NONCE_SIZE);
+
+    if (!get_shared_key_for_packet(onion->mono_time, onion->shared_keys_2, networking_get_precompute_pool(onion->net),
+                                   source, packet, length, shared_key, dht_get_self_secret_key(onion->dht),
+                                   packet + 1 + CRYPTO_NONCE_SIZE)) {
+        return 0;
+    }
+
     int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE,
                                      length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_1), plain);
 
@@ -428,10 +447,8 @@ static int handle_send_1(void *object, IP_Port source, const uint8_t *packet, ui
         return 1;
     }
 
-    uint8_t data[ONION_MAX_PACKET_SIZE];
     data[0] = NET_PACKET_ONION_SEND_2;
     memcpy(data + 1, packet + 1, CRYPTO_NONCE_SIZE);
-    memcpy(data + 1 + CRYPTO_NONCE_SIZE, plain + SIZE_IPPORT, len - SIZE_IPPORT);
     uint16_t data_len = 1 + CRYPTO_NONCE_SIZE + (len - SIZE_IPPORT);
     uint8_t *ret_part = data + data_len;
     random_nonce(ret_part);
@@ -468,10 +485,19 @@ static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, ui
 
     change_symmetric_key(onion);
 
-    uint8_t plain[ONION_MAX_PACKET_SIZE];
+    /* The address of the next hop is decrypted into the headroom in front of
+     * the packet we forward.
+     */
+    uint8_t plain[SIZE_IPPORT + ONION_MAX_PACKET_SIZE];
+    uint8_t *data = plain + SIZE_IPPORT;
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(onion->mono_time, &onion->shared_keys_3, shared_key, dht_get_self_secret_key(onion->dht),
-                   packet + 1 + CRYPTO_NONCE_SIZE);
+
+    if (!get_shared_key_for_packet(onion->mono_time, onion->shared_keys_3, networking_get_precompute_pool(onion->net),
+                                   source, packet, length, shared_key, dht_get_self_secret_key(onion->dht),
+                                   packet + 1 + CRYPTO_NONCE_SIZE)) {
+        return 0;
+    }
+
     int len = decrypt_data_symmetric(shared_key, packet + 1, packet + 1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE,
                                      length - (1 + CRYPTO_NONCE_SIZE + CRYPTO_PUBLIC_KEY_SIZE + RETURN_2), plain);
 
@@ -494,8 +520,6 @@ static int handle_send_2(void *object, IP_Port source, const uint8_t *packet, ui
         return 1;
     }
 
-    uint8_t data[ONION_MAX_PACKET_SIZE];
-    memcpy(data, plain + SIZE_IPPORT, len - SIZE_IPPORT);
     uint16_t data_len = (len - SIZE_IPPORT);
     uint8_t *ret_part = data + (len - SIZE_IPPORT);
     random_nonce(ret_part);
@@ -683,6 +707,15 @@ Onion *new_onion(Mono_Time *mono_time, DHT *dht)
     new_symmetric_key(onion->secret_symmetric_key);
     onion->timestamp = mono_time_get(onion->mono_time);
 
+    onion->shared_keys_1 = dht_shared_keys_new(dht);
+    onion->shared_keys_2 = dht_shared_keys_new(dht);
+    onion->shared_keys_3 = dht_shared_keys_new(dht);
+
+    if (onion->shared_keys_1 == nullptr || onion->shared_keys_2 == nullptr || onion->shared_keys_3 == nullptr) {
+        kill_onion(onion);
+        return nullptr;
+    }
+
     networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_INITIAL, &handle_send_initial, onion);
     networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_1, &handle_send_1, onion);
     networking_registerhandler(onion->net, NET_PACKET_ONION_SEND_2, &handle_send_2, onion);
@@ -708,5 +741,8 @@ void kill_onion(Onion *onion)
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_2, nullptr, nullptr);
     networking_registerhandler(onion->net, NET_PACKET_ONION_RECV_1, nullptr, nullptr);
 
+    shared_keys_kill(onion->shared_keys_1);
+    shared_keys_kill(onion->shared_keys_2);
+    shared_keys_kill(onion->shared_keys_3);
     free(onion);
 }
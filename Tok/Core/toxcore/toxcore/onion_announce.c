@@ -57,7 +57,7 @@ struct Onion_Announce {
     /* This is CRYPTO_SYMMETRIC_KEY_SIZE long just so we can use new_symmetric_key() to fill it */
     uint8_t secret_bytes[CRYPTO_SYMMETRIC_KEY_SIZE];
 
-    Shared_Keys shared_keys_recv;
+    Shared_Keys *shared_keys_recv;
 };
 
 uint8_t *onion_announce_entry_public_key(Onion_Announce *onion_a, uint32_t entry)
@@ -379,8 +379,12 @@ static int handle_announce_request(void *object, IP_Port source, const uint8_t *
 
     const uint8_t *packet_public_key = packet + 1 + CRYPTO_NONCE_SIZE;
     uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
-    get_shared_key(onion_a->mono_time, &onion_a->shared_keys_recv, shared_key, dht_get_self_secret_key(onion_a->dht),
-                   packet_public_key);
+
+    if (!get_shared_key_for_packet(onion_a->mono_time, onion_a->shared_keys_recv, networking_get_precompute_pool(onion_a->net),
+                                   source, packet, length, shared_key, dht_get_self_secret_key(onion_a->dht),
+                                   packet_public_key)) {
+        return 0;
+    }
 
     uint8_t plain[ONION_PING_ID_SIZE + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_PUBLIC_KEY_SIZE +
                                      ONION_ANNOUNCE_SENDBACK_DATA_LENGTH];
@@ -516,6 +520,13 @@ Onion_Announce *new_onion_announce(Mono_Time *mono_time, DHT *dht)
     onion_a->net = dht_get_net(dht);
     new_symmetric_key(onion_a->secret_bytes);
 
+    onion_a->shared_keys_recv = dht_shared_keys_new(dht);
+
+    if (onion_a->shared_keys_recv == nullptr) {
+        kill_onion_announce(onion_a);
+        return nullptr;
+    }
+
     networking_registerhandler(onion_a->net, NET_PACKET_ANNOUNCE_REQUEST, &handle_announce_request, onion_a);
     networking_registerhandler(onion_a->net, NET_PACKET_ONION_DATA_REQUEST, &handle_data_request, onion_a);
 
@@ -530,5 +541,6 @@ void kill_onion_announce(Onion_Announce *onion_a)
 
     networking_registerhandler(onion_a->net, NET_PACKET_ANNOUNCE_REQUEST, nullptr, nullptr);
     networking_registerhandler(onion_a->net, NET_PACKET_ONION_DATA_REQUEST, nullptr, nullptr);
+    shared_keys_kill(onion_a->shared_keys_recv);
     free(onion_a);
 }
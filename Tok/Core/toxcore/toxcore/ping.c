@@ -156,7 +156,10 @@ static int handle_ping_request(void *object, IP_Port source, const uint8_t *pack
 
     uint8_t ping_plain[PING_PLAIN_SIZE];
     // Decrypt ping_id
-    dht_get_shared_key_recv(dht, shared_key, packet + 1);
+    if (!dht_get_shared_key_recv_for_packet(dht, shared_key, packet + 1, source, packet, length)) {
+        return 0;
+    }
+
     rc = decrypt_data_symmetric(shared_key,
                                 packet + 1 + CRYPTO_PUBLIC_KEY_SIZE,
                                 packet + 1 + CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE,
@@ -363,7 +366,7 @@ Ping *ping_new(const Mono_Time *mono_time, DHT *dht)
         return nullptr;
     }
 
-    ping->ping_array = ping_array_new(PING_NUM_MAX, PING_TIMEOUT);
+    ping->ping_array = ping_array_new_inline(PING_NUM_MAX, PING_TIMEOUT, PING_DATA_SIZE);
 
     if (ping->ping_array == nullptr) {
         free(ping);
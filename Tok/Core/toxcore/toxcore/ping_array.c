@@ -44,13 +44,18 @@ typedef struct Ping_Array_Entry {
 struct Ping_Array {
     Ping_Array_Entry *entries;
 
+    /* With ping_array_new_inline, total_size slots of max_length bytes that
+     * hold the data of the entries, so that it isn't allocated per entry. */
+    uint8_t *slab;
+    uint32_t max_length;
+
     uint32_t last_deleted; /* number representing the next entry to be deleted. */
     uint32_t last_added;   /* number representing the last entry to be added. */
     uint32_t total_size;   /* The length of entries */
     uint32_t timeout;      /* The timeout after which entries are cleared. */
 };
 
-Ping_Array *ping_array_new(uint32_t size, uint32_t timeout)
+static Ping_Array *ping_array_create(uint32_t size, uint32_t timeout, uint32_t max_length)
 {
     if (size == 0 || timeout == 0) {
         return nullptr;
@@ -74,17 +79,46 @@ Ping_Array *ping_array_new(uint32_t size, uint32_t timeout)
         return nullptr;
     }
 
+    if (max_length != 0) {
+        empty_array->slab = (uint8_t *)malloc((size_t)size * max_length);
+
+        if (empty_array->slab == nullptr) {
+            free(empty_array->entries);
+            free(empty_array);
+            return nullptr;
+        }
+    }
+
     empty_array->last_deleted = 0;
     empty_array->last_added = 0;
     empty_array->total_size = size;
     empty_array->timeout = timeout;
+    empty_array->max_length = max_length;
     return empty_array;
 }
 
+Ping_Array *ping_array_new(uint32_t size, uint32_t timeout)
+{
+    return ping_array_create(size, timeout, 0);
+}
+
+Ping_Array *ping_array_new_inline(uint32_t size, uint32_t timeout, uint32_t max_length)
+{
+    if (max_length == 0) {
+        return nullptr;
+    }
+
+    return ping_array_create(size, timeout, max_length);
+}
+
 static void clear_entry(Ping_Array *array, uint32_t index)
 {
     const Ping_Array_Entry empty = {nullptr};
-    free(array->entries[index].data);
+
+    if (array->slab == nullptr) {
+        free(array->entries[index].data);
+    }
+
     array->entries[index] = empty;
 }
 
@@ -96,6 +130,7 @@ void ping_array_kill(Ping_Array *array)
         ++array->last_deleted;
     }
 
+    free(array->slab);
     free(array->entries);
     free(array);
 }
@@ -119,6 +154,10 @@ static void ping_array_clear_timedout(Ping_Array *array, const Mono_Time *mono_t
 uint64_t ping_array_add(Ping_Array *array, const Mono_Time *mono_time, const uint8_t *data,
                         uint32_t length)
 {
+    if (array->slab != nullptr && length > array->max_length) {
+        return 0;
+    }
+
     ping_array_clear_timedout(array, mono_time);
     const uint32_t index = array->last_added % array->total_size;
 
@@ -127,7 +166,11 @@ uint64_t ping_array_add(Ping_Array *array, const Mono_Time *mono_time, const uin
         clear_entry(array, index);
     }
 
-    array->entries[index].data = malloc(length);
+    if (array->slab != nullptr) {
+        array->entries[index].data = array->slab + (size_t)index * array->max_length;
+    } else {
+        array->entries[index].data = malloc(length);
+    }
 
     if (array->entries[index].data == nullptr) {
         return 0;
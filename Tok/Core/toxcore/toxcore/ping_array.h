@@ -51,6 +51,20 @@ typedef struct Ping_Array Ping_Array;
  */
 struct Ping_Array *ping_array_new(uint32_t size, uint32_t timeout);
 
+/**
+ * Initialize a Ping_Array that keeps the data of its entries in slots of
+ * max_length bytes, allocated here, so that adding, checking and timing out
+ * entries doesn't allocate or free memory.
+ *
+ * Data longer than max_length can't be added to it.
+ *
+ * @param size and timeout as for ping_array_new.
+ * @param max_length the most bytes of data an entry holds, at least 1.
+ *
+ * @return nullptr on failure.
+ */
+struct Ping_Array *ping_array_new_inline(uint32_t size, uint32_t timeout, uint32_t max_length);
+
 /**
  * Free all the allocated memory in a Ping_Array.
  */
@@ -1,6 +1,11 @@
 #include "ping_array.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
 #include <memory>
+#include <vector>
 
 #include <gtest/gtest.h>
 #include "mono_time.h"
@@ -116,4 +121,104 @@ TEST(PingArray, PingIdMustMatchOnCheck) {
   EXPECT_EQ(ping_array_check(arr.get(), mono_time.get(), nullptr, 0, ping_id), 0);
 }
 
+TEST(PingArray, InlineDataCanBeRetrieved) {
+  Ping_Array_Ptr const arr(ping_array_new_inline(2, 1, 4));
+  Mono_Time_Ptr const mono_time(mono_time_new());
+
+  uint64_t const ping_id =
+      ping_array_add(arr.get(), mono_time.get(), std::vector<uint8_t>{1, 2, 3, 4}.data(), 4);
+  EXPECT_NE(ping_id, 0);
+
+  std::vector<uint8_t> data(4);
+  EXPECT_EQ(ping_array_check(arr.get(), mono_time.get(), data.data(), data.size(), ping_id), 4);
+  EXPECT_EQ(data, std::vector<uint8_t>({1, 2, 3, 4}));
+  EXPECT_EQ(ping_array_check(arr.get(), mono_time.get(), data.data(), data.size(), ping_id), -1);
+}
+
+TEST(PingArray, InlineDataMustFitTheSlots) {
+  EXPECT_EQ(ping_array_new_inline(2, 1, 0), nullptr);
+  EXPECT_EQ(ping_array_new_inline(3, 1, 4), nullptr);
+
+  Ping_Array_Ptr const arr(ping_array_new_inline(2, 1, 4));
+  Mono_Time_Ptr const mono_time(mono_time_new());
+
+  EXPECT_EQ(ping_array_add(arr.get(), mono_time.get(), std::vector<uint8_t>(5).data(), 5), 0);
+
+  uint64_t const ping_id = ping_array_add(arr.get(), mono_time.get(), nullptr, 0);
+  EXPECT_NE(ping_id, 0);
+  EXPECT_EQ(ping_array_check(arr.get(), mono_time.get(), nullptr, 0, ping_id), 0);
+}
+
+// Overwriting the oldest entries as the array wraps around must not let their
+// ids return the data that replaced them.
+TEST(PingArray, InlineSlotsAreReused) {
+  Ping_Array_Ptr const arr(ping_array_new_inline(4, 1, sizeof(uint32_t)));
+  Mono_Time_Ptr const mono_time(mono_time_new());
+
+  std::vector<uint64_t> ping_ids;
+
+  for (uint32_t i = 0; i < 8; ++i) {
+    ping_ids.push_back(ping_array_add(arr.get(), mono_time.get(), reinterpret_cast<const uint8_t *>(&i), sizeof(i)));
+    EXPECT_NE(ping_ids.back(), 0);
+  }
+
+  for (uint32_t i = 0; i < 8; ++i) {
+    uint32_t data = 0;
+    int32_t const ret =
+        ping_array_check(arr.get(), mono_time.get(), reinterpret_cast<uint8_t *>(&data), sizeof(data), ping_ids[i]);
+
+    if (i < 4) {
+      EXPECT_EQ(ret, -1);
+    } else {
+      EXPECT_EQ(ret, static_cast<int32_t>(sizeof(data)));
+      EXPECT_EQ(data, i);
+    }
+  }
+}
+
+// Keeps as many pings outstanding as DHT.c does, adding one and answering the
+// oldest for each operation.
+double ops_per_second(Ping_Array *arr, Mono_Time *mono_time, uint32_t outstanding, uint32_t ops) {
+  std::vector<uint8_t> data(64, 1);
+  std::vector<uint64_t> ping_ids(outstanding);
+
+  for (uint64_t &ping_id : ping_ids) {
+    ping_id = ping_array_add(arr, mono_time, data.data(), data.size());
+  }
+
+  uint32_t answered = 0;
+  auto const start = std::chrono::steady_clock::now();
+
+  for (uint32_t i = 0; i < ops; ++i) {
+    uint64_t &ping_id = ping_ids[i % outstanding];
+    answered += ping_array_check(arr, mono_time, data.data(), data.size(), ping_id) == 64;
+    ping_id = ping_array_add(arr, mono_time, data.data(), data.size());
+  }
+
+  double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  EXPECT_EQ(answered, ops);
+  return ops / seconds;
+}
+
+TEST(PingArray, InlineBenchmark) {
+  uint32_t ops = 2000000;
+  char const *env = std::getenv("PING_ARRAY_BENCHMARK_OPS");
+
+  if (env != nullptr) {
+    ops = std::max(1000, std::atoi(env));
+  }
+
+  constexpr uint32_t kSize = 512;
+  Mono_Time_Ptr const mono_time(mono_time_new());
+
+  Ping_Array_Ptr const allocating(ping_array_new(kSize, 5));
+  Ping_Array_Ptr const inline_slots(ping_array_new_inline(kSize, 5, 64));
+
+  double const allocating_ops = ops_per_second(allocating.get(), mono_time.get(), kSize / 2, ops);
+  double const inline_ops = ops_per_second(inline_slots.get(), mono_time.get(), kSize / 2, ops);
+
+  std::printf("64 byte pings, %u outstanding: malloc per entry %.0f ops/s, inline slots %.0f ops/s\n", kSize / 2,
+              allocating_ops, inline_ops);
+}
+
 }  // namespace
@@ -0,0 +1,295 @@
+/*
+ * Worker threads computing shared keys for incoming packets.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "precompute.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ccompat.h"
+#include "crypto_core.h"
+
+/* Most keys a worker takes at once, so that it locks the queue less often. */
+#define PRECOMPUTE_BATCH 16
+
+typedef struct Precompute_Job {
+    IP_Port source;
+    uint8_t *packet;
+    uint16_t length;
+    bool done;
+
+    uint8_t public_key[CRYPTO_PUBLIC_KEY_SIZE];
+    uint8_t secret_key[CRYPTO_SECRET_KEY_SIZE];
+    uint8_t shared_key[CRYPTO_SHARED_KEY_SIZE];
+} Precompute_Job;
+
+struct Precompute_Pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    bool stopping;
+
+    pthread_t *threads;
+    uint32_t num_threads;
+
+    /* Always a power of 2. Positions count up and wrap around, the jobs from
+     * head to tail are queued, and those from next on are not taken yet. Only
+     * the draining thread moves head and tail. */
+    Precompute_Job *jobs;
+    uint32_t size;
+    uint32_t head;
+    uint32_t next;
+    uint32_t tail;
+
+    /* The job being dispatched by precompute_pool_drain. */
+    const Precompute_Job *current;
+};
+
+static Precompute_Job *job_at(const Precompute_Pool *pool, uint32_t position)
+{
+    return &pool->jobs[position & (pool->size - 1)];
+}
+
+static void *precompute_worker(void *arg)
+{
+    Precompute_Pool *const pool = (Precompute_Pool *)arg;
+
+    pthread_mutex_lock(&pool->mutex);
+
+    while (!pool->stopping) {
+        const uint32_t queued = pool->tail - pool->next;
+
+        if (queued == 0) {
+            pthread_cond_wait(&pool->work, &pool->mutex);
+            continue;
+        }
+
+        /* Leave some for the other workers when there are only a few. */
+        uint32_t count = queued / pool->num_threads;
+
+        if (count == 0) {
+            count = 1;
+        } else if (count > PRECOMPUTE_BATCH) {
+            count = PRECOMPUTE_BATCH;
+        }
+
+        const uint32_t first = pool->next;
+        pool->next += count;
+        pthread_mutex_unlock(&pool->mutex);
+
+        for (uint32_t i = 0; i < count; ++i) {
+            Precompute_Job *const job = job_at(pool, first + i);
+            encrypt_precompute(job->public_key, job->secret_key, job->shared_key);
+        }
+
+        pthread_mutex_lock(&pool->mutex);
+
+        for (uint32_t i = 0; i < count; ++i) {
+            job_at(pool, first + i)->done = true;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    return nullptr;
+}
+
+static void job_clear(Precompute_Job *job)
+{
+    free(job->packet);
+    crypto_memzero(job, sizeof(Precompute_Job));
+}
+
+Precompute_Pool *precompute_pool_new(uint32_t threads, uint32_t queue_size)
+{
+    if (threads == 0) {
+        return nullptr;
+    }
+
+    if (queue_size == 0) {
+        queue_size = PRECOMPUTE_DEFAULT_QUEUE_SIZE;
+    }
+
+    uint32_t size = 1;
+
+    while (size < queue_size) {
+        size *= 2;
+    }
+
+    Precompute_Pool *const pool = (Precompute_Pool *)calloc(1, sizeof(Precompute_Pool));
+
+    if (pool == nullptr) {
+        return nullptr;
+    }
+
+    pool->jobs = (Precompute_Job *)calloc(size, sizeof(Precompute_Job));
+    pool->threads = (pthread_t *)calloc(threads, sizeof(pthread_t));
+
+    if (pool->jobs == nullptr || pool->threads == nullptr) {
+        free(pool->jobs);
+        free(pool->threads);
+        free(pool);
+        return nullptr;
+    }
+
+    pool->size = size;
+
+    if (pthread_mutex_init(&pool->mutex, nullptr) != 0) {
+        free(pool->jobs);
+        free(pool->threads);
+        free(pool);
+        return nullptr;
+    }
+
+    if (pthread_cond_init(&pool->work, nullptr) != 0) {
+        pthread_mutex_destroy(&pool->mutex);
+        free(pool->jobs);
+        free(pool->threads);
+        free(pool);
+        return nullptr;
+    }
+
+    pool->num_threads = threads;
+
+    for (uint32_t i = 0; i < threads; ++i) {
+        if (pthread_create(&pool->threads[i], nullptr, precompute_worker, pool) != 0) {
+            pool->num_threads = i;
+            precompute_pool_kill(pool);
+            return nullptr;
+        }
+    }
+
+    return pool;
+}
+
+void precompute_pool_kill(Precompute_Pool *pool)
+{
+    if (pool == nullptr) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (uint32_t i = 0; i < pool->num_threads; ++i) {
+        pthread_join(pool->threads[i], nullptr);
+    }
+
+    for (uint32_t position = pool->head; position != pool->tail; ++position) {
+        job_clear(job_at(pool, position));
+    }
+
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->jobs);
+    free(pool->threads);
+    free(pool);
+}
+
+uint32_t precompute_pool_pending(const Precompute_Pool *pool)
+{
+    return pool->tail - pool->head;
+}
+
+static bool precompute_pool_submit(Precompute_Pool *pool, IP_Port source, const uint8_t *packet, uint16_t length,
+                                   const uint8_t *public_key, const uint8_t *secret_key)
+{
+    if (pool->tail - pool->head == pool->size) {
+        return false;
+    }
+
+    Precompute_Job *const job = job_at(pool, pool->tail);
+    job->packet = (uint8_t *)malloc(length);
+
+    if (job->packet == nullptr) {
+        return false;
+    }
+
+    memcpy(job->packet, packet, length);
+    job->length = length;
+    job->source = source;
+    memcpy(job->public_key, public_key, CRYPTO_PUBLIC_KEY_SIZE);
+    memcpy(job->secret_key, secret_key, CRYPTO_SECRET_KEY_SIZE);
+
+    pthread_mutex_lock(&pool->mutex);
+    ++pool->tail;
+    pthread_cond_signal(&pool->work);
+    pthread_mutex_unlock(&pool->mutex);
+    return true;
+}
+
+bool precompute_shared_key(Precompute_Pool *pool, IP_Port source, const uint8_t *packet, uint16_t length,
+                           const uint8_t *public_key, const uint8_t *secret_key, uint8_t *shared_key)
+{
+    if (pool != nullptr) {
+        const Precompute_Job *const current = pool->current;
+
+        if (current == nullptr || current->packet != packet) {
+            if (precompute_pool_submit(pool, source, packet, length, public_key, secret_key)) {
+                return false;
+            }
+        } else if (public_key_cmp(current->public_key, public_key) == 0
+                   && crypto_memcmp(current->secret_key, secret_key, CRYPTO_SECRET_KEY_SIZE) == 0) {
+            memcpy(shared_key, current->shared_key, CRYPTO_SHARED_KEY_SIZE);
+            return true;
+        }
+
+        /* A packet that came back needing another key gets it here, so it
+         * can't go round again. */
+    }
+
+    encrypt_precompute(public_key, secret_key, shared_key);
+    return true;
+}
+
+uint32_t precompute_pool_drain(Precompute_Pool *pool, precompute_dispatch_cb *dispatch, void *object,
+                               void *userdata)
+{
+    uint32_t count = 0;
+
+    while (pool->head != pool->tail) {
+        Precompute_Job *const job = job_at(pool, pool->head);
+
+        pthread_mutex_lock(&pool->mutex);
+        const bool done = job->done;
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (!done) {
+            break;
+        }
+
+        pool->current = job;
+        dispatch(object, job->source, job->packet, job->length, userdata);
+        pool->current = nullptr;
+
+        job_clear(job);
+        ++pool->head;
+        ++count;
+    }
+
+    return count;
+}
@@ -0,0 +1,93 @@
+/*
+ * Worker threads computing shared keys for incoming packets.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef C_TOXCORE_TOXCORE_PRECOMPUTE_H
+#define C_TOXCORE_TOXCORE_PRECOMPUTE_H
+
+#include "network.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Packet handlers that need a shared key they don't have cached ask for it
+ * with precompute_shared_key. With a pool, the packet is queued instead, its
+ * key computed by a worker thread, and the packet dispatched to its handler
+ * again from the thread that drains the pool. The handler then gets the key
+ * from precompute_shared_key without computing it.
+ *
+ * Packets come back in the order they were queued. Only the draining thread
+ * runs handlers; the workers only compute keys.
+ */
+typedef struct Precompute_Pool Precompute_Pool;
+
+#define PRECOMPUTE_DEFAULT_QUEUE_SIZE 1024
+
+/**
+ * Start threads workers, queueing up to queue_size packets. A queue_size of 0
+ * selects PRECOMPUTE_DEFAULT_QUEUE_SIZE.
+ *
+ * @return nullptr on failure.
+ */
+Precompute_Pool *precompute_pool_new(uint32_t threads, uint32_t queue_size);
+
+/**
+ * Stop the workers and drop the queued packets.
+ */
+void precompute_pool_kill(Precompute_Pool *pool);
+
+/**
+ * Number of packets queued or ready to be dispatched.
+ */
+uint32_t precompute_pool_pending(const Precompute_Pool *pool);
+
+/**
+ * Get the shared key of public_key and secret_key, to handle packet from source.
+ *
+ * If packet is being dispatched by precompute_pool_drain, the key is the one
+ * the workers computed. Otherwise, without a pool or with its queue full, the
+ * key is computed here. Else the packet is queued.
+ *
+ * @return true if shared_key was filled in.
+ * @return false if the packet was queued, and must be dropped by the caller.
+ */
+bool precompute_shared_key(Precompute_Pool *pool, IP_Port source, const uint8_t *packet, uint16_t length,
+                           const uint8_t *public_key, const uint8_t *secret_key, uint8_t *shared_key);
+
+typedef void precompute_dispatch_cb(void *object, IP_Port source, const uint8_t *packet, uint16_t length,
+                                    void *userdata);
+
+/**
+ * Pass the packets whose keys are ready to dispatch, in the order they were
+ * queued, stopping at the first one that isn't.
+ *
+ * @return the number of packets dispatched.
+ */
+uint32_t precompute_pool_drain(Precompute_Pool *pool, precompute_dispatch_cb *dispatch, void *object,
+                               void *userdata);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif // C_TOXCORE_TOXCORE_PRECOMPUTE_H
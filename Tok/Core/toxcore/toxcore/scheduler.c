@@ -0,0 +1,115 @@
+/*
+ * Deadline tracking for the periodic work done by tox_iterate.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "scheduler.h"
+
+#include <stdlib.h>
+
+#include "ccompat.h"
+
+struct Scheduler {
+    Mono_Time *mono_time;
+
+    /* In current_time_monotonic() milliseconds. */
+    uint64_t deadlines[SCHEDULER_NUM_TASKS];
+    uint64_t wakeups[SCHEDULER_NUM_TASKS];
+};
+
+Scheduler *scheduler_new(Mono_Time *mono_time)
+{
+    Scheduler *scheduler = (Scheduler *)calloc(1, sizeof(Scheduler));
+
+    if (scheduler == nullptr) {
+        return nullptr;
+    }
+
+    scheduler->mono_time = mono_time;
+
+    for (uint32_t i = 0; i < SCHEDULER_NUM_TASKS; ++i) {
+        scheduler->deadlines[i] = UINT64_MAX;
+    }
+
+    return scheduler;
+}
+
+void scheduler_kill(Scheduler *scheduler)
+{
+    free(scheduler);
+}
+
+bool scheduler_due(Scheduler *scheduler, Scheduler_Task task)
+{
+    if (scheduler->deadlines[task] > current_time_monotonic(scheduler->mono_time)) {
+        return false;
+    }
+
+    ++scheduler->wakeups[task];
+    return true;
+}
+
+void scheduler_set_next(Scheduler *scheduler, Scheduler_Task task, uint32_t delay_ms)
+{
+    scheduler->deadlines[task] = current_time_monotonic(scheduler->mono_time) + delay_ms;
+}
+
+void scheduler_set_next_second(Scheduler *scheduler, Scheduler_Task task)
+{
+    /* mono_time_get() is this clock in seconds plus a constant offset. */
+    scheduler->deadlines[task] = (current_time_monotonic(scheduler->mono_time) / 1000 + 1) * 1000;
+}
+
+void scheduler_wake(Scheduler *scheduler, Scheduler_Task task)
+{
+    scheduler->deadlines[task] = 0;
+}
+
+uint32_t scheduler_next_deadline(Scheduler *scheduler)
+{
+    uint64_t earliest = UINT64_MAX;
+
+    for (uint32_t i = 0; i < SCHEDULER_NUM_TASKS; ++i) {
+        if (scheduler->deadlines[i] < earliest) {
+            earliest = scheduler->deadlines[i];
+        }
+    }
+
+    if (earliest == UINT64_MAX) {
+        return UINT32_MAX;
+    }
+
+    const uint64_t now = current_time_monotonic(scheduler->mono_time);
+
+    if (earliest <= now) {
+        return 0;
+    }
+
+    return earliest - now < UINT32_MAX ? (uint32_t)(earliest - now) : UINT32_MAX;
+}
+
+uint64_t scheduler_wakeups(const Scheduler *scheduler, Scheduler_Task task)
+{
+    return scheduler->wakeups[task];
+}
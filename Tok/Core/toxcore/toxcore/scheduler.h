@@ -0,0 +1,97 @@
+/*
+ * Deadline tracking for the periodic work done by tox_iterate.
+ */
+
+/*
+ * Copyright © 2016-2018 The TokTok team.
+ *
+ * This file is part of Tox, the free peer to peer instant messenger.
+ *
+ * Tox is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Tox is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Tox.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef C_TOXCORE_TOXCORE_SCHEDULER_H
+#define C_TOXCORE_TOXCORE_SCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "mono_time.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The subsystems whose periodic work is scheduled. Each one records when it
+ * next has something to do, and is skipped by the main loop until then.
+ */
+typedef enum Scheduler_Task {
+    SCHEDULER_NET_CRYPTO,
+    SCHEDULER_DHT,
+    SCHEDULER_ONION_CLIENT,
+    SCHEDULER_FRIEND_CONNECTIONS,
+    SCHEDULER_GROUPCHATS,
+    SCHEDULER_TCP_SERVER,
+    SCHEDULER_NUM_TASKS,
+} Scheduler_Task;
+
+typedef struct Scheduler Scheduler;
+
+/**
+ * Create a scheduler with no task scheduled. Tasks join with scheduler_wake.
+ *
+ * @return nullptr on failure.
+ */
+Scheduler *scheduler_new(Mono_Time *mono_time);
+
+void scheduler_kill(Scheduler *scheduler);
+
+/**
+ * Check whether the task is due, counting a wakeup for it if it is. A due task
+ * stays due until it sets its next deadline.
+ */
+bool scheduler_due(Scheduler *scheduler, Scheduler_Task task);
+
+/**
+ * Make the task due delay_ms milliseconds from now.
+ */
+void scheduler_set_next(Scheduler *scheduler, Scheduler_Task task, uint32_t delay_ms);
+
+/**
+ * Make the task due when mono_time_get() next changes. This suits tasks whose
+ * timeouts are all kept in whole seconds.
+ */
+void scheduler_set_next_second(Scheduler *scheduler, Scheduler_Task task);
+
+/**
+ * Make the task due now, e.g. because an event left it work to do.
+ */
+void scheduler_wake(Scheduler *scheduler, Scheduler_Task task);
+
+/**
+ * @return milliseconds until the earliest task is due, 0 if one is due now,
+ *   UINT32_MAX if no task is scheduled.
+ */
+uint32_t scheduler_next_deadline(Scheduler *scheduler);
+
+/**
+ * @return how many times the task was found due.
+ */
+uint64_t scheduler_wakeups(const Scheduler *scheduler, Scheduler_Task task);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif // C_TOXCORE_TOXCORE_SCHEDULER_H
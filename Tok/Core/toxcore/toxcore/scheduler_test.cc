@@ -0,0 +1,102 @@
+#include "scheduler.h"
+
+#include <gtest/gtest.h>
+
+namespace {
+
+struct Fake_Clock {
+  uint64_t now = 1000;
+};
+
+uint64_t fake_time(Mono_Time *mono_time, void *user_data) {
+  return static_cast<Fake_Clock *>(user_data)->now;
+}
+
+class SchedulerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    mono_time_ = mono_time_new();
+    mono_time_set_current_time_callback(mono_time_, &fake_time, &clock_);
+    scheduler_ = scheduler_new(mono_time_);
+    ASSERT_NE(scheduler_, nullptr);
+  }
+
+  void TearDown() override {
+    scheduler_kill(scheduler_);
+    mono_time_free(mono_time_);
+  }
+
+  Fake_Clock clock_;
+  Mono_Time *mono_time_;
+  Scheduler *scheduler_;
+};
+
+TEST_F(SchedulerTest, NothingIsScheduledInitially) {
+  EXPECT_EQ(scheduler_next_deadline(scheduler_), UINT32_MAX);
+
+  for (int task = 0; task < SCHEDULER_NUM_TASKS; ++task) {
+    EXPECT_FALSE(scheduler_due(scheduler_, static_cast<Scheduler_Task>(task)));
+  }
+}
+
+TEST_F(SchedulerTest, TaskIsDueOnlyAfterItsDelay) {
+  scheduler_set_next(scheduler_, SCHEDULER_NET_CRYPTO, 50);
+  EXPECT_EQ(scheduler_next_deadline(scheduler_), 50);
+
+  clock_.now += 49;
+  EXPECT_FALSE(scheduler_due(scheduler_, SCHEDULER_NET_CRYPTO));
+  EXPECT_EQ(scheduler_next_deadline(scheduler_), 1);
+
+  clock_.now += 1;
+  EXPECT_TRUE(scheduler_due(scheduler_, SCHEDULER_NET_CRYPTO));
+  EXPECT_EQ(scheduler_next_deadline(scheduler_), 0);
+  EXPECT_EQ(scheduler_wakeups(scheduler_, SCHEDULER_NET_CRYPTO), 1);
+}
+
+TEST_F(SchedulerTest, NextSecondTracksMonoTimeGet) {
+  clock_.now = 12345;
+  mono_time_update(mono_time_);
+  uint64_t const second = mono_time_get(mono_time_);
+
+  scheduler_set_next_second(scheduler_, SCHEDULER_DHT);
+  EXPECT_EQ(scheduler_next_deadline(scheduler_), 655);
+
+  clock_.now = 12999;
+  mono_time_update(mono_time_);
+  EXPECT_FALSE(scheduler_due(scheduler_, SCHEDULER_DHT));
+  EXPECT_EQ(mono_time_get(mono_time_), second);
+
+  clock_.now = 13000;
+  mono_time_update(mono_time_);
+  EXPECT_TRUE(scheduler_due(scheduler_, SCHEDULER_DHT));
+  EXPECT_EQ(mono_time_get(mono_time_), second + 1);
+}
+
+TEST_F(SchedulerTest, EarliestTaskSetsTheDeadline) {
+  scheduler_set_next_second(scheduler_, SCHEDULER_DHT);
+  scheduler_set_next(scheduler_, SCHEDULER_NET_CRYPTO, 20);
+  scheduler_set_next(scheduler_, SCHEDULER_GROUPCHATS, 700);
+  EXPECT_EQ(scheduler_next_deadline(scheduler_), 20);
+
+  scheduler_wake(scheduler_, SCHEDULER_GROUPCHATS);
+  EXPECT_EQ(scheduler_next_deadline(scheduler_), 0);
+  EXPECT_TRUE(scheduler_due(scheduler_, SCHEDULER_GROUPCHATS));
+  EXPECT_FALSE(scheduler_due(scheduler_, SCHEDULER_NET_CRYPTO));
+}
+
+TEST_F(SchedulerTest, IdleSubsystemsWakeOncePerSecond) {
+  scheduler_wake(scheduler_, SCHEDULER_FRIEND_CONNECTIONS);
+
+  // A client iterating every 50ms for a minute.
+  for (uint32_t i = 0; i < 1200; ++i) {
+    if (scheduler_due(scheduler_, SCHEDULER_FRIEND_CONNECTIONS)) {
+      scheduler_set_next_second(scheduler_, SCHEDULER_FRIEND_CONNECTIONS);
+    }
+
+    clock_.now += 50;
+  }
+
+  EXPECT_EQ(scheduler_wakeups(scheduler_, SCHEDULER_FRIEND_CONNECTIONS), 60);
+}
+
+}  // namespace
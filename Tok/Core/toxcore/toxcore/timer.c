@@ -1,55 +1,386 @@
 #include "timer.h"
+
+#include <stdlib.h>
 #include <string.h>
 
-void add_event(BS_List* event_list, uint32_t event_type, uint32_t friend_number, uint32_t interval, void* user_data, tox_timeout_cb* cb) {
-	if (!event_list) {
-		return;
-	}
-	struct Event_Node event_node;
-	memset(&event_node, 0, sizeof(event_node));
-	event_node.event_type = event_type;
-	event_node.interval = interval;
-	event_node.friend_number = friend_number;
-	event_node.mono_time = mono_time_new();
-	if (event_node.mono_time != nullptr) {
-		event_node.lastdump = mono_time_get(event_node.mono_time); 
-	}
-	event_node.user_data = user_data;
-	event_node.cb = cb;
-	bs_list_add(event_list, (const uint8_t *)&event_node, event_type);
-}
-
-void del_event(BS_List* event_list, Event_Node* event_node) {
-	if (!event_list && !event_node) {
-		return;
-	}
-	if (event_node->mono_time) {
-		mono_time_free(event_node->mono_time);
-		event_node->mono_time = nullptr;
-	}
-	int res = bs_list_remove(event_list, (const uint8_t *)event_node, event_node->event_type);
-	if (!res) {
-		return;
-	}
-}
-
-void event_loop(Tox* tox, BS_List* event_list) {
-	if (!event_list) {
-		return;
-	}
-	for (int i = 0; i < event_list->n; i++) {
-		const void* start_address = event_list->data + event_list->element_size* i;
-		Event_Node* event_node = (Event_Node*)start_address;
-		if (event_node && event_node->mono_time) {
-			mono_time_update(event_node->mono_time);
-			if (mono_time_is_timeout(event_node->mono_time, event_node->lastdump, event_node->interval)) {
-				event_node->lastdump = mono_time_get(event_node->mono_time);	
-				event_node->cb(tox, event_node->friend_number, event_node->event_type, event_node->user_data);
-				del_event(event_list, event_node);
-				break;
-			}
-		}
-	}	
+#define TIMER_NIL UINT32_MAX
+#define TIMER_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LISTS (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS)
+/* Timers that are due and about to be fired by event_loop. */
+#define TIMER_FIRING_LIST TIMER_WHEEL_LISTS
+
+/**
+ * timer info. Nodes are linked by index so the pool can grow with realloc.
+ */
+typedef struct Event_Node {
+    uint32_t event_type;
+    uint32_t friend_number;
+    // timeout callback functions
+    tox_timeout_cb *cb;
+    void *user_data;
+
+    uint64_t expires; // in ticks
+    uint32_t prev;
+    uint32_t next;
+    uint32_t list; // TIMER_NIL if the node is free
+    uint32_t generation;
+} Event_Node;
+
+struct Timer_Wheel {
+    Mono_Time *mono_time;
+    uint64_t start_time; // monotonic ms at tick 0
+    uint64_t current_tick;
+
+    uint32_t heads[TIMER_WHEEL_LISTS + 1];
+    uint64_t occupied[TIMER_WHEEL_LEVELS]; // bit per non-empty slot
+
+    Event_Node *nodes;
+    uint32_t nodes_capacity;
+    uint32_t free_head;
+    uint32_t count;
+};
+
+static uint64_t timer_id(const Timer_Wheel *wheel, uint32_t index)
+{
+    return ((uint64_t)wheel->nodes[index].generation << 32) | (index + 1);
+}
+
+static void list_push(Timer_Wheel *wheel, uint32_t list, uint32_t index)
+{
+    Event_Node *const node = &wheel->nodes[index];
+    node->prev = TIMER_NIL;
+    node->next = wheel->heads[list];
+    node->list = list;
+
+    if (node->next != TIMER_NIL) {
+        wheel->nodes[node->next].prev = index;
+    }
+
+    wheel->heads[list] = index;
+
+    if (list < TIMER_WHEEL_LISTS) {
+        wheel->occupied[list / TIMER_WHEEL_SLOTS] |= 1ULL << (list % TIMER_WHEEL_SLOTS);
+    }
+}
+
+static void list_unlink(Timer_Wheel *wheel, uint32_t index)
+{
+    Event_Node *const node = &wheel->nodes[index];
+    const uint32_t list = node->list;
+
+    if (node->prev != TIMER_NIL) {
+        wheel->nodes[node->prev].next = node->next;
+    } else {
+        wheel->heads[list] = node->next;
+    }
+
+    if (node->next != TIMER_NIL) {
+        wheel->nodes[node->next].prev = node->prev;
+    }
+
+    if (list < TIMER_WHEEL_LISTS && wheel->heads[list] == TIMER_NIL) {
+        wheel->occupied[list / TIMER_WHEEL_SLOTS] &= ~(1ULL << (list % TIMER_WHEEL_SLOTS));
+    }
+
+    node->list = TIMER_NIL;
+}
+
+/* Put a node into the slot matching its expiry. Requires expires >= current_tick. */
+static void wheel_place(Timer_Wheel *wheel, uint32_t index)
+{
+    uint64_t expires = wheel->nodes[index].expires;
+    const uint64_t delta = expires - wheel->current_tick;
+    uint32_t level;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; ++level) {
+        if (delta < (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) {
+            break;
+        }
+    }
+
+    if (delta >= (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))) {
+        /* Beyond the wheel's range: park in the farthest slot, it cascades back here. */
+        expires = wheel->current_tick + (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+    }
+
+    const uint32_t slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_SLOT_MASK;
+    list_push(wheel, level * TIMER_WHEEL_SLOTS + slot, index);
+}
+
+static bool pool_grow(Timer_Wheel *wheel)
+{
+    const uint32_t old_capacity = wheel->nodes_capacity;
+    const uint32_t new_capacity = old_capacity == 0 ? 16 : old_capacity * 2;
+
+    if (new_capacity <= old_capacity || new_capacity >= TIMER_NIL) {
+        return false;
+    }
+
+    Event_Node *nodes = (Event_Node *)realloc(wheel->nodes, new_capacity * sizeof(Event_Node));
+
+    if (nodes == nullptr) {
+        return false;
+    }
+
+    memset(&nodes[old_capacity], 0, (new_capacity - old_capacity) * sizeof(Event_Node));
+
+    for (uint32_t i = new_capacity; i > old_capacity; --i) {
+        nodes[i - 1].list = TIMER_NIL;
+        nodes[i - 1].generation = 1;
+        nodes[i - 1].next = wheel->free_head;
+        wheel->free_head = i - 1;
+    }
+
+    wheel->nodes = nodes;
+    wheel->nodes_capacity = new_capacity;
+    return true;
 }
 
+static void node_free(Timer_Wheel *wheel, uint32_t index)
+{
+    list_unlink(wheel, index);
+    Event_Node *const node = &wheel->nodes[index];
+    ++node->generation;
+    node->next = wheel->free_head;
+    wheel->free_head = index;
+    --wheel->count;
+}
+
+Timer_Wheel *timer_wheel_new(Mono_Time *mono_time)
+{
+    Timer_Wheel *wheel = (Timer_Wheel *)calloc(1, sizeof(Timer_Wheel));
+
+    if (wheel == nullptr) {
+        return nullptr;
+    }
+
+    wheel->mono_time = mono_time;
+    wheel->start_time = current_time_monotonic(mono_time);
+    wheel->free_head = TIMER_NIL;
+
+    for (uint32_t i = 0; i <= TIMER_WHEEL_LISTS; ++i) {
+        wheel->heads[i] = TIMER_NIL;
+    }
+
+    return wheel;
+}
+
+void timer_wheel_kill(Timer_Wheel *wheel)
+{
+    if (wheel == nullptr) {
+        return;
+    }
+
+    free(wheel->nodes);
+    free(wheel);
+}
+
+uint32_t timer_wheel_count(const Timer_Wheel *wheel)
+{
+    return wheel->count;
+}
+
+uint64_t add_event_ms(Timer_Wheel *wheel, uint32_t event_type, uint32_t friend_number, uint64_t interval_ms,
+                      void *user_data, tox_timeout_cb *cb)
+{
+    if (wheel == nullptr) {
+        return 0;
+    }
+
+    if (wheel->free_head == TIMER_NIL && !pool_grow(wheel)) {
+        return 0;
+    }
+
+    const uint32_t index = wheel->free_head;
+    Event_Node *const node = &wheel->nodes[index];
+    wheel->free_head = node->next;
+
+    node->event_type = event_type;
+    node->friend_number = friend_number;
+    node->cb = cb;
+    node->user_data = user_data;
+
+    /* Round up, and never into the slot event_loop has already processed. */
+    const uint64_t now = current_time_monotonic(wheel->mono_time);
+    const uint64_t due = now - wheel->start_time + interval_ms;
+    node->expires = (due + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+
+    if (node->expires <= wheel->current_tick) {
+        node->expires = wheel->current_tick + 1;
+    }
+
+    wheel_place(wheel, index);
+    ++wheel->count;
 
+    return timer_id(wheel, index);
+}
+
+uint64_t add_event(Timer_Wheel *wheel, uint32_t event_type, uint32_t friend_number, uint32_t interval,
+                   void *user_data, tox_timeout_cb *cb)
+{
+    return add_event_ms(wheel, event_type, friend_number, (uint64_t)interval * 1000, user_data, cb);
+}
+
+bool del_event(Timer_Wheel *wheel, uint64_t timer_id)
+{
+    if (wheel == nullptr) {
+        return false;
+    }
+
+    const uint32_t index = (uint32_t)(timer_id & UINT32_MAX) - 1;
+
+    if (index >= wheel->nodes_capacity) {
+        return false;
+    }
+
+    const Event_Node *const node = &wheel->nodes[index];
+
+    if (node->list == TIMER_NIL || node->generation != (uint32_t)(timer_id >> 32)) {
+        return false;
+    }
+
+    node_free(wheel, index);
+    return true;
+}
+
+/* Re-place every node of a higher-level slot relative to the current tick. */
+static void wheel_cascade(Timer_Wheel *wheel, uint32_t level)
+{
+    const uint32_t slot = (wheel->current_tick >> (TIMER_WHEEL_BITS * level)) & TIMER_SLOT_MASK;
+    const uint32_t list = level * TIMER_WHEEL_SLOTS + slot;
+
+    while (wheel->heads[list] != TIMER_NIL) {
+        const uint32_t index = wheel->heads[list];
+        list_unlink(wheel, index);
+        wheel_place(wheel, index);
+    }
+}
+
+/* Advance the wheel by one tick, moving the timers due at that tick to the firing list. */
+static void wheel_tick(Timer_Wheel *wheel)
+{
+    ++wheel->current_tick;
+
+    for (uint32_t level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+        if ((wheel->current_tick & ((1ULL << (TIMER_WHEEL_BITS * level)) - 1)) != 0) {
+            break;
+        }
+
+        wheel_cascade(wheel, level);
+    }
+
+    const uint32_t list = wheel->current_tick & TIMER_SLOT_MASK;
+
+    while (wheel->heads[list] != TIMER_NIL) {
+        const uint32_t index = wheel->heads[list];
+        list_unlink(wheel, index);
+        list_push(wheel, TIMER_FIRING_LIST, index);
+    }
+}
+
+static uint32_t fire_due(Tox *tox, Timer_Wheel *wheel)
+{
+    uint32_t fired = 0;
+
+    /* Callbacks may add or cancel timers, including ones in this list. */
+    while (wheel->heads[TIMER_FIRING_LIST] != TIMER_NIL) {
+        const uint32_t index = wheel->heads[TIMER_FIRING_LIST];
+        const Event_Node node = wheel->nodes[index];
+        node_free(wheel, index);
+
+        if (node.cb != nullptr) {
+            node.cb(tox, node.friend_number, node.event_type, node.user_data);
+        }
+
+        ++fired;
+    }
+
+    return fired;
+}
+
+uint32_t event_loop(Tox *tox, Timer_Wheel *wheel)
+{
+    if (wheel == nullptr) {
+        return 0;
+    }
+
+    const uint64_t now_tick = (current_time_monotonic(wheel->mono_time) - wheel->start_time) / TIMER_WHEEL_TICK_MS;
+    uint32_t fired = 0;
+
+    while (wheel->current_tick < now_tick) {
+        if (wheel->count == 0) {
+            wheel->current_tick = now_tick;
+            break;
+        }
+
+        if (wheel->occupied[0] == 0) {
+            /* Nothing on the first level: skip to just before the next cascade. */
+            const uint64_t skip_to = wheel->current_tick | TIMER_SLOT_MASK;
+            wheel->current_tick = skip_to < now_tick ? skip_to : now_tick;
+
+            if (wheel->current_tick == now_tick) {
+                break;
+            }
+        }
+
+        wheel_tick(wheel);
+        fired += fire_due(tox, wheel);
+    }
+
+    return fired;
+}
+
+/* Number of ticks from now until the next tick at which the given slot is processed. */
+static uint64_t ticks_until_slot(const Timer_Wheel *wheel, uint32_t level, uint32_t slot)
+{
+    const uint32_t shift = TIMER_WHEEL_BITS * level;
+    const uint64_t current = wheel->current_tick >> shift;
+    const uint64_t distance = ((slot - current - 1) & TIMER_SLOT_MASK) + 1;
+
+    return ((current + distance) << shift) - wheel->current_tick;
+}
+
+uint32_t timer_wheel_next_deadline(const Timer_Wheel *wheel)
+{
+    if (wheel == nullptr || wheel->count == 0) {
+        return UINT32_MAX;
+    }
+
+    /* For higher levels the cascade time is a lower bound of the expiry. */
+    uint64_t best = UINT64_MAX;
+
+    for (uint32_t level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+        uint64_t bits = wheel->occupied[level];
+
+        while (bits != 0) {
+            uint32_t slot = 0;
+
+            while ((bits & (1ULL << slot)) == 0) {
+                ++slot;
+            }
+
+            bits &= ~(1ULL << slot);
+
+            const uint64_t ticks = ticks_until_slot(wheel, level, slot);
+
+            if (ticks < best) {
+                best = ticks;
+            }
+        }
+    }
+
+    if (best == UINT64_MAX) {
+        return 0;
+    }
+
+    /* event_loop may not have caught up with the clock. */
+    const uint64_t fire_ms = (wheel->current_tick + best) * TIMER_WHEEL_TICK_MS;
+    const uint64_t now_ms = current_time_monotonic(wheel->mono_time) - wheel->start_time;
+
+    if (fire_ms <= now_ms) {
+        return 0;
+    }
+
+    const uint64_t ms = fire_ms - now_ms;
+    return ms < UINT32_MAX ? (uint32_t)ms : UINT32_MAX - 1;
+}
@@ -1,10 +1,15 @@
 #ifndef TIMEOUT_LIST_H
 #define TIMEOUT_LIST_H
-#include <time.h>
-#include "list.h"
-#include "mono_time.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "ccompat.h"
-#include "crypto_core.h"
+#include "mono_time.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef struct Tox Tox;
 
@@ -12,35 +17,75 @@ typedef struct Tox Tox;
  * decare callback function
  */
 typedef void tox_timeout_cb (Tox* tox, uint32_t friend_number, uint32_t event_type, void* user_data);
+
 /**
- * timer info
- * public_key who' event to be triggered
- */ 
-typedef struct Event_Node {
-	uint32_t event_type;
-	uint32_t interval;
-	time_t lastdump;	
-	Mono_Time* mono_time; 	
-	uint32_t friend_number;
-	// timeout callback functions
-	tox_timeout_cb* cb;
-	void* user_data;
-} Event_Node;  
+ * Pending timers live in a hierarchical timing wheel: TIMER_WHEEL_LEVELS
+ * levels of TIMER_WHEEL_SLOTS slots each, the first level covering one
+ * TIMER_WHEEL_TICK_MS tick per slot and every next level 64 times more.
+ * Insert and cancel are O(1); timers on higher levels cascade down as the
+ * wheel turns.
+ */
+#define TIMER_WHEEL_TICK_MS 10
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+typedef struct Timer_Wheel Timer_Wheel;
 
+/**
+ * create a timer wheel driven by the given (shared) mono_time.
+ */
+Timer_Wheel *timer_wheel_new(Mono_Time *mono_time);
 
 /**
- * add a event node to list
+ * free the wheel and drop all pending timers without firing them.
  */
-void add_event(BS_List* event_list, uint32_t event_type, uint32_t friend_number, uint32_t interval, void* user_data, tox_timeout_cb* cb);
+void timer_wheel_kill(Timer_Wheel *wheel);
 
 /**
- * del event node from list
+ * return number of pending timers.
  */
-void del_event(BS_List* event_list, Event_Node* event_node);
+uint32_t timer_wheel_count(const Timer_Wheel *wheel);
 
 /**
- * dispatch event
+ * add a one-shot timer that fires interval seconds from now.
+ *
+ * return a non-zero timer id that can be passed to del_event.
+ * return 0 on failure.
  */
-void event_loop(Tox* tox, BS_List* event_list);
+uint64_t add_event(Timer_Wheel *wheel, uint32_t event_type, uint32_t friend_number, uint32_t interval,
+                   void *user_data, tox_timeout_cb *cb);
+
+/**
+ * same as add_event, but with a millisecond interval.
+ */
+uint64_t add_event_ms(Timer_Wheel *wheel, uint32_t event_type, uint32_t friend_number, uint64_t interval_ms,
+                      void *user_data, tox_timeout_cb *cb);
+
+/**
+ * cancel a pending timer.
+ *
+ * return true if the timer was pending and is now cancelled.
+ */
+bool del_event(Timer_Wheel *wheel, uint64_t timer_id);
+
+/**
+ * dispatch every timer that is due.
+ *
+ * return number of timers fired.
+ */
+uint32_t event_loop(Tox *tox, Timer_Wheel *wheel);
+
+/**
+ * return milliseconds until event_loop fires the earliest pending timer, or
+ * UINT32_MAX if there is none. Timers fire on the first tick at or after their
+ * expiry, so this can be up to TIMER_WHEEL_TICK_MS past it. For timers on
+ * higher wheel levels it may be early.
+ */
+uint32_t timer_wheel_next_deadline(const Timer_Wheel *wheel);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
 
 #endif
@@ -0,0 +1,202 @@
+#include "timer.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+struct Fake_Clock {
+  uint64_t now = 1000;
+};
+
+uint64_t fake_time(Mono_Time *mono_time, void *user_data) {
+  return static_cast<Fake_Clock *>(user_data)->now;
+}
+
+void count_fired(Tox *tox, uint32_t friend_number, uint32_t event_type, void *user_data) {
+  ++*static_cast<uint32_t *>(user_data);
+}
+
+class TimerWheel : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    mono_time_ = mono_time_new();
+    mono_time_set_current_time_callback(mono_time_, &fake_time, &clock_);
+    wheel_ = timer_wheel_new(mono_time_);
+    ASSERT_NE(wheel_, nullptr);
+  }
+
+  void TearDown() override {
+    timer_wheel_kill(wheel_);
+    mono_time_free(mono_time_);
+  }
+
+  Fake_Clock clock_;
+  Mono_Time *mono_time_;
+  Timer_Wheel *wheel_;
+};
+
+TEST_F(TimerWheel, TimerFiresOnlyAfterInterval) {
+  uint32_t fired = 0;
+  EXPECT_NE(add_event(wheel_, 1, 0, 2, &fired, &count_fired), 0);
+
+  clock_.now += 1999;
+  EXPECT_EQ(event_loop(nullptr, wheel_), 0);
+  EXPECT_EQ(fired, 0);
+
+  clock_.now += 1;
+  EXPECT_EQ(event_loop(nullptr, wheel_), 1);
+  EXPECT_EQ(fired, 1);
+  EXPECT_EQ(timer_wheel_count(wheel_), 0);
+}
+
+TEST_F(TimerWheel, AllDueTimersFireInOnePass) {
+  uint32_t fired = 0;
+
+  for (uint32_t i = 0; i < 1000; ++i) {
+    add_event_ms(wheel_, i, i, (i % 50) * 100, &fired, &count_fired);
+  }
+
+  clock_.now += 5000;
+  EXPECT_EQ(event_loop(nullptr, wheel_), 1000);
+  EXPECT_EQ(fired, 1000);
+}
+
+TEST_F(TimerWheel, CancelledTimerDoesNotFire) {
+  uint32_t fired = 0;
+  uint64_t const id = add_event(wheel_, 1, 0, 1, &fired, &count_fired);
+  add_event(wheel_, 2, 0, 1, &fired, &count_fired);
+
+  EXPECT_TRUE(del_event(wheel_, id));
+  EXPECT_FALSE(del_event(wheel_, id));
+
+  clock_.now += 1000;
+  event_loop(nullptr, wheel_);
+  EXPECT_EQ(fired, 1);
+}
+
+TEST_F(TimerWheel, IdOfFiredTimerIsNotReused) {
+  uint32_t fired = 0;
+  uint64_t const id = add_event(wheel_, 1, 0, 1, &fired, &count_fired);
+  clock_.now += 1000;
+  event_loop(nullptr, wheel_);
+
+  // The new timer takes the same slot in the pool, but must get a new id.
+  uint64_t const id2 = add_event(wheel_, 1, 0, 1, &fired, &count_fired);
+  EXPECT_NE(id, id2);
+  EXPECT_FALSE(del_event(wheel_, id));
+  EXPECT_TRUE(del_event(wheel_, id2));
+}
+
+TEST_F(TimerWheel, LongTimersCascadeToTheRightTime) {
+  uint32_t fired = 0;
+  // Roughly one per wheel level, plus one beyond the wheel's range.
+  std::vector<uint64_t> const intervals = {500, 30000, 2000000, 100000000, 400000000};
+
+  for (uint64_t interval : intervals) {
+    add_event_ms(wheel_, 0, 0, interval, &fired, &count_fired);
+  }
+
+  uint32_t expected = 0;
+
+  for (uint64_t interval : intervals) {
+    clock_.now = 1000 + interval - TIMER_WHEEL_TICK_MS;
+    event_loop(nullptr, wheel_);
+    EXPECT_EQ(fired, expected);
+
+    clock_.now = 1000 + interval;
+    event_loop(nullptr, wheel_);
+    EXPECT_EQ(fired, ++expected);
+  }
+}
+
+TEST_F(TimerWheel, NextDeadlineIsTheTickTheTimerFiresOn) {
+  EXPECT_EQ(timer_wheel_next_deadline(wheel_), UINT32_MAX);
+
+  uint32_t fired = 0;
+  add_event_ms(wheel_, 0, 0, 300, &fired, &count_fired);
+  add_event_ms(wheel_, 0, 0, 60000, &fired, &count_fired);
+
+  EXPECT_EQ(timer_wheel_next_deadline(wheel_), 300);
+
+  // Counted from the clock, not from where event_loop last left off.
+  clock_.now += 130;
+  EXPECT_EQ(timer_wheel_next_deadline(wheel_), 170);
+
+  clock_.now += 170;
+  event_loop(nullptr, wheel_);
+  EXPECT_EQ(fired, 1);
+  EXPECT_LE(timer_wheel_next_deadline(wheel_), 59700);
+}
+
+TEST_F(TimerWheel, NextDeadlineRoundsUpToATick) {
+  uint32_t fired = 0;
+  add_event_ms(wheel_, 0, 0, TIMER_WHEEL_TICK_MS * 30 + 1, &fired, &count_fired);
+
+  // Up to a tick past the expiry, which is when the timer fires.
+  EXPECT_EQ(timer_wheel_next_deadline(wheel_), TIMER_WHEEL_TICK_MS * 31);
+
+  clock_.now += TIMER_WHEEL_TICK_MS * 31 - 1;
+  event_loop(nullptr, wheel_);
+  EXPECT_EQ(fired, 0);
+  EXPECT_EQ(timer_wheel_next_deadline(wheel_), 1);
+
+  clock_.now += 1;
+  event_loop(nullptr, wheel_);
+  EXPECT_EQ(fired, 1);
+}
+
+void benchmark_timers(uint32_t count) {
+  Fake_Clock clock;
+  Mono_Time *mono_time = mono_time_new();
+  mono_time_set_current_time_callback(mono_time, &fake_time, &clock);
+  Timer_Wheel *wheel = timer_wheel_new(mono_time);
+
+  std::mt19937 rng(count);
+  std::uniform_int_distribution<uint64_t> interval(1, 600000);
+  std::vector<uint64_t> ids(count);
+  uint32_t fired = 0;
+
+  auto const start = std::chrono::steady_clock::now();
+
+  for (uint32_t i = 0; i < count; ++i) {
+    ids[i] = add_event_ms(wheel, 0, i, interval(rng), &fired, &count_fired);
+  }
+
+  auto const inserted = std::chrono::steady_clock::now();
+
+  for (uint32_t i = 0; i < count; i += 2) {
+    del_event(wheel, ids[i]);
+  }
+
+  auto const cancelled = std::chrono::steady_clock::now();
+
+  // Ten simulated minutes at the usual 50ms iteration interval.
+  for (uint32_t tick = 0; tick < 12000; ++tick) {
+    clock.now += 50;
+    event_loop(nullptr, wheel);
+  }
+
+  auto const done = std::chrono::steady_clock::now();
+
+  EXPECT_EQ(fired, count / 2);
+
+  auto const ns = [](std::chrono::steady_clock::duration d) {
+    return std::chrono::duration<double, std::nano>(d).count();
+  };
+  std::printf("%u timers: insert %.0f ns/op, cancel %.0f ns/op, 12000 iterations %.2f ms\n", count,
+              ns(inserted - start) / count, ns(cancelled - inserted) / (count / 2), ns(done - cancelled) / 1e6);
+
+  timer_wheel_kill(wheel);
+  mono_time_free(mono_time);
+}
+
+TEST(TimerWheelBenchmark, TenThousandTimers) { benchmark_timers(10000); }
+
+TEST(TimerWheelBenchmark, HundredThousandTimers) { benchmark_timers(100000); }
+
+}  // namespace
@@ -82,7 +82,7 @@
 struct Tox {
     Messenger *m;
     Mono_Time *mono_time;
-	BS_List timer;
+    Timer_Wheel *timer;
 
     tox_self_connection_status_cb *self_connection_status_callback;
     tox_friend_name_cb *friend_name_callback;
@@ -504,6 +504,9 @@ Tox *tox_new(const struct Tox_Options *options, Tox_Err_New *error)
     m_options.tcp_server_port = tox_options_get_tcp_port(opts);
     m_options.hole_punching_enabled = tox_options_get_hole_punching_enabled(opts);
     m_options.local_discovery_enabled = tox_options_get_local_discovery_enabled(opts);
+    m_options.udp_send_queue_enabled = tox_options_get_udp_send_queue_enabled(opts);
+    m_options.shared_keys_size = tox_options_get_shared_key_cache_size(opts);
+    m_options.precompute_threads = tox_options_get_precompute_threads(opts);
 
     m_options.log_callback = (logger_cb *)tox_options_get_log_callback(opts);
 	tox->user_add_callback = tox_options_get_user_add_callback(opts);
@@ -561,7 +564,6 @@ Tox *tox_new(const struct Tox_Options *options, Tox_Err_New *error)
 
     tox->mono_time = mono_time_new();
 
-	bs_list_init(&tox->timer, sizeof(Event_Node), 2);
 	srand((unsigned)time(nullptr)); 
 
     if (tox->mono_time == nullptr) {
@@ -571,6 +573,16 @@ Tox *tox_new(const struct Tox_Options *options, Tox_Err_New *error)
         return nullptr;
     }
 
+    tox->timer = timer_wheel_new(tox->mono_time);
+
+    if (tox->timer == nullptr) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_NEW_MALLOC);
+        mono_time_free(tox->mono_time);
+        tox_options_free(default_options);
+        free(tox);
+        return nullptr;
+    }
+
     unsigned int m_error;
     Messenger *const m = new_messenger(tox->mono_time, &m_options, &m_error);
     tox->m = m;
@@ -588,7 +600,7 @@ Tox *tox_new(const struct Tox_Options *options, Tox_Err_New *error)
             SET_ERROR_PARAMETER(error, TOX_ERR_NEW_MALLOC);
         }
 
-		bs_list_free(&tox->timer);
+        timer_wheel_kill(tox->timer);
         mono_time_free(tox->mono_time);
         tox_options_free(default_options);
         free(tox);
@@ -644,6 +656,7 @@ void tox_kill(Tox *tox)
     LOGGER_ASSERT(m->log, m->msi_packet == nullptr, "Attempted to kill tox while toxav is still alive");
     kill_groupchats(m->conferences_object);
     kill_messenger(m);
+    timer_wheel_kill(tox->timer);
     mono_time_free(tox->mono_time);
     free(tox);
 }
@@ -801,7 +814,9 @@ void tox_callback_self_connection_status(Tox *tox, tox_self_connection_status_cb
 uint32_t tox_iteration_interval(const Tox *tox)
 {
     const Messenger *m = tox->m;
-    return messenger_run_interval(m);
+    const uint32_t interval = messenger_run_interval(m);
+    const uint32_t timer_interval = timer_wheel_next_deadline(tox->timer);
+    return timer_interval < interval ? timer_interval : interval;
 }
 
 void tox_iterate(Tox *tox, void *user_data)
@@ -812,7 +827,86 @@ void tox_iterate(Tox *tox, void *user_data)
     struct Tox_Userdata tox_data = { tox, user_data };
     do_messenger(m, &tox_data);
     do_groupchats(m->conferences_object, &tox_data);
-	event_loop(tox, &tox->timer);
+    event_loop(tox, tox->timer);
+    networking_flush(m->net);
+}
+
+uint32_t tox_get_fds(const Tox *tox, int32_t *fds, uint8_t *events, uint32_t max_fds)
+{
+    Messenger *m = tox->m;
+
+    if (max_fds == 0) {
+        return messenger_sockets(m, nullptr, nullptr, 0);
+    }
+
+    Socket *socks = (Socket *)malloc(max_fds * sizeof(Socket));
+    bool *want_write = (bool *)malloc(max_fds * sizeof(bool));
+
+    if (socks == nullptr || want_write == nullptr) {
+        free(socks);
+        free(want_write);
+        return 0;
+    }
+
+    const uint32_t count = messenger_sockets(m, socks, want_write, max_fds);
+
+    for (uint32_t i = 0; i < count && i < max_fds; ++i) {
+        fds[i] = socks[i].socket;
+        events[i] = TOX_FD_EVENT_READ | (want_write[i] ? TOX_FD_EVENT_WRITE : 0);
+    }
+
+    free(socks);
+    free(want_write);
+    return count;
+}
+
+void tox_iterate_ready(Tox *tox, const int32_t *ready_fds, uint32_t num_ready, void *user_data)
+{
+    mono_time_update(tox->mono_time);
+
+    Messenger *m = tox->m;
+    struct Tox_Userdata tox_data = { tox, user_data };
+    Socket *ready = num_ready > 0 ? (Socket *)malloc(num_ready * sizeof(Socket)) : nullptr;
+
+    if (num_ready > 0 && ready == nullptr) {
+        /* Reading every socket is always correct, just slower. */
+        do_messenger(m, &tox_data);
+    } else {
+        for (uint32_t i = 0; i < num_ready; ++i) {
+            ready[i].socket = ready_fds[i];
+        }
+
+        do_messenger_ready(m, ready, num_ready, &tox_data);
+        free(ready);
+    }
+
+    do_groupchats(m->conferences_object, &tox_data);
+    event_loop(tox, tox->timer);
+    networking_flush(m->net);
+}
+
+uint64_t tox_subsystem_get_wakeups(const Tox *tox, Tox_Subsystem subsystem)
+{
+    const Messenger *m = tox->m;
+
+    switch (subsystem) {
+        case TOX_SUBSYSTEM_NET_CRYPTO:
+            return scheduler_wakeups(m->scheduler, SCHEDULER_NET_CRYPTO);
+
+        case TOX_SUBSYSTEM_DHT:
+            return scheduler_wakeups(m->scheduler, SCHEDULER_DHT);
+
+        case TOX_SUBSYSTEM_ONION:
+            return scheduler_wakeups(m->scheduler, SCHEDULER_ONION_CLIENT);
+
+        case TOX_SUBSYSTEM_FRIEND_CONNECTIONS:
+            return scheduler_wakeups(m->scheduler, SCHEDULER_FRIEND_CONNECTIONS);
+
+        case TOX_SUBSYSTEM_CONFERENCES:
+            return scheduler_wakeups(m->scheduler, SCHEDULER_GROUPCHATS);
+    }
+
+    return 0;
 }
 
 void tox_self_get_address(const Tox *tox, uint8_t *address)
@@ -1432,6 +1526,32 @@ uint32_t tox_decrypt_offline_message(Tox *tox, uint32_t friend_number, const uin
 	return message_len;
 }
 
+uint32_t tox_decrypt_offline_messages(Tox *tox, uint32_t friend_number, const uint8_t *const *messages,
+                                      const uint32_t *lengths, uint32_t count, uint8_t *const *decrypted_messages,
+                                      int32_t *decrypted_lengths, TOX_ERR_FRIEND_SEND_MESSAGE *error)
+{
+    if (!messages || !lengths || !decrypted_messages || !decrypted_lengths) {
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_SEND_MESSAGE_NULL);
+        return 0;
+    }
+
+    Messenger *m = tox->m;
+
+    if (!m_friend_exists(m, friend_number)) {
+        for (uint32_t i = 0; i < count; ++i) {
+            decrypted_lengths[i] = -1;
+        }
+
+        SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_SEND_MESSAGE_FRIEND_NOT_FOUND);
+        return 0;
+    }
+
+    uint32_t decrypted = m_decrypt_offline_messages(m, friend_number, messages, lengths, count, decrypted_messages,
+                                                    decrypted_lengths);
+    SET_ERROR_PARAMETER(error, TOX_ERR_FRIEND_SEND_MESSAGE_OK);
+    return decrypted;
+}
+
 void tox_callback_friend_read_receipt(Tox *tox, tox_friend_read_receipt_cb *callback)
 {
     tox->friend_read_receipt_callback = callback;
@@ -1687,6 +1807,45 @@ bool tox_file_send_chunk(Tox *tox, uint32_t friend_number, uint32_t file_number,
     return 0;
 }
 
+static bool tox_file_bulk_result(int ret, Tox_Err_File_Bulk *error)
+{
+    switch (ret) {
+        case 0:
+            SET_ERROR_PARAMETER(error, TOX_ERR_FILE_BULK_OK);
+            return 1;
+
+        case -1:
+            SET_ERROR_PARAMETER(error, TOX_ERR_FILE_BULK_FRIEND_NOT_FOUND);
+            return 0;
+
+        case -2:
+            SET_ERROR_PARAMETER(error, TOX_ERR_FILE_BULK_NOT_FOUND);
+            return 0;
+
+        case -3:
+            SET_ERROR_PARAMETER(error, TOX_ERR_FILE_BULK_DENIED);
+            return 0;
+
+        case -4:
+            SET_ERROR_PARAMETER(error, TOX_ERR_FILE_BULK_NOT_SUPPORTED);
+            return 0;
+    }
+
+    /* can't happen */
+    return 0;
+}
+
+bool tox_file_bulk_fd(Tox *tox, uint32_t friend_number, uint32_t file_number, int fd, Tox_Err_File_Bulk *error)
+{
+    return tox_file_bulk_result(file_bulk_fd(tox->m, friend_number, file_number, fd), error);
+}
+
+bool tox_file_bulk_buffer(Tox *tox, uint32_t friend_number, uint32_t file_number, uint8_t *buffer,
+                          Tox_Err_File_Bulk *error)
+{
+    return tox_file_bulk_result(file_bulk_buffer(tox->m, friend_number, file_number, buffer), error);
+}
+
 void tox_callback_file_chunk_request(Tox *tox, tox_file_chunk_request_cb *callback)
 {
     tox->file_chunk_request_callback = callback;
@@ -2336,8 +2495,13 @@ uint16_t tox_self_get_tcp_port(const Tox *tox, Tox_Err_Get_Port *error)
     return 0;
 }
 
-void tox_add_timer_event(Tox *tox, uint32_t event_type, uint32_t friend_number, uint32_t interval, void* user_data, tox_event_timer_cb* cb) {
-	add_event(&tox->timer, event_type, friend_number, interval, user_data, cb);				
+uint64_t tox_add_timer_event(Tox *tox, uint32_t event_type, uint32_t friend_number, uint32_t interval, void* user_data, tox_event_timer_cb* cb) {
+    return add_event(tox->timer, event_type, friend_number, interval, user_data, cb);
+}
+
+bool tox_cancel_timer_event(Tox *tox, uint64_t timer_id)
+{
+    return del_event(tox->timer, timer_id);
 }
 
 int64_t tox_unixtime() {
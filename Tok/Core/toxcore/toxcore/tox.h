@@ -813,6 +813,37 @@ struct Tox_Options {
 	 * dht sk
 	 */
 	uint8_t *dht_sk;
+
+
+    /**
+     * Queue outgoing UDP packets during tox_iterate and send them in batches
+     * at the end of the iteration. (Default: disabled).
+     *
+     * This saves syscalls on busy nodes, but delays packets sent between
+     * iterations (e.g. from an audio/video thread) until the next iteration.
+     */
+    bool udp_send_queue_enabled;
+
+
+    /**
+     * Number of shared keys each of the DHT and onion caches holds, so that
+     * they are not recomputed for every packet. 0 selects the default (1024).
+     *
+     * Nodes that talk to many peers, e.g. bootstrap nodes, should set this
+     * above the number of peers they see in a few minutes.
+     */
+    uint32_t shared_key_cache_size;
+
+
+    /**
+     * Threads computing the shared keys of incoming UDP packets, such as
+     * handshakes and onion requests, from peers whose keys aren't cached.
+     * (Default: 0, computing them in tox_iterate).
+     *
+     * Packets wait for their keys in order, so tox_iterate stays responsive
+     * when many peers connect at once.
+     */
+    uint32_t precompute_threads;
 };
 
 
@@ -896,6 +927,18 @@ uint8_t *tox_options_get_dht_sk(const struct Tox_Options *options);
 
 void tox_options_set_dht_sk(struct Tox_Options *options, uint8_t *dht_sk);
 
+bool tox_options_get_udp_send_queue_enabled(const struct Tox_Options *options);
+
+void tox_options_set_udp_send_queue_enabled(struct Tox_Options *options, bool udp_send_queue_enabled);
+
+uint32_t tox_options_get_shared_key_cache_size(const struct Tox_Options *options);
+
+void tox_options_set_shared_key_cache_size(struct Tox_Options *options, uint32_t shared_key_cache_size);
+
+uint32_t tox_options_get_precompute_threads(const struct Tox_Options *options);
+
+void tox_options_set_precompute_threads(struct Tox_Options *options, uint32_t precompute_threads);
+
 
 
 
@@ -1194,7 +1237,8 @@ void tox_callback_self_connection_status(Tox *tox, tox_self_connection_status_cb
 
 /**
  * Return the time in milliseconds before tox_iterate() should be called again
- * for optimal performance.
+ * for optimal performance. This is when the earliest pending work is due, so
+ * it is 0 if tox_iterate has work to do right away.
  */
 uint32_t tox_iteration_interval(const Tox *tox);
 
@@ -1204,6 +1248,86 @@ uint32_t tox_iteration_interval(const Tox *tox);
  */
 void tox_iterate(Tox *tox, void *user_data);
 
+/**
+ * The parts of tox_iterate that only run when they have work due.
+ */
+typedef enum TOX_SUBSYSTEM {
+
+    /**
+     * Sending and resending friend packets, and reading TCP relays.
+     */
+    TOX_SUBSYSTEM_NET_CRYPTO,
+
+    /**
+     * DHT maintenance: pinging nodes and looking for friends.
+     */
+    TOX_SUBSYSTEM_DHT,
+
+    /**
+     * Onion announcements and friend searches.
+     */
+    TOX_SUBSYSTEM_ONION,
+
+    /**
+     * Friend connection pings and timeouts.
+     */
+    TOX_SUBSYSTEM_FRIEND_CONNECTIONS,
+
+    /**
+     * Conference pings, timeouts and peer connections.
+     */
+    TOX_SUBSYSTEM_CONFERENCES,
+
+} TOX_SUBSYSTEM;
+
+/**
+ * Return how many times tox_iterate has run the given subsystem. Comparing this
+ * with the number of tox_iterate calls shows what keeps the client awake.
+ */
+uint64_t tox_subsystem_get_wakeups(const Tox *tox, TOX_SUBSYSTEM subsystem);
+
+/**
+ * What a file descriptor returned by tox_get_fds should be watched for. The
+ * events of a descriptor are a bitwise OR of these values.
+ */
+typedef enum TOX_FD_EVENT {
+
+    /**
+     * The descriptor has data to read or a connection to accept.
+     */
+    TOX_FD_EVENT_READ = 1,
+
+    /**
+     * The descriptor has queued data waiting for it to become writable.
+     */
+    TOX_FD_EVENT_WRITE = 2,
+
+} TOX_FD_EVENT;
+
+/**
+ * Get the file descriptors tox_iterate reads from, for embedding Tox in an
+ * event loop based on epoll, kqueue or similar instead of a fixed interval.
+ *
+ * Up to max_fds descriptors are written to fds, and what each one should be
+ * watched for to the same index of events. The set changes as connections come
+ * and go, so it must be fetched again after every call to tox_iterate or
+ * tox_iterate_ready and after adding friends or relays.
+ *
+ * @return the total number of descriptors, which may be more than max_fds.
+ */
+uint32_t tox_get_fds(const Tox *tox, int32_t *fds, uint8_t *events, uint32_t max_fds);
+
+/**
+ * Like tox_iterate, but only read from the descriptors in ready_fds, which
+ * should be the ones from tox_get_fds that the event loop reported as ready.
+ *
+ * Timed work such as pings and resends still runs when due, so an event loop
+ * must wait no longer than tox_iteration_interval() milliseconds before calling
+ * this again, with num_ready 0 if nothing became ready. When idle, that interval
+ * is up to a second instead of the 50 ms a polling tox_iterate loop needs.
+ */
+void tox_iterate_ready(Tox *tox, const int32_t *ready_fds, uint32_t num_ready, void *user_data);
+
 
 /*******************************************************************************
  *
@@ -2015,6 +2139,24 @@ uint32_t tox_encrypt_offline_message(Tox *tox, uint32_t friend_number, const uin
 uint32_t tox_decrypt_offline_message(Tox *tox, uint32_t friend_number, const uint8_t *message, size_t length, 
 								uint8_t *decrypted_message, TOX_ERR_FRIEND_SEND_MESSAGE *error);
 
+/**
+ * decrypt a batch of offline messages from the same friend, e.g. the contents
+ * of a TOX_MESSAGE_OFFLINE_PULL_RESPONSE.
+ * @param friend_number The friend number of the friend who sent the messages.
+ * @param messages Array of count pointers to the encrypted messages.
+ * @param lengths Array of count lengths of the encrypted messages.
+ * @param decrypted_messages Array of count output buffers, each at least as
+ *   large as the corresponding encrypted message.
+ * @param decrypted_lengths Array of count lengths, set to the decrypted length
+ *   of each message or -1 if that message could not be decrypted.
+ * @return the number of messages decrypted successfully, 0 with
+ *   TOX_ERR_FRIEND_SEND_MESSAGE_FRIEND_NOT_FOUND if friend_number is not a
+ *   friend.
+ */
+uint32_t tox_decrypt_offline_messages(Tox *tox, uint32_t friend_number, const uint8_t *const *messages,
+                                      const uint32_t *lengths, uint32_t count, uint8_t *const *decrypted_messages,
+                                      int32_t *decrypted_lengths, TOX_ERR_FRIEND_SEND_MESSAGE *error);
+
 /**
  * @param friend_number The friend number of the friend who received the message.
  * @param message_id The message ID as returned from tox_friend_send_message
@@ -2664,6 +2806,79 @@ typedef void tox_file_recv_chunk_cb(Tox *tox, uint32_t friend_number, uint32_t f
 void tox_callback_file_recv_chunk(Tox *tox, tox_file_recv_chunk_cb *callback);
 
 
+/*******************************************************************************
+ *
+ * :: File transmission: bulk transfers
+ *
+ ******************************************************************************/
+
+
+
+typedef enum TOX_ERR_FILE_BULK {
+
+    /**
+     * The function returned successfully.
+     */
+    TOX_ERR_FILE_BULK_OK,
+
+    /**
+     * The friend_number passed did not designate a valid friend.
+     */
+    TOX_ERR_FILE_BULK_FRIEND_NOT_FOUND,
+
+    /**
+     * No file transfer with the given file number was found for the given friend.
+     */
+    TOX_ERR_FILE_BULK_NOT_FOUND,
+
+    /**
+     * Chunks of this transfer were already requested through the
+     * `file_chunk_request` event.
+     */
+    TOX_ERR_FILE_BULK_DENIED,
+
+    /**
+     * File descriptors are not supported on this platform, or a buffer was
+     * passed for a stream of unknown size.
+     */
+    TOX_ERR_FILE_BULK_NOT_SUPPORTED,
+
+} TOX_ERR_FILE_BULK;
+
+
+/**
+ * Make a file transfer a bulk transfer that reads its data from, or writes it
+ * to, the file descriptor fd instead of going through the `file_chunk_request`
+ * and `file_recv_chunk` events. Chunks are read and written with pread and
+ * pwrite at their file position, so fd must be seekable.
+ *
+ * A sending transfer sends as many chunks per tox_iterate as the connection
+ * takes, without a callback per chunk, which is much faster for large files.
+ * Call this right after tox_file_send. A stream of size UINT64_MAX ends at the
+ * end of the file. A receiving transfer can be made a bulk transfer when it is
+ * received or before it is accepted.
+ *
+ * The chunk events are still triggered with length 0 when the transfer is
+ * finished, and `file_recv_control` with TOX_FILE_CONTROL_CANCEL if reading or
+ * writing fd fails. fd must stay open until then, and is not closed by Tox.
+ *
+ * @param friend_number The friend number of the friend the file is being
+ *   sent to or received from.
+ * @param file_number The friend-specific identifier for the file transfer.
+ * @param fd An open file descriptor, readable for sending and writable for
+ *   receiving.
+ */
+bool tox_file_bulk_fd(Tox *tox, uint32_t friend_number, uint32_t file_number, int fd, TOX_ERR_FILE_BULK *error);
+
+/**
+ * Like tox_file_bulk_fd, but with the whole file in memory, for example a
+ * mapped file. buffer must be file_size bytes long and stay valid until the
+ * transfer is finished. It is only read from when sending.
+ */
+bool tox_file_bulk_buffer(Tox *tox, uint32_t friend_number, uint32_t file_number, uint8_t *buffer,
+                          TOX_ERR_FILE_BULK *error);
+
+
 /*******************************************************************************
  *
  * :: Conference management
@@ -3458,9 +3673,18 @@ void event_timer_cb(Tox *tox, uint32_t friend_number, uint32_t event_type, void*
 void tox_callback_event_timer(Tox *tox, tox_event_timer_cb *callback);
 
 /**
- * add a event to timer list
+ * add a one-shot event that fires interval seconds from now during tox_iterate.
+ *
+ * @return a non-zero timer id for tox_cancel_timer_event, 0 on failure.
+ */
+uint64_t tox_add_timer_event(Tox *tox, uint32_t event_type, uint32_t friend_number, uint32_t interval, void* user_data, tox_event_timer_cb* cb);
+
+/**
+ * cancel an event added with tox_add_timer_event that has not fired yet.
+ *
+ * @return true if the event was pending and is now cancelled.
  */
-void tox_add_timer_event(Tox *tox, uint32_t event_type, uint32_t friend_number, uint32_t interval, void* user_data, tox_event_timer_cb* cb);
+bool tox_cancel_timer_event(Tox *tox, uint64_t timer_id);
 /**
  * return millisecond
  */
@@ -3502,6 +3726,7 @@ typedef TOX_ERR_FILE_SEEK Tox_Err_File_Seek;
 typedef TOX_ERR_FILE_GET Tox_Err_File_Get;
 typedef TOX_ERR_FILE_SEND Tox_Err_File_Send;
 typedef TOX_ERR_FILE_SEND_CHUNK Tox_Err_File_Send_Chunk;
+typedef TOX_ERR_FILE_BULK Tox_Err_File_Bulk;
 typedef TOX_ERR_CONFERENCE_NEW Tox_Err_Conference_New;
 typedef TOX_ERR_CONFERENCE_DELETE Tox_Err_Conference_Delete;
 typedef TOX_ERR_CONFERENCE_PEER_QUERY Tox_Err_Conference_Peer_Query;
@@ -3520,6 +3745,8 @@ typedef TOX_PROXY_TYPE Tox_Proxy_Type;
 typedef TOX_SAVEDATA_TYPE Tox_Savedata_Type;
 typedef TOX_LOG_LEVEL Tox_Log_Level;
 typedef TOX_CONNECTION Tox_Connection;
+typedef TOX_SUBSYSTEM Tox_Subsystem;
+typedef TOX_FD_EVENT Tox_Fd_Event;
 typedef TOX_FILE_CONTROL Tox_File_Control;
 typedef TOX_CONFERENCE_TYPE Tox_Conference_Type;
 typedef TOX_ERR_FRIEND_SET_DHT_NODE Tox_err_friend_set_dht_node;
@@ -63,6 +63,9 @@ ACCESSORS(uint8_t,, device_type)
 ACCESSORS(uint32_t,, version_code)
 ACCESSORS(uint8_t *,, dht_pk)
 ACCESSORS(uint8_t *,, dht_sk)
+ACCESSORS(bool,, udp_send_queue_enabled)
+ACCESSORS(uint32_t,, shared_key_cache_size)
+ACCESSORS(uint32_t,, precompute_threads)
 
 const uint8_t *tox_options_get_savedata_data(const struct Tox_Options *options)
 {
@@ -0,0 +1,253 @@
+#include "tox.h"
+
+#include <unistd.h>
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Tox_Deleter {
+  void operator()(Tox *tox) { tox_kill(tox); }
+};
+
+using Tox_Ptr = std::unique_ptr<Tox, Tox_Deleter>;
+
+Tox_Ptr new_tox() {
+  std::unique_ptr<Tox_Options, void (*)(Tox_Options *)> options(tox_options_new(nullptr), tox_options_free);
+  tox_options_set_ipv6_enabled(options.get(), false);
+  tox_options_set_local_discovery_enabled(options.get(), false);
+  return Tox_Ptr(tox_new(options.get(), nullptr));
+}
+
+// What each side of a transfer sees; passed to tox_iterate as user data.
+struct Transfer {
+  // Sender.
+  std::vector<uint8_t> const *source = nullptr;
+  uint32_t chunk_requests = 0;
+
+  // Receiver.
+  bool bulk = false;
+  FILE *sink_file = nullptr;
+  std::vector<uint8_t> sink;
+  uint32_t chunks_received = 0;
+  bool done = false;
+  bool cancelled = false;
+};
+
+void on_chunk_request(Tox *tox, uint32_t friend_number, uint32_t file_number, uint64_t position, size_t length,
+                      void *user_data) {
+  Transfer *t = static_cast<Transfer *>(user_data);
+  ++t->chunk_requests;
+
+  if (length == 0) {
+    return;
+  }
+
+  tox_file_send_chunk(tox, friend_number, file_number, position, t->source->data() + position, length, nullptr);
+}
+
+void on_file_recv(Tox *tox, uint32_t friend_number, uint32_t file_number, uint32_t kind, uint64_t file_size,
+                  const uint8_t *filename, size_t filename_length, void *user_data) {
+  Transfer *t = static_cast<Transfer *>(user_data);
+
+  if (t->bulk) {
+    t->sink_file = tmpfile();
+    ASSERT_TRUE(tox_file_bulk_fd(tox, friend_number, file_number, fileno(t->sink_file), nullptr));
+  } else {
+    t->sink.resize(file_size);
+  }
+
+  tox_file_control(tox, friend_number, file_number, TOX_FILE_CONTROL_RESUME, nullptr);
+}
+
+void on_recv_chunk(Tox *tox, uint32_t friend_number, uint32_t file_number, uint64_t position, const uint8_t *data,
+                   size_t length, void *user_data) {
+  Transfer *t = static_cast<Transfer *>(user_data);
+
+  if (length == 0) {
+    t->done = true;
+    return;
+  }
+
+  ++t->chunks_received;
+  memcpy(t->sink.data() + position, data, length);
+}
+
+void on_recv_control(Tox *tox, uint32_t friend_number, uint32_t file_number, Tox_File_Control control,
+                     void *user_data) {
+  if (control == TOX_FILE_CONTROL_CANCEL) {
+    static_cast<Transfer *>(user_data)->cancelled = true;
+  }
+}
+
+class ToxFile : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    sender_ = new_tox();
+    receiver_ = new_tox();
+    ASSERT_NE(sender_, nullptr);
+    ASSERT_NE(receiver_, nullptr);
+
+    std::array<uint8_t, TOX_PUBLIC_KEY_SIZE> pk;
+    tox_self_get_public_key(receiver_.get(), pk.data());
+    ASSERT_EQ(tox_friend_add_norequest(sender_.get(), pk.data(), nullptr), 0);
+    tox_self_get_public_key(sender_.get(), pk.data());
+    ASSERT_EQ(tox_friend_add_norequest(receiver_.get(), pk.data(), nullptr), 0);
+
+    std::array<uint8_t, TOX_PUBLIC_KEY_SIZE> dht_id;
+    tox_self_get_dht_id(receiver_.get(), dht_id.data());
+    ASSERT_TRUE(tox_bootstrap(sender_.get(), "127.0.0.1", tox_self_get_udp_port(receiver_.get(), nullptr),
+                              dht_id.data(), nullptr));
+
+    tox_callback_file_chunk_request(sender_.get(), &on_chunk_request);
+    tox_callback_file_recv_control(sender_.get(), &on_recv_control);
+    tox_callback_file_recv(receiver_.get(), &on_file_recv);
+    tox_callback_file_recv_chunk(receiver_.get(), &on_recv_chunk);
+    tox_callback_file_recv_control(receiver_.get(), &on_recv_control);
+
+    auto const deadline = Clock::now() + std::chrono::seconds(30);
+
+    while (tox_friend_get_connection_status(sender_.get(), 0, nullptr) == TOX_CONNECTION_NONE ||
+           tox_friend_get_connection_status(receiver_.get(), 0, nullptr) == TOX_CONNECTION_NONE) {
+      ASSERT_LT(Clock::now(), deadline);
+      tox_iterate(sender_.get(), nullptr);
+      tox_iterate(receiver_.get(), nullptr);
+      usleep(1000);
+    }
+  }
+
+  // Send data to the receiver, returning the time it took in seconds.
+  double transfer(std::vector<uint8_t> const &data, Transfer *sent, Transfer *received, FILE *source_file) {
+    sent->source = &data;
+    uint32_t const file_number =
+        tox_file_send(sender_.get(), 0, TOX_FILE_KIND_DATA, data.size(), nullptr, nullptr, 0, nullptr);
+    EXPECT_NE(file_number, UINT32_MAX);
+
+    if (source_file != nullptr) {
+      EXPECT_TRUE(tox_file_bulk_fd(sender_.get(), 0, file_number, fileno(source_file), nullptr));
+    }
+
+    auto const start = Clock::now();
+    auto const deadline = start + std::chrono::seconds(120);
+
+    while (!received->done && !received->cancelled && Clock::now() < deadline) {
+      tox_iterate(sender_.get(), sent);
+      tox_iterate(receiver_.get(), received);
+    }
+
+    return std::chrono::duration<double>(Clock::now() - start).count();
+  }
+
+  Tox_Ptr sender_;
+  Tox_Ptr receiver_;
+};
+
+std::vector<uint8_t> random_file(size_t size) {
+  std::vector<uint8_t> data(size);
+
+  for (size_t i = 0; i < size; ++i) {
+    data[i] = static_cast<uint8_t>(i * 2654435761u >> 24);
+  }
+
+  return data;
+}
+
+FILE *file_with(std::vector<uint8_t> const &data) {
+  FILE *file = tmpfile();
+  EXPECT_EQ(fwrite(data.data(), 1, data.size(), file), data.size());
+  fflush(file);
+  return file;
+}
+
+std::vector<uint8_t> contents_of(FILE *file) {
+  std::vector<uint8_t> data(lseek(fileno(file), 0, SEEK_END));
+  EXPECT_EQ(pread(fileno(file), data.data(), data.size(), 0), static_cast<ssize_t>(data.size()));
+  return data;
+}
+
+TEST_F(ToxFile, BulkTransferWritesTheFile) {
+  // Not a multiple of the chunk size, so the last chunk is short.
+  std::vector<uint8_t> const data = random_file(300 * 1000 + 17);
+  FILE *source = file_with(data);
+
+  Transfer sent;
+  Transfer received;
+  received.bulk = true;
+  transfer(data, &sent, &received, source);
+
+  ASSERT_TRUE(received.done);
+  EXPECT_EQ(received.chunks_received, 0);
+  EXPECT_EQ(contents_of(received.sink_file), data);
+
+  // Only the final zero length request reaches the sender's callback, once the
+  // last packets are acknowledged.
+  auto const deadline = Clock::now() + std::chrono::seconds(10);
+
+  while (sent.chunk_requests == 0 && Clock::now() < deadline) {
+    tox_iterate(sender_.get(), &sent);
+    tox_iterate(receiver_.get(), &received);
+    usleep(1000);
+  }
+
+  EXPECT_EQ(sent.chunk_requests, 1);
+
+  fclose(source);
+  fclose(received.sink_file);
+}
+
+TEST_F(ToxFile, BulkTransferIsCancelledWhenTheFileIsShort) {
+  std::vector<uint8_t> const data = random_file(100 * 1000);
+  // The file on disk is shorter than the size announced to the receiver.
+  FILE *source = file_with(std::vector<uint8_t>(data.begin(), data.begin() + 50 * 1000));
+
+  Transfer sent;
+  Transfer received;
+  received.bulk = true;
+  transfer(data, &sent, &received, source);
+
+  EXPECT_TRUE(sent.cancelled);
+  EXPECT_TRUE(received.cancelled);
+  EXPECT_FALSE(received.done);
+
+  fclose(source);
+  fclose(received.sink_file);
+}
+
+// Set TOX_FILE_BENCHMARK_BYTES to send more than 8 MiB.
+TEST_F(ToxFile, LoopbackThroughputBenchmark) {
+  char const *env = std::getenv("TOX_FILE_BENCHMARK_BYTES");
+  size_t const size = env != nullptr ? std::strtoull(env, nullptr, 0) : 8 << 20;
+  std::vector<uint8_t> const data = random_file(size);
+
+  Transfer sent;
+  Transfer received;
+  double const callback_seconds = transfer(data, &sent, &received, nullptr);
+  ASSERT_TRUE(received.done);
+  EXPECT_EQ(received.sink, data);
+
+  FILE *source = file_with(data);
+  Transfer bulk_sent;
+  Transfer bulk_received;
+  bulk_received.bulk = true;
+  double const bulk_seconds = transfer(data, &bulk_sent, &bulk_received, source);
+  ASSERT_TRUE(bulk_received.done);
+  EXPECT_EQ(contents_of(bulk_received.sink_file), data);
+
+  std::printf("%zu bytes over loopback: chunk callbacks %.1f MB/s (%u requests), bulk fd %.1f MB/s\n", size,
+              size / callback_seconds / 1e6, sent.chunk_requests, size / bulk_seconds / 1e6);
+
+  fclose(source);
+  fclose(bulk_received.sink_file);
+}
+
+}  // namespace
@@ -0,0 +1,144 @@
+#include "tox.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "crypto_core.h"
+
+namespace {
+
+struct Tox_Deleter {
+  void operator()(Tox *tox) { tox_kill(tox); }
+};
+
+using Tox_Ptr = std::unique_ptr<Tox, Tox_Deleter>;
+
+Tox_Ptr new_tox() {
+  std::unique_ptr<Tox_Options, void (*)(Tox_Options *)> options(tox_options_new(nullptr), tox_options_free);
+  tox_options_set_ipv6_enabled(options.get(), false);
+  tox_options_set_local_discovery_enabled(options.get(), false);
+  return Tox_Ptr(tox_new(options.get(), nullptr));
+}
+
+constexpr uint32_t kHeaderSize = CRYPTO_PUBLIC_KEY_SIZE + CRYPTO_NONCE_SIZE;
+
+// Two instances that are each other's friend 0. Offline messages only need
+// their keys, so they never connect.
+class ToxOfflineMessage : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    sender_ = new_tox();
+    receiver_ = new_tox();
+    ASSERT_NE(sender_, nullptr);
+    ASSERT_NE(receiver_, nullptr);
+
+    tox_self_get_public_key(receiver_.get(), receiver_pk_.data());
+    ASSERT_EQ(tox_friend_add_norequest(sender_.get(), receiver_pk_.data(), nullptr), 0);
+    tox_self_get_public_key(sender_.get(), sender_pk_.data());
+    ASSERT_EQ(tox_friend_add_norequest(receiver_.get(), sender_pk_.data(), nullptr), 0);
+  }
+
+  std::vector<uint8_t> encrypt(const std::vector<uint8_t> &message) {
+    std::vector<uint8_t> encrypted(kHeaderSize + message.size() + CRYPTO_MAC_SIZE);
+    TOX_ERR_FRIEND_SEND_MESSAGE err;
+    const uint32_t len =
+        tox_encrypt_offline_message(sender_.get(), 0, message.data(), message.size(), encrypted.data(), &err);
+    EXPECT_EQ(err, TOX_ERR_FRIEND_SEND_MESSAGE_OK);
+    EXPECT_EQ(len, encrypted.size());
+    return encrypted;
+  }
+
+  Tox_Ptr sender_;
+  Tox_Ptr receiver_;
+  std::array<uint8_t, TOX_PUBLIC_KEY_SIZE> sender_pk_;
+  std::array<uint8_t, TOX_PUBLIC_KEY_SIZE> receiver_pk_;
+};
+
+TEST_F(ToxOfflineMessage, CachedKeyMatchesPerMessageEncryption) {
+  const std::vector<uint8_t> message = {'h', 'e', 'l', 'l', 'o'};
+
+  for (int i = 0; i < 3; ++i) {
+    const std::vector<uint8_t> encrypted = encrypt(message);
+    EXPECT_TRUE(std::equal(receiver_pk_.begin(), receiver_pk_.end(), encrypted.begin()));
+
+    // What the offline message functions computed before the key was cached.
+    std::array<uint8_t, TOX_SECRET_KEY_SIZE> sender_sk;
+    tox_self_get_secret_key(sender_.get(), sender_sk.data());
+    std::vector<uint8_t> expected(message.size() + CRYPTO_MAC_SIZE);
+    ASSERT_EQ(encrypt_data(receiver_pk_.data(), sender_sk.data(), encrypted.data() + CRYPTO_PUBLIC_KEY_SIZE,
+                           message.data(), message.size(), expected.data()),
+              static_cast<int32_t>(expected.size()));
+    EXPECT_TRUE(std::equal(expected.begin(), expected.end(), encrypted.begin() + kHeaderSize));
+  }
+}
+
+TEST_F(ToxOfflineMessage, DecryptsABatchAndReportsBadMessages) {
+  std::vector<std::vector<uint8_t>> plain;
+  std::vector<std::vector<uint8_t>> encrypted;
+
+  for (uint8_t n = 1; n <= 5; ++n) {
+    plain.emplace_back(n * 100, n);
+    encrypted.push_back(encrypt(plain.back()));
+  }
+
+  // Message 1 is corrupted, 3 lost its last byte and 4 is shorter than the
+  // header.
+  encrypted[1][kHeaderSize + 10] ^= 1;
+  std::vector<uint32_t> lengths;
+
+  for (const std::vector<uint8_t> &message : encrypted) {
+    lengths.push_back(message.size());
+  }
+
+  lengths[3] -= 1;
+  lengths[4] = kHeaderSize - 1;
+
+  std::vector<const uint8_t *> messages;
+  std::vector<std::vector<uint8_t>> decrypted;
+  std::vector<uint8_t *> outputs;
+
+  for (const std::vector<uint8_t> &message : encrypted) {
+    messages.push_back(message.data());
+    decrypted.emplace_back(message.size());
+    outputs.push_back(decrypted.back().data());
+  }
+
+  std::vector<int32_t> decrypted_lengths(encrypted.size());
+  TOX_ERR_FRIEND_SEND_MESSAGE err;
+  EXPECT_EQ(tox_decrypt_offline_messages(receiver_.get(), 0, messages.data(), lengths.data(), messages.size(),
+                                         outputs.data(), decrypted_lengths.data(), &err),
+            2u);
+  EXPECT_EQ(err, TOX_ERR_FRIEND_SEND_MESSAGE_OK);
+
+  for (size_t i : {0, 2}) {
+    ASSERT_EQ(decrypted_lengths[i], static_cast<int32_t>(plain[i].size()));
+    decrypted[i].resize(decrypted_lengths[i]);
+    EXPECT_EQ(decrypted[i], plain[i]);
+  }
+
+  EXPECT_EQ(decrypted_lengths[1], -1);
+  EXPECT_EQ(decrypted_lengths[3], -1);
+  EXPECT_EQ(decrypted_lengths[4], -1);
+}
+
+TEST_F(ToxOfflineMessage, BatchFromUnknownFriendIsAnError) {
+  const std::vector<uint8_t> encrypted = encrypt({'h', 'i'});
+  const uint8_t *const messages[] = {encrypted.data()};
+  const uint32_t lengths[] = {static_cast<uint32_t>(encrypted.size())};
+  std::vector<uint8_t> decrypted(encrypted.size());
+  uint8_t *const outputs[] = {decrypted.data()};
+  int32_t decrypted_lengths[] = {0};
+
+  TOX_ERR_FRIEND_SEND_MESSAGE err;
+  EXPECT_EQ(tox_decrypt_offline_messages(receiver_.get(), 1, messages, lengths, 1, outputs, decrypted_lengths, &err),
+            0u);
+  EXPECT_EQ(err, TOX_ERR_FRIEND_SEND_MESSAGE_FRIEND_NOT_FOUND);
+  EXPECT_EQ(decrypted_lengths[0], -1);
+}
+
+}  // namespace
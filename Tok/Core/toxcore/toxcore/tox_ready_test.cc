@@ -0,0 +1,228 @@
+#include "tox.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Tox_Deleter {
+  void operator()(Tox *tox) { tox_kill(tox); }
+};
+
+using Tox_Ptr = std::unique_ptr<Tox, Tox_Deleter>;
+
+// Reference event loop for Linux. Instead of waking up every 50 ms to poll,
+// it sleeps in epoll_wait until one of toxcore's sockets is ready or
+// tox_iteration_interval runs out, and then lets tox_iterate_ready read only
+// the ready sockets.
+class Epoll_Loop {
+ public:
+  explicit Epoll_Loop(Tox *tox) : tox_(tox), efd_(epoll_create1(0)) {}
+  ~Epoll_Loop() { close(efd_); }
+
+  // Run until the deadline, returning the number of tox_iterate_ready calls.
+  uint32_t run_until(Clock::time_point deadline) {
+    uint32_t iterations = 0;
+    std::vector<epoll_event> events;
+    std::vector<int32_t> ready;
+
+    while (Clock::now() < deadline) {
+      sync_fds();
+      events.resize(watched_.size() + 1);
+
+      int const n = epoll_wait(efd_, events.data(), events.size(), tox_iteration_interval(tox_));
+      ready.clear();
+
+      for (int i = 0; i < n; ++i) {
+        ready.push_back(events[i].data.fd);
+      }
+
+      tox_iterate_ready(tox_, ready.data(), ready.size(), nullptr);
+      ++iterations;
+    }
+
+    return iterations;
+  }
+
+ private:
+  // The fd set changes as relay connections come and go, so bring the epoll
+  // registrations in line with tox_get_fds before every wait.
+  void sync_fds() {
+    uint32_t const count = tox_get_fds(tox_, nullptr, nullptr, 0);
+    std::vector<int32_t> fds(count);
+    std::vector<uint8_t> fd_events(count);
+    tox_get_fds(tox_, fds.data(), fd_events.data(), count);
+
+    std::unordered_map<int32_t, uint32_t> wanted;
+
+    for (uint32_t i = 0; i < count; ++i) {
+      wanted[fds[i]] = ((fd_events[i] & TOX_FD_EVENT_READ) ? EPOLLIN : 0) |
+                       ((fd_events[i] & TOX_FD_EVENT_WRITE) ? EPOLLOUT : 0);
+    }
+
+    for (auto it = watched_.begin(); it != watched_.end();) {
+      if (wanted.count(it->first) == 0) {
+        epoll_ctl(efd_, EPOLL_CTL_DEL, it->first, nullptr);
+        it = watched_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    for (auto const &fd : wanted) {
+      epoll_event ev{};
+      ev.events = fd.second;
+      ev.data.fd = fd.first;
+      auto const it = watched_.find(fd.first);
+
+      if (it == watched_.end()) {
+        epoll_ctl(efd_, EPOLL_CTL_ADD, fd.first, &ev);
+      } else if (it->second != fd.second) {
+        epoll_ctl(efd_, EPOLL_CTL_MOD, fd.first, &ev);
+      }
+
+      watched_[fd.first] = fd.second;
+    }
+  }
+
+  Tox *tox_;
+  int efd_;
+  std::unordered_map<int32_t, uint32_t> watched_;
+};
+
+double cpu_seconds() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+Tox_Ptr new_tox_with_friends(uint32_t num_friends) {
+  std::unique_ptr<Tox_Options, void (*)(Tox_Options *)> options(tox_options_new(nullptr), tox_options_free);
+  tox_options_set_ipv6_enabled(options.get(), false);
+  tox_options_set_local_discovery_enabled(options.get(), false);
+  Tox_Ptr tox(tox_new(options.get(), nullptr));
+
+  if (tox == nullptr) {
+    return tox;
+  }
+
+  std::mt19937 rng(num_friends);
+
+  for (uint32_t i = 0; i < num_friends; ++i) {
+    std::array<uint8_t, TOX_PUBLIC_KEY_SIZE> pk;
+
+    for (uint8_t &byte : pk) {
+      byte = static_cast<uint8_t>(rng());
+    }
+
+    pk[TOX_PUBLIC_KEY_SIZE - 1] &= 0x7f;  // Keep it a valid curve25519 point.
+    EXPECT_NE(tox_friend_add_norequest(tox.get(), pk.data(), nullptr), UINT32_MAX);
+  }
+
+  return tox;
+}
+
+TEST(ToxReady, ReportsTheUdpSocket) {
+  Tox_Ptr tox = new_tox_with_friends(0);
+  ASSERT_NE(tox, nullptr);
+
+  std::array<int32_t, 8> fds;
+  std::array<uint8_t, 8> events;
+  uint32_t const count = tox_get_fds(tox.get(), fds.data(), events.data(), fds.size());
+  ASSERT_GE(count, 1);
+  EXPECT_EQ(tox_get_fds(tox.get(), nullptr, nullptr, 0), count);
+
+  sockaddr_in addr{};
+  socklen_t len = sizeof(addr);
+  ASSERT_EQ(getsockname(fds[0], reinterpret_cast<sockaddr *>(&addr), &len), 0);
+  EXPECT_EQ(ntohs(addr.sin_port), tox_self_get_udp_port(tox.get(), nullptr));
+  EXPECT_EQ(events[0], TOX_FD_EVENT_READ);
+}
+
+TEST(ToxReady, ReadsReadySocketUntilDrained) {
+  Tox_Ptr tox = new_tox_with_friends(0);
+  ASSERT_NE(tox, nullptr);
+
+  int32_t fd;
+  uint8_t fd_events;
+  ASSERT_GE(tox_get_fds(tox.get(), &fd, &fd_events, 1), 1);
+
+  int const efd = epoll_create1(0);
+  epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.fd = fd;
+  ASSERT_EQ(epoll_ctl(efd, EPOLL_CTL_ADD, fd, &ev), 0);
+
+  // A packet toxcore does not understand still has to be read off the socket.
+  int const sender = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(tox_self_get_udp_port(tox.get(), nullptr));
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  uint8_t const garbage[] = {0xfe, 1, 2, 3};
+  ASSERT_EQ(sendto(sender, garbage, sizeof(garbage), 0, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)),
+            static_cast<ssize_t>(sizeof(garbage)));
+
+  ASSERT_EQ(epoll_wait(efd, &ev, 1, 1000), 1);
+  tox_iterate_ready(tox.get(), &fd, 1, nullptr);
+  EXPECT_EQ(epoll_wait(efd, &ev, 1, 0), 0);
+
+  close(sender);
+  close(efd);
+}
+
+// An idle client with 1000 friends that are all offline. A fixed-interval
+// tox_iterate loop wakes up 20 times a second for nothing; the epoll loop only
+// wakes up for timed work.
+TEST(ToxReady, EpollLoopIsNearlyIdleWithThousandFriends) {
+  Tox_Ptr tox = new_tox_with_friends(1000);
+  ASSERT_NE(tox, nullptr);
+
+  auto const duration = std::chrono::seconds(3);
+
+  double const poll_cpu_start = cpu_seconds();
+  auto const poll_deadline = Clock::now() + duration;
+  uint32_t poll_iterations = 0;
+
+  while (Clock::now() < poll_deadline) {
+    tox_iterate(tox.get(), nullptr);
+    ++poll_iterations;
+    std::this_thread::sleep_for(std::chrono::milliseconds(tox_iteration_interval(tox.get())));
+  }
+
+  double const poll_cpu = cpu_seconds() - poll_cpu_start;
+
+  Epoll_Loop loop(tox.get());
+  double const epoll_cpu_start = cpu_seconds();
+  uint32_t const epoll_iterations = loop.run_until(Clock::now() + duration);
+  double const epoll_cpu = cpu_seconds() - epoll_cpu_start;
+
+  std::printf("3 s idle with 1000 friends: tox_iterate loop %u wakeups, %.1f ms CPU; "
+              "epoll loop %u wakeups, %.1f ms CPU\n",
+              poll_iterations, poll_cpu * 1000, epoll_iterations, epoll_cpu * 1000);
+
+  // Each of the once-a-second subsystems may wake the loop on its own.
+  EXPECT_LE(epoll_iterations, 3 * 6 + 2);
+  EXPECT_LT(epoll_iterations, poll_iterations);
+  EXPECT_LT(epoll_cpu, 0.05 * std::chrono::duration<double>(duration).count());
+}
+
+}  // namespace
@@ -577,7 +577,7 @@ int probe_node_udp(const char *szHost, int nPort, const char *szPublicKey, int n
     }
     
     Mono_Time *mono_time = mono_time_new();
-    DHT *pDht = new_dht(pLog, mono_time, pNet, false, self_public_key, self_secret_key);
+    DHT *pDht = new_dht(pLog, mono_time, pNet, false, 0, 0, self_public_key, self_secret_key);
     if (pNet == nullptr)
     {
         kill_networking(pNet);